@@ -1,65 +1,509 @@
 
+// Storage for the planar intermediate and output buffers, chosen at build time (see storage.h).  
+// The float inputs are not affected.
+//   default			32-bit float
+//   STORAGE_HALF		16-bit half through vload_half / vstore_half - storage only, so 
+//						cl_khr_fp16 is not required
+//   STORAGE_UNORM16	16-bit unsigned normalised over [0, STORAGE_RANGE]
+#if defined(STORAGE_HALF)
+typedef half storage_t;
+#define LOAD_STORAGE(p, i)			vload_half((i), (p))
+#define STORE_STORAGE(p, i, v)		vstore_half((v), (i), (p))
+#elif defined(STORAGE_UNORM16)
+#ifndef STORAGE_RANGE
+#define STORAGE_RANGE 2.0f
+#endif
+typedef ushort storage_t;
+#define LOAD_STORAGE(p, i)			((float)(p)[i] * (STORAGE_RANGE / 65535.0f))
+#define STORE_STORAGE(p, i, v)		((p)[i] = convert_ushort_sat_rte((v) * (65535.0f / STORAGE_RANGE)))
+#else
+typedef float storage_t;
+#define LOAD_STORAGE(p, i)			((p)[i])
+#define STORE_STORAGE(p, i, v)		((p)[i] = (v))
+#endif
+
+// The "strict" build profile (-D STRICT_MATH) keeps a * b + c as a rounded multiply and a 
+// rounded add rather than letting the compiler contract it to an fma or mad
+#ifdef STRICT_MATH
+#pragma OPENCL FP_CONTRACT OFF
+#endif
+
+// Division in the colour math.  The "native" build profile (-D NATIVE_MATH, see precision.h) 
+// maps it to native_divide, which is several times cheaper than a correctly rounded divide 
+// but has implementation defined accuracy
+#ifdef NATIVE_MATH
+#define DIVIDE(a, b)				native_divide((a), (b))
+#else
+#define DIVIDE(a, b)				((a) / (b))
+#endif
+
+// Specialised variants (see kernel_variants.h) are built with -D IMAGE_WIDTH=, IMAGE_HEIGHT= 
+// and LUMINANCE_SCALE= so the per-pixel colour kernels below bounds check, index and scale 
+// with constants the compiler folds.  The w, h and L arguments are still passed, and ignored, 
+// so the host code is the same for the generic and specialised builds
+#ifdef IMAGE_WIDTH
+#define IMAGE_W						IMAGE_WIDTH
+#define IMAGE_H						IMAGE_HEIGHT
+#else
+#define IMAGE_W						w
+#define IMAGE_H						h
+#endif
+
+#ifdef LUMINANCE_SCALE
+#define SCALE_L						LUMINANCE_SCALE
+#else
+#define SCALE_L						L
+#endif
+
+// The work-group tuner binds scratch arguments to these kernels from the kernelLayouts table 
+// in autotune.cpp - a kernel whose arguments change needs its entry updated there
+
 // Input and output images stored as generic memory buffer objects
 kernel void RGB_XYY(global const float* red_input, global const float* green_input, global const float* blue_input, 
-				    global float *red_output,  global float *green_output,  global float *blue_output, 
-					const int w)
+				    global storage_t *red_output,  global storage_t *green_output,  global storage_t *blue_output, 
+					const int w, const int h)
 {
 	int baseX = get_global_id(0);
 	int baseY = get_global_id(1);
 
-	global const float *rsrcPixel = red_input   + (baseY * w) + baseX;
-	global const float *gsrcPixel = green_input + (baseY * w) + baseX;
-	global const float *bsrcPixel = blue_input  + (baseY * w) + baseX;
+	// the global size is rounded up to a multiple of the work-group size
+	if (baseX >= IMAGE_W || baseY >= IMAGE_H) return;
+
+	int offset = (baseY * IMAGE_W) + baseX;
 
-	global float *rdstPixel = red_output   + (baseY * w) + baseX;
-	global float *gdstPixel = green_output + (baseY * w) + baseX;
-	global float *bdstPixel = blue_output  + (baseY * w) + baseX;
+	float r = red_input[offset];
+	float g = green_input[offset];
+	float b = blue_input[offset];
 
-	*rdstPixel = 0.4124f * *rsrcPixel + 0.3576f * *gsrcPixel + 0.1805f * *bsrcPixel;
-	*gdstPixel = 0.2126f * *rsrcPixel + 0.7152f * *gsrcPixel + 0.0722f * *bsrcPixel;
-	*bdstPixel = 0.0193f * *rsrcPixel + 0.1192f * *gsrcPixel + 0.9505f * *bsrcPixel;
+	STORE_STORAGE(red_output,   offset, 0.4124f * r + 0.3576f * g + 0.1805f * b);
+	STORE_STORAGE(green_output, offset, 0.2126f * r + 0.7152f * g + 0.0722f * b);
+	STORE_STORAGE(blue_output,  offset, 0.0193f * r + 0.1192f * g + 0.9505f * b);
 }
 
-kernel void XYY_XYZ(global const float* red_input, global const float* green_input, global const float* blue_input, 
-				    global float *red_output,  global float *green_output,  global float *blue_output, 
-					const int w)
+kernel void XYY_XYZ(global const storage_t* red_input, global const storage_t* green_input, global const storage_t* blue_input, 
+				    global storage_t *red_output,  global storage_t *green_output,  global storage_t *blue_output, 
+					const int w, const int h, const float L)
 {
 	int baseX = get_global_id(0);
 	int baseY = get_global_id(1);
 
-	global const float *rsrcPixel = red_input   + (baseY * w) + baseX;
-	global const float *gsrcPixel = green_input + (baseY * w) + baseX;
-	global const float *bsrcPixel = blue_input  + (baseY * w) + baseX;
+	if (baseX >= IMAGE_W || baseY >= IMAGE_H) return;
+
+	int offset = (baseY * IMAGE_W) + baseX;
 
-	global float *rdstPixel = red_output   + (baseY * w) + baseX;
-	global float *gdstPixel = green_output + (baseY * w) + baseX;
-	global float *bdstPixel = blue_output  + (baseY * w) + baseX; 
+	float X = LOAD_STORAGE(red_input, offset);
+	float Y = LOAD_STORAGE(green_input, offset);
+	float Z = LOAD_STORAGE(blue_input, offset);
 
-	*rdstPixel = *rsrcPixel / (*rsrcPixel + *gsrcPixel + *bsrcPixel);
-	*gdstPixel = *gsrcPixel / (*rsrcPixel + *gsrcPixel + *bsrcPixel);
-	*bdstPixel = *gsrcPixel / 2;
+	STORE_STORAGE(red_output,   offset, DIVIDE(X, X + Y + Z));
+	STORE_STORAGE(green_output, offset, DIVIDE(Y, X + Y + Z));
+	STORE_STORAGE(blue_output,  offset, Y * SCALE_L);
 }
 
-kernel void XYY_L(global const float* red_input, global const float* green_input, global const float* blue_input, 
-				  global float *red_output,  global float *green_output,  global float *blue_output, 
-				  const int w)
+kernel void XYY_L(global const storage_t* red_input, global const storage_t* green_input, global const storage_t* blue_input, 
+				  global storage_t *red_output,  global storage_t *green_output,  global storage_t *blue_output, 
+				  const int w, const int h)
 {
 	int baseX = get_global_id(0);
 	int baseY = get_global_id(1);
 
-	global const float *rsrcPixel = red_input   + (baseY * w) + baseX;
-	global const float *gsrcPixel = green_input + (baseY * w) + baseX;
-	global const float *bsrcPixel = blue_input  + (baseY * w) + baseX;
+	if (baseX >= IMAGE_W || baseY >= IMAGE_H) return;
+
+	int offset = (baseY * IMAGE_W) + baseX;
+
+	float x  = LOAD_STORAGE(red_input, offset);
+	float y  = LOAD_STORAGE(green_input, offset);
+	float Yl = LOAD_STORAGE(blue_input, offset);
+
+	float X = x * DIVIDE(Yl, y);
+	float Y = Yl;
+	float Z = (1 - x - y) * DIVIDE(Yl, y);
+
+	STORE_STORAGE(red_output,   offset, 3.2405f * X + -1.5371f * Y + -0.4985f * Z);
+	STORE_STORAGE(green_output, offset, -0.9693f * X + 1.8760f * Y + 0.0416f * Z);
+	STORE_STORAGE(blue_output,  offset, 0.0556f * X + -0.2040f * Y + 1.0572f * Z);
+}
+
+// Luminance statistics, kept on the device so they can drive the tone mapping kernel without 
+// a readback.  LUMA_STATS reduces the Y plane of the RGB_XYY output to one (min, max, sum, 
+// sum of log) partial per work-group and adds its work-group's histogram into histogram, 
+// which the host clears first.  LUMA_STATS_FINAL then reduces the partials into 
+// stats[LUMA_MIN .. LUMA_LOG_AVERAGE] in a single work-group.  Both need a power of two 
+// work-group size and one float4 of local scratch per work-item.
+#define LUMA_MIN				0
+#define LUMA_MAX				1
+#define LUMA_MEAN				2
+#define LUMA_LOG_AVERAGE		3
+
+// histogram bins cover log2 luminance from LUMA_LOG2_MIN to 0 - a quarter stop per bin
+#define LUMA_HISTOGRAM_BINS		64
+#define LUMA_LOG2_MIN			(-16.0f)
+
+// keeps log() finite for black pixels
+#define LUMA_DELTA				1.0e-4f
+
+float4 combineLumaStats(float4 a, float4 b)
+{
+	return (float4)(fmin(a.x, b.x), fmax(a.y, b.y), a.z + b.z, a.w + b.w);
+}
+
+// Tree reduction of scratch[0 .. get_local_size(0)) into scratch[0]
+void reduceLumaStats(local float4* scratch)
+{
+	int lid = get_local_id(0);
+
+	for (int stride = get_local_size(0) / 2; stride > 0; stride >>= 1)
+	{
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (lid < stride)
+			scratch[lid] = combineLumaStats(scratch[lid], scratch[lid + stride]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+kernel void LUMA_STATS(global const storage_t* Y_input, const int count, 
+					   global float4* partials, global uint* histogram, 
+					   local float4* scratch, local uint* localHistogram)
+{
+	int lid = get_local_id(0);
+
+	for (int i = lid; i < LUMA_HISTOGRAM_BINS; i += get_local_size(0))
+		localHistogram[i] = 0;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// each work-item walks the plane with a stride of the whole launch, so any number of 
+	// work-groups covers any image size
+	float4 stats = (float4)(INFINITY, -INFINITY, 0.0f, 0.0f);
 
-	global float *rdstPixel = red_output   + (baseY * w) + baseX;
-	global float *gdstPixel = green_output + (baseY * w) + baseX;
-	global float *bdstPixel = blue_output  + (baseY * w) + baseX;
+	for (int i = get_global_id(0); i < count; i += get_global_size(0))
+	{
+		float Y = LOAD_STORAGE(Y_input, i);
+
+		stats = combineLumaStats(stats, (float4)(Y, Y, Y, log(Y + LUMA_DELTA)));
+
+		int bin = (int)((log2(Y + LUMA_DELTA) - LUMA_LOG2_MIN) * (LUMA_HISTOGRAM_BINS / -LUMA_LOG2_MIN));
+
+		atomic_inc(&localHistogram[clamp(bin, 0, LUMA_HISTOGRAM_BINS - 1)]);
+	}
+
+	scratch[lid] = stats;
+	reduceLumaStats(scratch);
+
+	if (lid == 0)
+		partials[get_group_id(0)] = scratch[0];
+
+	// reduceLumaStats ends with a barrier, so every local histogram update is visible
+	for (int i = lid; i < LUMA_HISTOGRAM_BINS; i += get_local_size(0))
+		if (localHistogram[i] != 0)
+			atomic_add(&histogram[i], localHistogram[i]);
+}
+
+kernel void LUMA_STATS_FINAL(global const float4* partials, const int numPartials, const int count, 
+							 global float* stats, local float4* scratch)
+{
+	int lid = get_local_id(0);
 
-	float X = *rsrcPixel * (*bsrcPixel / *gsrcPixel);
-	float Y = *bsrcPixel;
-	float Z = (1 - *rsrcPixel - *gsrcPixel) * (*bsrcPixel / *gsrcPixel);
+	float4 total = (float4)(INFINITY, -INFINITY, 0.0f, 0.0f);
+
+	for (int i = lid; i < numPartials; i += get_local_size(0))
+		total = combineLumaStats(total, partials[i]);
+
+	scratch[lid] = total;
+	reduceLumaStats(scratch);
+
+	if (lid == 0)
+	{
+		total = scratch[0];
+
+		stats[LUMA_MIN]			= total.x;
+		stats[LUMA_MAX]			= total.y;
+		stats[LUMA_MEAN]		= total.z / count;
+		stats[LUMA_LOG_AVERAGE]	= exp(total.w / count);
+	}
+}
+
+// Automatic exposure - replaces XYY_XYZ in the staged pipeline.  Converts the RGB_XYY output 
+// to xyY with the luminance tone mapped using the statistics from LUMA_STATS_FINAL:
+//   TONEMAP_REINHARD	Reinhard et al. global operator - the log-average is mapped to key and 
+//						the brightest pixel to white
+//   TONEMAP_MEAN		linear scale so the mean luminance becomes key
+#define TONEMAP_REINHARD	0
+#define TONEMAP_MEAN		1
+
+kernel void XYZ_XYY_TONEMAP(global const storage_t* red_input, global const storage_t* green_input, global const storage_t* blue_input, 
+							global storage_t *red_output,  global storage_t *green_output,  global storage_t *blue_output, 
+							const int w, const int h, global const float* stats, const float key, const int mode)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= w || baseY >= h) return;
+
+	int offset = (baseY * w) + baseX;
+
+	float X = LOAD_STORAGE(red_input, offset);
+	float Y = LOAD_STORAGE(green_input, offset);
+	float Z = LOAD_STORAGE(blue_input, offset);
+
+	float Yd;
+
+	if (mode == TONEMAP_MEAN)
+		Yd = Y * (key / fmax(stats[LUMA_MEAN], LUMA_DELTA));
+	else
+	{
+		float scale = key / stats[LUMA_LOG_AVERAGE];
+		float Ls    = Y * scale;
+		float white = fmax(stats[LUMA_MAX] * scale, LUMA_DELTA);
+
+		Yd = Ls * (1.0f + Ls / (white * white)) / (1.0f + Ls);
+	}
+
+	STORE_STORAGE(red_output,   offset, DIVIDE(X, X + Y + Z));
+	STORE_STORAGE(green_output, offset, DIVIDE(Y, X + Y + Z));
+	STORE_STORAGE(blue_output,  offset, Yd);
+}
+
+// Separable convolution of a single plane (the luminance plane of the staged pipeline) with 
+// 2 * radius + 1 weights.  Each work-group loads its tile plus a radius wide halo into local 
+// memory once, so every input value is read from global memory about once per pass instead of 
+// 2 * radius + 1 times.  Edges are clamped.  The work-group size must be CONV_TILE_X x 
+// CONV_TILE_Y and tile must hold (CONV_TILE_X + 2 * radius) * CONV_TILE_Y floats for the row 
+// pass and CONV_TILE_X * (CONV_TILE_Y + 2 * radius) for the column pass.  CONV_TILE_X and 
+// CONV_TILE_Y come from convolution.h - createProgram passes them to every build.
+#if !defined(CONV_TILE_X) || !defined(CONV_TILE_Y)
+#error CONV_TILE_X and CONV_TILE_Y must be given as build options
+#endif
+
+kernel __attribute__((reqd_work_group_size(CONV_TILE_X, CONV_TILE_Y, 1)))
+void CONVOLVE_ROWS(global const storage_t* input, global storage_t* output, const int w, const int h, 
+				   constant float* weights, const int radius, local float* tile)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+	int localX = get_local_id(0);
+
+	int tileWidth = CONV_TILE_X + 2 * radius;
+	int firstX    = get_group_id(0) * CONV_TILE_X - radius;
+
+	// work-items past the bottom edge still help load so every barrier is reached
+	int row = min(baseY, h - 1) * w;
+
+	local float* tileRow = tile + get_local_id(1) * tileWidth;
+
+	for (int i = localX; i < tileWidth; i += CONV_TILE_X)
+		tileRow[i] = LOAD_STORAGE(input, row + clamp(firstX + i, 0, w - 1));
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (baseX >= w || baseY >= h) return;
+
+	float sum = 0.0f;
+
+	for (int k = 0; k <= 2 * radius; ++k)
+		sum += weights[k] * tileRow[localX + k];
+
+	STORE_STORAGE(output, (baseY * w) + baseX, sum);
+}
+
+kernel __attribute__((reqd_work_group_size(CONV_TILE_X, CONV_TILE_Y, 1)))
+void CONVOLVE_COLUMNS(global const storage_t* input, global storage_t* output, const int w, const int h, 
+					  constant float* weights, const int radius, local float* tile)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+	int localX = get_local_id(0);
+	int localY = get_local_id(1);
 
-	*rdstPixel = 3.2405f * X + -1.5371f * Y + -0.4985f * Z;
-	*gdstPixel = -0.9693f * X + 1.8760f * Y + 0.0416f * Z;
-	*bdstPixel = 0.0556f * X + -0.2040f * Y + 1.0572f * Z;
-}
\ No newline at end of file
+	int tileHeight = CONV_TILE_Y + 2 * radius;
+	int firstY     = get_group_id(1) * CONV_TILE_Y - radius;
+	int column     = min(baseX, w - 1);
+
+	// rows of the tile are CONV_TILE_X wide so neighbouring work-items read neighbouring addresses
+	for (int i = localY; i < tileHeight; i += CONV_TILE_Y)
+		tile[i * CONV_TILE_X + localX] = LOAD_STORAGE(input, clamp(firstY + i, 0, h - 1) * w + column);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (baseX >= w || baseY >= h) return;
+
+	float sum = 0.0f;
+
+	for (int k = 0; k <= 2 * radius; ++k)
+		sum += weights[k] * tile[(localY + k) * CONV_TILE_X + localX];
+
+	STORE_STORAGE(output, (baseY * w) + baseX, sum);
+}
+
+// Unsharp mask - output = original + amount * (original - blurred).  output may be original
+kernel void UNSHARP(global const storage_t* original, global const storage_t* blurred, global storage_t* output, 
+					const int w, const int h, const float amount)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= w || baseY >= h) return;
+
+	int offset = (baseY * w) + baseX;
+
+	float value = LOAD_STORAGE(original, offset);
+
+	STORE_STORAGE(output, offset, value + amount * (value - LOAD_STORAGE(blurred, offset)));
+}
+
+// Shared colour math for the fused kernels: RGB -> XYZ -> xyY -> scale luminance by L -> 
+// XYZ -> RGB with every intermediate value kept in registers.  Black pixels (X + Y + Z == 0) 
+// have no defined chromaticity and are returned as black rather than propagating the NaN the 
+// three-stage path produces.
+float3 scaleLuminance(float3 rgb, const float L)
+{
+	// RGB -> XYZ
+	float X = 0.4124f * rgb.x + 0.3576f * rgb.y + 0.1805f * rgb.z;
+	float Y = 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+	float Z = 0.0193f * rgb.x + 0.1192f * rgb.y + 0.9505f * rgb.z;
+
+	float sum = X + Y + Z;
+
+	if (sum <= 0.0f || Y <= 0.0f)
+		return (float3)(0.0f);
+
+	// XYZ -> xyY, scaling the luminance
+	float x  = DIVIDE(X, sum);
+	float y  = DIVIDE(Y, sum);
+	float Yl = Y * L;
+
+	// xyY -> XYZ
+	X = x * DIVIDE(Yl, y);
+	Z = (1 - x - y) * DIVIDE(Yl, y);
+
+	// XYZ -> RGB
+	return (float3)(3.2405f * X + -1.5371f * Yl + -0.4985f * Z,
+					-0.9693f * X + 1.8760f * Yl + 0.0416f * Z,
+					0.0556f * X + -0.2040f * Yl + 1.0572f * Z);
+}
+
+// Fused version of RGB_XYY, XYY_XYZ and XYY_L.  Each pixel is read and written once so only 
+// the input and output planes are needed on the device.
+kernel void RGB_XYY_RGB(global const float* red_input, global const float* green_input, global const float* blue_input, 
+						global storage_t *red_output,  global storage_t *green_output,  global storage_t *blue_output, 
+						const int w, const int h, const float L)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= IMAGE_W || baseY >= IMAGE_H) return;
+
+	int offset = (baseY * IMAGE_W) + baseX;
+
+	float3 rgb = scaleLuminance((float3)(red_input[offset], green_input[offset], blue_input[offset]), SCALE_L);
+
+	STORE_STORAGE(red_output,   offset, rgb.x);
+	STORE_STORAGE(green_output, offset, rgb.y);
+	STORE_STORAGE(blue_output,  offset, rgb.z);
+}
+
+// Fused pipeline on packed 8-bit data.  The input is the raw 32bpp BGRA buffer produced by 
+// WIC and the output is packed 24bpp BGR, matching the bgr8 layout saveImage expects, so no 
+// host side format conversion is needed in either direction.
+kernel void BGRA8_XYY_BGR8(global const uchar4* input, global uchar* output, const int w, const int h, const float L)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= IMAGE_W || baseY >= IMAGE_H) return;
+
+	int offset = (baseY * IMAGE_W) + baseX;
+
+	// Unpack and normalise to [0, 1] - components are stored b, g, r, a
+	float4 bgra = convert_float4(input[offset]) * (1.0f / 255.0f);
+
+	float3 rgb = scaleLuminance(bgra.zyx, SCALE_L);
+
+	// Truncate to [0, 255] as the host side saveImage conversion does, but saturate rather 
+	// than wrap out-of-range values
+	vstore3(convert_uchar3_sat(rgb.zyx * 255.0f), offset, output);
+}
+
+// Image object version of BGRA8_XYY_BGR8 (see image_objects.h).  The format does the 
+// normalisation in both directions - read_imagef returns (r, g, b, a) in [0, 1] for CL_BGRA / 
+// CL_UNORM_INT8 and CL_RGBA / CL_HALF_FLOAT alike and write_imagef converts back - and fetches 
+// go through the texture cache.  Only compiled for devices with image support so the rest of 
+// the program still builds everywhere.
+#ifdef __IMAGE_SUPPORT__
+constant sampler_t pixelSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+kernel void IMAGE_XYY_IMAGE(read_only image2d_t input, write_only image2d_t output, const float L)
+{
+	int2 coord = (int2)(get_global_id(0), get_global_id(1));
+
+	if (coord.x >= get_image_width(input) || coord.y >= get_image_height(input)) return;
+
+	float4 rgba = read_imagef(input, pixelSampler, coord);
+
+	write_imagef(output, coord, (float4)(scaleLuminance(rgba.xyz, L), rgba.w));
+}
+#endif
+
+// Packed <-> planar conversions for the tiled path, which needs the xyY planes of each band so 
+// the luminance can be convolved.  BGRA8_XYY is RGB_XYY + XYY_XYZ on packed input and XYY_BGR8 
+// is XYY_L with packed output.  Black pixels are stored as (0, 0, 0) and come back black.
+kernel void BGRA8_XYY(global const uchar4* input, global storage_t *x_output, global storage_t *y_output, 
+					  global storage_t *Y_output, const int w, const int h, const float L)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= w || baseY >= h) return;
+
+	int offset = (baseY * w) + baseX;
+
+	float3 rgb = convert_float4(input[offset]).zyx * (1.0f / 255.0f);
+
+	float X = 0.4124f * rgb.x + 0.3576f * rgb.y + 0.1805f * rgb.z;
+	float Y = 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+	float Z = 0.0193f * rgb.x + 0.1192f * rgb.y + 0.9505f * rgb.z;
+
+	float sum = X + Y + Z;
+
+	if (sum <= 0.0f || Y <= 0.0f)
+	{
+		STORE_STORAGE(x_output, offset, 0.0f);
+		STORE_STORAGE(y_output, offset, 0.0f);
+		STORE_STORAGE(Y_output, offset, 0.0f);
+		return;
+	}
+
+	STORE_STORAGE(x_output, offset, DIVIDE(X, sum));
+	STORE_STORAGE(y_output, offset, DIVIDE(Y, sum));
+	STORE_STORAGE(Y_output, offset, Y * L);
+}
+
+kernel void XYY_BGR8(global const storage_t* x_input, global const storage_t* y_input, global const storage_t* Y_input, 
+					 global uchar* output, const int w, const int h)
+{
+	int baseX = get_global_id(0);
+	int baseY = get_global_id(1);
+
+	if (baseX >= w || baseY >= h) return;
+
+	int offset = (baseY * w) + baseX;
+
+	float x  = LOAD_STORAGE(x_input, offset);
+	float y  = LOAD_STORAGE(y_input, offset);
+	float Yl = LOAD_STORAGE(Y_input, offset);
+
+	float3 rgb = (float3)(0.0f);
+
+	if (y > 0.0f)
+	{
+		float X = x * DIVIDE(Yl, y);
+		float Z = (1 - x - y) * DIVIDE(Yl, y);
+
+		rgb = (float3)(3.2405f * X + -1.5371f * Yl + -0.4985f * Z,
+					   -0.9693f * X + 1.8760f * Yl + 0.0416f * Z,
+					   0.0556f * X + -0.2040f * Yl + 1.0572f * Z);
+	}
+
+	vstore3(convert_uchar3_sat(rgb.zyx * 255.0f), offset, output);
+}
@@ -0,0 +1,480 @@
+//
+// Work-group size autotuner - see autotune.h
+//
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include "autotune.h"
+#include "setup_cl.h"
+#include "trace_cl.h"
+
+// timed launches per candidate after one warm-up launch
+static const int tuningRuns = 3;
+
+// Scratch arguments of each tunable kernel in HelloWorld.cl, in order, one character each:
+//   1-9	global buffer of that many bytes per pixel
+//   i		image2d_t, w x h RGBA8
+//   w, h	int image width or height
+//   f		float (1.0f)
+//   n		int (0)
+// Kernels with local memory arguments cannot be described and are left out
+static const struct { const char* kernel; const char* layout; } kernelLayouts[] =
+{
+	{ "RGB_XYY",			"444444wh" },
+	{ "XYY_XYZ",			"444444whf" },
+	{ "XYY_L",				"444444wh" },
+	{ "XYZ_XYY_TONEMAP",	"444444wh4fn" },
+	{ "RGB_XYY_RGB",		"444444whf" },
+	{ "BGRA8_XYY_BGR8",		"43whf" },
+	{ "IMAGE_XYY_IMAGE",	"iif" },
+	{ "BGRA8_XYY",			"4444whf" },
+	{ "XYY_BGR8",			"4443wh" }
+};
+
+//
+// Private API
+//
+static bool		tuneKernel(cl_command_queue queue, cl_device_id device, cl_kernel kernel, int w, int h, WorkGroupSize* best);
+static cl_kernel	createScratchKernel(cl_kernel kernel, cl_command_queue queue, int w, int h, std::vector<cl_mem>& scratch);
+static const char*	scratchLayout(const char* kernelName);
+static int		sizeBucket(int size);
+static double	timeCandidate(cl_command_queue queue, cl_kernel kernel, int w, int h, const WorkGroupSize& local);
+static std::map<std::string, WorkGroupSize>	readCacheFile(const std::string& path);
+
+
+WorkGroupTuner::WorkGroupTuner(const std::string& cacheFile)
+	: cacheFile(cacheFile)
+{
+	load();
+}
+
+WorkGroupSize WorkGroupTuner::select(cl_command_queue queue, cl_kernel kernel, int w, int h)
+{
+	WorkGroupSize runtimeChoice = { 0, 0, true };
+
+	cl_device_id device = nullptr;
+	clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, nullptr);
+
+	if (!device) return runtimeChoice;
+
+	std::string id = key(device, kernel, w, h);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		std::map<std::string, WorkGroupSize>::iterator found = results.find(id);
+
+		if (found != results.end())
+			return found->second;
+
+		// another thread is tuning this kernel - launch with the runtime's choice rather than wait
+		if (!tuning.insert(id).second)
+			return runtimeChoice;
+	}
+
+	std::vector<cl_mem> scratch;
+	cl_kernel scratchKernel = createScratchKernel(kernel, queue, w, h, scratch);
+
+	WorkGroupSize best = runtimeChoice;
+	bool tuned = scratchKernel && tuneKernel(queue, device, scratchKernel, w, h, &best);
+
+	if (scratchKernel) clReleaseKernel(scratchKernel);
+
+	for (cl_mem buffer : scratch)
+		clReleaseMemObject(buffer);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		tuning.erase(id);
+
+		// a kernel that could not be tuned keeps the runtime's choice for this run only
+		results[id] = best;
+
+		if (!tuned)
+			untuned.insert(id);
+	}
+
+	if (tuned)
+		save();
+
+	return best;
+}
+
+void WorkGroupTuner::clear(void)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	results.clear();
+	untuned.clear();
+}
+
+WorkGroupTuner& WorkGroupTuner::shared(void)
+{
+	static WorkGroupTuner tuner;
+	return tuner;
+}
+
+// The best size depends on how the program was built (storage mode, build profile, a 
+// specialised variant's constants) and on the image shape as well as the kernel and device
+std::string WorkGroupTuner::key(cl_device_id device, cl_kernel kernel, int w, int h) const
+{
+	char deviceName[256] = { 0 }, driverVersion[128] = { 0 }, kernelName[128] = { 0 };
+	cl_program program = nullptr;
+	std::string options;
+
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, nullptr);
+	clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, nullptr);
+	clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernelName) - 1, kernelName, nullptr);
+
+	size_t optionsSize = 0;
+
+	if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr) == CL_SUCCESS &&
+		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_OPTIONS, 0, nullptr, &optionsSize) == CL_SUCCESS && 
+		optionsSize > 1)
+	{
+		std::vector<char> text(optionsSize + 1, 0);
+
+		if (clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_OPTIONS, optionsSize, text.data(), nullptr) == CL_SUCCESS)
+			options = text.data();
+	}
+
+	// the key is stored as one tab separated field so strip tabs and newlines
+	std::string result = std::string(deviceName) + "|" + driverVersion + "|" + kernelName + "|" + options + "|" + 
+						 std::to_string(sizeBucket(w)) + "x" + std::to_string(sizeBucket(h));
+	std::replace_if(result.begin(), result.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+	return result;
+}
+
+// file format: one "<key>\t<x>\t<y>" line per result, x = y = 0 for the runtime's choice
+void WorkGroupTuner::load(void)
+{
+	if (cacheFile.empty()) return;
+
+	results = readCacheFile(cacheFile);
+}
+
+// Rewrite the cache file through a temporary file and a rename, so another process never reads 
+// a partial file.  Entries other processes stored since this one loaded are kept; this 
+// process's results win where both have one
+void WorkGroupTuner::save(void)
+{
+	if (cacheFile.empty()) return;
+
+	std::lock_guard<std::mutex> saving(saveLock);
+
+	std::map<std::string, WorkGroupSize> merged = readCacheFile(cacheFile);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (const auto& item : results)
+			if (untuned.count(item.first) == 0)
+				merged[item.first] = item.second;
+	}
+
+	std::string tempPath = uniqueTempPath(cacheFile);
+	bool written;
+
+	{
+		std::ofstream file(tempPath, std::ios::out | std::ios::trunc);
+
+		for (const auto& item : merged)
+		{
+			size_t x = item.second.runtimeChosen ? 0 : item.second.x;
+			size_t y = item.second.runtimeChosen ? 0 : item.second.y;
+
+			file << item.first << '\t' << x << '\t' << y << '\n';
+		}
+
+		written = static_cast<bool>(file);
+	}
+
+	std::error_code ec;
+
+	if (written)
+		std::filesystem::rename(tempPath, cacheFile, ec);
+
+	if (!written || ec)
+		std::filesystem::remove(tempPath, ec);
+}
+
+cl_int enqueueImageKernel(
+						  cl_command_queue queue,
+						  cl_kernel kernel,
+						  int w,
+						  int h,
+						  const WorkGroupSize& local,
+						  cl_uint numEvents,
+						  const cl_event* waitList,
+						  cl_event* event,
+						  const size_t* offset
+						  )
+{
+	size_t globalSize[2] = { static_cast<size_t>(w), static_cast<size_t>(h) };
+	size_t localSize[2] = { local.x, local.y };
+
+	// round up - the extra work-items fail the kernels' bounds check and return
+	if (!local.runtimeChosen)
+	{
+		globalSize[0] = (w + local.x - 1) / local.x * local.x;
+		globalSize[1] = (h + local.y - 1) / local.y * local.y;
+	}
+
+	auto enqueue = [&](cl_event* commandEvent)
+	{
+		return clEnqueueNDRangeKernel(queue, kernel, 2, offset, globalSize, local.runtimeChosen ? nullptr : localSize,
+									  numEvents, waitList, commandEvent);
+	};
+
+	if (!traceEnabled())
+		return enqueue(event);
+
+	// every image kernel is launched through here, so this is where they are traced
+	char kernelName[128] = "kernel";
+	clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernelName) - 1, kernelName, 0);
+
+	return traceCommand(kernelName, queue, event, enqueue);
+}
+
+//
+// Private API implementation
+//
+
+// Time the candidate local sizes for kernel, whose arguments are set, and return the fastest in 
+// *best.  Returns false if no candidate could be launched
+static bool tuneKernel(cl_command_queue queue, cl_device_id device, cl_kernel kernel, int w, int h, WorkGroupSize* best)
+{
+	WorkGroupSize runtimeChoice = { 0, 0, true };
+
+	// Limits for this kernel on this device
+	size_t maxGroup = 0, multiple = 1;
+	size_t maxItems[3] = { 0, 0, 0 };
+
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, nullptr);
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, nullptr);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems, nullptr);
+
+	if (multiple == 0) multiple = 1;
+
+	// Candidates - the runtime's own choice, the usual square and wide shapes, and row shapes 
+	// built from the preferred multiple (warp / wavefront / SIMD width)
+	std::vector<WorkGroupSize> candidates;
+	candidates.push_back(runtimeChoice);
+
+	const size_t shapes[][2] = { { 8, 8 }, { 16, 8 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 2 }, { 64, 4 }, { 128, 1 }, { 256, 1 } };
+
+	for (const size_t* shape : shapes)
+		candidates.push_back({ shape[0], shape[1], false });
+
+	for (size_t rows = 1; rows <= 8; rows *= 2)
+		candidates.push_back({ multiple, rows, false });
+
+	double bestTime = -1.0;
+
+	for (const WorkGroupSize& candidate : candidates)
+	{
+		if (!candidate.runtimeChosen)
+		{
+			if (candidate.x * candidate.y > maxGroup || candidate.x > maxItems[0] || candidate.y > maxItems[1])
+				continue;
+
+			// prefer shapes whose width keeps whole SIMD groups busy
+			if (candidate.x * candidate.y % multiple != 0)
+				continue;
+
+			// skip duplicates of shapes already tried
+			bool duplicate = false;
+			for (const WorkGroupSize& other : candidates)
+			{
+				if (&other == &candidate) break;
+				duplicate |= (!other.runtimeChosen && other.x == candidate.x && other.y == candidate.y);
+			}
+			if (duplicate) continue;
+		}
+
+		double seconds = timeCandidate(queue, kernel, w, h, candidate);
+
+		if (seconds >= 0.0 && (bestTime < 0.0 || seconds < bestTime))
+		{
+			bestTime = seconds;
+			*best = candidate;
+		}
+	}
+
+	return bestTime >= 0.0;
+}
+
+// A new kernel object for kernel's function, from its program, with every argument bound as 
+// its kernelLayouts entry describes - buffers are zeroed so the kernels see ordinary numbers.  
+// The scratch memory objects are added to scratch for the caller to release.  Returns null if 
+// the kernel has no entry, the entry does not match the kernel's argument count or memory 
+// cannot be allocated
+static cl_kernel createScratchKernel(cl_kernel kernel, cl_command_queue queue, int w, int h, std::vector<cl_mem>& scratch)
+{
+	cl_program program = nullptr;
+	cl_context context = nullptr;
+	cl_uint numArgs = 0;
+	char name[128] = { 0 };
+
+	if (w <= 0 || h <= 0 ||
+		clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, nullptr) != CL_SUCCESS ||
+		clGetKernelInfo(kernel, CL_KERNEL_CONTEXT, sizeof(cl_context), &context, nullptr) != CL_SUCCESS ||
+		clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(cl_uint), &numArgs, nullptr) != CL_SUCCESS ||
+		clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name) - 1, name, nullptr) != CL_SUCCESS)
+		return nullptr;
+
+	const char* layout = scratchLayout(name);
+
+	if (!layout)
+		return nullptr;
+
+	// the table has fallen out of step with HelloWorld.cl - say so rather than quietly skip tuning
+	if (strlen(layout) != numArgs)
+	{
+		std::cout << "work-group tuning skipped for " << name << " - layout " << layout << " does not match its " 
+				  << numArgs << " arguments\n";
+		return nullptr;
+	}
+
+	cl_int err;
+	cl_kernel scratchKernel = clCreateKernel(program, name, &err);
+
+	if (!scratchKernel) return nullptr;
+
+	size_t pixels = static_cast<size_t>(w) * h;
+
+	for (cl_uint i = 0; i < numArgs && err == CL_SUCCESS; ++i)
+	{
+		char kind = layout[i];
+
+		if (kind >= '1' && kind <= '9')
+		{
+			// never smaller than a float4, for arguments such as the tone mapping statistics
+			size_t bytes = std::max<size_t>(pixels * (kind - '0'), 16);
+			cl_uchar zero = 0;
+
+			cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, nullptr, &err);
+
+			if (buffer)
+			{
+				scratch.push_back(buffer);
+				err = clEnqueueFillBuffer(queue, buffer, &zero, sizeof(zero), 0, bytes, 0, nullptr, nullptr);
+			}
+
+			if (err == CL_SUCCESS)
+				err = clSetKernelArg(scratchKernel, i, sizeof(cl_mem), &buffer);
+		}
+		else if (kind == 'i')
+		{
+			cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+			cl_image_desc desc;
+
+			memset(&desc, 0, sizeof(desc));
+			desc.image_type   = CL_MEM_OBJECT_IMAGE2D;
+			desc.image_width  = w;
+			desc.image_height = h;
+
+			cl_mem image = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, nullptr, &err);
+
+			if (image)
+			{
+				scratch.push_back(image);
+				err = clSetKernelArg(scratchKernel, i, sizeof(cl_mem), &image);
+			}
+		}
+		else if (kind == 'w' || kind == 'h' || kind == 'n')
+		{
+			cl_int value = (kind == 'w') ? w : (kind == 'h') ? h : 0;
+			err = clSetKernelArg(scratchKernel, i, sizeof(cl_int), &value);
+		}
+		else if (kind == 'f')
+		{
+			cl_float value = 1.0f;
+			err = clSetKernelArg(scratchKernel, i, sizeof(cl_float), &value);
+		}
+		else
+			err = CL_INVALID_ARG_VALUE;
+	}
+
+	if (err != CL_SUCCESS)
+	{
+		clReleaseKernel(scratchKernel);
+		return nullptr;
+	}
+	return scratchKernel;
+}
+
+// median of tuningRuns launches in seconds, or -1 if the launch is rejected
+static double timeCandidate(cl_command_queue queue, cl_kernel kernel, int w, int h, const WorkGroupSize& local)
+{
+	std::vector<double> times;
+
+	for (int i = 0; i <= tuningRuns; ++i)
+	{
+		cl_event event;
+
+		if (enqueueImageKernel(queue, kernel, w, h, local, 0, nullptr, &event) != CL_SUCCESS)
+			return -1.0;
+
+		clWaitForEvents(1, &event);
+
+		// first launch is a warm-up
+		if (i > 0)
+			times.push_back(eventSeconds(event));
+
+		clReleaseEvent(event);
+	}
+
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// kernelLayouts entry for the kernel function called kernelName, or null
+static const char* scratchLayout(const char* kernelName)
+{
+	for (const auto& entry : kernelLayouts)
+		if (strcmp(entry.kernel, kernelName) == 0)
+			return entry.layout;
+
+	return nullptr;
+}
+
+// smallest power of two >= size - images in one bucket share a tuned size
+static int sizeBucket(int size)
+{
+	int bucket = 1;
+
+	while (bucket < size && bucket < (1 << 30))
+		bucket *= 2;
+
+	return bucket;
+}
+
+static std::map<std::string, WorkGroupSize> readCacheFile(const std::string& path)
+{
+	std::map<std::string, WorkGroupSize> entries;
+
+	std::ifstream file(path);
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		size_t tab = line.find('\t');
+
+		if (tab == std::string::npos) continue;
+
+		std::istringstream values(line.substr(tab + 1));
+		WorkGroupSize size = { 0, 0, false };
+
+		if (values >> size.x >> size.y)
+		{
+			size.runtimeChosen = (size.x == 0 || size.y == 0);
+			entries[line.substr(0, tab)] = size;
+		}
+	}
+	return entries;
+}
@@ -0,0 +1,77 @@
+//
+// Work-group size autotuning.  Candidate local sizes are timed per kernel and device, the 
+// winner is remembered in memory and persisted to a text file, and kernels are launched with 
+// the global size rounded up to a multiple of the local size so any image size works (the 
+// kernels bounds check against w and h).
+//
+// Tuning runs outside the tuner's lock on a separate kernel object created from the caller's 
+// program, bound to scratch memory described by the kernel's entry in the layout table in 
+// autotune.cpp, so it never touches the caller's buffers and other threads keep launching 
+// while it runs.  A thread asking for a 
+// kernel another thread is still tuning gets the runtime's choice instead of waiting.
+//
+#ifndef _AUTOTUNE_
+#define _AUTOTUNE_
+
+#include <CL/opencl.h>
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+
+// A 2D local work size.  runtimeChosen means pass NULL and let the runtime decide.
+struct WorkGroupSize
+{
+	size_t		x, y;
+	bool		runtimeChosen;
+};
+
+class WorkGroupTuner
+{
+public:
+
+	// cacheFile is loaded now and rewritten whenever a new winner is found ("" for no file)
+	explicit WorkGroupTuner(const std::string& cacheFile = "workgroup_cache.txt");
+
+	// Return the best local size for kernel on the device of queue, tuning it for a w x h image 
+	// the first time the kernel, its program's build options and the size bucket of w x h 
+	// (each side rounded up to a power of two) are seen on the device.  Kernels missing from 
+	// the layout table, or whose table entry does not match CL_KERNEL_NUM_ARGS, use the 
+	// runtime's choice
+	WorkGroupSize select(cl_command_queue queue, cl_kernel kernel, int w, int h);
+
+	// forget every stored result so the next select() re-tunes
+	void clear(void);
+
+	// process wide tuner used by the pipelines
+	static WorkGroupTuner& shared(void);
+
+private:
+
+	std::string key(cl_device_id device, cl_kernel kernel, int w, int h) const;
+	void load(void);
+	void save(void);
+
+	std::string							cacheFile;
+	std::map<std::string, WorkGroupSize>	results;
+	std::set<std::string>				tuning;			// keys being tuned by some thread
+	std::set<std::string>				untuned;		// keys left to the runtime because tuning could not run - not saved
+	std::mutex							lock;
+	std::mutex							saveLock;		// one save at a time, each writing the latest results
+};
+
+// Enqueue kernel over a w x h image with local size local, rounding the global size up to a 
+// multiple of it.  Arguments as for clEnqueueNDRangeKernel.
+cl_int enqueueImageKernel(
+						  cl_command_queue queue,
+						  cl_kernel kernel,
+						  int w,
+						  int h,
+						  const WorkGroupSize& local,
+						  cl_uint numEvents,
+						  const cl_event* waitList,
+						  cl_event* event,
+						  const size_t* offset = nullptr
+						  );
+
+#endif
@@ -0,0 +1,336 @@
+//
+// Double-buffered batch pipeline - see batch.h
+//
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include <map>
+#include "batch.h"
+#include "imageio.h"
+#include "buffer_pool.h"
+#include "autotune.h"
+#include "kernel_variants.h"
+#include "trace_cl.h"
+
+// number of images in flight on the device at once
+static const int numSlots = 2;
+
+// per slot state - buffers come from the pools and are returned once the image is encoded
+struct BatchSlot
+{
+	cl_kernel			kernel;
+	std::future<bool>	encode;
+
+	BatchSlot(void)
+	{
+		kernel = nullptr;
+	}
+};
+
+//
+// Private API
+//
+static bool			isImageFile(const std::filesystem::path& path);
+static CPBitmapImage	decodeImage(const std::wstring& path);
+static std::wstring		lowerCase(std::wstring text);
+
+
+//
+// Public function implementation
+//
+std::vector<std::wstring> collectBatchInputs(const std::wstring& source)
+{
+	std::vector<std::wstring> inputs;
+	std::error_code ec;
+
+	if (std::filesystem::is_directory(source, ec))
+	{
+		for (const auto& entry : std::filesystem::directory_iterator(source, ec))
+			if (entry.is_regular_file() && isImageFile(entry.path()))
+				inputs.push_back(entry.path().wstring());
+
+		std::sort(inputs.begin(), inputs.end());
+	}
+	else
+	{
+		std::wifstream listFile{ std::filesystem::path(source) };
+		std::wstring line;
+
+		while (std::getline(listFile, line))
+		{
+			// trim trailing whitespace and CR from files edited on Windows
+			while (!line.empty() && iswspace(line.back()))
+				line.pop_back();
+
+			if (!line.empty())
+				inputs.push_back(line);
+		}
+	}
+	return inputs;
+}
+
+std::vector<std::wstring> batchOutputPaths(const std::vector<std::wstring>& inputs, const std::wstring& outputDirectory)
+{
+	std::map<std::wstring, int> stems, names;
+
+	for (const std::wstring& input : inputs)
+	{
+		std::filesystem::path path(input);
+
+		stems[lowerCase(path.stem().wstring())]++;
+		names[lowerCase(path.filename().wstring())]++;
+	}
+
+	std::vector<std::wstring> outputs;
+
+	for (size_t n = 0; n < inputs.size(); ++n)
+	{
+		std::filesystem::path path(inputs[n]);
+		std::wstring name = path.stem().wstring();
+
+		if (stems[lowerCase(name)] > 1)
+			name = path.filename().wstring();
+
+		if (names[lowerCase(path.filename().wstring())] > 1)
+			name += L"_" + std::to_wstring(n);
+
+		outputs.push_back((std::filesystem::path(outputDirectory) / (name + L".tif")).wstring());
+	}
+	return outputs;
+}
+
+int runBatch(
+			 cl_context context,
+			 cl_device_id device,
+			 cl_program program,
+			 const std::vector<std::wstring>& inputs,
+			 const std::wstring& outputDirectory,
+			 const float luminanceScale,
+			 const size_t poolMemoryCap,
+			 KernelVariantCache* variants
+			 )
+{
+	if (inputs.empty()) return 0;
+
+	std::error_code ec;
+	std::filesystem::create_directories(outputDirectory, ec);
+
+	// Separate in-order queues for each stage so an upload or download can run alongside a 
+	// kernel from a different image.  Dependencies between stages are expressed with events.
+	cl_command_queue uploadQueue   = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue computeQueue  = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue downloadQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+
+	if (!uploadQueue || !computeQueue || !downloadQueue)
+	{
+		std::cout << "command queue not created\n";
+		return static_cast<int>(inputs.size());
+	}
+
+	// Device buffers and pinned download buffers are reused across images of similar size
+	DeviceBufferPool devicePool(context, poolMemoryCap);
+	HostStagingPool  stagingPool(context, downloadQueue, poolMemoryCap);
+
+	std::vector<std::wstring> outputPaths = batchOutputPaths(inputs, outputDirectory);
+
+	BatchSlot slots[numSlots];
+
+	for (int i = 0; i < numSlots; ++i)
+		slots[i].kernel = clCreateKernel(program, "BGRA8_XYY_BGR8", 0);
+
+	std::atomic<int> failures(0);
+	WorkGroupSize batchLocal = { 0, 0, true };
+	bool batchTuned = false;
+
+	auto batchStart = std::chrono::steady_clock::now();
+
+	// decode the first image on this thread so the WIC factory is created before any worker 
+	// thread touches it
+	CPBitmapImage next = decodeImage(inputs[0]);
+	std::future<CPBitmapImage> nextDecode;
+
+	for (size_t n = 0; n < inputs.size(); ++n)
+	{
+		BatchSlot& slot = slots[n % numSlots];
+
+		// wait for image n - numSlots to finish encoding so its slot can be reused
+		if (slot.encode.valid() && !slot.encode.get())
+			++failures;
+
+		CPBitmapImage image = (n == 0) ? next : nextDecode.get();
+
+		// start decoding image n + 1 while image n is uploaded and processed
+		if (n + 1 < inputs.size())
+			nextDecode = std::async(std::launch::async, decodeImage, inputs[n + 1]);
+
+		if (!image.buffer)
+		{
+			std::wcout << L"cannot load " << inputs[n] << std::endl;
+			++failures;
+			continue;
+		}
+
+		size_t numPixels = static_cast<size_t>(image.w) * image.h;
+
+		cl_mem inputBuffer  = devicePool.acquire(numPixels * sizeof(BGRA8), CL_MEM_READ_ONLY);
+		cl_mem outputBuffer = devicePool.acquire(numPixels * sizeof(bgr8), CL_MEM_WRITE_ONLY);
+
+		// the result is downloaded into pinned memory so the copy runs at full DMA speed
+		StagingBuffer hostOutput = stagingPool.acquire(numPixels * sizeof(bgr8));
+
+		if (!inputBuffer || !outputBuffer || !hostOutput.buffer)
+		{
+			std::wcout << L"cannot allocate buffers for " << inputs[n] << L" - rejected at the pool memory cap or out of device memory" << std::endl;
+			devicePool.release(inputBuffer);
+			devicePool.release(outputBuffer);
+			stagingPool.release(hostOutput);
+			free(image.buffer);
+			++failures;
+			continue;
+		}
+
+		// the slot's kernel is swapped for one specialised for this size once the size repeats
+		if (variants)
+			slot.kernel = variants->selectKernel(slot.kernel, "BGRA8_XYY_BGR8", image.w, image.h, luminanceScale);
+
+		cl_event writeEvent = nullptr, kernelEvent = nullptr, readEvent = nullptr;
+
+		cl_int err = slot.kernel ? CL_SUCCESS : CL_INVALID_KERNEL;
+
+		if (err == CL_SUCCESS)
+			err = traceCommand("upload", uploadQueue, &writeEvent, [&](cl_event* event)
+			{
+				return clEnqueueWriteBuffer(uploadQueue, inputBuffer, CL_FALSE, 0, numPixels * sizeof(BGRA8), 
+											image.buffer, 0, 0, event);
+			});
+
+		clSetKernelArg(slot.kernel, 0, sizeof(cl_mem), &inputBuffer);
+		clSetKernelArg(slot.kernel, 1, sizeof(cl_mem), &outputBuffer);
+		clSetKernelArg(slot.kernel, 2, sizeof(cl_int), &image.w);
+		clSetKernelArg(slot.kernel, 3, sizeof(cl_int), &image.h);
+		clSetKernelArg(slot.kernel, 4, sizeof(cl_float), &luminanceScale);
+
+		// tuned once per device on the first image - the kernels handle any image size
+		if (!batchTuned && err == CL_SUCCESS)
+		{
+			batchLocal = WorkGroupTuner::shared().select(computeQueue, slot.kernel, image.w, image.h);
+			batchTuned = true;
+		}
+
+		if (err == CL_SUCCESS)
+			err = enqueueImageKernel(computeQueue, slot.kernel, image.w, image.h, batchLocal, 1, &writeEvent, &kernelEvent);
+
+		if (err == CL_SUCCESS)
+			err = traceCommand("download", downloadQueue, &readEvent, [&](cl_event* event)
+			{
+				return clEnqueueReadBuffer(downloadQueue, outputBuffer, CL_FALSE, 0, numPixels * sizeof(bgr8), 
+										   hostOutput.hostPtr, 1, &kernelEvent, event);
+			});
+
+		// make sure the commands are submitted - cross-queue waits need all queues flushed
+		clFlush(uploadQueue);
+		clFlush(computeQueue);
+		clFlush(downloadQueue);
+
+		if (err != CL_SUCCESS)
+		{
+			std::wcout << L"cannot enqueue " << inputs[n] << L" (error " << err << L")" << std::endl;
+			clFinish(uploadQueue);
+			clFinish(computeQueue);
+			clFinish(downloadQueue);
+
+			// whichever commands were enqueued before the failure
+			if (writeEvent) clReleaseEvent(writeEvent);
+			if (kernelEvent) clReleaseEvent(kernelEvent);
+			if (readEvent) clReleaseEvent(readEvent);
+
+			devicePool.release(inputBuffer);
+			devicePool.release(outputBuffer);
+			stagingPool.release(hostOutput);
+			free(image.buffer);
+			++failures;
+			continue;
+		}
+
+		// wait for the download and encode image n on a host thread while the loop moves on
+		std::filesystem::path outputPath = outputPaths[n];
+
+		slot.encode = std::async(std::launch::async, [=, &devicePool, &stagingPool](void)
+		{
+			clWaitForEvents(1, &readEvent);
+
+			clReleaseEvent(writeEvent);
+			clReleaseEvent(kernelEvent);
+			clReleaseEvent(readEvent);
+			free(image.buffer);
+
+			// the device buffers are free as soon as the download has completed
+			devicePool.release(inputBuffer);
+			devicePool.release(outputBuffer);
+
+			initCOM();
+			bool ok = (saveImage(image.w, image.h, static_cast<bgr8*>(hostOutput.hostPtr), outputPath.wstring()) == 0);
+			shutdownCOM();
+
+			stagingPool.release(hostOutput);
+			return ok;
+		});
+	}
+
+	// drain the pipeline
+	for (int i = 0; i < numSlots; ++i)
+		if (slots[i].encode.valid() && !slots[i].encode.get())
+			++failures;
+
+	auto batchEnd = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(batchEnd - batchStart).count();
+
+	std::cout << "Processed " << inputs.size() - failures << " of " << inputs.size() << " images in " 
+			  << seconds << "s (" << (inputs.size() / seconds) << " images/s)" << std::endl;
+
+	devicePool.report("Device buffer pool");
+	stagingPool.report("Pinned staging pool");
+
+	for (int i = 0; i < numSlots; ++i)
+		if (slots[i].kernel) clReleaseKernel(slots[i].kernel);
+
+	clReleaseCommandQueue(uploadQueue);
+	clReleaseCommandQueue(computeQueue);
+	clReleaseCommandQueue(downloadQueue);
+	return failures;
+}
+
+//
+// Private API implementation
+//
+static bool isImageFile(const std::filesystem::path& path)
+{
+	std::wstring ext = lowerCase(path.extension().wstring());
+
+	return ext == L".jpg" || ext == L".jpeg" || ext == L".png" || ext == L".bmp" || 
+		   ext == L".tif" || ext == L".tiff";
+}
+
+
+static std::wstring lowerCase(std::wstring text)
+{
+	std::transform(text.begin(), text.end(), text.begin(), ::towlower);
+	return text;
+}
+
+// decode one image - runs on a worker thread so COM is initialised for the duration of the call
+static CPBitmapImage decodeImage(const std::wstring& path)
+{
+	CPBitmapImage image;
+
+	initCOM();
+	if (loadImage(path, &image) != 0)
+		image.buffer = nullptr;
+	shutdownCOM();
+
+	return image;
+}
@@ -0,0 +1,42 @@
+//
+// Batch processing of many images with decode, upload, compute, download and encode overlapped
+//
+#ifndef _BATCH_
+#define _BATCH_
+
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+class KernelVariantCache;
+
+// Expand a batch source into a list of image paths.  source is either a directory (every 
+// .jpg/.jpeg/.png/.bmp/.tif/.tiff file in it, sorted by name) or a text file with one image 
+// path per line
+std::vector<std::wstring> collectBatchInputs(const std::wstring& source);
+
+// Output path for each input - <stem>.tif, or <name>.tif (keeping the extension, so a.jpg and
+// a.png become a.jpg.tif and a.png.tif) when another input has the same stem, plus _<index>
+// when the whole file name repeats (the same name in different directories of a list file).
+// Names are compared without case as they are on Windows and macOS file systems
+std::vector<std::wstring> batchOutputPaths(const std::vector<std::wstring>& inputs, const std::wstring& outputDirectory);
+
+// Run the packed BGRA8_XYY_BGR8 pipeline over every image in inputs, writing the 
+// batchOutputPaths files in outputDirectory.  Images flow through a double-buffered pipeline - 
+// while image N runs on the device, image N+1 is decoded and uploaded and image N-1 is 
+// downloaded and encoded on host threads.  Device buffers and pinned download buffers come from pools that reuse 
+// allocations across images of similar size; poolMemoryCap bounds each pool (0 for no limit).  
+// With variants, images whose size repeats run a kernel specialised for it.  Returns the 
+// number of images that failed.
+int runBatch(
+			 cl_context context,
+			 cl_device_id device,
+			 cl_program program,
+			 const std::vector<std::wstring>& inputs,
+			 const std::wstring& outputDirectory,
+			 const float luminanceScale,
+			 const size_t poolMemoryCap = 0,
+			 KernelVariantCache* variants = nullptr
+			 );
+
+#endif
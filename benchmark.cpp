@@ -0,0 +1,666 @@
+//
+// Benchmark for the colour pipeline.  Generates synthetic images over a range of sizes and 
+// reports per-kernel time, host <-> device bandwidth, host decode/encode time and end-to-end 
+// throughput as JSON, including the image object (texture) path in both formats so the 
+// faster of buffers and images can be picked per device.  Built as a separate executable from 
+// benchmark.cpp and the imagepipeline library.
+//
+// Usage: benchmark [-iterations N] [-warmup N] [-sizes WxH,WxH,...] [-o results.json] 
+//                  [-kernels HelloWorld.cl] [-nocpu] [-nocache]
+//                  [-platform name] [-vendor name] [-devtype gpu|cpu|accelerator|all] [-device index]
+//
+// With no device selection the first device of any platform is used, so on a GPU-less box 
+// with PoCL installed the benchmark runs on the CPU device.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include "setup_cl.h"
+#include "cpu_pipeline.h"
+#include "image_objects.h"
+#include "image_pipeline.h"
+#include "imageio.h"
+
+// Summary of a set of timings, in milliseconds
+struct TimingStats
+{
+	double		mean, median, min, max, stddev;
+	int			samples;
+};
+
+struct BenchmarkConfig
+{
+	int			warmup;
+	int			iterations;
+	std::vector<std::pair<int, int>> sizes;
+	std::string	outputPath;
+	std::string	kernelFile;
+	bool		includeCPU;
+
+	BenchmarkConfig(void)
+		: warmup(2), iterations(10), outputPath("benchmark.json"), 
+		  kernelFile(defaultKernelFile()), includeCPU(true)
+	{
+		// from thumbnails to 8K
+		sizes = { { 256, 256 }, { 1024, 768 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+	}
+};
+
+// Everything needed to run kernels on the benchmark device
+struct BenchmarkDevice
+{
+	cl_context			context;
+	cl_device_id		device;
+	cl_command_queue	queue;
+	cl_program			program;
+	cl_ulong			maxAlloc;
+	cl_ulong			globalMem;
+};
+
+//
+// Private API
+//
+static TimingStats	computeStats(std::vector<double> samples);
+static std::string	statsJSON(const TimingStats& stats);
+static std::string	jsonString(const std::string& text);
+static TimingStats	timeRepeated(const BenchmarkConfig& config, const std::function<double(void)>& run);
+static void			fillSynthetic(int w, int h, std::vector<unsigned char>& bgra, std::vector<float>& R, 
+								  std::vector<float>& G, std::vector<float>& B);
+static std::string	benchmarkSize(const BenchmarkConfig& config, BenchmarkDevice& dev, int w, int h);
+static bool			parseSizes(const char* text, std::vector<std::pair<int, int>>& sizes);
+
+
+int main(int argc, char** argv)
+{
+	BenchmarkConfig config;
+	DeviceSelector selector;
+
+	// default to the first device anywhere so CI boxes without a GPU use PoCL
+	selector.platform.clear();
+	selector.type = CL_DEVICE_TYPE_ALL;
+	selector.index = 0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-iterations") == 0 && i + 1 < argc)
+			config.iterations = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-warmup") == 0 && i + 1 < argc)
+			config.warmup = std::max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-sizes") == 0 && i + 1 < argc && parseSizes(argv[i + 1], config.sizes))
+			++i;
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			config.outputPath = argv[++i];
+		else if (strcmp(argv[i], "-kernels") == 0 && i + 1 < argc)
+			config.kernelFile = argv[++i];
+		else if (strcmp(argv[i], "-nocpu") == 0)
+			config.includeCPU = false;
+		else if (strcmp(argv[i], "-nocache") == 0)
+			setProgramCacheDirectory(std::string());
+		else if (strcmp(argv[i], "-platform") == 0 && i + 1 < argc)
+			selector.platform = argv[++i], selector.index = -1;
+		else if (strcmp(argv[i], "-vendor") == 0 && i + 1 < argc)
+			selector.vendor = argv[++i], selector.index = -1;
+		else if (strcmp(argv[i], "-devtype") == 0 && i + 1 < argc && parseDeviceType(argv[i + 1], &selector.type))
+			++i, selector.index = -1;
+		else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc)
+			selector.index = atoi(argv[++i]);
+		else
+		{
+			std::cout << "Usage: " << argv[0] << " [-iterations N] [-warmup N] [-sizes WxH,...] [-o file.json] "
+					  << "[-kernels file.cl] [-nocpu] [-nocache] [-platform name] [-vendor name] "
+					  << "[-devtype type] [-device index]\n";
+			return 1;
+		}
+	}
+
+	initCOM();
+
+	BenchmarkDevice dev = {};
+	dev.context = createContext(selector);
+
+	if (!dev.context)
+	{
+		std::cout << "cl context not created\n";
+		return 1;
+	}
+
+	clGetContextInfo(dev.context, CL_CONTEXT_DEVICES, sizeof(cl_device_id), &dev.device, 0);
+	clGetDeviceInfo(dev.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &dev.maxAlloc, 0);
+	clGetDeviceInfo(dev.device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &dev.globalMem, 0);
+
+	dev.queue = clCreateCommandQueue(dev.context, dev.device, CL_QUEUE_PROFILING_ENABLE, 0);
+	dev.program = createProgram(dev.context, dev.device, config.kernelFile.c_str());
+
+	if (!dev.queue || !dev.program)
+	{
+		std::cout << "cannot set up device\n";
+		return 1;
+	}
+
+	char deviceName[256] = { 0 }, deviceVendor[256] = { 0 }, driverVersion[256] = { 0 };
+	clGetDeviceInfo(dev.device, CL_DEVICE_NAME, sizeof(deviceName) - 1, deviceName, 0);
+	clGetDeviceInfo(dev.device, CL_DEVICE_VENDOR, sizeof(deviceVendor) - 1, deviceVendor, 0);
+	clGetDeviceInfo(dev.device, CL_DRIVER_VERSION, sizeof(driverVersion) - 1, driverVersion, 0);
+
+	std::ostringstream json;
+
+	json << "{\n  \"device\": { \"name\": " << jsonString(deviceName) << ", \"vendor\": " << jsonString(deviceVendor)
+		 << ", \"driver\": " << jsonString(driverVersion) << " },\n"
+		 << "  \"cpu_simd\": " << jsonString(cpuSimdLevelName(cpuDetectSimdLevel())) << ",\n"
+		 << "  \"warmup\": " << config.warmup << ",\n  \"iterations\": " << config.iterations << ",\n"
+		 << "  \"results\": [";
+
+	for (size_t i = 0; i < config.sizes.size(); ++i)
+	{
+		int w = config.sizes[i].first, h = config.sizes[i].second;
+
+		std::cout << "Benchmarking " << w << "x" << h << "..." << std::endl;
+
+		json << (i ? ",\n" : "\n") << benchmarkSize(config, dev, w, h);
+	}
+
+	json << "\n  ]\n}\n";
+
+	std::ofstream outputFile(config.outputPath);
+	outputFile << json.str();
+
+	std::cout << "Results written to " << config.outputPath << std::endl;
+
+	clReleaseProgram(dev.program);
+	clReleaseCommandQueue(dev.queue);
+	clReleaseContext(dev.context);
+
+	shutdownCOM();
+	return outputFile ? 0 : 1;
+}
+
+//
+// Private API implementation
+//
+static TimingStats computeStats(std::vector<double> samples)
+{
+	TimingStats stats = { 0.0, 0.0, 0.0, 0.0, 0.0, static_cast<int>(samples.size()) };
+
+	if (samples.empty()) return stats;
+
+	std::sort(samples.begin(), samples.end());
+
+	double sum = 0.0;
+	for (double s : samples) sum += s;
+
+	stats.mean = sum / samples.size();
+	stats.min = samples.front();
+	stats.max = samples.back();
+	stats.median = (samples.size() % 2) ? samples[samples.size() / 2] 
+										: 0.5 * (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]);
+
+	double variance = 0.0;
+	for (double s : samples) variance += (s - stats.mean) * (s - stats.mean);
+
+	stats.stddev = std::sqrt(variance / samples.size());
+	return stats;
+}
+
+static std::string statsJSON(const TimingStats& stats)
+{
+	char text[256];
+	snprintf(text, sizeof(text), "{ \"mean_ms\": %.4f, \"median_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f, \"stddev_ms\": %.4f }",
+			 stats.mean, stats.median, stats.min, stats.max, stats.stddev);
+	return text;
+}
+
+static std::string jsonString(const std::string& text)
+{
+	std::string result("\"");
+
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\') result += '\\';
+		if (static_cast<unsigned char>(c) >= 0x20) result += c;
+	}
+	return result + "\"";
+}
+
+
+// run() returns the time of one iteration in ms - warm-up iterations are discarded
+static TimingStats timeRepeated(const BenchmarkConfig& config, const std::function<double(void)>& run)
+{
+	std::vector<double> samples;
+
+	for (int i = 0; i < config.warmup; ++i)
+		run();
+
+	for (int i = 0; i < config.iterations; ++i)
+		samples.push_back(run());
+
+	return computeStats(samples);
+}
+
+// deterministic gradient with a little noise so every code path (including black) is exercised
+static void fillSynthetic(int w, int h, std::vector<unsigned char>& bgra, std::vector<float>& R, 
+						  std::vector<float>& G, std::vector<float>& B)
+{
+	size_t numPixels = static_cast<size_t>(w) * h;
+	unsigned int seed = 12345;
+
+	bgra.resize(numPixels * 4);
+	R.resize(numPixels);
+	G.resize(numPixels);
+	B.resize(numPixels);
+
+	for (int y = 0; y < h; ++y)
+	{
+		for (int x = 0; x < w; ++x)
+		{
+			size_t i = static_cast<size_t>(y) * w + x;
+
+			seed = seed * 1664525u + 1013904223u;
+			int noise = static_cast<int>(seed >> 28) - 8;
+
+			int r = std::min(255, std::max(0, (x * 255) / std::max(1, w - 1) + noise));
+			int g = std::min(255, std::max(0, (y * 255) / std::max(1, h - 1) + noise));
+			int b = std::min(255, std::max(0, 255 - r / 2 - g / 2 + noise));
+
+			bgra[i * 4 + 0] = static_cast<unsigned char>(b);
+			bgra[i * 4 + 1] = static_cast<unsigned char>(g);
+			bgra[i * 4 + 2] = static_cast<unsigned char>(r);
+			bgra[i * 4 + 3] = 255;
+
+			R[i] = r / 255.0f;
+			G[i] = g / 255.0f;
+			B[i] = b / 255.0f;
+		}
+	}
+}
+
+static std::string benchmarkSize(const BenchmarkConfig& config, BenchmarkDevice& dev, int w, int h)
+{
+	std::ostringstream json;
+	size_t numPixels = static_cast<size_t>(w) * h;
+	size_t planeBytes = numPixels * sizeof(float);
+	double megapixels = numPixels * 1.0e-6;
+
+	json << "    { \"width\": " << w << ", \"height\": " << h << ", \"megapixels\": " << megapixels;
+
+	// the staged pipeline needs nine float planes on the device at once
+	if (planeBytes > dev.maxAlloc || 9 * planeBytes > dev.globalMem)
+	{
+		std::cout << "  skipped - does not fit in device memory\n";
+		json << ", \"skipped\": \"insufficient device memory\" }";
+		return json.str();
+	}
+
+	std::vector<unsigned char> bgra;
+	std::vector<float> R, G, B;
+
+	fillSynthetic(w, h, bgra, R, G, B);
+
+	cl_context context = dev.context;
+	cl_command_queue queue = dev.queue;
+
+	cl_mem planes[9];
+
+	for (int i = 0; i < 9; ++i)
+		planes[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, planeBytes, 0, 0);
+
+	cl_mem packedIn  = clCreateBuffer(context, CL_MEM_READ_ONLY, numPixels * 4, 0, 0);
+	cl_mem packedOut = clCreateBuffer(context, CL_MEM_WRITE_ONLY, numPixels * 3, 0, 0);
+
+	clEnqueueWriteBuffer(queue, planes[0], CL_TRUE, 0, planeBytes, R.data(), 0, 0, 0);
+	clEnqueueWriteBuffer(queue, planes[1], CL_TRUE, 0, planeBytes, G.data(), 0, 0, 0);
+	clEnqueueWriteBuffer(queue, planes[2], CL_TRUE, 0, planeBytes, B.data(), 0, 0, 0);
+	clEnqueueWriteBuffer(queue, packedIn, CL_TRUE, 0, numPixels * 4, bgra.data(), 0, 0, 0);
+
+	float luminanceScale = 0.5f;
+	size_t imageWrkSize[2] = { static_cast<size_t>(w), static_cast<size_t>(h) };
+
+	//
+	// Kernels - each timed on its own from its profiling event
+	//
+	struct KernelCase
+	{
+		const char	*name;
+		int			input, output;	// first plane index, -1 for the packed buffers
+		bool		hasScale;
+	};
+
+	const KernelCase kernelCases[] =
+	{
+		{ "RGB_XYY",		0, 3, false },
+		{ "XYY_XYZ",		3, 6, true },
+		{ "XYY_L",			6, 3, false },
+		{ "RGB_XYY_RGB",	0, 3, true },
+		{ "BGRA8_XYY_BGR8",	-1, -1, true }
+	};
+
+	json << ",\n      \"kernels\": {";
+
+	for (size_t k = 0; k < sizeof(kernelCases) / sizeof(kernelCases[0]); ++k)
+	{
+		const KernelCase& c = kernelCases[k];
+		cl_int err;
+		cl_kernel kernel = clCreateKernel(dev.program, c.name, &err);
+
+		json << (k ? ",\n" : "\n") << "        " << jsonString(c.name) << ": ";
+
+		if (!kernel || err != CL_SUCCESS)
+		{
+			std::cout << "clCreateKernel " << c.name << " failed with error " << err << std::endl;
+			json << "null";
+			continue;
+		}
+
+		if (c.input < 0)
+		{
+			clSetKernelArg(kernel, 0, sizeof(cl_mem), &packedIn);
+			clSetKernelArg(kernel, 1, sizeof(cl_mem), &packedOut);
+			clSetKernelArg(kernel, 2, sizeof(cl_int), &w);
+			clSetKernelArg(kernel, 3, sizeof(cl_int), &h);
+			clSetKernelArg(kernel, 4, sizeof(cl_float), &luminanceScale);
+		}
+		else
+		{
+			for (int p = 0; p < 3; ++p)
+			{
+				clSetKernelArg(kernel, p, sizeof(cl_mem), &planes[c.input + p]);
+				clSetKernelArg(kernel, p + 3, sizeof(cl_mem), &planes[c.output + p]);
+			}
+			clSetKernelArg(kernel, 6, sizeof(cl_int), &w);
+			clSetKernelArg(kernel, 7, sizeof(cl_int), &h);
+
+			if (c.hasScale)
+				clSetKernelArg(kernel, 8, sizeof(cl_float), &luminanceScale);
+		}
+
+		bool failed = false;
+
+		// a rejected launch has no event to wait for - the remaining runs are skipped and the 
+		// kernel is reported as null
+		TimingStats stats = timeRepeated(config, [&](void)
+		{
+			if (failed) return 0.0;
+
+			cl_event event;
+			cl_int launchErr = clEnqueueNDRangeKernel(queue, kernel, 2, 0, imageWrkSize, 0, 0, 0, &event);
+
+			if (launchErr != CL_SUCCESS)
+			{
+				std::cout << c.name << " launch failed with error " << launchErr << std::endl;
+				failed = true;
+				return 0.0;
+			}
+
+			clWaitForEvents(1, &event);
+
+			double ms = eventSeconds(event) * 1000.0;
+			clReleaseEvent(event);
+			return ms;
+		});
+
+		json << (failed ? std::string("null") : statsJSON(stats));
+
+		clReleaseKernel(kernel);
+	}
+
+	json << "\n      }";
+
+	//
+	// Transfers - one float plane from pageable (malloc) and pinned (mapped) host memory
+	//
+	cl_mem pinned = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, planeBytes, 0, 0);
+	void *pinnedPtr = clEnqueueMapBuffer(queue, pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, planeBytes, 0, 0, 0, 0);
+
+	if (pinnedPtr)
+		memcpy(pinnedPtr, R.data(), planeBytes);
+
+	auto timeTransfer = [&](bool write, void *host)
+	{
+		return timeRepeated(config, [&](void)
+		{
+			cl_event event;
+
+			if (write)
+				clEnqueueWriteBuffer(queue, planes[3], CL_TRUE, 0, planeBytes, host, 0, 0, &event);
+			else
+				clEnqueueReadBuffer(queue, planes[3], CL_TRUE, 0, planeBytes, host, 0, 0, &event);
+
+			double ms = eventSeconds(event) * 1000.0;
+			clReleaseEvent(event);
+			return ms;
+		});
+	};
+
+	auto bandwidth = [&](const TimingStats& stats)
+	{
+		return (stats.median > 0.0) ? (planeBytes / (stats.median * 1.0e-3)) * 1.0e-9 : 0.0;
+	};
+
+	std::vector<float> readBack(numPixels);
+
+	TimingStats h2dPageable = timeTransfer(true, R.data());
+	TimingStats d2hPageable = timeTransfer(false, readBack.data());
+
+	json << ",\n      \"transfers\": {\n        \"bytes\": " << planeBytes 
+		 << ",\n        \"h2d_pageable\": " << statsJSON(h2dPageable) << ", \"h2d_pageable_gbps\": " << bandwidth(h2dPageable)
+		 << ",\n        \"d2h_pageable\": " << statsJSON(d2hPageable) << ", \"d2h_pageable_gbps\": " << bandwidth(d2hPageable);
+
+	if (pinnedPtr)
+	{
+		TimingStats h2dPinned = timeTransfer(true, pinnedPtr);
+		TimingStats d2hPinned = timeTransfer(false, pinnedPtr);
+
+		json << ",\n        \"h2d_pinned\": " << statsJSON(h2dPinned) << ", \"h2d_pinned_gbps\": " << bandwidth(h2dPinned)
+			 << ",\n        \"d2h_pinned\": " << statsJSON(d2hPinned) << ", \"d2h_pinned_gbps\": " << bandwidth(d2hPinned);
+
+		clEnqueueUnmapMemObject(queue, pinned, pinnedPtr, 0, 0, 0);
+		clFinish(queue);
+	}
+
+	json << "\n      }";
+
+	if (pinned) clReleaseMemObject(pinned);
+
+	//
+	// Host encode through saveImage's TIFF encoder, and decode through WIC on Windows - 
+	// elsewhere loadImage only reads .cpfi files, so there is no decode to time
+	//
+	std::vector<unsigned char> packedResult(numPixels * 3);
+	std::function<double(void)> encodeOnce, decodeOnce;
+	std::wstring tempPath(L"benchmark_temp.tif");
+
+	encodeOnce = [&](void)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		saveImage(w, h, reinterpret_cast<bgr8*>(packedResult.data()), tempPath);
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	};
+
+#ifdef _WIN32
+	decodeOnce = [&](void)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		CPBitmapImage I;
+		loadImage(tempPath, &I);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		free(I.buffer);
+		return ms;
+	};
+#endif
+
+	json << ",\n      \"host\": {";
+
+	TimingStats encodeStats = timeRepeated(config, encodeOnce);
+
+	json << " \"encode\": " << statsJSON(encodeStats) << ",\n        \"decode\": ";
+
+	if (decodeOnce)
+		json << statsJSON(timeRepeated(config, decodeOnce));
+	else
+		json << "null";
+
+	json << " }";
+
+	//
+	// End to end - packed upload, kernel, download and encode (and decode where available), 
+	// timed on the host
+	//
+	cl_int err;
+	cl_kernel packedKernel = clCreateKernel(dev.program, "BGRA8_XYY_BGR8", &err);
+	bool packedFailed = !packedKernel || err != CL_SUCCESS;
+
+	if (packedFailed)
+		std::cout << "clCreateKernel BGRA8_XYY_BGR8 failed with error " << err << std::endl;
+	else
+	{
+		clSetKernelArg(packedKernel, 0, sizeof(cl_mem), &packedIn);
+		clSetKernelArg(packedKernel, 1, sizeof(cl_mem), &packedOut);
+		clSetKernelArg(packedKernel, 2, sizeof(cl_int), &w);
+		clSetKernelArg(packedKernel, 3, sizeof(cl_int), &h);
+		clSetKernelArg(packedKernel, 4, sizeof(cl_float), &luminanceScale);
+	}
+
+	TimingStats endToEnd = timeRepeated(config, [&](void)
+	{
+		if (packedFailed) return 0.0;
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		// the decoded copy of the synthetic image has the same size as bgra, so upload bgra
+		if (decodeOnce) decodeOnce();
+
+		clEnqueueWriteBuffer(queue, packedIn, CL_FALSE, 0, numPixels * 4, bgra.data(), 0, 0, 0);
+
+		cl_int launchErr = clEnqueueNDRangeKernel(queue, packedKernel, 2, 0, imageWrkSize, 0, 0, 0, 0);
+
+		// skip the remaining runs - the upload is finished first as it reads bgra
+		if (launchErr != CL_SUCCESS)
+		{
+			std::cout << "BGRA8_XYY_BGR8 launch failed with error " << launchErr << std::endl;
+			clFinish(queue);
+			packedFailed = true;
+			return 0.0;
+		}
+
+		clEnqueueReadBuffer(queue, packedOut, CL_TRUE, 0, numPixels * 3, packedResult.data(), 0, 0, 0);
+
+		encodeOnce();
+
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	});
+
+	if (packedKernel) clReleaseKernel(packedKernel);
+
+	if (packedFailed)
+		json << ",\n      \"end_to_end\": null";
+	else
+		json << ",\n      \"end_to_end\": " << statsJSON(endToEnd) << ", \"includes_decode\": " << (decodeOnce ? "true" : "false")
+			 << ", \"megapixels_per_second\": " << ((endToEnd.median > 0.0) ? megapixels / (endToEnd.median * 1.0e-3) : 0.0);
+
+	//
+	// Image object path - the same end to end run with the pixels in image2d objects, plus the 
+	// kernel on its own, for each format the device supports
+	//
+	const ImageObjectFormat imageFormats[] = { IMAGE_OBJECT_UNORM8, IMAGE_OBJECT_HALF };
+
+	json << ",\n      \"image_objects\": {";
+
+	for (size_t f = 0; f < sizeof(imageFormats) / sizeof(imageFormats[0]); ++f)
+	{
+		ImageObjectPipeline imagePipeline(context, dev.device, dev.program, imageFormats[f]);
+
+		json << (f ? ",\n" : "\n") << "        " << jsonString(imageObjectFormatName(imageFormats[f])) << ": ";
+
+		if (!imagePipeline.valid())
+		{
+			json << "null";
+			continue;
+		}
+
+		const BGRA8 *pixels = reinterpret_cast<const BGRA8*>(bgra.data());
+		bgr8 *result = reinterpret_cast<bgr8*>(packedResult.data());
+
+		TimingStats imageKernel = timeRepeated(config, [&](void)
+		{
+			double kernelSeconds = 0.0;
+			imagePipeline.process(queue, pixels, w, h, luminanceScale, result, &kernelSeconds);
+			return kernelSeconds * 1.0e3;
+		});
+
+		TimingStats imageEndToEnd = timeRepeated(config, [&](void)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+
+			if (decodeOnce) decodeOnce();
+
+			imagePipeline.process(queue, pixels, w, h, luminanceScale, result);
+
+			encodeOnce();
+
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		});
+
+		json << "{ \"kernel\": " << statsJSON(imageKernel) << ",\n          \"end_to_end\": " << statsJSON(imageEndToEnd)
+			 << ", \"megapixels_per_second\": " << ((imageEndToEnd.median > 0.0) ? megapixels / (imageEndToEnd.median * 1.0e-3) : 0.0) 
+			 << " }";
+	}
+
+	json << "\n      }";
+
+	//
+	// Native CPU backend for comparison
+	//
+	if (config.includeCPU)
+	{
+		std::vector<float> outR(numPixels), outG(numPixels), outB(numPixels);
+
+		TimingStats cpuStats = timeRepeated(config, [&](void)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			cpuScaleLuminance(w, h, R.data(), G.data(), B.data(), outR.data(), outG.data(), outB.data(), luminanceScale);
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		});
+
+		json << ",\n      \"cpu_backend\": " << statsJSON(cpuStats) << ", \"cpu_megapixels_per_second\": " 
+			 << ((cpuStats.median > 0.0) ? megapixels / (cpuStats.median * 1.0e-3) : 0.0);
+	}
+
+	json << " }";
+
+	for (int i = 0; i < 9; ++i)
+		if (planes[i]) clReleaseMemObject(planes[i]);
+
+	clReleaseMemObject(packedIn);
+	clReleaseMemObject(packedOut);
+	return json.str();
+}
+
+static bool parseSizes(const char* text, std::vector<std::pair<int, int>>& sizes)
+{
+	std::vector<std::pair<int, int>> parsed;
+	std::stringstream stream(text);
+	std::string item;
+
+	while (std::getline(stream, item, ','))
+	{
+		int w = 0, h = 0;
+
+		if (sscanf(item.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+			return false;
+
+		parsed.push_back(std::make_pair(w, h));
+	}
+
+	if (parsed.empty()) return false;
+
+	sizes = parsed;
+	return true;
+}
@@ -0,0 +1,441 @@
+//
+// Size bucketed buffer pools - see buffer_pool.h
+//
+#include <iostream>
+#include <chrono>
+#include "buffer_pool.h"
+#include "trace_cl.h"
+
+BufferPoolBase::BufferPoolBase(cl_context context, size_t memoryCap)
+	: context(context), memoryCap(memoryCap), acquireTimeout(10000), useCounter(0), counters()
+{
+	if (context) clRetainContext(context);
+}
+
+BufferPoolBase::~BufferPoolBase(void)
+{
+	// derived destructors release the buffers since destroyEntry is virtual
+	if (context) clReleaseContext(context);
+}
+
+void BufferPoolBase::trim(void)
+{
+	std::vector<Entry> evicted;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (auto& item : freeList)
+		{
+			counters.bytesCached -= item.second.size;
+			evicted.push_back(item.second);
+		}
+		freeList.clear();
+		leastRecent.clear();
+	}
+
+	destroyEntries(evicted);
+}
+
+void BufferPoolBase::setMemoryCap(size_t cap)
+{
+	std::vector<Entry> evicted;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		memoryCap = cap;
+		makeRoom(0, evicted);
+	}
+
+	// a larger cap may let waiting requests in
+	released.notify_all();
+	destroyEntries(evicted);
+}
+
+void BufferPoolBase::setAcquireTimeout(unsigned int milliseconds)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	acquireTimeout = milliseconds;
+}
+
+BufferPoolStats BufferPoolBase::stats(void) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+void BufferPoolBase::report(const char* label) const
+{
+	BufferPoolStats s = stats();
+
+	std::cout << label << ": " << s.allocations << " allocation(s), " << s.evictions << " eviction(s), " 
+			  << "hit rate " << (s.hitRate() * 100.0) << "%, " 
+			  << (s.bytesInUse >> 20) << " MB in use, " << (s.bytesCached >> 20) << " MB cached, " 
+			  << (s.peakBytes >> 20) << " MB peak";
+
+	if (s.waits || s.rejections)
+		std::cout << ", " << s.waits << " wait(s) and " << s.rejections << " rejection(s) at the memory cap";
+
+	std::cout << "\n";
+}
+
+size_t BufferPoolBase::bucketSize(size_t bytes)
+{
+	// small buffers all share the smallest bucket
+	const size_t minBucket = 4096;
+
+	if (bytes <= minBucket) return minBucket;
+
+	// highest power of two not above bytes, then round up to the next quarter step above it
+	size_t power = minBucket;
+	while (power <= bytes / 2) power <<= 1;
+
+	size_t step = power / 4;
+	return ((bytes + step - 1) / step) * step;
+}
+
+bool BufferPoolBase::acquireEntry(size_t bytes, cl_mem_flags flags, Entry& entry)
+{
+	return acquireEntries(1, &bytes, &flags, &entry);
+}
+
+bool BufferPoolBase::acquireEntries(int count, const size_t* bytes, const cl_mem_flags* flags, Entry* entries)
+{
+	std::vector<size_t> sizes(count);
+	std::vector<bool> reused(count, false);
+	std::vector<Entry> evicted;
+	size_t total = 0;
+
+	for (int i = 0; i < count; ++i)
+	{
+		sizes[i] = bucketSize(bytes[i]);
+		total += sizes[i];
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(acquireTimeout);
+	bool waited = false, timedOut = false;
+
+	// Every pass looks for free buffers first, so one released while this request waited is 
+	// reused rather than evicted to make room for a new one
+	for (;;)
+	{
+		size_t needed = 0;
+
+		// taken off the free list as they are found, so two requests of one size get two buffers
+		for (int i = 0; i < count; ++i)
+		{
+			FreeList::iterator it = freeList.find(std::make_pair(sizes[i], flags[i]));
+
+			reused[i] = (it != freeList.end());
+
+			if (reused[i])
+			{
+				entries[i] = it->second;
+				removeFree(it);
+
+				counters.bytesCached -= entries[i].size;
+				counters.bytesInUse += entries[i].size;
+			}
+			else
+				needed += sizes[i];
+		}
+
+		if (makeRoom(needed, evicted))
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				if (reused[i])
+					counters.hits++;
+				else
+					counters.misses++;
+			}
+
+			// reserve the bytes so other requests see them, then create the buffers without the lock
+			counters.bytesInUse += needed;
+			guard.unlock();
+
+			destroyEntries(evicted);
+
+			std::vector<Entry> created;
+			bool failed = false;
+
+			for (int i = 0; i < count && !failed; ++i)
+			{
+				if (reused[i]) continue;
+
+				failed = !createEntry(sizes[i], flags[i], entries[i]);
+
+				if (!failed)
+					created.push_back(entries[i]);
+			}
+
+			guard.lock();
+
+			if (failed)
+			{
+				// hand back the whole set - the reused buffers go back on the free list
+				counters.bytesInUse -= needed;
+
+				for (int i = 0; i < count; ++i)
+					if (reused[i])
+					{
+						counters.bytesInUse -= entries[i].size;
+						addFree(entries[i]);
+					}
+
+				guard.unlock();
+				released.notify_all();
+				destroyEntries(created);
+				return false;
+			}
+
+			counters.allocations += created.size();
+			break;
+		}
+
+		// not all of it fits - return the free buffers taken above rather than hold them
+		for (int i = 0; i < count; ++i)
+			if (reused[i])
+			{
+				counters.bytesInUse -= entries[i].size;
+				addFree(entries[i]);
+			}
+
+		// a request larger than the cap never fits and with nothing in use no release is coming
+		if (timedOut || total > memoryCap || counters.bytesInUse == 0)
+		{
+			counters.misses += count;
+			counters.rejections++;
+			guard.unlock();
+			destroyEntries(evicted);
+			return false;
+		}
+
+		if (!waited)
+		{
+			counters.waits++;
+			waited = true;
+		}
+
+		timedOut = (released.wait_until(guard, deadline) == std::cv_status::timeout);
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		entries[i].lastUse = ++useCounter;
+		inUse[entries[i].buffer] = entries[i];
+	}
+
+	if (counters.bytesInUse + counters.bytesCached > counters.peakBytes)
+		counters.peakBytes = counters.bytesInUse + counters.bytesCached;
+
+	guard.unlock();
+	destroyEntries(evicted);
+	return true;
+}
+
+void BufferPoolBase::releaseEntry(cl_mem buffer)
+{
+	std::vector<Entry> evicted;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		std::map<cl_mem, Entry>::iterator it = inUse.find(buffer);
+
+		if (it == inUse.end()) return;
+
+		Entry entry = it->second;
+		inUse.erase(it);
+
+		entry.lastUse = ++useCounter;
+		counters.bytesInUse -= entry.size;
+
+		addFree(entry);
+		makeRoom(0, evicted);
+	}
+
+	released.notify_all();
+	destroyEntries(evicted);
+}
+
+// called with lock held
+bool BufferPoolBase::makeRoom(size_t bytes, std::vector<Entry>& evicted)
+{
+	if (memoryCap == 0) return true;
+
+	// evicting is pointless if the buffers in use alone leave no room
+	if (counters.bytesInUse + bytes > memoryCap) return false;
+
+	while (counters.bytesInUse + counters.bytesCached + bytes > memoryCap && !leastRecent.empty())
+	{
+		FreeList::iterator oldest = leastRecent.begin()->second;
+
+		counters.bytesCached -= oldest->second.size;
+		counters.evictions++;
+		evicted.push_back(oldest->second);
+		removeFree(oldest);
+	}
+
+	return counters.bytesInUse + counters.bytesCached + bytes <= memoryCap;
+}
+
+// called with lock held - entry keeps its lastUse, so a buffer put back unused keeps its 
+// place in the eviction order
+void BufferPoolBase::addFree(const Entry& entry)
+{
+	FreeList::iterator added = freeList.insert(std::make_pair(std::make_pair(entry.size, entry.flags), entry));
+	leastRecent[entry.lastUse] = added;
+	counters.bytesCached += entry.size;
+}
+
+// called with lock held
+void BufferPoolBase::removeFree(FreeList::iterator it)
+{
+	leastRecent.erase(it->second.lastUse);
+	freeList.erase(it);
+}
+
+// called without the lock - destroying a staging buffer waits for its unmap
+void BufferPoolBase::destroyEntries(std::vector<Entry>& entries)
+{
+	for (Entry& entry : entries)
+		destroyEntry(entry);
+
+	entries.clear();
+}
+
+//
+// DeviceBufferPool
+//
+DeviceBufferPool::DeviceBufferPool(cl_context context, size_t memoryCap)
+	: BufferPoolBase(context, memoryCap)
+{
+}
+
+DeviceBufferPool::~DeviceBufferPool(void)
+{
+	trim();
+}
+
+cl_mem DeviceBufferPool::acquire(size_t bytes, cl_mem_flags flags)
+{
+	Entry entry;
+	return acquireEntry(bytes, flags, entry) ? entry.buffer : nullptr;
+}
+
+bool DeviceBufferPool::acquire(int count, const size_t* bytes, const cl_mem_flags* flags, cl_mem* buffers)
+{
+	std::vector<Entry> entries(count);
+	bool acquired = acquireEntries(count, bytes, flags, entries.data());
+
+	for (int i = 0; i < count; ++i)
+		buffers[i] = acquired ? entries[i].buffer : nullptr;
+
+	return acquired;
+}
+
+void DeviceBufferPool::release(cl_mem buffer)
+{
+	if (buffer) releaseEntry(buffer);
+}
+
+bool DeviceBufferPool::createEntry(size_t size, cl_mem_flags flags, Entry& entry)
+{
+	cl_int err;
+
+	entry.buffer = clCreateBuffer(context, flags, size, 0, &err);
+	entry.mapped = nullptr;
+	entry.size   = size;
+	entry.flags  = flags;
+
+	return entry.buffer && err == CL_SUCCESS;
+}
+
+void DeviceBufferPool::destroyEntry(Entry& entry)
+{
+	clReleaseMemObject(entry.buffer);
+}
+
+//
+// HostStagingPool
+//
+HostStagingPool::HostStagingPool(cl_context context, cl_command_queue queue, size_t memoryCap)
+	: BufferPoolBase(context, memoryCap), queue(queue)
+{
+	clRetainCommandQueue(queue);
+}
+
+HostStagingPool::~HostStagingPool(void)
+{
+	trim();
+	clReleaseCommandQueue(queue);
+}
+
+StagingBuffer HostStagingPool::acquire(size_t bytes)
+{
+	StagingBuffer staging = { nullptr, nullptr, 0 };
+	Entry entry;
+
+	if (acquireEntry(bytes, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, entry))
+	{
+		staging.buffer  = entry.buffer;
+		staging.hostPtr = entry.mapped;
+		staging.size    = entry.size;
+	}
+	return staging;
+}
+
+void HostStagingPool::release(const StagingBuffer& staging)
+{
+	if (staging.buffer) releaseEntry(staging.buffer);
+}
+
+bool HostStagingPool::createEntry(size_t size, cl_mem_flags flags, Entry& entry)
+{
+	cl_int err;
+
+	entry.buffer = clCreateBuffer(context, flags, size, 0, &err);
+	entry.mapped = nullptr;
+	entry.size   = size;
+	entry.flags  = flags;
+
+	if (!entry.buffer || err != CL_SUCCESS)
+		return false;
+
+	// map once and keep the mapping for the lifetime of the buffer
+	err = traceCommand("map staging", queue, 0, [&](cl_event* event)
+	{
+		cl_int mapErr;
+		entry.mapped = clEnqueueMapBuffer(queue, entry.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 
+										  0, 0, event, &mapErr);
+		return mapErr;
+	});
+
+	if (!entry.mapped || err != CL_SUCCESS)
+	{
+		clReleaseMemObject(entry.buffer);
+		return false;
+	}
+	return true;
+}
+
+void HostStagingPool::destroyEntry(Entry& entry)
+{
+	cl_event unmapped = nullptr;
+
+	cl_int err = traceCommand("unmap staging", queue, &unmapped, [&](cl_event* event)
+	{
+		return clEnqueueUnmapMemObject(queue, entry.buffer, entry.mapped, 0, 0, event);
+	});
+
+	// wait for this unmap only, not for everything else on the queue
+	if (err == CL_SUCCESS)
+	{
+		clWaitForEvents(1, &unmapped);
+		clReleaseEvent(unmapped);
+	}
+	clReleaseMemObject(entry.buffer);
+}
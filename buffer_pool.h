@@ -0,0 +1,177 @@
+//
+// Size bucketed pools of OpenCL buffers so a long running pipeline reuses allocations across 
+// images of similar size instead of creating and releasing buffers for every image
+//
+#ifndef _BUFFER_POOL_
+#define _BUFFER_POOL_
+
+#include <CL/opencl.h>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <condition_variable>
+
+struct BufferPoolStats
+{
+	size_t		allocations;	// buffers created
+	size_t		evictions;		// free buffers released to stay under the cap
+	size_t		hits;			// requests served from a free buffer
+	size_t		misses;			// requests that needed a new buffer
+	size_t		waits;			// requests that waited for a release to make room under the cap
+	size_t		rejections;		// requests refused - no room under the cap within the acquire timeout
+	size_t		bytesInUse;		// bytes handed out and not yet released
+	size_t		bytesCached;	// bytes held in free buffers
+	size_t		peakBytes;		// highest bytesInUse + bytesCached seen
+
+	double hitRate(void) const
+	{
+		return (hits + misses) ? static_cast<double>(hits) / (hits + misses) : 0.0;
+	}
+};
+
+// Common bucketing, reuse and LRU eviction logic.  Requests are rounded up to one of four 
+// buckets per power of two so a reused buffer is never more than 25% larger than needed.  A 
+// request that does not fit under the memory cap waits for buffers in use to be released, up 
+// to the acquire timeout, and is only refused (counted in rejections) after that - or at once 
+// if it is larger than the cap or nothing is in use.  A request can cover several buffers, 
+// which are then reserved together or not at all, so threads that each need a set never sit 
+// on part of one waiting for the rest.  Buffers are created and destroyed outside the pool 
+// lock.
+class BufferPoolBase
+{
+public:
+
+	// memoryCap is the most bytes (in use + cached) the pool may hold, 0 for no limit.  context 
+	// is retained, and may be null for a derived pool that creates no OpenCL objects
+	BufferPoolBase(cl_context context, size_t memoryCap);
+	virtual ~BufferPoolBase(void);
+
+	BufferPoolBase(const BufferPoolBase&) = delete;
+	BufferPoolBase& operator=(const BufferPoolBase&) = delete;
+
+	// release every free buffer
+	void trim(void);
+
+	void setMemoryCap(size_t memoryCap);
+
+	// longest an acquire waits for room under the cap (default 10s).  A caller that holds 
+	// buffers from the pool while acquiring more can only be unblocked by other threads, so 
+	// the wait is bounded
+	void setAcquireTimeout(unsigned int milliseconds);
+
+	BufferPoolStats stats(void) const;
+
+	// print the counters on one line with the given label
+	void report(const char* label) const;
+
+	// round a request up to its bucket size
+	static size_t bucketSize(size_t bytes);
+
+protected:
+
+	struct Entry
+	{
+		cl_mem			buffer;
+		void			*mapped;	// host pointer for pinned staging buffers, nullptr otherwise
+		size_t			size;
+		cl_mem_flags	flags;
+		unsigned long long lastUse;
+	};
+
+	// find or create a buffer of at least bytes with the given flags - returns false if the 
+	// request cannot be met within the memory cap before the acquire timeout
+	bool acquireEntry(size_t bytes, cl_mem_flags flags, Entry& entry);
+
+	// acquireEntry for count buffers at once - all of them are reserved in the same pass under 
+	// the lock, and none is held when it returns false
+	bool acquireEntries(int count, const size_t* bytes, const cl_mem_flags* flags, Entry* entries);
+
+	// return the buffer to the free list
+	void releaseEntry(cl_mem buffer);
+
+	virtual bool createEntry(size_t size, cl_mem_flags flags, Entry& entry) = 0;
+	virtual void destroyEntry(Entry& entry) = 0;
+
+	cl_context		context;
+
+private:
+
+	typedef std::multimap<std::pair<size_t, cl_mem_flags>, Entry> FreeList;
+
+	// take least recently used free buffers off the free list until bytes more fit under the 
+	// cap - they are added to evicted for the caller to destroy once the lock is released
+	bool makeRoom(size_t bytes, std::vector<Entry>& evicted);
+
+	void addFree(const Entry& entry);
+	void removeFree(FreeList::iterator it);
+	void destroyEntries(std::vector<Entry>& entries);
+
+	FreeList					freeList;
+	std::map<unsigned long long, FreeList::iterator>	leastRecent;	// free buffers by lastUse, oldest first
+	std::map<cl_mem, Entry>		inUse;
+	size_t						memoryCap;
+	unsigned int				acquireTimeout;		// ms
+	unsigned long long			useCounter;
+	BufferPoolStats				counters;
+	mutable std::mutex			lock;
+	std::condition_variable		released;
+};
+
+// Pool of device buffers
+class DeviceBufferPool : public BufferPoolBase
+{
+public:
+
+	DeviceBufferPool(cl_context context, size_t memoryCap = 0);
+	~DeviceBufferPool(void);
+
+	// buffer of at least bytes, or nullptr if it cannot be allocated within the cap before the 
+	// acquire timeout
+	cl_mem acquire(size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE);
+
+	// count buffers of bytes[i] with flags[i], reserved together so callers each needing a set 
+	// (a pipeline's input and output) cannot block one another at the cap.  Returns false, with 
+	// every buffers[i] nullptr, if the set cannot be allocated before the acquire timeout
+	bool acquire(int count, const size_t* bytes, const cl_mem_flags* flags, cl_mem* buffers);
+
+	void release(cl_mem buffer);
+
+protected:
+
+	bool createEntry(size_t size, cl_mem_flags flags, Entry& entry) override;
+	void destroyEntry(Entry& entry) override;
+};
+
+// Pinned host staging buffer - a CL_MEM_ALLOC_HOST_PTR buffer kept mapped for its lifetime so 
+// host code can read and write hostPtr and transfers to and from it run at full DMA speed
+struct StagingBuffer
+{
+	cl_mem		buffer;
+	void		*hostPtr;
+	size_t		size;
+};
+
+// Pool of pinned host staging buffers.  queue is used to map and unmap the buffers.
+class HostStagingPool : public BufferPoolBase
+{
+public:
+
+	HostStagingPool(cl_context context, cl_command_queue queue, size_t memoryCap = 0);
+	~HostStagingPool(void);
+
+	// staging buffer of at least bytes, buffer == nullptr if it cannot be allocated within the 
+	// cap before the acquire timeout
+	StagingBuffer acquire(size_t bytes);
+
+	void release(const StagingBuffer& staging);
+
+protected:
+
+	bool createEntry(size_t size, cl_mem_flags flags, Entry& entry) override;
+	void destroyEntry(Entry& entry) override;
+
+	cl_command_queue	queue;
+};
+
+#endif
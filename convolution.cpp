@@ -0,0 +1,229 @@
+//
+// Tiled separable convolution - see convolution.h
+//
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include "convolution.h"
+#include "cpu_pipeline.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+//
+// Private API
+//
+static cl_device_id		programDevice(cl_program program);
+
+
+//
+// Public function implementation
+//
+const char* convolutionModeName(ConvolutionMode mode)
+{
+	switch (mode)
+	{
+	case CONVOLVE_BLUR:		return "blur";
+	case CONVOLVE_SHARPEN:	return "sharpen";
+	default:				return "none";
+	}
+}
+
+std::string convolutionBuildOptions(void)
+{
+	return "-D CONV_TILE_X=" + std::to_string(convolutionTileX) + " -D CONV_TILE_Y=" + std::to_string(convolutionTileY);
+}
+
+std::vector<float> gaussianWeights(int radius, float sigma)
+{
+	if (sigma <= 0.0f)
+		sigma = std::max(radius / 3.0f, 0.5f);
+
+	std::vector<float> result(2 * radius + 1);
+	float sum = 0.0f;
+
+	for (int k = -radius; k <= radius; ++k)
+	{
+		result[k + radius] = std::exp(-(k * k) / (2.0f * sigma * sigma));
+		sum += result[k + radius];
+	}
+
+	for (float& weight : result)
+		weight /= sum;
+
+	return result;
+}
+
+SeparableConvolution::SeparableConvolution(cl_context context, cl_program program, int radius, float sigma)
+	: rowKernel(nullptr), columnKernel(nullptr), unsharpKernel(nullptr), weightsBuffer(nullptr),
+	  kernelRadius(std::min(std::max(radius, 1), maxConvolutionRadius))
+{
+	rowTileFloats    = static_cast<size_t>(convolutionTileX + 2 * kernelRadius) * convolutionTileY;
+	columnTileFloats = static_cast<size_t>(convolutionTileX) * (convolutionTileY + 2 * kernelRadius);
+
+	weights = gaussianWeights(kernelRadius, sigma);
+
+	rowKernel    = clCreateKernel(program, "CONVOLVE_ROWS", 0);
+	columnKernel = clCreateKernel(program, "CONVOLVE_COLUMNS", 0);
+
+	weightsBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+								   weights.size() * sizeof(float), weights.data(), 0);
+
+	cl_kernel unsharp = clCreateKernel(program, "UNSHARP", 0);
+
+	if (!rowKernel || !columnKernel || !unsharp || !weightsBuffer)
+	{
+		std::cout << "convolution kernels not created\n";
+
+		if (unsharp) clReleaseKernel(unsharp);
+		return;
+	}
+
+	// the tile is a local argument, so an oversized one would only fail at enqueue time
+	cl_device_id device = programDevice(program);
+	cl_ulong localMemory = 0, rowStatic = 0, columnStatic = 0;
+
+	if (device)
+	{
+		clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemory), &localMemory, 0);
+		clGetKernelWorkGroupInfo(rowKernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(rowStatic), &rowStatic, 0);
+		clGetKernelWorkGroupInfo(columnKernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(columnStatic), &columnStatic, 0);
+	}
+
+	cl_ulong needed = std::max(rowStatic + rowTileFloats * sizeof(float), columnStatic + columnTileFloats * sizeof(float));
+
+	if (!device || needed > localMemory)
+	{
+		std::cout << "convolution radius " << kernelRadius << " needs " << needed << " bytes of local memory, the device has " 
+				  << localMemory << std::endl;
+
+		clReleaseKernel(unsharp);
+		return;
+	}
+
+	unsharpKernel = unsharp;
+}
+
+SeparableConvolution::~SeparableConvolution(void)
+{
+	if (rowKernel) clReleaseKernel(rowKernel);
+	if (columnKernel) clReleaseKernel(columnKernel);
+	if (unsharpKernel) clReleaseKernel(unsharpKernel);
+	if (weightsBuffer) clReleaseMemObject(weightsBuffer);
+}
+
+cl_int SeparableConvolution::enqueue(cl_command_queue queue, cl_mem plane, cl_mem scratch, cl_mem blurred, int w, int h,
+									 ConvolutionMode mode, float amount, cl_uint numEvents, const cl_event* waitList,
+									 cl_event* event)
+{
+	if (!valid() || mode == CONVOLVE_NONE) return CL_INVALID_VALUE;
+
+	// only the first pass needs the wait list - the queue orders the rest
+	cl_int err = enqueuePass(queue, rowKernel, plane, scratch, w, h, rowTileFloats, numEvents, waitList, 0);
+
+	if (mode == CONVOLVE_BLUR)
+	{
+		if (err == CL_SUCCESS)
+			err = enqueuePass(queue, columnKernel, scratch, plane, w, h, columnTileFloats, 0, 0, event);
+		return err;
+	}
+
+	if (err == CL_SUCCESS)
+		err = enqueuePass(queue, columnKernel, scratch, blurred, w, h, columnTileFloats, 0, 0, 0);
+
+	clSetKernelArg(unsharpKernel, 0, sizeof(cl_mem), &plane);
+	clSetKernelArg(unsharpKernel, 1, sizeof(cl_mem), &blurred);
+	clSetKernelArg(unsharpKernel, 2, sizeof(cl_mem), &plane);
+	clSetKernelArg(unsharpKernel, 3, sizeof(cl_int), &w);
+	clSetKernelArg(unsharpKernel, 4, sizeof(cl_int), &h);
+	clSetKernelArg(unsharpKernel, 5, sizeof(cl_float), &amount);
+
+	// UNSHARP works in place so it cannot be tuned - repeated tuning launches would sharpen 
+	// the plane several times
+	WorkGroupSize tile = { convolutionTileX, convolutionTileY, false };
+
+	if (err == CL_SUCCESS)
+		err = enqueueImageKernel(queue, unsharpKernel, w, h, tile, 0, 0, event);
+
+	return err;
+}
+
+float SeparableConvolution::validate(cl_context context, cl_command_queue queue, int w, int h, const float* plane,
+									 ConvolutionMode mode, float amount)
+{
+	size_t planeSize = static_cast<size_t>(w) * h * sizeof(float);
+
+	cl_mem device[3];
+
+	device[0] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, planeSize, const_cast<float*>(plane), 0);
+	device[1] = clCreateBuffer(context, CL_MEM_READ_WRITE, planeSize, 0, 0);
+	device[2] = clCreateBuffer(context, CL_MEM_READ_WRITE, planeSize, 0, 0);
+
+	float* result    = static_cast<float*>(malloc(planeSize));
+	float* reference = static_cast<float*>(malloc(planeSize));
+
+	float maxError = -1.0f;
+
+	if (device[0] && device[1] && device[2] &&
+		enqueue(queue, device[0], device[1], device[2], w, h, mode, amount, 0, 0, 0) == CL_SUCCESS &&
+		traceCommand("download plane", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueReadBuffer(queue, device[0], CL_TRUE, 0, planeSize, result, 0, 0, event);
+		}) == CL_SUCCESS)
+	{
+		cpuSeparableConvolution(w, h, plane, reference, weights.data(), kernelRadius);
+
+		if (mode == CONVOLVE_SHARPEN)
+			cpuUnsharpMask(w, h, plane, reference, reference, amount);
+
+		maxError = 0.0f;
+
+		for (size_t i = 0; i < static_cast<size_t>(w) * h; ++i)
+			maxError = std::max(maxError, std::fabs(result[i] - reference[i]));
+	}
+
+	for (cl_mem buffer : device)
+		if (buffer) clReleaseMemObject(buffer);
+
+	free(result);
+	free(reference);
+	return maxError;
+}
+
+
+//
+// Private function implementation
+//
+cl_int SeparableConvolution::enqueuePass(cl_command_queue queue, cl_kernel kernel, cl_mem input, cl_mem output,
+										 int w, int h, size_t tileFloats, cl_uint numEvents, const cl_event* waitList,
+										 cl_event* event)
+{
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &input);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
+	clSetKernelArg(kernel, 2, sizeof(cl_int), &w);
+	clSetKernelArg(kernel, 3, sizeof(cl_int), &h);
+	clSetKernelArg(kernel, 4, sizeof(cl_mem), &weightsBuffer);
+	clSetKernelArg(kernel, 5, sizeof(cl_int), &kernelRadius);
+	clSetKernelArg(kernel, 6, tileFloats * sizeof(float), 0);
+
+	// fixed tile shaped work-groups, so no tuning
+	WorkGroupSize tile = { convolutionTileX, convolutionTileY, false };
+
+	return enqueueImageKernel(queue, kernel, w, h, tile, numEvents, waitList, event);
+}
+
+// First device program was built for, or null
+static cl_device_id programDevice(cl_program program)
+{
+	size_t size = 0;
+
+	if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, 0, 0, &size) != CL_SUCCESS || size < sizeof(cl_device_id))
+		return nullptr;
+
+	std::vector<cl_device_id> devices(size / sizeof(cl_device_id));
+
+	if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, size, devices.data(), 0) != CL_SUCCESS)
+		return nullptr;
+
+	return devices[0];
+}
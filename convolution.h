@@ -0,0 +1,80 @@
+//
+// Separable convolution of the luminance plane - Gaussian blur and unsharp mask.  The device
+// passes (CONVOLVE_ROWS, CONVOLVE_COLUMNS and UNSHARP in HelloWorld.cl) work on one plane of the
+// planar layout in the storage mode the program was built for; cpuSeparableConvolution and
+// cpuUnsharpMask in cpu_pipeline.h are the reference they are validated against.
+//
+#ifndef _CONVOLUTION_
+#define _CONVOLUTION_
+
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+enum ConvolutionMode
+{
+	CONVOLVE_NONE = 0,
+	CONVOLVE_BLUR,
+	CONVOLVE_SHARPEN
+};
+
+const char* convolutionModeName(ConvolutionMode mode);
+
+// largest radius the kernels are set up for - keeps the local memory tiles small
+const int maxConvolutionRadius = 32;
+
+// Work-group size the convolution kernels require - CONV_TILE_X / CONV_TILE_Y in HelloWorld.cl
+const int convolutionTileX = 16;
+const int convolutionTileY = 16;
+
+// "-D CONV_TILE_X=.. -D CONV_TILE_Y=.." from the constants above - createProgram adds these to 
+// every build so the kernels and the host always agree
+std::string convolutionBuildOptions(void);
+
+// 2 * radius + 1 normalised Gaussian weights.  sigma <= 0 uses radius / 3
+std::vector<float> gaussianWeights(int radius, float sigma = 0.0f);
+
+class SeparableConvolution
+{
+public:
+
+	// Create the kernels from program and upload the Gaussian weights for radius (clamped to
+	// 1 .. maxConvolutionRadius).  The object is left invalid if the tiles for radius do not fit
+	// in the device's local memory
+	SeparableConvolution(cl_context context, cl_program program, int radius, float sigma = 0.0f);
+	~SeparableConvolution(void);
+
+	SeparableConvolution(const SeparableConvolution&) = delete;
+	SeparableConvolution& operator=(const SeparableConvolution&) = delete;
+
+	bool valid(void) const { return unsharpKernel != nullptr; }
+
+	int radius(void) const { return kernelRadius; }
+
+	// Blur or sharpen the w x h plane in place.  scratch and blurred are planes of the same
+	// size (blurred is only used by CONVOLVE_SHARPEN).  The queue must be in order - event is
+	// set on the last pass.
+	cl_int enqueue(cl_command_queue queue, cl_mem plane, cl_mem scratch, cl_mem blurred, int w, int h,
+				   ConvolutionMode mode, float amount, cl_uint numEvents, const cl_event* waitList, cl_event* event);
+
+	// Run mode on a float plane with a float storage program and return the largest
+	// difference from the CPU reference, or a negative value on failure
+	float validate(cl_context context, cl_command_queue queue, int w, int h, const float* plane,
+				   ConvolutionMode mode, float amount);
+
+private:
+
+	cl_int enqueuePass(cl_command_queue queue, cl_kernel kernel, cl_mem input, cl_mem output, int w, int h,
+					   size_t tileFloats, cl_uint numEvents, const cl_event* waitList, cl_event* event);
+
+	cl_kernel				rowKernel;
+	cl_kernel				columnKernel;
+	cl_kernel				unsharpKernel;
+	cl_mem					weightsBuffer;
+	int						kernelRadius;
+	size_t					rowTileFloats;		// local memory tile of each pass
+	size_t					columnTileFloats;
+	std::vector<float>		weights;
+};
+
+#endif
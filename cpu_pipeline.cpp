@@ -0,0 +1,454 @@
+//
+// CPU backend for the colour pipeline - see cpu_pipeline.h
+//
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include "cpu_pipeline.h"
+#include "thread_pool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_PIPELINE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// NEON is part of the AArch64 baseline, so it needs neither a target attribute nor detection
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define CPU_PIPELINE_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and clang need the target attribute to emit AVX2 in a translation unit that is not built 
+// with -mavx2.  MSVC accepts the intrinsics anywhere.
+#if defined(CPU_PIPELINE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CPU_TARGET_AVX2
+#endif
+
+// rows are handed out in chunks of at least this many pixels so small images stay on one thread
+static const int minPixelsPerChunk = 64 * 1024;
+
+//
+// Private API
+//
+typedef void (*ScaleRowFunc)(int n, const float *R, const float *G, const float *B,
+							 float *outR, float *outG, float *outB, float L);
+
+static ScaleRowFunc getScaleRowFunc(CPUSimdLevel level);
+
+
+// scalar version of scaleLuminance() in HelloWorld.cl
+static inline void scaleLuminancePixel(float r, float g, float b, float L, float *outR, float *outG, float *outB)
+{
+	// RGB -> XYZ
+	float X = 0.4124f * r + 0.3576f * g + 0.1805f * b;
+	float Y = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+	float Z = 0.0193f * r + 0.1192f * g + 0.9505f * b;
+
+	float sum = X + Y + Z;
+
+	if (sum <= 0.0f || Y <= 0.0f)
+	{
+		*outR = *outG = *outB = 0.0f;
+		return;
+	}
+
+	// XYZ -> xyY, scaling the luminance
+	float x  = X / sum;
+	float y  = Y / sum;
+	float Yl = Y * L;
+
+	// xyY -> XYZ
+	X = x * (Yl / y);
+	Z = (1 - x - y) * (Yl / y);
+
+	// XYZ -> RGB
+	*outR = 3.2405f * X + -1.5371f * Yl + -0.4985f * Z;
+	*outG = -0.9693f * X + 1.8760f * Yl + 0.0416f * Z;
+	*outB = 0.0556f * X + -0.2040f * Yl + 1.0572f * Z;
+}
+
+static void scaleRowScalar(int n, const float *R, const float *G, const float *B,
+						   float *outR, float *outG, float *outB, float L)
+{
+	for (int i = 0; i < n; ++i)
+		scaleLuminancePixel(R[i], G[i], B[i], L, outR + i, outG + i, outB + i);
+}
+
+#ifdef CPU_PIPELINE_X86
+
+// 4 pixels per iteration.  Operations are applied in the same order as the scalar code so the 
+// results only differ where the compiler contracts the scalar version differently.
+static void scaleRowSSE(int n, const float *R, const float *G, const float *B,
+						float *outR, float *outG, float *outB, float L)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one  = _mm_set1_ps(1.0f);
+	const __m128 vL   = _mm_set1_ps(L);
+
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 r = _mm_loadu_ps(R + i);
+		__m128 g = _mm_loadu_ps(G + i);
+		__m128 b = _mm_loadu_ps(B + i);
+
+		__m128 X = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.4124f), r), _mm_mul_ps(_mm_set1_ps(0.3576f), g)), _mm_mul_ps(_mm_set1_ps(0.1805f), b));
+		__m128 Y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.2126f), r), _mm_mul_ps(_mm_set1_ps(0.7152f), g)), _mm_mul_ps(_mm_set1_ps(0.0722f), b));
+		__m128 Z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.0193f), r), _mm_mul_ps(_mm_set1_ps(0.1192f), g)), _mm_mul_ps(_mm_set1_ps(0.9505f), b));
+
+		__m128 sum = _mm_add_ps(_mm_add_ps(X, Y), Z);
+
+		// black pixels are masked to zero after the arithmetic
+		__m128 valid = _mm_and_ps(_mm_cmpgt_ps(sum, zero), _mm_cmpgt_ps(Y, zero));
+
+		__m128 x  = _mm_div_ps(X, sum);
+		__m128 y  = _mm_div_ps(Y, sum);
+		__m128 Yl = _mm_mul_ps(Y, vL);
+		__m128 k  = _mm_div_ps(Yl, y);
+
+		X = _mm_mul_ps(x, k);
+		Z = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, x), y), k);
+
+		__m128 oR = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(3.2405f), X), _mm_mul_ps(_mm_set1_ps(-1.5371f), Yl)), _mm_mul_ps(_mm_set1_ps(-0.4985f), Z));
+		__m128 oG = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(-0.9693f), X), _mm_mul_ps(_mm_set1_ps(1.8760f), Yl)), _mm_mul_ps(_mm_set1_ps(0.0416f), Z));
+		__m128 oB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.0556f), X), _mm_mul_ps(_mm_set1_ps(-0.2040f), Yl)), _mm_mul_ps(_mm_set1_ps(1.0572f), Z));
+
+		_mm_storeu_ps(outR + i, _mm_and_ps(oR, valid));
+		_mm_storeu_ps(outG + i, _mm_and_ps(oG, valid));
+		_mm_storeu_ps(outB + i, _mm_and_ps(oB, valid));
+	}
+
+	scaleRowScalar(n - i, R + i, G + i, B + i, outR + i, outG + i, outB + i, L);
+}
+
+// 8 pixels per iteration - same sequence of operations as scaleRowSSE
+CPU_TARGET_AVX2
+static void scaleRowAVX2(int n, const float *R, const float *G, const float *B,
+						 float *outR, float *outG, float *outB, float L)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one  = _mm256_set1_ps(1.0f);
+	const __m256 vL   = _mm256_set1_ps(L);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 r = _mm256_loadu_ps(R + i);
+		__m256 g = _mm256_loadu_ps(G + i);
+		__m256 b = _mm256_loadu_ps(B + i);
+
+		__m256 X = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.4124f), r), _mm256_mul_ps(_mm256_set1_ps(0.3576f), g)), _mm256_mul_ps(_mm256_set1_ps(0.1805f), b));
+		__m256 Y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.2126f), r), _mm256_mul_ps(_mm256_set1_ps(0.7152f), g)), _mm256_mul_ps(_mm256_set1_ps(0.0722f), b));
+		__m256 Z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.0193f), r), _mm256_mul_ps(_mm256_set1_ps(0.1192f), g)), _mm256_mul_ps(_mm256_set1_ps(0.9505f), b));
+
+		__m256 sum = _mm256_add_ps(_mm256_add_ps(X, Y), Z);
+
+		__m256 valid = _mm256_and_ps(_mm256_cmp_ps(sum, zero, _CMP_GT_OQ), _mm256_cmp_ps(Y, zero, _CMP_GT_OQ));
+
+		__m256 x  = _mm256_div_ps(X, sum);
+		__m256 y  = _mm256_div_ps(Y, sum);
+		__m256 Yl = _mm256_mul_ps(Y, vL);
+		__m256 k  = _mm256_div_ps(Yl, y);
+
+		X = _mm256_mul_ps(x, k);
+		Z = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(one, x), y), k);
+
+		__m256 oR = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(3.2405f), X), _mm256_mul_ps(_mm256_set1_ps(-1.5371f), Yl)), _mm256_mul_ps(_mm256_set1_ps(-0.4985f), Z));
+		__m256 oG = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(-0.9693f), X), _mm256_mul_ps(_mm256_set1_ps(1.8760f), Yl)), _mm256_mul_ps(_mm256_set1_ps(0.0416f), Z));
+		__m256 oB = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(0.0556f), X), _mm256_mul_ps(_mm256_set1_ps(-0.2040f), Yl)), _mm256_mul_ps(_mm256_set1_ps(1.0572f), Z));
+
+		_mm256_storeu_ps(outR + i, _mm256_and_ps(oR, valid));
+		_mm256_storeu_ps(outG + i, _mm256_and_ps(oG, valid));
+		_mm256_storeu_ps(outB + i, _mm256_and_ps(oB, valid));
+	}
+
+	scaleRowSSE(n - i, R + i, G + i, B + i, outR + i, outG + i, outB + i, L);
+}
+
+#endif
+
+#ifdef CPU_PIPELINE_NEON
+
+// 4 pixels per iteration - same sequence of operations as scaleRowSSE
+static void scaleRowNEON(int n, const float *R, const float *G, const float *B,
+						 float *outR, float *outG, float *outB, float L)
+{
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+	const float32x4_t one  = vdupq_n_f32(1.0f);
+	const float32x4_t vL   = vdupq_n_f32(L);
+
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		float32x4_t r = vld1q_f32(R + i);
+		float32x4_t g = vld1q_f32(G + i);
+		float32x4_t b = vld1q_f32(B + i);
+
+		float32x4_t X = vaddq_f32(vaddq_f32(vmulq_n_f32(r, 0.4124f), vmulq_n_f32(g, 0.3576f)), vmulq_n_f32(b, 0.1805f));
+		float32x4_t Y = vaddq_f32(vaddq_f32(vmulq_n_f32(r, 0.2126f), vmulq_n_f32(g, 0.7152f)), vmulq_n_f32(b, 0.0722f));
+		float32x4_t Z = vaddq_f32(vaddq_f32(vmulq_n_f32(r, 0.0193f), vmulq_n_f32(g, 0.1192f)), vmulq_n_f32(b, 0.9505f));
+
+		float32x4_t sum = vaddq_f32(vaddq_f32(X, Y), Z);
+
+		uint32x4_t valid = vandq_u32(vcgtq_f32(sum, zero), vcgtq_f32(Y, zero));
+
+		float32x4_t x  = vdivq_f32(X, sum);
+		float32x4_t y  = vdivq_f32(Y, sum);
+		float32x4_t Yl = vmulq_f32(Y, vL);
+		float32x4_t k  = vdivq_f32(Yl, y);
+
+		X = vmulq_f32(x, k);
+		Z = vmulq_f32(vsubq_f32(vsubq_f32(one, x), y), k);
+
+		float32x4_t oR = vaddq_f32(vaddq_f32(vmulq_n_f32(X, 3.2405f), vmulq_n_f32(Yl, -1.5371f)), vmulq_n_f32(Z, -0.4985f));
+		float32x4_t oG = vaddq_f32(vaddq_f32(vmulq_n_f32(X, -0.9693f), vmulq_n_f32(Yl, 1.8760f)), vmulq_n_f32(Z, 0.0416f));
+		float32x4_t oB = vaddq_f32(vaddq_f32(vmulq_n_f32(X, 0.0556f), vmulq_n_f32(Yl, -0.2040f)), vmulq_n_f32(Z, 1.0572f));
+
+		vst1q_f32(outR + i, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(oR), valid)));
+		vst1q_f32(outG + i, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(oG), valid)));
+		vst1q_f32(outB + i, vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(oB), valid)));
+	}
+
+	scaleRowScalar(n - i, R + i, G + i, B + i, outR + i, outG + i, outB + i, L);
+}
+
+#endif
+
+//
+// Public function implementation
+//
+CPUSimdLevel cpuDetectSimdLevel(void)
+{
+#ifdef CPU_PIPELINE_X86
+	static const CPUSimdLevel level = [](void)
+	{
+#if defined(_MSC_VER)
+		int info[4];
+
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+
+		__cpuid(info, 1);
+		bool sse2 = (info[3] & (1 << 26)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		bool avx2 = false;
+
+		// AVX state must also be enabled by the OS
+		if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+		{
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		bool sse2 = __builtin_cpu_supports("sse2");
+		bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+		if (avx2) return CPU_SIMD_AVX2;
+		if (sse2) return CPU_SIMD_SSE;
+		return CPU_SIMD_SCALAR;
+	}();
+
+	return level;
+#elif defined(CPU_PIPELINE_NEON)
+	return CPU_SIMD_NEON;
+#else
+	return CPU_SIMD_SCALAR;
+#endif
+}
+
+const char* cpuSimdLevelName(CPUSimdLevel level)
+{
+	switch (level)
+	{
+	case CPU_SIMD_AVX2:	return "AVX2";
+	case CPU_SIMD_SSE:	return "SSE";
+	case CPU_SIMD_NEON:	return "NEON";
+	default:			return "scalar";
+	}
+}
+
+void cpuScaleLuminance(
+					   const int w,
+					   const int h,
+					   const float *R,
+					   const float *G,
+					   const float *B,
+					   float *outR,
+					   float *outG,
+					   float *outB,
+					   const float L,
+					   CPUSimdLevel level,
+					   ThreadPool *pool
+					   )
+{
+	ScaleRowFunc scaleRow = getScaleRowFunc(level);
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	int minRows = (w > 0) ? (minPixelsPerChunk + w - 1) / w : 1;
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		size_t offset = static_cast<size_t>(y0) * w;
+		int n = (y1 - y0) * w;
+
+		scaleRow(n, R + offset, G + offset, B + offset, outR + offset, outG + offset, outB + offset, L);
+	}, minRows);
+}
+
+void cpuScaleLuminancePacked(
+							 const int w,
+							 const int h,
+							 const unsigned char *bgra,
+							 unsigned char *bgr,
+							 const float L,
+							 CPUSimdLevel level,
+							 ThreadPool *pool
+							 )
+{
+	ScaleRowFunc scaleRow = getScaleRowFunc(level);
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	int minRows = (w > 0) ? (minPixelsPerChunk + w - 1) / w : 1;
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		// one row of float planes per chunk, reused for every row in the chunk
+		std::vector<float> scratch(6 * static_cast<size_t>(w));
+
+		float *r = scratch.data(), *g = r + w, *b = g + w;
+		float *oR = b + w, *oG = oR + w, *oB = oG + w;
+
+		for (int y = y0; y < y1; ++y)
+		{
+			const unsigned char *src = bgra + static_cast<size_t>(y) * w * 4;
+			unsigned char *dst = bgr + static_cast<size_t>(y) * w * 3;
+
+			for (int i = 0; i < w; ++i, src += 4)
+			{
+				b[i] = src[0] * (1.0f / 255.0f);
+				g[i] = src[1] * (1.0f / 255.0f);
+				r[i] = src[2] * (1.0f / 255.0f);
+			}
+
+			scaleRow(w, r, g, b, oR, oG, oB, L);
+
+			// saturate then truncate, as convert_uchar3_sat does in BGRA8_XYY_BGR8
+			for (int i = 0; i < w; ++i, dst += 3)
+			{
+				float v[3] = { oB[i] * 255.0f, oG[i] * 255.0f, oR[i] * 255.0f };
+
+				for (int c = 0; c < 3; ++c)
+					dst[c] = static_cast<unsigned char>(v[c] >= 255.0f ? 255.0f : (v[c] > 0.0f ? v[c] : 0.0f));
+			}
+		}
+	}, minRows);
+}
+
+void cpuSeparableConvolution(
+							 const int w,
+							 const int h,
+							 const float *input,
+							 float *output,
+							 const float *weights,
+							 const int radius,
+							 ThreadPool *pool
+							 )
+{
+	if (!pool) pool = &ThreadPool::shared();
+
+	int minRows = (w > 0) ? (minPixelsPerChunk + w - 1) / w : 1;
+
+	std::vector<float> rows(static_cast<size_t>(w) * h);
+
+	// horizontal pass, clamping at the left and right edges as CONVOLVE_ROWS does
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+		{
+			const float *src = input + static_cast<size_t>(y) * w;
+			float *dst = rows.data() + static_cast<size_t>(y) * w;
+
+			for (int x = 0; x < w; ++x)
+			{
+				float sum = 0.0f;
+
+				for (int k = 0; k <= 2 * radius; ++k)
+					sum += weights[k] * src[std::min(std::max(x + k - radius, 0), w - 1)];
+
+				dst[x] = sum;
+			}
+		}
+	}, minRows);
+
+	// vertical pass, clamping at the top and bottom edges
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+		{
+			float *dst = output + static_cast<size_t>(y) * w;
+
+			for (int x = 0; x < w; ++x)
+				dst[x] = 0.0f;
+
+			for (int k = 0; k <= 2 * radius; ++k)
+			{
+				const float *src = rows.data() + static_cast<size_t>(std::min(std::max(y + k - radius, 0), h - 1)) * w;
+
+				for (int x = 0; x < w; ++x)
+					dst[x] += weights[k] * src[x];
+			}
+		}
+	}, minRows);
+}
+
+void cpuUnsharpMask(
+					const int w,
+					const int h,
+					const float *original,
+					const float *blurred,
+					float *output,
+					const float amount,
+					ThreadPool *pool
+					)
+{
+	if (!pool) pool = &ThreadPool::shared();
+
+	int minRows = (w > 0) ? (minPixelsPerChunk + w - 1) / w : 1;
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		for (size_t i = static_cast<size_t>(y0) * w; i < static_cast<size_t>(y1) * w; ++i)
+			output[i] = original[i] + amount * (original[i] - blurred[i]);
+	}, minRows);
+}
+
+//
+// Private API implementation
+//
+static ScaleRowFunc getScaleRowFunc(CPUSimdLevel level)
+{
+	// never use more than the running CPU supports
+	if (level > cpuDetectSimdLevel())
+		level = cpuDetectSimdLevel();
+
+#ifdef CPU_PIPELINE_X86
+	if (level == CPU_SIMD_AVX2) return scaleRowAVX2;
+	if (level == CPU_SIMD_SSE) return scaleRowSSE;
+#endif
+#ifdef CPU_PIPELINE_NEON
+	if (level == CPU_SIMD_NEON) return scaleRowNEON;
+#endif
+	return scaleRowScalar;
+}
@@ -0,0 +1,80 @@
+//
+// Native CPU implementation of the RGB -> xyY -> scale luminance -> RGB pipeline.  Used when no 
+// OpenCL device is available and as the reference implementation the device kernels are 
+// validated against.  Rows are split across a ThreadPool and each row is processed with 
+// SSE, AVX2 or NEON when the CPU supports it, falling back to scalar code otherwise.  Also holds 
+// the reference separable convolution and unsharp mask for the convolution kernels.
+//
+#ifndef _CPU_PIPELINE_
+#define _CPU_PIPELINE_
+
+class ThreadPool;
+
+enum CPUSimdLevel
+{
+	CPU_SIMD_SCALAR = 0,
+	CPU_SIMD_SSE,
+	CPU_SIMD_AVX2,
+	CPU_SIMD_NEON			// AArch64 builds only
+};
+
+// return the widest instruction set supported by both the build and the running CPU.  Levels 
+// above it fall back to it, so requesting CPU_SIMD_NEON on x86 gets AVX2 or SSE
+CPUSimdLevel cpuDetectSimdLevel(void);
+
+const char* cpuSimdLevelName(CPUSimdLevel level);
+
+// Planar float version of the RGB_XYY_RGB kernel.  Input and output planes are w * h floats in 
+// [0, 1] and may alias.  pool == nullptr uses ThreadPool::shared()
+void cpuScaleLuminance(
+					   const int w,
+					   const int h,
+					   const float *R,
+					   const float *G,
+					   const float *B,
+					   float *outR,
+					   float *outG,
+					   float *outB,
+					   const float L,
+					   CPUSimdLevel level = cpuDetectSimdLevel(),
+					   ThreadPool *pool = nullptr
+					   );
+
+// Packed version of the BGRA8_XYY_BGR8 kernel.  bgra holds w * h 32bpp pixels and bgr receives 
+// w * h packed 24bpp pixels
+void cpuScaleLuminancePacked(
+							 const int w,
+							 const int h,
+							 const unsigned char *bgra,
+							 unsigned char *bgr,
+							 const float L,
+							 CPUSimdLevel level = cpuDetectSimdLevel(),
+							 ThreadPool *pool = nullptr
+							 );
+
+// Reference for the CONVOLVE_ROWS + CONVOLVE_COLUMNS passes - convolve the w x h plane with the 
+// 2 * radius + 1 weights horizontally then vertically, clamping at the edges.  input and 
+// output must not alias
+void cpuSeparableConvolution(
+							 const int w,
+							 const int h,
+							 const float *input,
+							 float *output,
+							 const float *weights,
+							 const int radius,
+							 ThreadPool *pool = nullptr
+							 );
+
+// Reference for UNSHARP - output = original + amount * (original - blurred).  output may alias 
+// either input
+void cpuUnsharpMask(
+					const int w,
+					const int h,
+					const float *original,
+					const float *blurred,
+					float *output,
+					const float amount,
+					ThreadPool *pool = nullptr
+					);
+
+#endif
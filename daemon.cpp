@@ -0,0 +1,610 @@
+//
+// Image processing daemon - see daemon.h
+//
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <atomic>
+#include <set>
+#include <cerrno>
+#include "daemon.h"
+
+#ifndef _WIN32
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//
+// Private API
+//
+struct DaemonRequest
+{
+	std::string		inputPath;
+	std::string		shmName;
+	std::string		outputPath;
+	int				w, h;
+	ImageParams		params;
+
+	DaemonRequest(void)
+		: w(0), h(0)
+	{
+	}
+};
+
+// A request accepted into the queue.  The connection thread owns it and waits on done
+struct DaemonJob
+{
+	DaemonRequest							request;
+	std::chrono::steady_clock::time_point	accepted;
+	std::promise<std::string>				done;
+};
+
+class ImageDaemon
+{
+public:
+
+	explicit ImageDaemon(const DaemonOptions& options);
+	~ImageDaemon(void);
+
+	int run(void);
+
+private:
+
+	void serveConnection(int fd);
+	std::string handleRequest(const std::string& line);
+	bool enqueue(DaemonJob* job, size_t* queued);
+	void workerLoop(void);
+	std::string processJob(DaemonJob* job, std::vector<bgr8>& output);
+	std::string statsReply(void);
+	void stop(void);
+
+	DaemonOptions				options;
+	ImagePipeline				pipeline;
+	int							listenFd;
+
+	std::deque<DaemonJob*>		jobs;
+	std::set<int>				connections;
+	bool						stopping;
+	std::mutex					lock;
+	std::condition_variable		jobReady;
+	std::condition_variable		connectionClosed;
+	std::vector<std::thread>	workers;
+
+	std::atomic<long>			jobsDone, jobsFailed, jobsRefused;
+};
+
+static bool claimSocketPath(const std::string& path, const sockaddr_un& address);
+static bool parseRequest(const std::string& line, DaemonRequest* request, std::string* error);
+static bool readLine(int fd, std::string& pending, std::string* line);
+static bool writeLine(int fd, const std::string& line);
+static double millisecondsSince(std::chrono::steady_clock::time_point start);
+
+static const size_t maxRequestLength = 4096;
+
+
+//
+// Public function implementation
+//
+int runDaemon(const DaemonOptions& options)
+{
+	ImageDaemon daemon(options);
+
+	return daemon.run();
+}
+
+
+//
+// Private function implementation
+//
+ImageDaemon::ImageDaemon(const DaemonOptions& options)
+	: options(options), pipeline(options.pipeline), listenFd(-1), stopping(false), jobsDone(0), jobsFailed(0), jobsRefused(0)
+{
+}
+
+ImageDaemon::~ImageDaemon(void)
+{
+	stop();
+
+	for (std::thread& worker : workers)
+		if (worker.joinable()) worker.join();
+
+	if (listenFd >= 0) close(listenFd);
+}
+
+int ImageDaemon::run(void)
+{
+	if (!pipeline.valid())
+	{
+		std::cout << "daemon pipeline not created\n";
+		return 1;
+	}
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+
+	if (options.socketPath.empty() || options.socketPath.size() >= sizeof(address.sun_path))
+	{
+		std::cout << "invalid daemon socket path " << options.socketPath << std::endl;
+		return 1;
+	}
+
+	options.socketPath.copy(address.sun_path, options.socketPath.size());
+
+	if (!claimSocketPath(options.socketPath, address))
+		return 1;
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	// the socket is created owner only - any local user who can connect can read and write 
+	// files as the daemon
+	mode_t previousMask = umask(0077);
+
+	bool listening = listenFd >= 0 && bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+
+	umask(previousMask);
+
+	if (!listening || listen(listenFd, 16) != 0)
+	{
+		std::cout << "cannot listen on " << options.socketPath << std::endl;
+		return 1;
+	}
+
+	for (int i = 0; i < std::max(options.workers, 1); ++i)
+		workers.emplace_back(&ImageDaemon::workerLoop, this);
+
+	size_t maxConnections = static_cast<size_t>(std::max(options.maxConnections, 1));
+
+	std::cout << "daemon listening on " << options.socketPath << " (" << workers.size() << " workers, queue " << options.queueCapacity 
+			  << ", " << maxConnections << " connections)\n";
+
+	for (;;)
+	{
+		int fd = accept(listenFd, nullptr, nullptr);
+
+		if (fd < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		size_t open = 0;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (stopping)
+			{
+				close(fd);
+				break;
+			}
+
+			open = connections.size();
+
+			// connection threads are detached so a long running daemon does not collect them -
+			// the set of open connections is what shutdown waits on
+			if (open < maxConnections)
+			{
+				connections.insert(fd);
+				std::thread(&ImageDaemon::serveConnection, this, fd).detach();
+				continue;
+			}
+		}
+
+		// each connection holds a thread, so past the cap a connection gets one busy reply
+		writeLine(fd, "busy connections=" + std::to_string(open) + " capacity=" + std::to_string(maxConnections));
+		close(fd);
+	}
+
+	stop();
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		connectionClosed.wait(guard, [this](void) { return connections.empty(); });
+	}
+
+	unlink(options.socketPath.c_str());
+
+	std::cout << "daemon stopped - " << jobsDone << " jobs done, " << jobsFailed << " failed, " << jobsRefused << " refused\n";
+	return 0;
+}
+
+void ImageDaemon::serveConnection(int fd)
+{
+	std::string pending, line;
+
+	while (readLine(fd, pending, &line))
+	{
+		if (!writeLine(fd, handleRequest(line))) break;
+	}
+
+	// closed under the lock so stop() never shuts down a reused descriptor, and the daemon is
+	// not touched after the notify
+	std::lock_guard<std::mutex> guard(lock);
+
+	close(fd);
+	connections.erase(fd);
+	connectionClosed.notify_all();
+}
+
+std::string ImageDaemon::handleRequest(const std::string& line)
+{
+	if (line == "stats") return statsReply();
+
+	if (line == "shutdown")
+	{
+		stop();
+		return "ok shutdown";
+	}
+
+	DaemonJob job;
+	std::string error;
+
+	if (!parseRequest(line, &job.request, &error))
+	{
+		++jobsFailed;
+		return "error " + error;
+	}
+
+	job.accepted = std::chrono::steady_clock::now();
+
+	std::future<std::string> reply = job.done.get_future();
+	size_t queued = 0;
+
+	if (!enqueue(&job, &queued))
+	{
+		++jobsRefused;
+		return "busy queued=" + std::to_string(queued) + " capacity=" + std::to_string(options.queueCapacity);
+	}
+
+	// the job lives on this thread's stack, so always wait for the worker to finish with it
+	return reply.get();
+}
+
+// Bounded queue - a full queue refuses the job instead of blocking so the client sees the
+// backpressure (a blocked connection thread would only move the queue into the socket)
+bool ImageDaemon::enqueue(DaemonJob* job, size_t* queued)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		*queued = jobs.size();
+
+		if (stopping || jobs.size() >= static_cast<size_t>(std::max(options.queueCapacity, 1)))
+			return false;
+
+		jobs.push_back(job);
+	}
+
+	jobReady.notify_one();
+	return true;
+}
+
+void ImageDaemon::workerLoop(void)
+{
+	// each worker reuses its output buffer, so a warm daemon only allocates for decoding
+	std::vector<bgr8> output;
+
+	// WIC decoding needs COM on every thread that uses it
+	initCOM();
+
+	for (;;)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		jobReady.wait(guard, [this](void) { return stopping || !jobs.empty(); });
+
+		// accepted jobs are still completed after a shutdown request
+		if (jobs.empty()) break;
+
+		DaemonJob *job = jobs.front();
+		jobs.pop_front();
+
+		guard.unlock();
+
+		job->done.set_value(processJob(job, output));
+	}
+
+	shutdownCOM();
+}
+
+std::string ImageDaemon::processJob(DaemonJob* job, std::vector<bgr8>& output)
+{
+	const DaemonRequest& request = job->request;
+
+	double queueMs = millisecondsSince(job->accepted);
+
+	std::chrono::steady_clock::time_point decodeStart = std::chrono::steady_clock::now();
+
+	CPBitmapImage image;
+	void *mapping = MAP_FAILED;
+	size_t mappingSize = 0;
+	std::string error;
+
+	if (!request.shmName.empty())
+	{
+		// shared memory input is mapped read only and uploaded in place
+		mappingSize = static_cast<size_t>(request.w) * request.h * sizeof(BGRA8);
+
+		int shmFd = shm_open(request.shmName.c_str(), O_RDONLY, 0);
+		struct stat info = {};
+
+		if (shmFd < 0)
+			error = "cannot open shared memory " + request.shmName;
+		else if (fstat(shmFd, &info) != 0 || static_cast<size_t>(info.st_size) < mappingSize)
+			error = "shared memory " + request.shmName + " smaller than width * height * 4";
+		else if ((mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, shmFd, 0)) == MAP_FAILED)
+			error = "cannot map shared memory " + request.shmName;
+
+		if (shmFd >= 0) close(shmFd);
+
+		image.w = request.w;
+		image.h = request.h;
+		image.buffer = (mapping != MAP_FAILED) ? static_cast<BGRA8*>(mapping) : nullptr;
+	}
+	else if (loadImage(std::filesystem::path(request.inputPath).wstring(), &image) != 0)
+	{
+		error = "cannot load " + request.inputPath;
+	}
+
+	double decodeMs = millisecondsSince(decodeStart);
+
+	ImageResult result = {};
+	double encodeMs = 0.0;
+
+	if (error.empty())
+	{
+		size_t pixels = static_cast<size_t>(image.w) * image.h;
+
+		if (output.size() < pixels) output.resize(pixels, bgr8(0));
+
+		result = pipeline.submit(image, output.data(), request.params).get();
+
+		// the device pool refuses a job it cannot fit under its cap within the acquire timeout
+		if (result.status == CL_MEM_OBJECT_ALLOCATION_FAILURE)
+			error = "rejected - no device buffer memory within the pool cap";
+		else if (result.status != CL_SUCCESS)
+			error = "pipeline failed with error " + std::to_string(result.status);
+	}
+
+	if (error.empty())
+	{
+		std::chrono::steady_clock::time_point encodeStart = std::chrono::steady_clock::now();
+
+		if (saveImage(image.w, image.h, output.data(), std::filesystem::path(request.outputPath).wstring()) != 0)
+			error = "cannot save " + request.outputPath;
+
+		encodeMs = millisecondsSince(encodeStart);
+	}
+
+	if (mapping != MAP_FAILED)
+		munmap(mapping, mappingSize);
+	else if (image.buffer)
+		free(image.buffer);
+
+	if (!error.empty())
+	{
+		++jobsFailed;
+		return "error " + error;
+	}
+
+	++jobsDone;
+
+	std::ostringstream reply;
+
+	reply << std::fixed << std::setprecision(3)
+		  << "ok queue_ms=" << queueMs
+		  << " decode_ms=" << decodeMs
+		  << " upload_ms=" << result.uploadSeconds * 1000.0
+		  << " kernel_ms=" << result.kernelSeconds * 1000.0
+		  << " download_ms=" << result.downloadSeconds * 1000.0
+		  << " encode_ms=" << encodeMs
+		  << " total_ms=" << millisecondsSince(job->accepted);
+
+	return reply.str();
+}
+
+std::string ImageDaemon::statsReply(void)
+{
+	size_t queued;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queued = jobs.size();
+	}
+
+	BufferPoolStats pool = pipeline.poolStats();
+
+	std::ostringstream reply;
+
+	reply << "ok queued=" << queued << " capacity=" << options.queueCapacity
+		  << " done=" << jobsDone << " failed=" << jobsFailed << " refused=" << jobsRefused
+		  << " pool_hits=" << pool.hits << " pool_misses=" << pool.misses << " pool_bytes=" << pool.bytesInUse + pool.bytesCached;
+
+	return reply.str();
+}
+
+// stop accepting connections and jobs - open connections are shut down so their threads see
+// end of file once their current request has been answered
+void ImageDaemon::stop(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (stopping) return;
+		stopping = true;
+
+		for (int fd : connections)
+			shutdown(fd, SHUT_RD);
+	}
+
+	jobReady.notify_all();
+
+	if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);
+}
+
+
+//
+// Private API implementation
+//
+// Make path free for bind.  A socket nobody answers on is left by a daemon that did not shut 
+// down cleanly and is removed; a live daemon or anything that is not a socket is left alone
+static bool claimSocketPath(const std::string& path, const sockaddr_un& address)
+{
+	struct stat info;
+
+	if (lstat(path.c_str(), &info) != 0)
+	{
+		if (errno == ENOENT) return true;
+
+		std::cout << "cannot check " << path << std::endl;
+		return false;
+	}
+
+	if (!S_ISSOCK(info.st_mode))
+	{
+		std::cout << path << " exists and is not a socket\n";
+		return false;
+	}
+
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (probe < 0)
+		return false;
+
+	bool answered = connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+	int  error    = errno;
+
+	close(probe);
+
+	if (answered)
+	{
+		std::cout << "a daemon is already listening on " << path << std::endl;
+		return false;
+	}
+
+	if (error != ECONNREFUSED || unlink(path.c_str()) != 0)
+	{
+		std::cout << "cannot reuse " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool parseRequest(const std::string& line, DaemonRequest* request, std::string* error)
+{
+	std::istringstream fields(line);
+	std::string field;
+
+	while (std::getline(fields, field, '\t'))
+	{
+		if (field.empty()) continue;
+
+		size_t split = field.find('=');
+
+		if (split == std::string::npos)
+		{
+			*error = "field without a value: " + field;
+			return false;
+		}
+
+		std::string key = field.substr(0, split), value = field.substr(split + 1);
+
+		if (key == "in")
+			request->inputPath = value;
+		else if (key == "shm")
+			request->shmName = value;
+		else if (key == "out")
+			request->outputPath = value;
+		else if (key == "width")
+			request->w = atoi(value.c_str());
+		else if (key == "height")
+			request->h = atoi(value.c_str());
+		else if (key == "L")
+			request->params.luminanceScale = static_cast<float>(atof(value.c_str()));
+		else
+		{
+			*error = "unknown field " + key;
+			return false;
+		}
+	}
+
+	if (request->inputPath.empty() == request->shmName.empty())
+		*error = "one of in= or shm= is required";
+	else if (!request->shmName.empty() && (request->w <= 0 || request->h <= 0))
+		*error = "shm= needs width= and height=";
+	else if (request->outputPath.empty())
+		*error = "out= is required";
+
+	return error->empty();
+}
+
+// read one '\n' terminated line (without the terminator or a trailing '\r').  Bytes after the
+// line are kept in pending for the next call
+static bool readLine(int fd, std::string& pending, std::string* line)
+{
+	for (;;)
+	{
+		size_t end = pending.find('\n');
+
+		if (end != std::string::npos)
+		{
+			*line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+
+			if (!line->empty() && line->back() == '\r') line->pop_back();
+			return true;
+		}
+
+		if (pending.size() > maxRequestLength) return false;
+
+		char buffer[1024];
+		ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+
+		pending.append(buffer, static_cast<size_t>(received));
+	}
+}
+
+static bool writeLine(int fd, const std::string& line)
+{
+	std::string text = line + "\n";
+	size_t sent = 0;
+
+	while (sent < text.size())
+	{
+		// MSG_NOSIGNAL - a client that hung up must not take the daemon down with SIGPIPE
+		ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+
+		sent += static_cast<size_t>(n);
+	}
+
+	return true;
+}
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#else
+
+//
+// Public function implementation
+//
+int runDaemon(const DaemonOptions& options)
+{
+	std::cout << "daemon mode needs Unix domain sockets and POSIX shared memory\n";
+	return 1;
+}
+
+#endif
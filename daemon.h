@@ -0,0 +1,56 @@
+//
+// Image processing daemon.  One process keeps an ImagePipeline (context, program, queues,
+// kernels and buffer pool) warm and serves jobs from local clients over a Unix domain socket,
+// so a job costs decode + transfer + kernel + encode instead of platform enumeration, program
+// build and buffer creation as well.
+//
+// Protocol - one request per line, fields separated by tabs (so paths may contain spaces):
+//
+//   in=<path> out=<path> [L=<scale>]
+//   shm=<name> width=<w> height=<h> out=<path> [L=<scale>]
+//   stats
+//   shutdown
+//
+// shm names a POSIX shared memory segment (shm_open) holding width * height 32bpp BGRA
+// pixels, which is mapped and uploaded without a decode or copy.  Every request gets one
+// reply line:
+//
+//   ok queue_ms=.. decode_ms=.. upload_ms=.. kernel_ms=.. download_ms=.. encode_ms=.. total_ms=..
+//   busy queued=<n> capacity=<n>
+//   error <message>
+//
+// The job queue is bounded - when it is full a request is refused with busy straight away
+// rather than queued, so clients see backpressure and can retry or slow down.  Requests on one
+// connection are handled in order; use several connections for concurrency.  Each connection
+// has a thread, so connections beyond maxConnections get "busy connections=<n> capacity=<n>"
+// and are closed.
+//
+// The socket is created owner only.  A stale socket file left by a daemon that did not shut
+// down is replaced, but the daemon refuses to start if another one answers on the path or the
+// path is not a socket.
+//
+#ifndef _DAEMON_
+#define _DAEMON_
+
+#include <string>
+#include "image_pipeline.h"
+
+struct DaemonOptions
+{
+	std::string				socketPath;
+	int						workers;		// threads decoding, submitting and encoding jobs
+	int						queueCapacity;	// jobs accepted but not yet started
+	int						maxConnections;	// open client connections
+	ImagePipelineConfig		pipeline;
+
+	DaemonOptions(void)
+		: socketPath(), workers(4), queueCapacity(16), maxConnections(64), pipeline()
+	{
+	}
+};
+
+// Serve requests on options.socketPath until a shutdown request.  Returns non-zero if the
+// pipeline or the socket cannot be set up (and always on platforms without Unix sockets)
+int runDaemon(const DaemonOptions& options);
+
+#endif
@@ -0,0 +1,573 @@
+//
+// Vectorised, row parallel host pixel conversions - see image_convert.h
+//
+#include <cstring>
+#include <cstdint>
+#include <cfloat>
+#include <cmath>
+#include <mutex>
+#include <algorithm>
+#include "image_convert.h"
+#include "thread_pool.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGE_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define IMAGE_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+// see cpu_pipeline.cpp
+#if defined(IMAGE_CONVERT_X86) && (defined(__GNUC__) || defined(__clang__))
+#define CONVERT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CONVERT_TARGET_AVX2
+#endif
+
+// rows are handed out in chunks of at least this many pixels so small images stay on one thread
+static const int minPixelsPerChunk = 64 * 1024;
+
+//
+// Private API
+//
+typedef void (*UnpackRowFunc)(int n, const unsigned char *bgra, float *R, float *G, float *B, float *A);
+typedef void (*PackRowFunc)(int n, const float *R, const float *G, const float *B, unsigned char *bgr);
+typedef void (*RangeRowFunc)(int n, const float *image, float *minValue, float *maxValue);
+typedef void (*GreyRowFunc)(int n, const float *image, float maxValue, float offset, float scale, unsigned char *bgr);
+
+struct ConvertRowFuncs
+{
+	UnpackRowFunc	unpack;
+	PackRowFunc		pack;
+	RangeRowFunc	range;
+	GreyRowFunc		grey;
+};
+
+static ConvertRowFuncs getConvertRowFuncs(CPUSimdLevel level);
+static int minRowsPerChunk(int w);
+
+
+// saturate then truncate, as the BYTE casts in imageio did for values in range
+static inline unsigned char saturateByte(float v)
+{
+	return static_cast<unsigned char>(v >= 255.0f ? 255.0f : (v > 0.0f ? v : 0.0f));
+}
+
+static void unpackRowScalar(int n, const unsigned char *bgra, float *R, float *G, float *B, float *A)
+{
+	for (int i = 0; i < n; ++i, bgra += 4)
+	{
+		B[i] = static_cast<float>(bgra[0]) / 255.0f;
+		G[i] = static_cast<float>(bgra[1]) / 255.0f;
+		R[i] = static_cast<float>(bgra[2]) / 255.0f;
+
+		if (A) A[i] = static_cast<float>(bgra[3]) / 255.0f;
+	}
+}
+
+static void packRowScalar(int n, const float *R, const float *G, const float *B, unsigned char *bgr)
+{
+	for (int i = 0; i < n; ++i, bgr += 3)
+	{
+		bgr[0] = saturateByte(B[i] * 255.0f);
+		bgr[1] = saturateByte(G[i] * 255.0f);
+		bgr[2] = saturateByte(R[i] * 255.0f);
+	}
+}
+
+static void rangeRowScalar(int n, const float *image, float *minValue, float *maxValue)
+{
+	float mn = *minValue, mx = *maxValue;
+
+	for (int i = 0; i < n; ++i)
+	{
+		if (image[i] < mn) mn = image[i];
+		if (image[i] > mx) mx = image[i];
+	}
+
+	*minValue = mn;
+	*maxValue = mx;
+}
+
+static void greyRowScalar(int n, const float *image, float maxValue, float offset, float scale, unsigned char *bgr)
+{
+	for (int i = 0; i < n; ++i, bgr += 3)
+		bgr[0] = bgr[1] = bgr[2] = saturateByte((image[i] / maxValue + offset) * scale);
+}
+
+#ifdef IMAGE_CONVERT_X86
+
+static inline __m128i saturateSSE(__m128 v)
+{
+	// max returns the second operand for NaN, so NaN saturates to 0 as in saturateByte
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f)));
+}
+
+// write 4 pixels given as 32-bit lanes - SSE2 has no byte shuffle, so the 3 byte stores are scalar
+static inline void storeBGRSSE(unsigned char *bgr, __m128i b, __m128i g, __m128i r)
+{
+	__m128i px = _mm_or_si128(b, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(r, 16)));
+
+	alignas(16) uint32_t packed[4];
+	_mm_store_si128(reinterpret_cast<__m128i*>(packed), px);
+
+	for (int j = 0; j < 4; ++j)
+		memcpy(bgr + 3 * j, &packed[j], 3);
+}
+
+static void unpackRowSSE(int n, const unsigned char *bgra, float *R, float *G, float *B, float *A)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128  k    = _mm_set1_ps(255.0f);
+
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgra + 4 * i));
+
+		_mm_storeu_ps(B + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(px, mask)), k));
+		_mm_storeu_ps(G + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask)), k));
+		_mm_storeu_ps(R + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask)), k));
+
+		if (A) _mm_storeu_ps(A + i, _mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(px, 24)), k));
+	}
+
+	unpackRowScalar(n - i, bgra + 4 * i, R + i, G + i, B + i, A ? A + i : nullptr);
+}
+
+static void packRowSSE(int n, const float *R, const float *G, const float *B, unsigned char *bgr)
+{
+	const __m128 k = _mm_set1_ps(255.0f);
+
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i b = saturateSSE(_mm_mul_ps(_mm_loadu_ps(B + i), k));
+		__m128i g = saturateSSE(_mm_mul_ps(_mm_loadu_ps(G + i), k));
+		__m128i r = saturateSSE(_mm_mul_ps(_mm_loadu_ps(R + i), k));
+
+		storeBGRSSE(bgr + 3 * i, b, g, r);
+	}
+
+	packRowScalar(n - i, R + i, G + i, B + i, bgr + 3 * i);
+}
+
+static void rangeRowSSE(int n, const float *image, float *minValue, float *maxValue)
+{
+	__m128 mn = _mm_set1_ps(*minValue);
+	__m128 mx = _mm_set1_ps(*maxValue);
+
+	int i = 0;
+
+	// the running value is the second operand so NaNs are skipped
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_loadu_ps(image + i);
+
+		mn = _mm_min_ps(v, mn);
+		mx = _mm_max_ps(v, mx);
+	}
+
+	alignas(16) float lanes[8];
+	_mm_store_ps(lanes, mn);
+	_mm_store_ps(lanes + 4, mx);
+
+	rangeRowScalar(4, lanes, minValue, maxValue);
+	rangeRowScalar(4, lanes + 4, minValue, maxValue);
+	rangeRowScalar(n - i, image + i, minValue, maxValue);
+}
+
+static void greyRowSSE(int n, const float *image, float maxValue, float offset, float scale, unsigned char *bgr)
+{
+	const __m128 vMax    = _mm_set1_ps(maxValue);
+	const __m128 vOffset = _mm_set1_ps(offset);
+	const __m128 vScale  = _mm_set1_ps(scale);
+
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_div_ps(_mm_loadu_ps(image + i), vMax), vOffset), vScale);
+		__m128i grey = saturateSSE(v);
+
+		storeBGRSSE(bgr + 3 * i, grey, grey, grey);
+	}
+
+	greyRowScalar(n - i, image + i, maxValue, offset, scale, bgr + 3 * i);
+}
+
+CONVERT_TARGET_AVX2
+static inline __m256i saturateAVX2(__m256 v)
+{
+	return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f)));
+}
+
+// write 8 pixels given as 32-bit lanes - the low 3 bytes of each lane are gathered to the
+// bottom of each 128-bit half, then the halves are joined into 24 contiguous bytes
+CONVERT_TARGET_AVX2
+static inline void storeBGRAVX2(unsigned char *bgr, __m256i b, __m256i g, __m256i r)
+{
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+											 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	__m256i px = _mm256_or_si256(b, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(r, 16)));
+
+	px = _mm256_shuffle_epi8(px, shuffle);
+	px = _mm256_permutevar8x32_epi32(px, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(bgr), _mm256_castsi256_si128(px));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(bgr + 16), _mm256_extracti128_si256(px, 1));
+}
+
+CONVERT_TARGET_AVX2
+static void unpackRowAVX2(int n, const unsigned char *bgra, float *R, float *G, float *B, float *A)
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256  k    = _mm256_set1_ps(255.0f);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bgra + 4 * i));
+
+		_mm256_storeu_ps(B + i, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(px, mask)), k));
+		_mm256_storeu_ps(G + i, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), mask)), k));
+		_mm256_storeu_ps(R + i, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 16), mask)), k));
+
+		if (A) _mm256_storeu_ps(A + i, _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(px, 24)), k));
+	}
+
+	unpackRowSSE(n - i, bgra + 4 * i, R + i, G + i, B + i, A ? A + i : nullptr);
+}
+
+CONVERT_TARGET_AVX2
+static void packRowAVX2(int n, const float *R, const float *G, const float *B, unsigned char *bgr)
+{
+	const __m256 k = _mm256_set1_ps(255.0f);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i b = saturateAVX2(_mm256_mul_ps(_mm256_loadu_ps(B + i), k));
+		__m256i g = saturateAVX2(_mm256_mul_ps(_mm256_loadu_ps(G + i), k));
+		__m256i r = saturateAVX2(_mm256_mul_ps(_mm256_loadu_ps(R + i), k));
+
+		storeBGRAVX2(bgr + 3 * i, b, g, r);
+	}
+
+	packRowSSE(n - i, R + i, G + i, B + i, bgr + 3 * i);
+}
+
+CONVERT_TARGET_AVX2
+static void rangeRowAVX2(int n, const float *image, float *minValue, float *maxValue)
+{
+	__m256 mn = _mm256_set1_ps(*minValue);
+	__m256 mx = _mm256_set1_ps(*maxValue);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v = _mm256_loadu_ps(image + i);
+
+		mn = _mm256_min_ps(v, mn);
+		mx = _mm256_max_ps(v, mx);
+	}
+
+	alignas(32) float lanes[16];
+	_mm256_store_ps(lanes, mn);
+	_mm256_store_ps(lanes + 8, mx);
+
+	rangeRowScalar(8, lanes, minValue, maxValue);
+	rangeRowScalar(8, lanes + 8, minValue, maxValue);
+	rangeRowSSE(n - i, image + i, minValue, maxValue);
+}
+
+CONVERT_TARGET_AVX2
+static void greyRowAVX2(int n, const float *image, float maxValue, float offset, float scale, unsigned char *bgr)
+{
+	const __m256 vMax    = _mm256_set1_ps(maxValue);
+	const __m256 vOffset = _mm256_set1_ps(offset);
+	const __m256 vScale  = _mm256_set1_ps(scale);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(_mm256_loadu_ps(image + i), vMax), vOffset), vScale);
+		__m256i grey = saturateAVX2(v);
+
+		storeBGRAVX2(bgr + 3 * i, grey, grey, grey);
+	}
+
+	greyRowSSE(n - i, image + i, maxValue, offset, scale, bgr + 3 * i);
+}
+
+#endif
+
+#ifdef IMAGE_CONVERT_NEON
+
+// 8 floats to saturated bytes.  maxnm returns the number for NaN, so NaN saturates to 0
+static inline uint8x8_t saturateNEON(float32x4_t lo, float32x4_t hi)
+{
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+	const float32x4_t k    = vdupq_n_f32(255.0f);
+
+	uint16x4_t a = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxnmq_f32(lo, zero), k)));
+	uint16x4_t b = vmovn_u32(vcvtq_u32_f32(vminq_f32(vmaxnmq_f32(hi, zero), k)));
+
+	return vmovn_u16(vcombine_u16(a, b));
+}
+
+// 16 bytes to 16 floats in [0, 1]
+static inline void unpackBytesNEON(uint8x16_t v, float *out)
+{
+	const float32x4_t k = vdupq_n_f32(255.0f);
+
+	uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+	uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+
+	vst1q_f32(out,      vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), k));
+	vst1q_f32(out + 4,  vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), k));
+	vst1q_f32(out + 8,  vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), k));
+	vst1q_f32(out + 12, vdivq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), k));
+}
+
+static void unpackRowNEON(int n, const unsigned char *bgra, float *R, float *G, float *B, float *A)
+{
+	int i = 0;
+
+	// vld4 deinterleaves 16 pixels into one register per channel
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16x4_t px = vld4q_u8(bgra + 4 * i);
+
+		unpackBytesNEON(px.val[0], B + i);
+		unpackBytesNEON(px.val[1], G + i);
+		unpackBytesNEON(px.val[2], R + i);
+
+		if (A) unpackBytesNEON(px.val[3], A + i);
+	}
+
+	unpackRowScalar(n - i, bgra + 4 * i, R + i, G + i, B + i, A ? A + i : nullptr);
+}
+
+static void packRowNEON(int n, const float *R, const float *G, const float *B, unsigned char *bgr)
+{
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		uint8x8x3_t px;
+
+		px.val[0] = saturateNEON(vmulq_n_f32(vld1q_f32(B + i), 255.0f), vmulq_n_f32(vld1q_f32(B + i + 4), 255.0f));
+		px.val[1] = saturateNEON(vmulq_n_f32(vld1q_f32(G + i), 255.0f), vmulq_n_f32(vld1q_f32(G + i + 4), 255.0f));
+		px.val[2] = saturateNEON(vmulq_n_f32(vld1q_f32(R + i), 255.0f), vmulq_n_f32(vld1q_f32(R + i + 4), 255.0f));
+
+		// vst3 interleaves the channels back into 24bpp pixels
+		vst3_u8(bgr + 3 * i, px);
+	}
+
+	packRowScalar(n - i, R + i, G + i, B + i, bgr + 3 * i);
+}
+
+static void rangeRowNEON(int n, const float *image, float *minValue, float *maxValue)
+{
+	float32x4_t mn = vdupq_n_f32(*minValue);
+	float32x4_t mx = vdupq_n_f32(*maxValue);
+
+	int i = 0;
+
+	// minnm / maxnm return the number when one operand is NaN
+	for (; i + 4 <= n; i += 4)
+	{
+		float32x4_t v = vld1q_f32(image + i);
+
+		mn = vminnmq_f32(v, mn);
+		mx = vmaxnmq_f32(v, mx);
+	}
+
+	*minValue = vminnmvq_f32(mn);
+	*maxValue = vmaxnmvq_f32(mx);
+
+	rangeRowScalar(n - i, image + i, minValue, maxValue);
+}
+
+static void greyRowNEON(int n, const float *image, float maxValue, float offset, float scale, unsigned char *bgr)
+{
+	const float32x4_t vMax    = vdupq_n_f32(maxValue);
+	const float32x4_t vOffset = vdupq_n_f32(offset);
+
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		float32x4_t lo = vmulq_n_f32(vaddq_f32(vdivq_f32(vld1q_f32(image + i), vMax), vOffset), scale);
+		float32x4_t hi = vmulq_n_f32(vaddq_f32(vdivq_f32(vld1q_f32(image + i + 4), vMax), vOffset), scale);
+
+		uint8x8_t grey = saturateNEON(lo, hi);
+		uint8x8x3_t px = { { grey, grey, grey } };
+
+		vst3_u8(bgr + 3 * i, px);
+	}
+
+	greyRowScalar(n - i, image + i, maxValue, offset, scale, bgr + 3 * i);
+}
+
+#endif
+
+//
+// Public function implementation
+//
+void convertBGRA8ToFloat(
+						 const int w,
+						 const int h,
+						 const unsigned char *bgra,
+						 float *R,
+						 float *G,
+						 float *B,
+						 float *A,
+						 CPUSimdLevel level,
+						 ThreadPool *pool
+						 )
+{
+	UnpackRowFunc unpackRow = getConvertRowFuncs(level).unpack;
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		size_t offset = static_cast<size_t>(y0) * w;
+
+		unpackRow((y1 - y0) * w, bgra + 4 * offset, R + offset, G + offset, B + offset, A ? A + offset : nullptr);
+	}, minRowsPerChunk(w));
+}
+
+void convertFloatToBGR8(
+						const int w,
+						const int h,
+						const float *R,
+						const float *G,
+						const float *B,
+						unsigned char *bgr,
+						CPUSimdLevel level,
+						ThreadPool *pool
+						)
+{
+	PackRowFunc packRow = getConvertRowFuncs(level).pack;
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		size_t offset = static_cast<size_t>(y0) * w;
+
+		packRow((y1 - y0) * w, R + offset, G + offset, B + offset, bgr + 3 * offset);
+	}, minRowsPerChunk(w));
+}
+
+void floatImageRange(
+					 const int w,
+					 const int h,
+					 const float *image,
+					 float *minValue,
+					 float *maxValue,
+					 CPUSimdLevel level,
+					 ThreadPool *pool
+					 )
+{
+	RangeRowFunc rangeRow = getConvertRowFuncs(level).range;
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	float mn = FLT_MAX, mx = -FLT_MAX;
+	std::mutex rangeMutex;
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		float chunkMin = FLT_MAX, chunkMax = -FLT_MAX;
+
+		rangeRow((y1 - y0) * w, image + static_cast<size_t>(y0) * w, &chunkMin, &chunkMax);
+
+		std::lock_guard<std::mutex> lock(rangeMutex);
+
+		mn = std::min(mn, chunkMin);
+		mx = std::max(mx, chunkMax);
+	}, minRowsPerChunk(w));
+
+	// an empty image (or one that is all NaN) has no range
+	if (mn > mx)
+		mn = mx = 0.0f;
+
+	if (minValue) *minValue = mn;
+	if (maxValue) *maxValue = mx;
+}
+
+void convertFloatToGreyBGR8(
+							const int w,
+							const int h,
+							const float *image,
+							unsigned char *bgr,
+							CPUSimdLevel level,
+							ThreadPool *pool
+							)
+{
+	float mn, mx;
+
+	floatImageRange(w, h, image, &mn, &mx, level, pool);
+
+	// the range gives both the largest absolute value and the sign in one pass
+	float maxValue = std::max(std::fabs(mn), std::fabs(mx));
+	bool semiPositive = (mn >= 0.0f);
+
+	// an all zero image stays black
+	if (maxValue == 0.0f)
+		maxValue = 1.0f;
+
+	// (v / max) * 255 for semi-positive images, (v / max + 1) / 2 * 255 otherwise
+	float offset = semiPositive ? 0.0f : 1.0f;
+	float scale  = semiPositive ? 255.0f : 127.5f;
+
+	GreyRowFunc greyRow = getConvertRowFuncs(level).grey;
+
+	if (!pool) pool = &ThreadPool::shared();
+
+	pool->parallelFor(0, h, [&](int y0, int y1)
+	{
+		size_t offset0 = static_cast<size_t>(y0) * w;
+
+		greyRow((y1 - y0) * w, image + offset0, maxValue, offset, scale, bgr + 3 * offset0);
+	}, minRowsPerChunk(w));
+}
+
+
+//
+// Private API implementation
+//
+static ConvertRowFuncs getConvertRowFuncs(CPUSimdLevel level)
+{
+	// never use more than the running CPU supports
+	if (level > cpuDetectSimdLevel())
+		level = cpuDetectSimdLevel();
+
+#ifdef IMAGE_CONVERT_X86
+	if (level == CPU_SIMD_AVX2) return { unpackRowAVX2, packRowAVX2, rangeRowAVX2, greyRowAVX2 };
+	if (level == CPU_SIMD_SSE) return { unpackRowSSE, packRowSSE, rangeRowSSE, greyRowSSE };
+#endif
+#ifdef IMAGE_CONVERT_NEON
+	if (level == CPU_SIMD_NEON) return { unpackRowNEON, packRowNEON, rangeRowNEON, greyRowNEON };
+#endif
+	return { unpackRowScalar, packRowScalar, rangeRowScalar, greyRowScalar };
+}
+
+static int minRowsPerChunk(int w)
+{
+	return (w > 0) ? (minPixelsPerChunk + w - 1) / w : 1;
+}
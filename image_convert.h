@@ -0,0 +1,62 @@
+//
+// Host pixel format conversions used by imageio - BGRA8 to float planes on load, float planes
+// to bgr8 on save and the normalised single channel float to grey bgr8 conversion.  Like the
+// CPU backend, rows are split across a ThreadPool and processed with SSE, AVX2 or NEON as
+// picked by cpuDetectSimdLevel, with scalar versions for the remainder of each row and for
+// other CPUs.  Every level gives the same bytes.
+//
+#ifndef _IMAGE_CONVERT_
+#define _IMAGE_CONVERT_
+
+#include "cpu_pipeline.h"
+
+// deinterleave w * h 32bpp BGRA pixels into float planes in [0, 1].  A may be nullptr
+void convertBGRA8ToFloat(
+						 const int w,
+						 const int h,
+						 const unsigned char *bgra,
+						 float *R,
+						 float *G,
+						 float *B,
+						 float *A,
+						 CPUSimdLevel level = cpuDetectSimdLevel(),
+						 ThreadPool *pool = nullptr
+						 );
+
+// pack UNORM float planes into w * h 24bpp bgr pixels - each value is scaled by 255,
+// saturated and truncated
+void convertFloatToBGR8(
+						const int w,
+						const int h,
+						const float *R,
+						const float *G,
+						const float *B,
+						unsigned char *bgr,
+						CPUSimdLevel level = cpuDetectSimdLevel(),
+						ThreadPool *pool = nullptr
+						);
+
+// smallest and largest value of a w x h float image in a single pass (NaNs are ignored)
+void floatImageRange(
+					 const int w,
+					 const int h,
+					 const float *image,
+					 float *minValue,
+					 float *maxValue,
+					 CPUSimdLevel level = cpuDetectSimdLevel(),
+					 ThreadPool *pool = nullptr
+					 );
+
+// Write a single channel float image as grey bgr8, normalised by its largest absolute value -
+// [0, max] maps to [0, 255] for semi-positive images and [-max, max] otherwise.  One range
+// pass and one conversion pass
+void convertFloatToGreyBGR8(
+							const int w,
+							const int h,
+							const float *image,
+							unsigned char *bgr,
+							CPUSimdLevel level = cpuDetectSimdLevel(),
+							ThreadPool *pool = nullptr
+							);
+
+#endif
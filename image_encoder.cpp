@@ -0,0 +1,548 @@
+//
+// Parallel strip TIFF / PNG encoding - see image_encoder.h
+//
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <zlib.h>
+#include "image_encoder.h"
+#include "thread_pool.h"
+
+// read by every encoder - the batch, pipeline and daemon threads save while main may set it
+static std::atomic<ImageCompression>	currentCompression(IMAGE_COMPRESSION_DEFAULT);
+
+// strips in flight per batch for each pool thread - bounds the compressed data held at once
+static const int			stripsPerThread = 4;
+
+static const unsigned char	pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+//
+// Private API
+//
+static std::FILE*	openBinaryFile(const std::wstring& imagePath);
+static int			deflateLevel(ImageCompression compression);
+static int			stripBatchSize(void);
+static bool			encodeTiffStrip(const unsigned char* bgr, int w, int rows, ImageCompression compression, std::vector<unsigned char>& out);
+static bool			encodePNGPiece(const unsigned char* bgr, int w, int rows, ImageCompression compression, bool first, bool last,
+								   std::vector<unsigned char>& out, uLong* adler);
+static bool			writePNGChunk(std::FILE* file, const char* type, const unsigned char* data, size_t size);
+static void			put16LE(std::vector<unsigned char>& out, uint32_t value);
+static void			put32LE(std::vector<unsigned char>& out, uint32_t value);
+static void			put32BE(unsigned char* out, uint32_t value);
+
+
+//
+// Public function implementation
+//
+bool parseImageCompression(const char* name, ImageCompression* result)
+{
+	if (!name || !result) return false;
+
+	if (strcmp(name, "none") == 0)
+		*result = IMAGE_COMPRESSION_NONE;
+	else if (strcmp(name, "fast") == 0)
+		*result = IMAGE_COMPRESSION_FAST;
+	else if (strcmp(name, "default") == 0)
+		*result = IMAGE_COMPRESSION_DEFAULT;
+	else
+		return false;
+
+	return true;
+}
+
+const char* imageCompressionName(ImageCompression compression)
+{
+	switch (compression)
+	{
+	case IMAGE_COMPRESSION_NONE:	return "none";
+	case IMAGE_COMPRESSION_FAST:	return "fast";
+	default:						return "default";
+	}
+}
+
+void setImageCompression(ImageCompression compression)
+{
+	currentCompression = compression;
+}
+
+ImageCompression imageCompression(void)
+{
+	return currentCompression;
+}
+
+TiffStripEncoder::TiffStripEncoder(void)
+	: file(nullptr), width(0), height(0), rowsDone(0), compression(IMAGE_COMPRESSION_DEFAULT), fileOffset(0), pendingRows(0)
+{
+}
+
+TiffStripEncoder::~TiffStripEncoder(void)
+{
+	if (file) std::fclose(file);
+}
+
+int TiffStripEncoder::open(const std::wstring& imagePath, int w, int h, ImageCompression mode)
+{
+	if (file || w <= 0 || h <= 0) return 1;
+
+	file = openBinaryFile(imagePath);
+
+	if (!file) return 1;
+
+	width = w;
+	height = h;
+	rowsDone = 0;
+	compression = mode;
+	pendingRows = 0;
+	pending.clear();
+	stripOffsets.clear();
+	stripBytes.clear();
+
+	// little endian header - the IFD offset is patched in by close
+	std::vector<unsigned char> header = { 'I', 'I' };
+
+	put16LE(header, 42);
+	put32LE(header, 0);
+
+	fileOffset = header.size();
+
+	return (std::fwrite(header.data(), 1, header.size(), file) == header.size()) ? 0 : 1;
+}
+
+int TiffStripEncoder::writeRows(int rows, const unsigned char* bgr)
+{
+	if (!file || !bgr || rows <= 0 || rowsDone + rows > height) return 1;
+
+	size_t rowBytes = static_cast<size_t>(width) * 3;
+	int result = 0;
+
+	rowsDone += rows;
+
+	// top up a strip left incomplete by the previous call first
+	if (pendingRows > 0)
+	{
+		int take = std::min(rows, encoderStripRows - pendingRows);
+
+		pending.insert(pending.end(), bgr, bgr + take * rowBytes);
+		pendingRows += take;
+		bgr += take * rowBytes;
+		rows -= take;
+
+		if (pendingRows == encoderStripRows || (rows == 0 && rowsDone == height))
+		{
+			result = writeStrips(pending.data(), pendingRows);
+			pending.clear();
+			pendingRows = 0;
+		}
+	}
+
+	// whole strips go straight from the caller's buffer - at the end of the image so does the
+	// short last strip
+	int direct = (rowsDone == height) ? rows : (rows / encoderStripRows) * encoderStripRows;
+
+	if (result == 0 && direct > 0)
+		result = writeStrips(bgr, direct);
+
+	if (result == 0 && rows > direct)
+	{
+		pending.assign(bgr + direct * rowBytes, bgr + rows * rowBytes);
+		pendingRows = rows - direct;
+	}
+
+	return result;
+}
+
+int TiffStripEncoder::close(void)
+{
+	if (!file) return 1;
+
+	int result = (rowsDone == height && pendingRows == 0) ? writeDirectory() : 1;
+
+	if (std::fclose(file) != 0)
+		result = 1;
+
+	file = nullptr;
+	return result;
+}
+
+int encodePNG(const std::wstring& imagePath, int w, int h, const unsigned char* bgr, ImageCompression compression)
+{
+	if (!bgr || w <= 0 || h <= 0) return 1;
+
+	std::FILE *file = openBinaryFile(imagePath);
+
+	if (!file) return 1;
+
+	// IHDR - 8 bit RGB, deflate, adaptive filtering, no interlace
+	unsigned char header[13] = { 0 };
+
+	put32BE(header, static_cast<uint32_t>(w));
+	put32BE(header + 4, static_cast<uint32_t>(h));
+	header[8] = 8;
+	header[9] = 2;
+
+	bool ok = std::fwrite(pngSignature, 1, sizeof(pngSignature), file) == sizeof(pngSignature) &&
+			  writePNGChunk(file, "IHDR", header, sizeof(header));
+
+	size_t rowBytes = static_cast<size_t>(w) * 3;
+
+	int numPieces = (h + encoderStripRows - 1) / encoderStripRows;
+	int batchSize = stripBatchSize();
+
+	std::vector<std::vector<unsigned char>> pieces(std::min(numPieces, batchSize));
+	std::vector<uLong> adlers(pieces.size());
+	std::vector<char> encoded(pieces.size());
+
+	uLong adler = adler32(0L, Z_NULL, 0);
+
+	for (int batch = 0; ok && batch < numPieces; batch += batchSize)
+	{
+		int batchPieces = std::min(batchSize, numPieces - batch);
+
+		ThreadPool::shared().parallelFor(0, batchPieces, [&](int p0, int p1)
+		{
+			for (int p = p0; p < p1; ++p)
+			{
+				int piece = batch + p;
+				int y = piece * encoderStripRows;
+				int rows = std::min(encoderStripRows, h - y);
+
+				encoded[p] = encodePNGPiece(bgr + y * rowBytes, w, rows, compression, piece == 0, piece == numPieces - 1,
+											pieces[p], &adlers[p]);
+			}
+		});
+
+		// one IDAT per piece, in order.  The stream trailer follows the last piece
+		for (int p = 0; ok && p < batchPieces; ++p)
+		{
+			int piece = batch + p;
+			int rows = std::min(encoderStripRows, h - piece * encoderStripRows);
+
+			ok = encoded[p] != 0;
+
+			adler = adler32_combine(adler, adlers[p], static_cast<z_off_t>(rows * (rowBytes + 1)));
+
+			if (ok && piece == numPieces - 1)
+			{
+				size_t size = pieces[p].size();
+
+				pieces[p].resize(size + 4);
+				put32BE(pieces[p].data() + size, static_cast<uint32_t>(adler));
+			}
+
+			ok = ok && writePNGChunk(file, "IDAT", pieces[p].data(), pieces[p].size());
+		}
+	}
+
+	ok = ok && writePNGChunk(file, "IEND", nullptr, 0);
+
+	if (std::fclose(file) != 0)
+		ok = false;
+
+	return ok ? 0 : 1;
+}
+
+
+//
+// Private function implementation
+//
+int TiffStripEncoder::writeStrips(const unsigned char* bgr, int rows)
+{
+	size_t rowBytes = static_cast<size_t>(width) * 3;
+
+	int numStrips = (rows + encoderStripRows - 1) / encoderStripRows;
+	int batchSize = stripBatchSize();
+
+	std::vector<std::vector<unsigned char>> strips(std::min(numStrips, batchSize));
+	std::vector<char> encoded(strips.size());
+
+	for (int batch = 0; batch < numStrips; batch += batchSize)
+	{
+		int batchStrips = std::min(batchSize, numStrips - batch);
+
+		ThreadPool::shared().parallelFor(0, batchStrips, [&](int s0, int s1)
+		{
+			for (int s = s0; s < s1; ++s)
+			{
+				int y = (batch + s) * encoderStripRows;
+				int stripRows = std::min(encoderStripRows, rows - y);
+
+				encoded[s] = encodeTiffStrip(bgr + y * rowBytes, width, stripRows, compression, strips[s]);
+			}
+		});
+
+		// strips go out in order so the file is written sequentially
+		for (int s = 0; s < batchStrips; ++s)
+		{
+			if (!encoded[s] || fileOffset + strips[s].size() > UINT32_MAX ||
+				std::fwrite(strips[s].data(), 1, strips[s].size(), file) != strips[s].size())
+				return 1;
+
+			stripOffsets.push_back(static_cast<uint32_t>(fileOffset));
+			stripBytes.push_back(static_cast<uint32_t>(strips[s].size()));
+
+			fileOffset += strips[s].size();
+		}
+	}
+	return 0;
+}
+
+int TiffStripEncoder::writeDirectory(void)
+{
+	uint32_t numStrips = static_cast<uint32_t>(stripOffsets.size());
+
+	std::vector<unsigned char> block;
+
+	// the IFD and the values it points to must start on a word boundary
+	if (fileOffset & 1)
+		block.push_back(0);
+
+	uint64_t bitsOffset    = fileOffset + block.size();
+	uint64_t offsetsOffset = bitsOffset + 8;
+	uint64_t countsOffset  = offsetsOffset + 4 * numStrips;
+	uint64_t ifdOffset     = countsOffset + 4 * numStrips;
+
+	if (ifdOffset + 256 > UINT32_MAX) return 1;
+
+	// BitsPerSample (8, 8, 8) padded to 8 bytes, then the strip tables
+	for (int i = 0; i < 3; ++i)
+		put16LE(block, 8);
+
+	put16LE(block, 0);
+
+	for (uint32_t offset : stripOffsets)
+		put32LE(block, offset);
+
+	for (uint32_t bytes : stripBytes)
+		put32LE(block, bytes);
+
+	// a single strip's offset and size fit in the entries themselves
+	uint32_t offsetsValue = (numStrips == 1) ? stripOffsets[0] : static_cast<uint32_t>(offsetsOffset);
+	uint32_t countsValue  = (numStrips == 1) ? stripBytes[0] : static_cast<uint32_t>(countsOffset);
+
+	const uint16_t SHORT = 3, LONG = 4;
+
+	struct { uint16_t tag, type; uint32_t count, value; } entries[] =
+	{
+		{ 256, LONG,  1, static_cast<uint32_t>(width) },				// ImageWidth
+		{ 257, LONG,  1, static_cast<uint32_t>(height) },				// ImageLength
+		{ 258, SHORT, 3, static_cast<uint32_t>(bitsOffset) },			// BitsPerSample
+		{ 259, SHORT, 1, compression == IMAGE_COMPRESSION_NONE ? 1u : 8u },	// Compression - none or Deflate
+		{ 262, SHORT, 1, 2 },											// PhotometricInterpretation - RGB
+		{ 273, LONG,  numStrips, offsetsValue },						// StripOffsets
+		{ 277, SHORT, 1, 3 },											// SamplesPerPixel
+		{ 278, LONG,  1, static_cast<uint32_t>(encoderStripRows) },		// RowsPerStrip
+		{ 279, LONG,  numStrips, countsValue },							// StripByteCounts
+		{ 284, SHORT, 1, 1 },											// PlanarConfiguration - chunky
+		{ 317, SHORT, 1, compression == IMAGE_COMPRESSION_NONE ? 1u : 2u }	// Predictor - horizontal differencing when deflated
+	};
+
+	put16LE(block, sizeof(entries) / sizeof(entries[0]));
+
+	for (const auto& entry : entries)
+	{
+		put16LE(block, entry.tag);
+		put16LE(block, entry.type);
+		put32LE(block, entry.count);
+		put32LE(block, entry.value);
+	}
+
+	// no further IFDs
+	put32LE(block, 0);
+
+	if (std::fwrite(block.data(), 1, block.size(), file) != block.size()) return 1;
+
+	// point the header at the IFD
+	std::vector<unsigned char> offset;
+	put32LE(offset, static_cast<uint32_t>(ifdOffset));
+
+	return (std::fseek(file, 4, SEEK_SET) == 0 && std::fwrite(offset.data(), 1, 4, file) == 4) ? 0 : 1;
+}
+
+//
+// Private API implementation
+//
+static std::FILE* openBinaryFile(const std::wstring& imagePath)
+{
+#ifdef _WIN32
+	return _wfopen(imagePath.c_str(), L"wb");
+#else
+	return std::fopen(std::filesystem::path(imagePath).string().c_str(), "wb");
+#endif
+}
+
+static int deflateLevel(ImageCompression compression)
+{
+	switch (compression)
+	{
+	case IMAGE_COMPRESSION_NONE:	return 0;
+	case IMAGE_COMPRESSION_FAST:	return 1;
+	default:						return 6;
+	}
+}
+
+static int stripBatchSize(void)
+{
+	// the calling thread works on the batch too
+	return (ThreadPool::shared().size() + 1) * stripsPerThread;
+}
+
+// swap bgr to rgb and, unless compression is IMAGE_COMPRESSION_NONE, difference and deflate
+// (as a zlib stream, which is what TIFF Deflate expects)
+static bool encodeTiffStrip(const unsigned char* bgr, int w, int rows, ImageCompression compression, std::vector<unsigned char>& out)
+{
+	size_t pixels = static_cast<size_t>(w) * rows;
+	size_t bytes = pixels * 3;
+
+	std::vector<unsigned char> rgb(bytes);
+
+	for (size_t i = 0; i < bytes; i += 3)
+	{
+		rgb[i]     = bgr[i + 2];
+		rgb[i + 1] = bgr[i + 1];
+		rgb[i + 2] = bgr[i];
+	}
+
+	if (compression == IMAGE_COMPRESSION_NONE)
+	{
+		out.swap(rgb);
+		return true;
+	}
+
+	// horizontal differencing (Predictor 2), right to left so each byte still sees its
+	// original left neighbour
+	size_t rowBytes = static_cast<size_t>(w) * 3;
+
+	for (int y = 0; y < rows; ++y)
+	{
+		unsigned char *row = &rgb[y * rowBytes];
+
+		for (size_t i = rowBytes - 1; i >= 3; --i)
+			row[i] = static_cast<unsigned char>(row[i] - row[i - 3]);
+	}
+
+	uLongf size = compressBound(static_cast<uLong>(bytes));
+	out.resize(size);
+
+	if (compress2(out.data(), &size, rgb.data(), static_cast<uLong>(bytes), deflateLevel(compression)) != Z_OK)
+		return false;
+
+	out.resize(size);
+	return true;
+}
+
+// Filter rows rows into PNG scanlines and deflate them as raw deflate data.  The first piece
+// gets the zlib header in front, the last ends the deflate stream; the others end on a sync
+// flush so the next piece can follow on a byte boundary.  *adler is the Adler-32 of the
+// filtered bytes, for combining into the stream checksum
+static bool encodePNGPiece(const unsigned char* bgr, int w, int rows, ImageCompression compression, bool first, bool last,
+						   std::vector<unsigned char>& out, uLong* adler)
+{
+	size_t rowBytes = static_cast<size_t>(w) * 3;
+	size_t lineBytes = rowBytes + 1;
+
+	std::vector<unsigned char> lines(lineBytes * rows);
+
+	// Sub filtering (difference from the pixel to the left) helps deflate on photographic
+	// images.  Stored output is left unfiltered
+	bool sub = (compression != IMAGE_COMPRESSION_NONE);
+
+	for (int y = 0; y < rows; ++y)
+	{
+		const unsigned char *src = bgr + y * rowBytes;
+		unsigned char *dst = &lines[y * lineBytes];
+
+		*dst++ = sub ? 1 : 0;
+
+		unsigned char left[3] = { 0, 0, 0 };
+
+		for (int x = 0; x < w; ++x, src += 3, dst += 3)
+		{
+			unsigned char rgb[3] = { src[2], src[1], src[0] };
+
+			for (int c = 0; c < 3; ++c)
+			{
+				dst[c] = sub ? static_cast<unsigned char>(rgb[c] - left[c]) : rgb[c];
+				left[c] = rgb[c];
+			}
+		}
+	}
+
+	*adler = adler32(adler32(0L, Z_NULL, 0), lines.data(), static_cast<uInt>(lines.size()));
+
+	int level = deflateLevel(compression);
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+
+	// negative window bits - raw deflate, the zlib wrapper is assembled by the caller
+	if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+	// room for the zlib header and the sync flush marker
+	size_t headerBytes = first ? 2 : 0;
+	size_t bound = deflateBound(&stream, static_cast<uLong>(lines.size())) + 16;
+
+	out.resize(headerBytes + bound);
+
+	if (first)
+	{
+		// CMF 0x78 (deflate, 32K window) and FLG with the level hint and check bits
+		out[0] = 0x78;
+		out[1] = (level >= 6) ? 0x9c : 0x01;
+	}
+
+	stream.next_in   = lines.data();
+	stream.avail_in  = static_cast<uInt>(lines.size());
+	stream.next_out  = out.data() + headerBytes;
+	stream.avail_out = static_cast<uInt>(bound);
+
+	int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+	bool ok = last ? (result == Z_STREAM_END) : (result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0);
+
+	out.resize(headerBytes + stream.total_out);
+
+	deflateEnd(&stream);
+	return ok;
+}
+
+static bool writePNGChunk(std::FILE* file, const char* type, const unsigned char* data, size_t size)
+{
+	unsigned char length[4], crc[4];
+
+	put32BE(length, static_cast<uint32_t>(size));
+
+	// the CRC covers the type and the data
+	uLong checksum = crc32(0L, Z_NULL, 0);
+	checksum = crc32(checksum, reinterpret_cast<const Bytef*>(type), 4);
+
+	if (size > 0)
+		checksum = crc32(checksum, data, static_cast<uInt>(size));
+
+	put32BE(crc, static_cast<uint32_t>(checksum));
+
+	return std::fwrite(length, 1, 4, file) == 4 &&
+		   std::fwrite(type, 1, 4, file) == 4 &&
+		   (size == 0 || std::fwrite(data, 1, size, file) == size) &&
+		   std::fwrite(crc, 1, 4, file) == 4;
+}
+
+static void put16LE(std::vector<unsigned char>& out, uint32_t value)
+{
+	out.push_back(static_cast<unsigned char>(value));
+	out.push_back(static_cast<unsigned char>(value >> 8));
+}
+
+static void put32LE(std::vector<unsigned char>& out, uint32_t value)
+{
+	put16LE(out, value & 0xffff);
+	put16LE(out, value >> 16);
+}
+
+static void put32BE(unsigned char* out, uint32_t value)
+{
+	out[0] = static_cast<unsigned char>(value >> 24);
+	out[1] = static_cast<unsigned char>(value >> 16);
+	out[2] = static_cast<unsigned char>(value >> 8);
+	out[3] = static_cast<unsigned char>(value);
+}
@@ -0,0 +1,85 @@
+//
+// Portable TIFF and PNG encoding for 24bpp BGR images (zlib, no WIC).  The image is cut into
+// independent strips of encoderStripRows rows which are converted and deflated in parallel on
+// the shared thread pool, then written in order - encode time scales with the core count
+// instead of being bound to one codec thread.
+//
+// TIFF strips are separate deflate streams by definition.  PNG has a single zlib stream, so
+// each strip is deflated on its own and ended with a sync flush (the final one with the
+// stream end), which leaves every piece byte aligned so the pieces can simply be
+// concatenated.  The Adler-32 checksums of the pieces are combined for the stream trailer.
+//
+#ifndef _IMAGE_ENCODER_
+#define _IMAGE_ENCODER_
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum ImageCompression
+{
+	IMAGE_COMPRESSION_NONE = 0,		// stored - TIFF compression 1, PNG deflate level 0
+	IMAGE_COMPRESSION_FAST,			// deflate level 1
+	IMAGE_COMPRESSION_DEFAULT		// deflate level 6
+};
+
+// rows per strip (TIFF) or independently deflated piece (PNG)
+static const int encoderStripRows = 32;
+
+// parse "none", "fast" or "default".  Returns false for anything else
+bool parseImageCompression(const char* name, ImageCompression* result);
+
+const char* imageCompressionName(ImageCompression compression);
+
+// compression used by saveImage and the row writer (IMAGE_COMPRESSION_DEFAULT unless changed).
+// Safe to call from any thread - encoders already open keep the setting they started with
+void setImageCompression(ImageCompression compression);
+ImageCompression imageCompression(void);
+
+// Strip TIFF writer.  Rows are appended top to bottom; each complete strip is compressed and
+// written straight away, so only a partial strip is ever buffered.  The IFD is written after
+// the strip data when the file is closed.  Files are limited to 4GB (no BigTIFF)
+class TiffStripEncoder
+{
+public:
+
+	TiffStripEncoder(void);
+	~TiffStripEncoder(void);
+
+	TiffStripEncoder(const TiffStripEncoder&) = delete;
+	TiffStripEncoder& operator=(const TiffStripEncoder&) = delete;
+
+	// create imagePath for a w x h image.  Returns non-zero on failure
+	int open(const std::wstring& imagePath, int w, int h, ImageCompression compression);
+
+	// append rows rows of w bgr pixels (3 bytes each, tightly packed)
+	int writeRows(int rows, const unsigned char* bgr);
+
+	// write the last strip and the IFD and close the file.  Fails unless all h rows were written
+	int close(void);
+
+	int rowsWritten(void) const { return rowsDone; }
+
+private:
+
+	// compress rows rows starting at bgr as consecutive strips (the last may be partial) and
+	// write them in order
+	int writeStrips(const unsigned char* bgr, int rows);
+	int writeDirectory(void);
+
+	std::FILE					*file;
+	int							width, height, rowsDone;
+	ImageCompression			compression;
+	uint64_t					fileOffset;
+
+	std::vector<unsigned char>	pending;		// rows of an incomplete strip
+	int							pendingRows;
+
+	std::vector<uint32_t>		stripOffsets, stripBytes;
+};
+
+// encode w x h bgr pixels as a PNG at imagePath.  Returns non-zero on failure
+int encodePNG(const std::wstring& imagePath, int w, int h, const unsigned char* bgr, ImageCompression compression);
+
+#endif
@@ -0,0 +1,242 @@
+//
+// Image object pipeline - see image_objects.h
+//
+#include <cstring>
+#include <algorithm>
+#include "image_objects.h"
+#include "storage.h"
+#include "setup_cl.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+//
+// Public function implementation
+//
+bool parseImageObjectFormat(const char* name, ImageObjectFormat* format)
+{
+	if (strcmp(name, "unorm8") == 0)
+		*format = IMAGE_OBJECT_UNORM8;
+	else if (strcmp(name, "half") == 0)
+		*format = IMAGE_OBJECT_HALF;
+	else
+		return false;
+
+	return true;
+}
+
+const char* imageObjectFormatName(ImageObjectFormat format)
+{
+	return (format == IMAGE_OBJECT_HALF) ? "half" : "unorm8";
+}
+
+cl_image_format imageObjectFormat(ImageObjectFormat format)
+{
+	cl_image_format imageFormat;
+
+	// CL_BGRA matches the WIC pixel layout, so the 8-bit upload needs no swizzle
+	imageFormat.image_channel_order     = (format == IMAGE_OBJECT_HALF) ? CL_RGBA : CL_BGRA;
+	imageFormat.image_channel_data_type = (format == IMAGE_OBJECT_HALF) ? CL_HALF_FLOAT : CL_UNORM_INT8;
+
+	return imageFormat;
+}
+
+size_t imageObjectPixelSize(ImageObjectFormat format)
+{
+	return (format == IMAGE_OBJECT_HALF) ? 4 * sizeof(uint16_t) : 4;
+}
+
+bool imageObjectFormatSupported(cl_context context, cl_device_id device, ImageObjectFormat format)
+{
+	cl_bool imageSupport = CL_FALSE;
+
+	clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &imageSupport, 0);
+
+	if (!imageSupport) return false;
+
+	cl_image_format wanted = imageObjectFormat(format);
+
+	// the input is only read and the output only written, but check both for each
+	cl_mem_flags access[2] = { CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY };
+
+	for (cl_mem_flags flags : access)
+	{
+		cl_uint count = 0;
+
+		if (clGetSupportedImageFormats(context, flags, CL_MEM_OBJECT_IMAGE2D, 0, 0, &count) != CL_SUCCESS || count == 0)
+			return false;
+
+		std::vector<cl_image_format> formats(count);
+
+		clGetSupportedImageFormats(context, flags, CL_MEM_OBJECT_IMAGE2D, count, formats.data(), 0);
+
+		bool found = std::any_of(formats.begin(), formats.end(), [&](const cl_image_format& f)
+		{
+			return f.image_channel_order == wanted.image_channel_order &&
+				   f.image_channel_data_type == wanted.image_channel_data_type;
+		});
+
+		if (!found) return false;
+	}
+
+	return true;
+}
+
+ImageObjectPipeline::ImageObjectPipeline(cl_context context, cl_device_id device, cl_program program, ImageObjectFormat format)
+	: clContext(context), kernel(nullptr), objectFormat(format), inputImage(nullptr), outputImage(nullptr), imageW(0), imageH(0)
+{
+	// IMAGE_XYY_IMAGE is only compiled for devices with image support
+	if (imageObjectFormatSupported(context, device, format))
+		kernel = clCreateKernel(program, "IMAGE_XYY_IMAGE", 0);
+}
+
+ImageObjectPipeline::~ImageObjectPipeline(void)
+{
+	if (inputImage) clReleaseMemObject(inputImage);
+	if (outputImage) clReleaseMemObject(outputImage);
+	if (kernel) clReleaseKernel(kernel);
+}
+
+cl_int ImageObjectPipeline::process(cl_command_queue queue, const BGRA8* input, int w, int h, float luminanceScale,
+									bgr8* output, double* kernelSeconds)
+{
+	if (!kernel) return CL_INVALID_KERNEL;
+
+	cl_int err = createImages(w, h);
+
+	if (err != CL_SUCCESS) return err;
+
+	size_t numPixels = static_cast<size_t>(w) * h;
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { static_cast<size_t>(w), static_cast<size_t>(h), 1 };
+
+	const void *upload = input;
+
+	if (objectFormat == IMAGE_OBJECT_HALF)
+	{
+		// there are only 256 input values, so convert them once and look them up
+		uint16_t halfOf[256];
+
+		for (int v = 0; v < 256; ++v)
+			halfOf[v] = floatToHalf(v / 255.0f);
+
+		halfPixels.resize(numPixels * 4);
+
+		const unsigned char *src = reinterpret_cast<const unsigned char*>(input);
+
+		for (size_t i = 0; i < numPixels; ++i, src += 4)
+		{
+			halfPixels[i * 4 + 0] = halfOf[src[2]];
+			halfPixels[i * 4 + 1] = halfOf[src[1]];
+			halfPixels[i * 4 + 2] = halfOf[src[0]];
+			halfPixels[i * 4 + 3] = halfOf[src[3]];
+		}
+
+		upload = halfPixels.data();
+	}
+
+	err = traceCommand("upload image", queue, 0, [&](cl_event* event)
+	{
+		return clEnqueueWriteImage(queue, inputImage, CL_FALSE, origin, region, 0, 0, upload, 0, 0, event);
+	});
+
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &inputImage);
+	clSetKernelArg(kernel, 1, sizeof(cl_mem), &outputImage);
+	clSetKernelArg(kernel, 2, sizeof(cl_float), &luminanceScale);
+
+	WorkGroupSize local = WorkGroupTuner::shared().select(queue, kernel, w, h);
+
+	cl_event kernelEvent = nullptr;
+
+	if (err == CL_SUCCESS)
+		err = enqueueImageKernel(queue, kernel, w, h, local, 0, 0, &kernelEvent);
+
+	readPixels.resize(numPixels * imageObjectPixelSize(objectFormat));
+
+	if (err == CL_SUCCESS)
+		err = traceCommand("download image", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueReadImage(queue, outputImage, CL_TRUE, origin, region, 0, 0, readPixels.data(), 0, 0, event);
+		});
+
+	if (kernelEvent)
+	{
+		if (kernelSeconds && err == CL_SUCCESS) *kernelSeconds = eventSeconds(kernelEvent);
+		clReleaseEvent(kernelEvent);
+	}
+
+	if (err != CL_SUCCESS) return err;
+
+	// drop alpha and pack to bgr8 - the half result is truncated as saveImage does
+	unsigned char *dst = reinterpret_cast<unsigned char*>(output);
+
+	if (objectFormat == IMAGE_OBJECT_HALF)
+	{
+		std::vector<float> row(static_cast<size_t>(w) * 4);
+		const uint16_t *src = reinterpret_cast<const uint16_t*>(readPixels.data());
+
+		for (int y = 0; y < h; ++y, src += w * 4)
+		{
+			storageToFloat(STORAGE_HALF, src, row.data(), row.size());
+
+			for (int x = 0; x < w; ++x, dst += 3)
+			{
+				dst[0] = static_cast<unsigned char>(std::min(std::max(row[x * 4 + 2], 0.0f), 1.0f) * 255.0f);
+				dst[1] = static_cast<unsigned char>(std::min(std::max(row[x * 4 + 1], 0.0f), 1.0f) * 255.0f);
+				dst[2] = static_cast<unsigned char>(std::min(std::max(row[x * 4 + 0], 0.0f), 1.0f) * 255.0f);
+			}
+		}
+	}
+	else
+	{
+		const unsigned char *src = readPixels.data();
+
+		for (size_t i = 0; i < numPixels; ++i, src += 4, dst += 3)
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+	}
+
+	return CL_SUCCESS;
+}
+
+
+//
+// Private function implementation
+//
+cl_int ImageObjectPipeline::createImages(int w, int h)
+{
+	if (inputImage && w == imageW && h == imageH) return CL_SUCCESS;
+
+	if (inputImage) clReleaseMemObject(inputImage);
+	if (outputImage) clReleaseMemObject(outputImage);
+
+	inputImage = outputImage = nullptr;
+
+	cl_image_format imageFormat = imageObjectFormat(objectFormat);
+	cl_image_desc desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.image_type   = CL_MEM_OBJECT_IMAGE2D;
+	desc.image_width  = w;
+	desc.image_height = h;
+
+	cl_int err = CL_SUCCESS;
+
+	inputImage = clCreateImage(clContext, CL_MEM_READ_ONLY, &imageFormat, &desc, 0, &err);
+
+	if (err == CL_SUCCESS)
+		outputImage = clCreateImage(clContext, CL_MEM_WRITE_ONLY, &imageFormat, &desc, 0, &err);
+
+	if (err != CL_SUCCESS)
+	{
+		if (inputImage) clReleaseMemObject(inputImage);
+		inputImage = nullptr;
+		return err;
+	}
+
+	imageW = w;
+	imageH = h;
+	return CL_SUCCESS;
+}
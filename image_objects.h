@@ -0,0 +1,82 @@
+//
+// Image object (texture) version of the packed pipeline.  Instead of linear buffers addressed
+// by hand the pixels live in image2d objects read with read_imagef and written with
+// write_imagef (IMAGE_XYY_IMAGE in HelloWorld.cl), so fetches go through the texture cache
+// with 2D locality, normalisation is done by the format and out of range coordinates clamp to
+// the edge.  Two formats are supported:
+//
+//   IMAGE_OBJECT_UNORM8	CL_BGRA / CL_UNORM_INT8 - the decoded BGRA8 pixels are uploaded as
+//							they are.  write_imagef rounds to nearest where the buffer path
+//							truncates, so results can differ from -packed by one step
+//   IMAGE_OBJECT_HALF		CL_RGBA / CL_HALF_FLOAT - 8 bytes per pixel, converted on the host,
+//							for inputs and intermediates that need more than 8 bits
+//
+// Devices without image support (or without the format) are reported by
+// imageObjectFormatSupported and the callers fall back to the buffer path.
+//
+#ifndef _IMAGE_OBJECTS_
+#define _IMAGE_OBJECTS_
+
+#include <CL/opencl.h>
+#include <vector>
+#include <cstdint>
+#include "imageio.h"
+
+enum ImageObjectFormat
+{
+	IMAGE_OBJECT_UNORM8 = 0,
+	IMAGE_OBJECT_HALF
+};
+
+// parse "unorm8" or "half" - returns false for anything else
+bool parseImageObjectFormat(const char* name, ImageObjectFormat* format);
+
+const char* imageObjectFormatName(ImageObjectFormat format);
+
+cl_image_format imageObjectFormat(ImageObjectFormat format);
+
+// bytes per pixel of the image objects
+size_t imageObjectPixelSize(ImageObjectFormat format);
+
+// true if the device of context supports images and format can be both read and written
+bool imageObjectFormatSupported(cl_context context, cl_device_id device, ImageObjectFormat format);
+
+class ImageObjectPipeline
+{
+public:
+
+	// create IMAGE_XYY_IMAGE from program - valid() is false if the device has no image
+	// support or format is not available
+	ImageObjectPipeline(cl_context context, cl_device_id device, cl_program program, ImageObjectFormat format);
+	~ImageObjectPipeline(void);
+
+	ImageObjectPipeline(const ImageObjectPipeline&) = delete;
+	ImageObjectPipeline& operator=(const ImageObjectPipeline&) = delete;
+
+	bool valid(void) const { return kernel != nullptr; }
+
+	ImageObjectFormat format(void) const { return objectFormat; }
+
+	// Upload w x h BGRA8 pixels to the input image, run the kernel and read the result back
+	// into output as packed bgr8.  The images are kept and reused while the size stays the
+	// same.  kernelSeconds (if not null) is set to the kernel's device time
+	cl_int process(cl_command_queue queue, const BGRA8* input, int w, int h, float luminanceScale,
+				   bgr8* output, double* kernelSeconds = nullptr);
+
+private:
+
+	cl_int createImages(int w, int h);
+
+	cl_context					clContext;
+	cl_kernel					kernel;
+	ImageObjectFormat			objectFormat;
+	cl_mem						inputImage;
+	cl_mem						outputImage;
+	int							imageW, imageH;
+
+	// host side staging for the half format and the BGRA / RGBA -> bgr8 pack
+	std::vector<uint16_t>		halfPixels;
+	std::vector<unsigned char>	readPixels;
+};
+
+#endif
@@ -0,0 +1,286 @@
+//
+// Asynchronous image pipeline - see image_pipeline.h
+//
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include "image_pipeline.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+//
+// Private API
+//
+static double secondsSince(std::chrono::steady_clock::time_point start);
+
+
+//
+// Public function implementation
+//
+std::string defaultKernelFile(void)
+{
+	return (std::filesystem::path("Resources") / "Kernels" / "HelloWorld.cl").string();
+}
+
+ImagePipeline::ImagePipeline(const ImagePipelineConfig& config)
+	: clContext(nullptr), clDevice(nullptr), clProgram(nullptr), devicePool(nullptr), variants(nullptr), ready(false), stopping(false)
+{
+	clContext = createContext(config.selector);
+
+	if (!clContext)
+	{
+		std::cout << "pipeline context not created\n";
+		return;
+	}
+
+	// the selector can match several devices - the pipeline runs on the first
+	size_t devicesSize = 0;
+	cl_int err = clGetContextInfo(clContext, CL_CONTEXT_DEVICES, 0, 0, &devicesSize);
+
+	std::vector<cl_device_id> devices(devicesSize / sizeof(cl_device_id));
+
+	if (err == CL_SUCCESS && !devices.empty())
+		err = clGetContextInfo(clContext, CL_CONTEXT_DEVICES, devicesSize, devices.data(), 0);
+
+	if (err != CL_SUCCESS || devices.empty())
+	{
+		std::cout << "pipeline context has no devices (error " << err << ")\n";
+		return;
+	}
+
+	clDevice = devices[0];
+
+	std::string buildOptions = buildProfileOptions(config.profile, clDevice);
+
+	clProgram = createProgram(clContext, clDevice, config.kernelFile.c_str(), buildOptions.c_str());
+
+	if (!clProgram)
+	{
+		std::cout << "pipeline program not created\n";
+		return;
+	}
+
+	start(config);
+}
+
+ImagePipeline::ImagePipeline(cl_context context, cl_device_id device, cl_program program, const ImagePipelineConfig& config)
+	: clContext(context), clDevice(device), clProgram(program), devicePool(nullptr), variants(nullptr), ready(false), stopping(false)
+{
+	if (!context || !device || !program) return;
+
+	clRetainContext(clContext);
+	clRetainProgram(clProgram);
+
+	start(config);
+}
+
+ImagePipeline::~ImagePipeline(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+
+	requestReady.notify_all();
+
+	for (Lane& lane : lanes)
+		if (lane.thread.joinable()) lane.thread.join();
+
+	for (Lane& lane : lanes)
+	{
+		if (lane.kernel) clReleaseKernel(lane.kernel);
+		if (lane.queue) clReleaseCommandQueue(lane.queue);
+	}
+
+	delete variants;
+
+	// pooled buffers before the context they belong to
+	delete devicePool;
+
+	if (clProgram) clReleaseProgram(clProgram);
+	if (clContext) clReleaseContext(clContext);
+}
+
+std::future<ImageResult> ImagePipeline::submit(const CPBitmapImage& image, bgr8* output, const ImageParams& params)
+{
+	Request request;
+
+	request.input     = image.buffer;
+	request.output    = output;
+	request.w         = image.w;
+	request.h         = image.h;
+	request.params    = params;
+	request.submitted = std::chrono::steady_clock::now();
+
+	std::future<ImageResult> result = request.promise.get_future();
+
+	if (!ready || !image.buffer || !output || image.w <= 0 || image.h <= 0)
+	{
+		ImageResult failed = {};
+		failed.status = ready ? CL_INVALID_VALUE : CL_INVALID_CONTEXT;
+
+		request.promise.set_value(failed);
+		return result;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		requests.push_back(std::move(request));
+	}
+
+	requestReady.notify_one();
+	return result;
+}
+
+BufferPoolStats ImagePipeline::poolStats(void) const
+{
+	return devicePool ? devicePool->stats() : BufferPoolStats();
+}
+
+
+//
+// Private function implementation
+//
+void ImagePipeline::start(const ImagePipelineConfig& config)
+{
+	devicePool = new DeviceBufferPool(clContext, config.poolMemoryCap);
+
+	if (config.specialiseAfter > 0)
+		variants = new KernelVariantCache(clContext, clDevice, config.kernelFile, clProgram, buildProfileOptions(config.profile, clDevice), config.specialiseAfter);
+
+	lanes.resize(std::max(config.lanes, 1));
+
+	bool created = true;
+
+	// profiling is needed for the per request times and by the work-group tuner
+	for (Lane& lane : lanes)
+	{
+		lane.queue  = clCreateCommandQueue(clContext, clDevice, CL_QUEUE_PROFILING_ENABLE, 0);
+		lane.kernel = clCreateKernel(clProgram, "BGRA8_XYY_BGR8", 0);
+
+		created = created && lane.queue && lane.kernel;
+	}
+
+	if (!created)
+	{
+		std::cout << "pipeline queues or kernels not created\n";
+		return;
+	}
+
+	// the lanes vector is not resized again, so the threads can hold pointers into it
+	for (Lane& lane : lanes)
+		lane.thread = std::thread(&ImagePipeline::laneLoop, this, &lane);
+
+	ready = true;
+}
+
+void ImagePipeline::laneLoop(Lane* lane)
+{
+	for (;;)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		requestReady.wait(guard, [this](void) { return stopping || !requests.empty(); });
+
+		// queued requests are still completed after the destructor starts
+		if (requests.empty()) return;
+
+		Request request = std::move(requests.front());
+		requests.pop_front();
+
+		guard.unlock();
+
+		request.promise.set_value(process(lane, request));
+	}
+}
+
+ImageResult ImagePipeline::process(Lane* lane, Request& request)
+{
+	ImageResult result = {};
+
+	result.queueSeconds = secondsSince(request.submitted);
+
+	size_t pixels     = static_cast<size_t>(request.w) * request.h;
+	size_t inputSize  = pixels * sizeof(BGRA8);
+	size_t outputSize = pixels * sizeof(bgr8);
+
+	// input and output are reserved together - lanes each holding an input while waiting for an 
+	// output would stall one another at the pool's cap
+	const size_t sizes[2]      = { inputSize, outputSize };
+	const cl_mem_flags flags[2] = { CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY };
+	cl_mem buffers[2];
+
+	devicePool->acquire(2, sizes, flags, buffers);
+
+	cl_mem inputBuffer  = buffers[0];
+	cl_mem outputBuffer = buffers[1];
+
+	cl_event events[3] = { nullptr, nullptr, nullptr };
+
+	cl_int err = (inputBuffer && outputBuffer) ? CL_SUCCESS : CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+	// the lane's queue is in order, so the commands need no wait lists
+	if (err == CL_SUCCESS)
+		err = traceCommand("upload", lane->queue, &events[0], [&](cl_event* event)
+		{
+			return clEnqueueWriteBuffer(lane->queue, inputBuffer, CL_FALSE, 0, inputSize, request.input, 0, 0, event);
+		});
+
+	float luminanceScale = request.params.luminanceScale;
+
+	// the lane keeps its kernel while consecutive requests share a key
+	if (err == CL_SUCCESS && variants)
+	{
+		lane->kernel = variants->selectKernel(lane->kernel, "BGRA8_XYY_BGR8", request.w, request.h, luminanceScale);
+
+		if (!lane->kernel) err = CL_INVALID_KERNEL;
+	}
+
+	if (err == CL_SUCCESS)
+	{
+		clSetKernelArg(lane->kernel, 0, sizeof(cl_mem), &inputBuffer);
+		clSetKernelArg(lane->kernel, 1, sizeof(cl_mem), &outputBuffer);
+		clSetKernelArg(lane->kernel, 2, sizeof(cl_int), &request.w);
+		clSetKernelArg(lane->kernel, 3, sizeof(cl_int), &request.h);
+		clSetKernelArg(lane->kernel, 4, sizeof(cl_float), &luminanceScale);
+
+		WorkGroupSize local = WorkGroupTuner::shared().select(lane->queue, lane->kernel, request.w, request.h);
+
+		err = enqueueImageKernel(lane->queue, lane->kernel, request.w, request.h, local, 0, 0, &events[1]);
+	}
+
+	if (err == CL_SUCCESS)
+		err = traceCommand("download", lane->queue, &events[2], [&](cl_event* event)
+		{
+			return clEnqueueReadBuffer(lane->queue, outputBuffer, CL_FALSE, 0, outputSize, request.output, 0, 0, event);
+		});
+
+	cl_int finishErr = clFinish(lane->queue);
+
+	result.status = (err != CL_SUCCESS) ? err : finishErr;
+
+	if (result.status == CL_SUCCESS)
+	{
+		result.uploadSeconds   = eventSeconds(events[0]);
+		result.kernelSeconds   = eventSeconds(events[1]);
+		result.downloadSeconds = eventSeconds(events[2]);
+	}
+
+	for (cl_event event : events)
+		if (event) clReleaseEvent(event);
+
+	if (inputBuffer) devicePool->release(inputBuffer);
+	if (outputBuffer) devicePool->release(outputBuffer);
+
+	result.totalSeconds = secondsSince(request.submitted);
+	return result;
+}
+
+
+//
+// Private API implementation
+//
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,144 @@
+//
+// Reusable asynchronous image pipeline for embedding the packed colour pipeline in a service.
+// An ImagePipeline is set up once - context, program, command queues, kernels and a device
+// buffer pool stay warm - and then processes any number of images submitted from any thread.
+// submit() queues a request and returns a future.  Requests are picked up by lanes, each a
+// worker thread with its own in-order command queue and kernel object, so the upload, kernel
+// and download of different images overlap on the device.  Device buffers are reused across
+// requests and the caller supplies the host input and output memory, so a request on a warm
+// pipeline makes no host allocations beyond its future.
+//
+#ifndef _IMAGE_PIPELINE_
+#define _IMAGE_PIPELINE_
+
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "setup_cl.h"
+#include "imageio.h"
+#include "buffer_pool.h"
+#include "kernel_variants.h"
+#include "precision.h"
+
+// Resources/Kernels/HelloWorld.cl relative to the working directory, with the platform's
+// path separator
+std::string defaultKernelFile(void);
+
+struct ImagePipelineConfig
+{
+	DeviceSelector		selector;		// device for the pipeline's own context
+	std::string			kernelFile;		// defaultKernelFile() unless set
+	BuildProfile		profile;		// build profile for the program (default strict)
+	int					lanes;			// requests processed concurrently (default 2)
+	size_t				poolMemoryCap;	// device buffer pool cap in bytes, 0 for no limit
+	int					specialiseAfter;// requests of one size and scale before the lanes switch 
+										// to a kernel specialised for them (see kernel_variants.h), 
+										// 0 to always run the generic kernel
+
+	ImagePipelineConfig(void)
+		: selector(), kernelFile(defaultKernelFile()), profile(BUILD_PROFILE_STRICT), lanes(2), poolMemoryCap(0), specialiseAfter(0)
+	{
+	}
+};
+
+// per request parameters
+struct ImageParams
+{
+	float		luminanceScale;
+
+	ImageParams(void)
+		: luminanceScale(0.5f)
+	{
+	}
+};
+
+struct ImageResult
+{
+	cl_int		status;				// CL_SUCCESS, or the error of the first call that failed
+	double		queueSeconds;		// submit until a lane picked the request up
+	double		uploadSeconds;		// device (profiling) times of the three commands
+	double		kernelSeconds;
+	double		downloadSeconds;
+	double		totalSeconds;		// submit until the result was ready
+};
+
+class ImagePipeline
+{
+public:
+
+	// create a context for config.selector and build config.kernelFile
+	explicit ImagePipeline(const ImagePipelineConfig& config = ImagePipelineConfig());
+
+	// share an existing context and program built from HelloWorld.cl - both are retained, so
+	// the caller may release its own references at any time
+	ImagePipeline(cl_context context, cl_device_id device, cl_program program,
+				  const ImagePipelineConfig& config = ImagePipelineConfig());
+
+	// completes every queued request, then stops the lanes and releases the OpenCL objects
+	~ImagePipeline(void);
+
+	ImagePipeline(const ImagePipeline&) = delete;
+	ImagePipeline& operator=(const ImagePipeline&) = delete;
+
+	bool valid(void) const { return ready; }
+
+	// Queue image for the BGRA8_XYY_BGR8 kernel with its result written to output, which must
+	// hold image.w * image.h pixels.  image.buffer and output must stay valid until the
+	// future is ready.  Safe to call from any number of threads
+	std::future<ImageResult> submit(const CPBitmapImage& image, bgr8* output, const ImageParams& params = ImageParams());
+
+	cl_context context(void) const { return clContext; }
+	cl_device_id device(void) const { return clDevice; }
+
+	// device buffer pool counters
+	BufferPoolStats poolStats(void) const;
+
+private:
+
+	struct Request
+	{
+		const BGRA8							*input;
+		bgr8								*output;
+		int									w, h;
+		ImageParams							params;
+		std::promise<ImageResult>			promise;
+		std::chrono::steady_clock::time_point	submitted;
+	};
+
+	struct Lane
+	{
+		cl_command_queue	queue;
+		cl_kernel			kernel;
+		std::thread			thread;
+
+		Lane(void)
+			: queue(nullptr), kernel(nullptr)
+		{
+		}
+	};
+
+	void start(const ImagePipelineConfig& config);
+	void laneLoop(Lane* lane);
+	ImageResult process(Lane* lane, Request& request);
+
+	cl_context					clContext;
+	cl_device_id				clDevice;
+	cl_program					clProgram;
+	DeviceBufferPool			*devicePool;
+	KernelVariantCache			*variants;		// null unless config.specialiseAfter is set
+	std::vector<Lane>			lanes;
+	bool						ready;
+
+	std::deque<Request>			requests;
+	bool						stopping;
+	std::mutex					lock;
+	std::condition_variable		requestReady;
+};
+
+#endif
@@ -1,17 +1,32 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <filesystem>
 #include "imageio.h"
+#include "image_encoder.h"
+#include "image_convert.h"
+#include "rawimage.h"
+#include "trace.h"
 
+#ifdef _WIN32
 // Windows Imaging Component factory class (singleton)
 static IWICImagingFactory			*wicFactory = NULL;
+#endif
 
 //
 // Private API
 //
+#ifdef _WIN32
 HRESULT					createWICFactory(void);
 IWICImagingFactory*		getWICFactory(void);
 HRESULT					getWICFormatConverter(IWICFormatConverter **formatConverter);
 HRESULT					loadWICBitmap(const std::wstring& imagePath, IWICBitmap **bitmap);
+HRESULT					loadWICSource(const std::wstring& imagePath, IWICFormatConverter **source);
+#endif
 bgr8*					convertFloatImageToBGR8Image(int w, int h, const float *image);
+static bool				isPNGPath(const std::wstring& imagePath);
 
+#ifdef _WIN32
 // safe release COM interfaces
 template <class T>
 inline void SafeRelease(T **comInterface)
@@ -22,6 +37,7 @@ inline void SafeRelease(T **comInterface)
 		*comInterface = NULL;
 	}
 }
+#endif
 
 //
 // Public function implementation
@@ -45,96 +61,27 @@ int saveImage(const int w, const int h, const float *floatImage, const std::wstr
 
 int saveImage(const int w, const int h, bgr8 *buffer, const std::wstring& imagePath)
 {
-	// validate image buffer parameter
-	if (!buffer) return 1;
-
-	HRESULT		hr;
-
-	// get and validate WIC factory
-	IWICImagingFactory *wicFactory = getWICFactory();
-
-	if (!wicFactory) return 1;
-
-	//	
-	// export using WIC
-	//
-	IWICStream				*piStream = NULL;
-	IWICBitmapEncoder		*piEncoder = NULL;
-	IWICBitmapFrameEncode	*piBitmapFrame = NULL;
-	IPropertyBag2			*pPropertybag = NULL;
-
-
-	// create new stream
-	hr = wicFactory->CreateStream(&piStream);
-
-	// initialise stream from imagePath and setup for generic write
-	if (SUCCEEDED(hr))
-		hr = piStream->InitializeFromFilename(imagePath.c_str(), GENERIC_WRITE);
-
-	// create new image encoder
-	if (SUCCEEDED(hr))
-		hr = wicFactory->CreateEncoder(GUID_ContainerFormatTiff, NULL, &piEncoder);
+	// validate image buffer parameter - a .cpfi file holds float planes, never 8-bit pixels
+	if (!buffer || isRawImagePath(imagePath)) return 1;
 
-	// initialise the encode with the given stream
-	if (SUCCEEDED(hr))
-		hr = piEncoder->Initialize(piStream, WICBitmapEncoderNoCache);
-
-	// create new frame
-	if (SUCCEEDED(hr))
-		hr = piEncoder->CreateNewFrame(&piBitmapFrame, &pPropertybag);
-
-	// configure TIFF output
-	if (SUCCEEDED(hr))
-	{
-		PROPBAG2 option = { 0 };
-		VARIANT varValue;
-
-		option.pstrName = L"TiffCompressionMethod";
+	TraceSpan span("encode");
 
-		VariantInit(&varValue);
+	// PNG is one zlib stream so it is encoded in one go rather than through the row writer
+	if (isPNGPath(imagePath))
+		return encodePNG(imagePath, w, h, reinterpret_cast<const unsigned char*>(buffer), imageCompression());
 
-		varValue.vt = VT_UI1;
-		varValue.bVal = WICTiffCompressionZIP;
+	ImageRowWriter writer;
 
-		hr = pPropertybag->Write(1, &option, &varValue);
+	int result = openImageWriter(imagePath, w, h, &writer);
 
-		if (SUCCEEDED(hr))
-			hr = piBitmapFrame->Initialize(pPropertybag);
-	}
-
-	// set frame size
-	if (SUCCEEDED(hr))
-		hr = piBitmapFrame->SetSize(w, h);
-
-	// set image format
-	WICPixelFormatGUID formatGUID = GUID_WICPixelFormat24bppBGR;
-	if (SUCCEEDED(hr))
-		hr = piBitmapFrame->SetPixelFormat(&formatGUID);
-
-	// verify formatGUID was returned with GUID_WICPixelFormat24bppBGR
-	if (SUCCEEDED(hr))
-		hr = IsEqualGUID(formatGUID, GUID_WICPixelFormat24bppBGR) ? S_OK : E_FAIL;
+	// write the whole image as a single band
+	if (result == 0)
+		result = writeImageRows(&writer, h, buffer);
 
-	// write image buffer to the bitmap frame
-	if (SUCCEEDED(hr)) {
+	// always close so the encoder is released
+	int closeResult = closeImageWriter(&writer);
 
-		int stride = (w * (sizeof(bgr8) << 3) + 7) / 8;
-		hr = piBitmapFrame->WritePixels(h, stride, stride*h, (BYTE*)buffer);
-	}
-
-	// commit changes to bitmap frame
-	if (SUCCEEDED(hr))
-		hr = piBitmapFrame->Commit();
-
-	// commit changes in encoder
-	if (SUCCEEDED(hr))
-		hr = piEncoder->Commit();
-
-	// release resources
-	SafeRelease(&piBitmapFrame);
-	SafeRelease(&piEncoder);
-	SafeRelease(&piStream);
-	return 0;
+	return (result != 0) ? result : closeResult;
 }
 
 // Save (assumed) UNORM float image stored as colour planes as a bgr8 image.
@@ -147,36 +94,43 @@ int saveImage(
 			  const std::wstring& imagePath
 			  )
 {
+	// .cpfi keeps the planes as they are
+	if (isRawImagePath(imagePath))
+	{
+		CPFloatImage image;
+		image.w = w;
+		image.h = h;
+		image.redChannel   = R;
+		image.greenChannel = G;
+		image.blueChannel  = B;
+
+		return saveRawImage(image, imagePath);
+	}
+
 	bgr8 *I = static_cast<bgr8*>(malloc(w * h * sizeof(bgr8)));
 
 	if (!I) return 1;
 
-	float *rPtr = R;
-	float *gPtr = G;
-	float *bPtr = B;
-
-	bgr8 *bgrPtr = I;
-
-	for (int i = 0; i<h; i++)
+	// vectorised and split across the shared thread pool
 	{
-		for (int j = 0; j<w; j++, rPtr++, gPtr++, bPtr++, bgrPtr++)
-		{
-			BYTE _r = BYTE(*rPtr * 255.0f);
-			BYTE _g = BYTE(*gPtr * 255.0f);
-			BYTE _b = BYTE(*bPtr * 255.0f);
-
-			*bgrPtr = bgr8(_b, _g, _r);
-		}
+		TraceSpan span("float to BGR8", "convert");
+		convertFloatToBGR8(w, h, R, G, B, reinterpret_cast<unsigned char*>(I));
 	}
 
-	return saveImage(w, h, I, imagePath);
+	int result = saveImage(w, h, I, imagePath);
+
+	free(I);
+	return result;
 }
 
+#ifdef _WIN32
 // load a bitmap file from disk and return the image data in the CGFloatImage structure *result
 int loadImage(const std::wstring& imagePath, CPFloatImage* result)
 {
 	if (!result) return 1;
 
+	TraceSpan span("decode");
+
 	IWICBitmap			*textureBitmap = NULL;
 	IWICBitmapLock		*lock = NULL;
 
@@ -211,18 +165,9 @@ int loadImage(const std::wstring& imagePath, CPFloatImage* result)
 		if (B && G && R && A)
 		{
 			// extract colour channels into float buffer
-			float *bptr = B, *gptr = G, *rptr = R, *aptr = A;
-			BYTE *imagePtr = buffer;
-
-			for (UINT j = 0; j<h; j++)
 			{
-				for (UINT i = 0; i<w; i++, bptr++, gptr++, rptr++, aptr++, imagePtr += 4)
-				{
-					*bptr = static_cast<float>(imagePtr[0]) / 255.0f;
-					*gptr = static_cast<float>(imagePtr[1]) / 255.0f;
-					*rptr = static_cast<float>(imagePtr[2]) / 255.0f;
-					*aptr = static_cast<float>(imagePtr[3]) / 255.0f;
-				}
+				TraceSpan span("BGRA8 to float", "convert");
+				convertBGRA8ToFloat(static_cast<int>(w), static_cast<int>(h), buffer, R, G, B, A);
 			}
 
 			// store buffers in result
@@ -250,6 +195,225 @@ int loadImage(const std::wstring& imagePath, CPFloatImage* result)
 	return (hr == S_OK) ? 0 : 1; // return 0 on success, otherwise return error code 1
 }
 
+// load a bitmap file from disk and return the packed BGRA8 pixels in the CPBitmapImage structure *result
+int loadImage(const std::wstring& imagePath, CPBitmapImage* result)
+{
+	if (!result) return 1;
+
+	TraceSpan span("decode");
+
+	IWICBitmap			*textureBitmap = NULL;
+	IWICBitmapLock		*lock = NULL;
+
+	HRESULT hr = loadWICBitmap(imagePath.c_str(), &textureBitmap);
+
+	if (!SUCCEEDED(hr)) return 1;
+
+	// get image dimensions
+	UINT w = 0, h = 0;
+	hr = textureBitmap->GetSize(&w, &h);
+
+	// lock image
+	WICRect rect = { 0, 0, w, h };
+	if (SUCCEEDED(hr))
+		hr = textureBitmap->Lock(&rect, WICBitmapLockRead, &lock);
+
+	// get pointer to image data and the stride between rows
+	UINT bufferSize = 0, stride = 0;
+	BYTE *buffer = NULL;
+
+	if (SUCCEEDED(hr))
+		hr = lock->GetDataPointer(&bufferSize, &buffer);
+
+	if (SUCCEEDED(hr))
+		hr = lock->GetStride(&stride);
+
+	if (SUCCEEDED(hr))
+	{
+		BGRA8 *B = static_cast<BGRA8*>(malloc(w * h * sizeof(BGRA8)));
+
+		if (B)
+		{
+			// copy rows as-is - the layout already matches BGRA8
+			for (UINT j = 0; j<h; j++)
+				memcpy(B + j * w, buffer + j * stride, w * sizeof(BGRA8));
+
+			result->w = w;
+			result->h = h;
+			result->buffer = B;
+		}
+		else
+			hr = E_FAIL;
+	}
+
+	SafeRelease(&lock);
+	SafeRelease(&textureBitmap);
+	return (hr == S_OK) ? 0 : 1; // return 0 on success, otherwise return error code 1
+}
+
+// decode the image at imagePath straight into the memory returned by allocate(w, h)
+int loadImage(const std::wstring& imagePath, const std::function<BGRA8*(int w, int h)>& allocate, int* w, int* h)
+{
+	if (!w || !h) return 1;
+
+	TraceSpan span("decode");
+
+	IWICFormatConverter		*source = NULL;
+
+	HRESULT hr = loadWICSource(imagePath, &source);
+
+	// get image dimensions
+	UINT width = 0, height = 0;
+
+	if (SUCCEEDED(hr))
+		hr = source->GetSize(&width, &height);
+
+	BGRA8 *buffer = NULL;
+
+	if (SUCCEEDED(hr))
+	{
+		buffer = allocate(static_cast<int>(width), static_cast<int>(height));
+		hr = buffer ? S_OK : E_FAIL;
+	}
+
+	// decode and convert directly into the caller's buffer - no intermediate bitmap
+	if (SUCCEEDED(hr))
+	{
+		UINT stride = width * sizeof(BGRA8);
+		hr = source->CopyPixels(NULL, stride, stride * height, reinterpret_cast<BYTE*>(buffer));
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		*w = static_cast<int>(width);
+		*h = static_cast<int>(height);
+	}
+
+	SafeRelease(&source);
+	return (hr == S_OK) ? 0 : 1; // return 0 on success, otherwise return error code 1
+}
+
+int openImageReader(const std::wstring& imagePath, ImageRowReader* reader)
+{
+	if (!reader) return 1;
+
+	HRESULT hr = loadWICSource(imagePath, &reader->source);
+
+	UINT width = 0, height = 0;
+
+	if (SUCCEEDED(hr))
+		hr = reader->source->GetSize(&width, &height);
+
+	if (SUCCEEDED(hr))
+	{
+		reader->w = static_cast<int>(width);
+		reader->h = static_cast<int>(height);
+	}
+	else
+		SafeRelease(&reader->source);
+
+	return (hr == S_OK) ? 0 : 1;
+}
+
+int readImageRows(ImageRowReader* reader, int y, int rows, BGRA8* buffer)
+{
+	if (!reader || !reader->source || !buffer || y < 0 || rows <= 0 || y + rows > reader->h) return 1;
+
+	TraceSpan span("decode rows");
+
+	// only the requested rows are converted
+	WICRect rect = { 0, y, reader->w, rows };
+	UINT stride = reader->w * sizeof(BGRA8);
+
+	HRESULT hr = reader->source->CopyPixels(&rect, stride, stride * rows, reinterpret_cast<BYTE*>(buffer));
+
+	return (hr == S_OK) ? 0 : 1;
+}
+
+void closeImageReader(ImageRowReader* reader)
+{
+	if (reader)
+		SafeRelease(&reader->source);
+}
+
+#else
+// no decoder outside Windows
+int loadImage(const std::wstring&, CPFloatImage*)
+{
+	return 1;
+}
+
+int loadImage(const std::wstring&, CPBitmapImage*)
+{
+	return 1;
+}
+
+int loadImage(const std::wstring&, const std::function<BGRA8*(int w, int h)>&, int*, int*)
+{
+	return 1;
+}
+
+int openImageReader(const std::wstring&, ImageRowReader*)
+{
+	return 1;
+}
+
+int readImageRows(ImageRowReader*, int, int, BGRA8*)
+{
+	return 1;
+}
+
+void closeImageReader(ImageRowReader*)
+{
+}
+#endif
+
+int openImageWriter(const std::wstring& imagePath, const int w, const int h, ImageRowWriter* writer)
+{
+	if (!writer || writer->encoder || isRawImagePath(imagePath)) return 1;
+
+	writer->w = w;
+	writer->h = h;
+	writer->rowsWritten = 0;
+	writer->encoder = new TiffStripEncoder();
+
+	if (writer->encoder->open(imagePath, w, h, imageCompression()) != 0)
+	{
+		delete writer->encoder;
+		writer->encoder = nullptr;
+		return 1;
+	}
+	return 0;
+}
+
+int writeImageRows(ImageRowWriter* writer, const int rows, const bgr8 *buffer)
+{
+	if (!writer || !writer->encoder || !buffer) return 1;
+
+	TraceSpan span("encode rows");
+
+	// complete strips are compressed in parallel and appended below the rows already written
+	int result = writer->encoder->writeRows(rows, reinterpret_cast<const unsigned char*>(buffer));
+
+	if (result == 0)
+		writer->rowsWritten += rows;
+
+	return result;
+}
+
+int closeImageWriter(ImageRowWriter* writer)
+{
+	if (!writer || !writer->encoder) return 1;
+
+	int result = writer->encoder->close();
+
+	// release resources
+	delete writer->encoder;
+	writer->encoder = nullptr;
+	return result;
+}
+
+#ifdef _WIN32
 // Load and return an IWICBitmap interface representing the image loaded from path.  
 // No format conversion is done here - this is left to the caller so each delegate 
 // can apply the loaded image data as needed.
@@ -258,6 +422,28 @@ HRESULT loadWICBitmap(const std::wstring& imagePath, IWICBitmap **bitmap)
 	// validate image buffer parameter
 	if (!bitmap) return E_FAIL;
 
+	*bitmap = NULL;
+
+	IWICFormatConverter		*formatConverter = NULL;
+
+	HRESULT hr = loadWICSource(imagePath, &formatConverter);
+
+	// convert and create bitmap from converter
+	if (SUCCEEDED(hr))
+		hr = getWICFactory()->CreateBitmapFromSource(formatConverter, WICBitmapCacheOnDemand, bitmap);
+
+	// cleanup
+	SafeRelease(&formatConverter);
+	return hr;
+}
+
+// Open the image at path and return a format converter that produces 32bpp PBGRA pixels on 
+// demand.  Nothing is decoded until the caller copies pixels out of the converter.
+HRESULT loadWICSource(const std::wstring& imagePath, IWICFormatConverter **source)
+{
+	// validate source parameter
+	if (!source) return E_FAIL;
+
 	HRESULT		hr;
 
 	// get and validate WIC factory
@@ -269,7 +455,7 @@ HRESULT loadWICBitmap(const std::wstring& imagePath, IWICBitmap **bitmap)
 	IWICBitmapFrameDecode	*imageFrame = NULL;
 	IWICFormatConverter		*formatConverter = NULL;
 
-	*bitmap = NULL;
+	*source = NULL;
 
 	// create image decoder
 	hr = wicFactory->CreateDecoderFromFilename(
@@ -317,9 +503,12 @@ HRESULT loadWICBitmap(const std::wstring& imagePath, IWICBitmap **bitmap)
 										 );
 	}
 
-	// convert and create bitmap from converter
+	// the converter keeps its own reference to the frame
 	if (SUCCEEDED(hr))
-		hr = wicFactory->CreateBitmapFromSource(formatConverter, WICBitmapCacheOnDemand, bitmap);
+	{
+		*source = formatConverter;
+		formatConverter = NULL;
+	}
 
 	// cleanup
 	SafeRelease(&formatConverter);
@@ -373,35 +562,36 @@ HRESULT getWICFormatConverter(IWICFormatConverter **formatConverter)
 	else
 		return wicFactory->CreateFormatConverter(formatConverter);
 }
-
-bgr8 *convertFloatImageToBGR8Image(const int w, const int h, const float *image)
+#else
+HRESULT initCOM(void)
 {
-	// first find the largest absolute value in image (assume no negative values)
-	float maxValue = 0.0f;
-	const float *ptr = image;
-
-	for (int i = 0; i<h; i++)
-		for (int j = 0; j<w; j++, ptr++)
-			maxValue = (fabs(*ptr) > maxValue) ? fabs(*ptr) : maxValue;
+	return 0;
+}
 
-	// determine semi-positive status of image
-	bool P = isSemiPositive<float>(w, h, image);
+void shutdownCOM(void)
+{
+}
+#endif
 
+bgr8 *convertFloatImageToBGR8Image(const int w, const int h, const float *image)
+{
 	// create new BGR8 image
 	bgr8 *newImage = static_cast<bgr8*>(malloc(w * h * sizeof(bgr8)));
 
+	// store normalised floats in [0, 255] range - the range and sign come from a single scan
 	if (newImage)
 	{
-		// store normalised floats in [0, 255] range
-		ptr = image;
-		bgr8 *bgrPtr = newImage;
-
-		for (int i = 0; i<h; i++)
-			for (int j = 0; j<w; j++, ptr++, bgrPtr++)
-				if (P) // semi-positive image
-					*bgrPtr = bgr8(BYTE((*ptr / maxValue) * 255.0f));
-				else
-					*bgrPtr = bgr8(BYTE((*ptr / maxValue + 1.0f) / 2.0f * 255.0f));
+		TraceSpan span("float to grey BGR8", "convert");
+		convertFloatToGreyBGR8(w, h, image, reinterpret_cast<unsigned char*>(newImage));
 	}
+
 	return newImage;
-}
\ No newline at end of file
+}
+
+static bool isPNGPath(const std::wstring& imagePath)
+{
+	std::wstring ext = std::filesystem::path(imagePath).extension().wstring();
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+
+	return ext == L".png";
+}
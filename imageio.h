@@ -1,13 +1,23 @@
 //
-// imageio is a simple library to load and save image buffers using WIC
+// imageio is a simple library to load and save image buffers.  Images are decoded with WIC 
+// (Windows only) and encoded with the portable parallel TIFF / PNG encoder in image_encoder.h
 //
 #ifndef _IMAGE_IO_
 #define _IMAGE_IO_
 
+#ifdef _WIN32
 #include <windows.h>
 #include <wincodec.h>
+#else
+typedef unsigned char	BYTE;
+typedef long			HRESULT;
+
+struct IWICFormatConverter;
+#endif
+
 #include <vector>
 #include <string>
+#include <functional>
 
 struct bgr8
 {
@@ -52,6 +62,12 @@ struct CPBitmapImage
 {
 	int			w, h;
 	BGRA8		*buffer;
+
+	CPBitmapImage(void)
+	{
+		w = h = 0;
+		buffer = nullptr;
+	}
 };
 
 // store a BGRA8 image as floating point values in the range [0, 1].  Each channel 
@@ -84,19 +100,83 @@ bool isSemiPositive(const int w, const int h, const T* image)
 }
 
 
+// Decoding needs WIC - on other platforms the load functions and openImageReader return failure 
+// (raw .cpfi images, see rawimage.h, work everywhere)
+
 // load a bitmap image using WIC and return the RGBA channels as floating point arrays in *result
 int loadImage(const std::wstring& imagePath, CPFloatImage* result);
 
+// load a bitmap image using WIC and return the raw 32bpp BGRA pixels in *result without any 
+// format conversion.  The caller owns result->buffer and should release it with free()
+int loadImage(const std::wstring& imagePath, CPBitmapImage* result);
+
+// load a bitmap image using WIC and decode its 32bpp BGRA pixels directly into the buffer 
+// returned by allocate(w, h), which must hold w * h pixels.  Lets the caller decode straight 
+// into mapped device-visible memory.  Returns non-zero on failure, including allocate returning 
+// nullptr
+int loadImage(const std::wstring& imagePath, const std::function<BGRA8*(int w, int h)>& allocate, int* w, int* h);
+
+// Row band access for images too large to hold in memory.  The decoder stays open and each 
+// readImageRows call converts just the requested rows to 32bpp BGRA.  Decoders such as JPEG 
+// stream top to bottom, so bands should be read in order (overlapping halo rows are fine)
+struct ImageRowReader
+{
+	int						w, h;
+	IWICFormatConverter		*source;
+
+	ImageRowReader(void)
+	{
+		w = h = 0;
+		source = NULL;
+	}
+};
+
+// open imagePath and set reader->w and reader->h.  Returns non-zero on failure
+int openImageReader(const std::wstring& imagePath, ImageRowReader* reader);
+
+// decode rows [y, y + rows) into buffer, which must hold reader->w * rows pixels
+int readImageRows(ImageRowReader* reader, int y, int rows, BGRA8* buffer);
+
+void closeImageReader(ImageRowReader* reader);
+
+class TiffStripEncoder;
+
+// Incremental bgr8 TIFF encoding - rows are appended top to bottom so only the rows being 
+// written (and at most one partial strip) need to be in memory
+struct ImageRowWriter
+{
+	int						w, h, rowsWritten;
+	TiffStripEncoder		*encoder;
+
+	ImageRowWriter(void)
+	{
+		w = h = rowsWritten = 0;
+		encoder = nullptr;
+	}
+};
+
+// create imagePath for a w x h image, compressed as set by setImageCompression.  Returns 
+// non-zero on failure - .cpfi paths always fail, the rows are 8-bit
+int openImageWriter(const std::wstring& imagePath, const int w, const int h, ImageRowWriter* writer);
+
+// append rows rows of w pixels from buffer
+int writeImageRows(ImageRowWriter* writer, const int rows, const bgr8 *buffer);
+
+// finish the file (which fails unless all h rows were written) and release the encoder
+int closeImageWriter(ImageRowWriter* writer);
+
 // save a 1D std::vector float array to the image file specified in imagePath
 int saveImage(const int w, const std::vector<float>& image, const std::wstring& imagePath);
 
 // save a raw 2D float image to disk that is w pixels wide and h pixel high
 int saveImage(const int w, const int h, const float *floatImage, const std::wstring& imagePath);
 
-// save a bgr8 image to disk that is w pixels wide and h pixel high
+// save a bgr8 image to disk that is w pixels wide and h pixel high - as a PNG if imagePath 
+// ends .png, otherwise as a TIFF.  .cpfi paths are refused
 int saveImage(const int w, const int h, bgr8 *buffer, const std::wstring& imagePath);
 
-// Save (assumed) UNORM float image stored as colour planes as a bgr8 image.
+// Save (assumed) UNORM float image stored as colour planes as a bgr8 image, or as the planes 
+// themselves if imagePath ends .cpfi
 int saveImage(
 			  const int w,
 			  const int h,
@@ -106,7 +186,7 @@ int saveImage(
 			  const std::wstring& imagePath
 			  );
 
-// Initialise COM so we can access WIC functionality
+// Initialise COM so we can access WIC functionality (does nothing on other platforms)
 HRESULT initCOM(void);
 
 // Shutdown COM when done
@@ -0,0 +1,221 @@
+//
+// Specialised kernel variants - see kernel_variants.h
+//
+#include <cstdio>
+#include <algorithm>
+#include "kernel_variants.h"
+#include "setup_cl.h"
+
+// the request counts are only a heuristic, so forget them all rather than grow without bound
+static const size_t maxTrackedRequests = 1024;
+
+
+//
+// Public function implementation
+//
+KernelVariantCache::KernelVariantCache(cl_context context, cl_device_id device, const std::string& kernelFile,
+									   cl_program generic, const std::string& baseOptions, int repeatThreshold, size_t capacity)
+	: clContext(context), clDevice(device), clGeneric(generic), kernelFile(kernelFile), sourceHash(0), 
+	  baseOptions(baseOptions), repeatThreshold(repeatThreshold), capacity(capacity), counters()
+{
+	if (clGeneric) clRetainProgram(clGeneric);
+
+	// the source does not change while the cache is in use, so the disk cache lookups for new
+	// keys only hash the options
+	sourceHashed = hashProgramSource(kernelFile.c_str(), &sourceHash);
+}
+
+KernelVariantCache::~KernelVariantCache(void)
+{
+	// kernels handed out keep their own programs alive
+	for (Variant& variant : variants)
+		if (variant.program) clReleaseProgram(variant.program);
+
+	if (clGeneric) clReleaseProgram(clGeneric);
+}
+
+cl_kernel KernelVariantCache::selectKernel(cl_kernel current, const char* kernelName, int w, int h, float L, int uses,
+										  bool* specialised)
+{
+	std::string buildOptions;
+	cl_program program;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		program = findProgram(w, h, L, uses, &buildOptions);
+	}
+
+	// the compile runs without the lock - meanwhile other callers get the generic program
+	if (!buildOptions.empty())
+		program = buildVariant(buildOptions);
+
+	// program is retained, so evicting it from the cache on another thread cannot free it
+	// before the kernel is created
+	cl_program retained = program;
+	cl_program currentProgram = nullptr;
+
+	if (current)
+		clGetKernelInfo(current, CL_KERNEL_PROGRAM, sizeof(cl_program), &currentProgram, 0);
+
+	cl_kernel kernel = current;
+
+	if (!current || currentProgram != program)
+	{
+		kernel = clCreateKernel(program, kernelName, 0);
+
+		// a variant that built but lacks the kernel falls back like a failed build
+		if (!kernel && program != clGeneric)
+		{
+			program = clGeneric;
+			kernel = (currentProgram == clGeneric) ? current : clCreateKernel(clGeneric, kernelName, 0);
+		}
+
+		if (current && kernel != current) clReleaseKernel(current);
+	}
+
+	clReleaseProgram(retained);
+
+	if (kernel)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (program == clGeneric)
+			counters.generic++;
+		else
+			counters.specialised++;
+	}
+
+	if (specialised) *specialised = kernel && (program != clGeneric);
+
+	return kernel;
+}
+
+KernelVariantStats KernelVariantCache::stats(void) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+std::string KernelVariantCache::variantOptions(int w, int h, float L)
+{
+	// the scale is written with enough digits to round trip and an f suffix so the kernels see
+	// exactly the float the host would have passed
+	char options[128];
+	snprintf(options, sizeof(options), "-D IMAGE_WIDTH=%d -D IMAGE_HEIGHT=%d -D LUMINANCE_SCALE=%.9ef", w, h, L);
+
+	return options;
+}
+
+
+//
+// Private function implementation
+//
+
+// The program for (w, h, L), retained for the caller - the variant if it is built, the generic
+// program otherwise.  If the variant is now worth building, a placeholder is added, its options
+// are returned in buildOptions and the result is null - the caller builds it with buildVariant.
+// Called with the lock held
+cl_program KernelVariantCache::findProgram(int w, int h, float L, int uses, std::string* buildOptions)
+{
+	std::string options = variantOptions(w, h, L);
+
+	if (!baseOptions.empty())
+		options = baseOptions + " " + options;
+
+	for (auto i = variants.begin(); i != variants.end(); ++i)
+	{
+		if (i->options == options)
+		{
+			variants.splice(variants.begin(), variants, i);
+
+			cl_program program = i->program ? i->program : clGeneric;
+			clRetainProgram(program);
+			return program;
+		}
+	}
+
+	// clamped so a caller announcing a very long run cannot overflow the count
+	int& count = requests[options];
+
+	count = (std::max(uses, 1) >= repeatThreshold - count) ? repeatThreshold : count + std::max(uses, 1);
+
+	if (count < repeatThreshold && !(sourceHashed && isProgramCached(clDevice, sourceHash, options.c_str())))
+	{
+		if (requests.size() > maxTrackedRequests)
+			requests.clear();
+
+		clRetainProgram(clGeneric);
+		return clGeneric;
+	}
+
+	requests.erase(options);
+
+	Variant variant;
+
+	variant.options  = options;
+	variant.program  = nullptr;
+	variant.building = true;
+
+	variants.push_front(variant);
+	trimVariants();
+
+	*buildOptions = options;
+	return nullptr;
+}
+
+// Build the variant findProgram asked for and store it in its entry.  Called without the lock,
+// returns the program to use retained
+cl_program KernelVariantCache::buildVariant(const std::string& options)
+{
+	cl_program program = createProgram(clContext, clDevice, kernelFile.c_str(), options.c_str());
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (program)
+		counters.built++;
+	else
+		counters.failed++;
+
+	auto i = std::find_if(variants.begin(), variants.end(), [&](const Variant& v) { return v.options == options; });
+
+	// evicted while building - put it back, it has just been used
+	if (i == variants.end())
+	{
+		Variant variant;
+
+		variant.options  = options;
+		variant.program  = nullptr;
+		variant.building = true;
+
+		variants.push_front(variant);
+		i = variants.begin();
+	}
+
+	if (!i->building && i->program)
+	{
+		// another caller built the same key after an eviction and finished first
+		if (program) clReleaseProgram(program);
+	}
+	else
+	{
+		i->program  = program;
+		i->building = false;
+	}
+
+	cl_program result = i->program ? i->program : clGeneric;
+	clRetainProgram(result);
+
+	trimVariants();
+
+	return result;
+}
+
+// Drop the least recently used variants beyond the capacity.  Called with the lock held
+void KernelVariantCache::trimVariants(void)
+{
+	while (variants.size() > capacity && variants.size() > 1)
+	{
+		if (variants.back().program) clReleaseProgram(variants.back().program);
+		variants.pop_back();
+	}
+}
@@ -0,0 +1,94 @@
+//
+// Compile-time specialised kernel variants.  A variant is HelloWorld.cl built with the image
+// size and luminance scale as -D constants (IMAGE_WIDTH, IMAGE_HEIGHT, LUMINANCE_SCALE), so the
+// per-pixel colour kernels bounds check, index and scale with folded constants.  The colour
+// matrix coefficients are literals in the kernels and the channel counts are fixed by their
+// signatures, so those are constant in every build already.
+//
+// KernelVariantCache builds a variant for a (w, h, L) key once the key has been asked for
+// repeatThreshold times, or at once if createProgram's on-disk binary cache already holds it -
+// until then the generic program is used, so a one-off size never pays for a compile.  The
+// build runs outside the cache lock, and other callers keep getting generic kernels for the
+// key until it is done.  Built variants are kept in memory up to a capacity (least recently
+// used first out) and on disk through the program binary cache, so later runs load them
+// without compiling.
+//
+#ifndef _KERNEL_VARIANTS_
+#define _KERNEL_VARIANTS_
+
+#include <CL/opencl.h>
+#include <cstdint>
+#include <string>
+#include <list>
+#include <map>
+#include <mutex>
+
+struct KernelVariantStats
+{
+	unsigned int	specialised;	// kernels handed out from a specialised variant
+	unsigned int	generic;		// kernels handed out from the generic program
+	unsigned int	built;			// variants created, from source or the disk cache
+	unsigned int	failed;			// variants that did not build - their keys stay generic
+};
+
+class KernelVariantCache
+{
+public:
+
+	// generic is the program built from kernelFile with baseOptions (storage mode, build
+	// profile) - it is retained, and every variant is built with baseOptions too
+	KernelVariantCache(cl_context context, cl_device_id device, const std::string& kernelFile, cl_program generic,
+					   const std::string& baseOptions = std::string(), int repeatThreshold = 2, size_t capacity = 8);
+	~KernelVariantCache(void);
+
+	KernelVariantCache(const KernelVariantCache&) = delete;
+	KernelVariantCache& operator=(const KernelVariantCache&) = delete;
+
+	bool valid(void) const { return clGeneric != nullptr; }
+
+	// Return a kernelName kernel for uses images of w x h with luminance scale L - callers that
+	// know more images of the same key follow (a stream) pass their number so the variant is
+	// built straight away.  current (which may be null) is returned unchanged if it already
+	// comes from the right program, otherwise it is released and a kernel from the right
+	// program is created, so a caller that keeps one kernel per slot or thread only pays for
+	// clCreateKernel when the key changes.  Returns null if no kernel could be created.  Safe to
+	// call from any number of threads - the caller that triggers a variant build waits for it,
+	// the others are not held up
+	cl_kernel selectKernel(cl_kernel current, const char* kernelName, int w, int h, float L, int uses = 1,
+						   bool* specialised = nullptr);
+
+	KernelVariantStats stats(void) const;
+
+	// The -D options a variant for (w, h, L) adds to the base options
+	static std::string variantOptions(int w, int h, float L);
+
+private:
+
+	struct Variant
+	{
+		std::string		options;
+		cl_program		program;		// null if the build failed or is still running
+		bool			building;
+	};
+
+	cl_program findProgram(int w, int h, float L, int uses, std::string* buildOptions);
+	cl_program buildVariant(const std::string& options);
+	void trimVariants(void);
+
+	cl_context					clContext;
+	cl_device_id				clDevice;
+	cl_program					clGeneric;
+	std::string					kernelFile;
+	uint64_t					sourceHash;		// of kernelFile, for isProgramCached
+	bool						sourceHashed;
+	std::string					baseOptions;
+	int							repeatThreshold;
+	size_t						capacity;
+
+	std::list<Variant>			variants;		// most recently used first
+	std::map<std::string, int>	requests;		// uses each unbuilt key has been asked for
+	KernelVariantStats			counters;
+	mutable std::mutex			lock;
+};
+
+#endif
@@ -1,21 +1,1359 @@
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <chrono>
+#include <filesystem>
 #include "setup_cl.h"
 #include "imageio.h"
+#include "cpu_pipeline.h"
+#include "batch.h"
+#include "multi_device.h"
+#include "transfer.h"
+#include "autotune.h"
+#include "storage.h"
+#include "tonemap.h"
+#include "convolution.h"
+#include "tiled.h"
+#include "rawimage.h"
+#include "image_encoder.h"
+#include "image_pipeline.h"
+#include "daemon.h"
+#include "image_objects.h"
+#include "stream.h"
+#include "roi.h"
+#include "precision.h"
+#include "kernel_variants.h"
+#include "trace_cl.h"
 
-int main(void)
+
+// Settings for the planar float pipelines
+struct PlanarOptions
+{
+	bool				staged;				// RGB_XYY, XYY_XYZ, XYY_L rather than RGB_XYY_RGB
+	StorageMode			storage;			// intermediate and output buffer format
+	float				luminanceScale;
+	ToneMapMode			toneMap;			// replaces the fixed scale of XYY_XYZ (staged only)
+	float				toneMapKey;
+	ConvolutionMode		convolution;		// applied to the luminance plane (staged only)
+	int					convolutionRadius;
+	float				sharpenAmount;
+};
+
+// Run either the fused or the staged pipeline on the float planes in F and read the result 
+// back as float planes.  The intermediate and output buffers use the storage mode program 
+// was built for, so each stage moves storageElementSize(options.storage) bytes per value.  
+// With a tone mapping mode the staged pipeline replaces the fixed luminance scale of XYY_XYZ 
+// with the device side statistics and XYZ_XYY_TONEMAP run by toneMapper, which the caller 
+// creates once from program and keeps across runs (the statistics are printed when 
+// reportStats is set), and with a convolution mode the luminance plane is blurred or 
+// sharpened before XYY_L
+static cl_int runPlanarKernels(cl_context context, cl_command_queue commandQueue, cl_program program, 
+							   const PlanarOptions& options, LuminanceToneMapper* toneMapper, bool reportStats, 
+							   const CPFloatImage& F, bool inputMapped, float* redOut, float* greenOut, float* blueOut, 
+							   double* kernelSeconds)
+{
+	StorageMode storageMode = options.storage;
+	float luminanceScale    = options.luminanceScale;
+
+	size_t storageSize = F.w * F.h * storageElementSize(storageMode);
+
+	// Setup input image as read only (appears as const parameter in the kernel).  Planes 
+	// mapped from a .cpfi file are page aligned and used in place
+	cl_mem_flags inputFlags = CL_MEM_READ_ONLY | (inputMapped ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR);
+
+	cl_mem inputBufferRed  = clCreateBuffer(context, inputFlags,
+										    F.w * F.h * sizeof(float), F.redChannel, 0);
+
+	cl_mem inputBufferGreen = clCreateBuffer(context, inputFlags,
+											 F.w * F.h * sizeof(float), F.greenChannel, 0);
+
+	cl_mem inputBufferBlue  = clCreateBuffer(context, inputFlags, 
+											 F.w * F.h * sizeof(float), F.blueChannel, 0);
+	// ------------------------------------------------------------------------------
+
+	// Setup buffer to store the output image (again don't need to provide data 
+	// - we fill the buffer from the kernels)
+	cl_mem outputBufferRed   = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+	cl_mem outputBufferGreen = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+	cl_mem outputBufferBlue  = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+
+	cl_event firstEvent = nullptr, lastEvent = nullptr;
+	cl_int err;
+
+	SeparableConvolution* convolution = nullptr;
+
+	if (options.staged)
+	{
+		// The staged pipeline needs a second set of intermediate buffers
+		cl_mem outputBufferRedOne   = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+		cl_mem outputBufferGreenOne = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+		cl_mem outputBufferBlueOne  = clCreateBuffer(context, CL_MEM_READ_WRITE, storageSize, 0, 0);
+
+		// Get the relevant kernel from the program object
+		cl_kernel xyyImageKernel   = clCreateKernel(program, "RGB_XYY", 0);
+		cl_kernel xyzImageKernel   = clCreateKernel(program, "XYY_XYZ", 0);
+		cl_kernel xyy_LImageKernel = clCreateKernel(program, "XYY_L", 0);
+
+		// Set kernel arguements - note the width is passed by reference to the image 
+		// structure variable
+		clSetKernelArg(xyyImageKernel, 0, sizeof(cl_mem), &inputBufferRed);
+		clSetKernelArg(xyyImageKernel, 1, sizeof(cl_mem), &inputBufferGreen);
+		clSetKernelArg(xyyImageKernel, 2, sizeof(cl_mem), &inputBufferBlue);
+		clSetKernelArg(xyyImageKernel, 3, sizeof(cl_mem), &outputBufferRed);
+		clSetKernelArg(xyyImageKernel, 4, sizeof(cl_mem), &outputBufferGreen);
+		clSetKernelArg(xyyImageKernel, 5, sizeof(cl_mem), &outputBufferBlue);
+		clSetKernelArg(xyyImageKernel, 6, sizeof(cl_int), &F.w);
+		clSetKernelArg(xyyImageKernel, 7, sizeof(cl_int), &F.h);
+
+		clSetKernelArg(xyzImageKernel, 0, sizeof(cl_mem), &outputBufferRed);
+		clSetKernelArg(xyzImageKernel, 1, sizeof(cl_mem), &outputBufferGreen);
+		clSetKernelArg(xyzImageKernel, 2, sizeof(cl_mem), &outputBufferBlue);
+		clSetKernelArg(xyzImageKernel, 3, sizeof(cl_mem), &outputBufferRedOne);
+		clSetKernelArg(xyzImageKernel, 4, sizeof(cl_mem), &outputBufferGreenOne);
+		clSetKernelArg(xyzImageKernel, 5, sizeof(cl_mem), &outputBufferBlueOne);
+		clSetKernelArg(xyzImageKernel, 6, sizeof(cl_int), &F.w);
+		clSetKernelArg(xyzImageKernel, 7, sizeof(cl_int), &F.h);
+		clSetKernelArg(xyzImageKernel, 8, sizeof(cl_float), &luminanceScale);
+
+		clSetKernelArg(xyy_LImageKernel, 0, sizeof(cl_mem), &outputBufferRedOne);
+		clSetKernelArg(xyy_LImageKernel, 1, sizeof(cl_mem), &outputBufferGreenOne);
+		clSetKernelArg(xyy_LImageKernel, 2, sizeof(cl_mem), &outputBufferBlueOne);
+		clSetKernelArg(xyy_LImageKernel, 3, sizeof(cl_mem), &outputBufferRed);
+		clSetKernelArg(xyy_LImageKernel, 4, sizeof(cl_mem), &outputBufferGreen);
+		clSetKernelArg(xyy_LImageKernel, 5, sizeof(cl_mem), &outputBufferBlue);
+		clSetKernelArg(xyy_LImageKernel, 6, sizeof(cl_int), &F.w);
+		clSetKernelArg(xyy_LImageKernel, 7, sizeof(cl_int), &F.h);
+
+		// Pick the local work size for each kernel before the real run - tuning times copies of
+		// the kernels on scratch buffers, so the arguments set above are left alone
+		WorkGroupTuner& tuner = WorkGroupTuner::shared();
+
+		WorkGroupSize xyyLocal   = tuner.select(commandQueue, xyyImageKernel, F.w, F.h);
+		WorkGroupSize xyzLocal   = tuner.select(commandQueue, xyzImageKernel, F.w, F.h);
+		WorkGroupSize xyy_LLocal = tuner.select(commandQueue, xyy_LImageKernel, F.w, F.h);
+
+		cl_event xyzEvent = nullptr;
+
+		err = enqueueImageKernel(commandQueue, xyyImageKernel, F.w, F.h, xyyLocal, 0, 0, &firstEvent);
+
+		// each stage is only enqueued if everything before it was
+		if (err == CL_SUCCESS && options.toneMap != TONEMAP_NONE)
+		{
+			if (toneMapper && toneMapper->valid())
+				err = toneMapper->enqueue(commandQueue, outputBufferRed, outputBufferGreen, outputBufferBlue, 
+										  outputBufferRedOne, outputBufferGreenOne, outputBufferBlueOne, 
+										  F.w, F.h, options.toneMap, options.toneMapKey, 1, &firstEvent, &xyzEvent);
+			else
+				err = CL_INVALID_KERNEL;
+		}
+		else if (err == CL_SUCCESS)
+			err = enqueueImageKernel(commandQueue, xyzImageKernel, F.w, F.h, xyzLocal, 1, &firstEvent, &xyzEvent); 
+
+		if (err == CL_SUCCESS && options.convolution != CONVOLVE_NONE)
+		{
+			// the XYZ planes are free until XYY_L writes its result, so they serve as scratch
+			convolution = new SeparableConvolution(context, program, options.convolutionRadius);
+
+			cl_event convolutionEvent;
+
+			err = convolution->enqueue(commandQueue, outputBufferBlueOne, outputBufferRed, outputBufferGreen, F.w, F.h, 
+									   options.convolution, options.sharpenAmount, 1, &xyzEvent, &convolutionEvent);
+
+			if (err == CL_SUCCESS)
+			{
+				clReleaseEvent(xyzEvent);
+				xyzEvent = convolutionEvent;
+			}
+		}
+	
+		if (err == CL_SUCCESS)
+			err = enqueueImageKernel(commandQueue, xyy_LImageKernel, F.w, F.h, xyy_LLocal, 1, &xyzEvent, &lastEvent);
+
+		// The runtime keeps these alive until the enqueued kernels have finished with them
+		clReleaseKernel(xyyImageKernel);
+		clReleaseKernel(xyzImageKernel);
+		clReleaseKernel(xyy_LImageKernel);
+		clReleaseMemObject(outputBufferRedOne);
+		clReleaseMemObject(outputBufferGreenOne);
+		clReleaseMemObject(outputBufferBlueOne);
+
+		if (xyzEvent) clReleaseEvent(xyzEvent);
+	}
+	else
+	{
+		// Fused pipeline - one pass from the input planes straight to the output planes
+		cl_kernel fusedImageKernel = clCreateKernel(program, "RGB_XYY_RGB", 0);
+
+		clSetKernelArg(fusedImageKernel, 0, sizeof(cl_mem), &inputBufferRed);
+		clSetKernelArg(fusedImageKernel, 1, sizeof(cl_mem), &inputBufferGreen);
+		clSetKernelArg(fusedImageKernel, 2, sizeof(cl_mem), &inputBufferBlue);
+		clSetKernelArg(fusedImageKernel, 3, sizeof(cl_mem), &outputBufferRed);
+		clSetKernelArg(fusedImageKernel, 4, sizeof(cl_mem), &outputBufferGreen);
+		clSetKernelArg(fusedImageKernel, 5, sizeof(cl_mem), &outputBufferBlue);
+		clSetKernelArg(fusedImageKernel, 6, sizeof(cl_int), &F.w);
+		clSetKernelArg(fusedImageKernel, 7, sizeof(cl_int), &F.h);
+		clSetKernelArg(fusedImageKernel, 8, sizeof(cl_float), &luminanceScale);
+
+		WorkGroupSize fusedLocal = WorkGroupTuner::shared().select(commandQueue, fusedImageKernel, F.w, F.h);
+
+		err = enqueueImageKernel(commandQueue, fusedImageKernel, F.w, F.h, fusedLocal, 0, 0, &firstEvent);
+
+		clReleaseKernel(fusedImageKernel);
+
+		if (err == CL_SUCCESS)
+		{
+			lastEvent = firstEvent;
+			clRetainEvent(lastEvent);
+		}
+	}
+
+	// Synchronisation point - after a failure wait for whatever was enqueued before it
+	if (err == CL_SUCCESS)
+		clWaitForEvents(1, &lastEvent);
+	else
+		clFinish(commandQueue);
+
+	*kernelSeconds = (err == CL_SUCCESS) ? eventSeconds(firstEvent, lastEvent) : 0.0;
+
+	LuminanceStats stats;
+
+	if (err == CL_SUCCESS && options.staged && options.toneMap != TONEMAP_NONE && toneMapper && reportStats && 
+		toneMapper->readStats(commandQueue, &stats))
+		std::cout << "Luminance min = " << stats.minimum << ", max = " << stats.maximum << ", mean = " 
+				  << stats.mean << ", log average = " << stats.logAverage << std::endl;
+
+	delete convolution;
+
+	// Get results, converting back to float when the planes are stored in 16 bits
+	void* stored = (storageMode == STORAGE_FLOAT) ? nullptr : malloc(storageSize);
+
+	cl_mem outputBuffers[3] = { outputBufferRed, outputBufferGreen, outputBufferBlue };
+	float* outputPlanes[3]  = { redOut, greenOut, blueOut };
+
+	for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+	{
+		void* destination = stored ? stored : outputPlanes[i];
+
+		err = traceCommand("download plane", commandQueue, 0, [&](cl_event* event)
+		{
+			return clEnqueueReadBuffer(commandQueue, outputBuffers[i], CL_TRUE, 0, storageSize, destination, 0, 0, event);
+		});
+
+		if (stored && err == CL_SUCCESS)
+			storageToFloat(storageMode, stored, outputPlanes[i], F.w * F.h);
+	}
+
+	if (firstEvent) clReleaseEvent(firstEvent);
+	if (lastEvent) clReleaseEvent(lastEvent);
+	clReleaseMemObject(inputBufferRed);
+	clReleaseMemObject(inputBufferGreen);
+	clReleaseMemObject(inputBufferBlue);
+	clReleaseMemObject(outputBufferRed);
+	clReleaseMemObject(outputBufferGreen);
+	clReleaseMemObject(outputBufferBlue);
+	free(stored);
+	return err;
+}
+
+// Largest difference between a plane and the float reference over the displayable range - 
+// both are clamped to [0, 1] as the 8-bit output is.  Pixels the reference leaves undefined 
+// (the staged pipeline gives NaN for black) are skipped
+static float maxPlaneError(const float* plane, const float* reference, size_t count)
+{
+	float maxError = 0.0f;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!std::isfinite(reference[i]))
+			continue;
+
+		float a = std::isfinite(plane[i]) ? std::min(std::max(plane[i], 0.0f), 1.0f) : 0.0f;
+		float b = std::min(std::max(reference[i], 0.0f), 1.0f);
+
+		maxError = std::max(maxError, std::fabs(a - b));
+	}
+	return maxError;
+}
+
+// Load the image as float planes, run either the fused or the staged pipeline and save the 
+// result.  .cpfi inputs and outputs are memory mapped - the input planes are used in place and 
+// the result is read back straight into the mapped output file.  With a 16-bit storage mode 
+// the float build in referenceProgram is run on the same image and the maximum error against 
+// it reported.  checkConvolution also compares the device convolution against the CPU 
+// reference on the green input plane
+static int runPlanarPipeline(cl_context context, cl_command_queue commandQueue, cl_program program, 
+							 cl_program referenceProgram, const PlanarOptions& options, bool checkConvolution, 
+							 const std::wstring& inputPath, const std::wstring& outputPath)
+{
+	CPFloatImage F;
+	MappedRawImage mappedInput, mappedOutput;
+
+	bool inputMapped  = isRawImagePath(inputPath);
+	bool outputMapped = isRawImagePath(outputPath);
+
+	// Use WIC to load image and extract RGBA channels as float buffers
+	if ((inputMapped ? mapRawImage(inputPath, &mappedInput) : loadImage(inputPath, &F)) != 0)
+	{
+		std::cout << "cannot load input image\n";
+		return 1;
+	}
+
+	if (inputMapped)
+		F = mappedInput.image;
+
+	if (outputMapped && createRawImage(outputPath, F.w, F.h, 3, &mappedOutput) != 0)
+	{
+		std::cout << "cannot create output image\n";
+		outputMapped = false;
+	}
+
+	// Setup buffers to store the result
+	float* redOut   = outputMapped ? mappedOutput.image.redChannel : static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+	float* greenOut = outputMapped ? mappedOutput.image.greenChannel : static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+	float* blueOut  = outputMapped ? mappedOutput.image.blueChannel : static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+
+	double kernelSeconds = 0.0;
+
+	// one tone mapper per program, kept for every run on it - its statistics buffers are read 
+	// after the run
+	LuminanceToneMapper* toneMapper = nullptr;
+	LuminanceToneMapper* referenceToneMapper = nullptr;
+
+	if (options.staged && options.toneMap != TONEMAP_NONE)
+	{
+		cl_device_id device;
+		clGetCommandQueueInfo(commandQueue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, 0);
+
+		toneMapper = new LuminanceToneMapper(context, device, program);
+
+		if (referenceProgram)
+			referenceToneMapper = new LuminanceToneMapper(context, device, referenceProgram);
+	}
+
+	cl_int err = runPlanarKernels(context, commandQueue, program, options, toneMapper, true, F, inputMapped, 
+								  redOut, greenOut, blueOut, &kernelSeconds);
+
+	if (err == CL_SUCCESS)
+		std::cout << "Time taken = " << kernelSeconds << std::endl;
+	else
+		std::cout << "planar pipeline failed with error " << err << std::endl;
+
+	if (err == CL_SUCCESS && options.storage != STORAGE_FLOAT && referenceProgram)
+	{
+		float* redRef   = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+		float* greenRef = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+		float* blueRef  = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+
+		double referenceSeconds = 0.0;
+
+		PlanarOptions referenceOptions = options;
+		referenceOptions.storage = STORAGE_FLOAT;
+
+		cl_int referenceErr = runPlanarKernels(context, commandQueue, referenceProgram, referenceOptions, referenceToneMapper, 
+											   false, F, inputMapped, redRef, greenRef, blueRef, &referenceSeconds);
+
+		if (referenceErr == CL_SUCCESS)
+		{
+			size_t count = F.w * F.h;
+			float  maxError = std::max(maxPlaneError(redOut, redRef, count), 
+									   std::max(maxPlaneError(greenOut, greenRef, count), maxPlaneError(blueOut, blueRef, count)));
+
+			std::cout << "Storage " << storageModeName(options.storage) << ": max error vs float = " << maxError 
+					  << " (" << (maxError * 255.0f) << " of 255), float time = " << referenceSeconds << std::endl;
+		}
+		else
+			std::cout << "float reference run failed with error " << referenceErr << std::endl;
+
+		free(redRef);
+		free(greenRef);
+		free(blueRef);
+	}
+
+	delete toneMapper;
+	delete referenceToneMapper;
+
+	if (err == CL_SUCCESS && checkConvolution && options.convolution != CONVOLVE_NONE)
+	{
+		// validate() needs the float build
+		SeparableConvolution convolution(context, referenceProgram ? referenceProgram : program, options.convolutionRadius);
+
+		float maxError = convolution.validate(context, commandQueue, F.w, F.h, F.greenChannel, 
+											  options.convolution, options.sharpenAmount);
+
+		if (maxError < 0.0f)
+			std::cout << "Convolution check failed to run\n";
+		else
+			std::cout << "Convolution " << convolutionModeName(options.convolution) << " radius " << convolution.radius() 
+					  << ": max error vs CPU reference = " << maxError << std::endl;
+	}
+
+	// a failed run leaves nothing worth saving - a mapped output keeps whatever was read back
+	int result = (err == CL_SUCCESS) ? 0 : 1;
+
+	if (outputMapped)
+		unmapRawImage(&mappedOutput);
+	else
+	{
+		if (err == CL_SUCCESS)
+			result = saveImage(F.w, F.h, redOut, greenOut, blueOut, outputPath);
+
+		free(redOut);
+		free(greenOut);
+		free(blueOut);
+	}
+
+	if (inputMapped)
+		unmapRawImage(&mappedInput);
+	else
+	{
+		free(F.redChannel);
+		free(F.greenChannel);
+		free(F.blueChannel);
+		free(F.alphaChannel);
+	}
+	return result;
+}
+
+// Load the image as packed BGRA8, run the fused pipeline on the packed data and save the 
+// packed BGR8 result directly - 4 bytes per pixel up and 3 bytes per pixel down
+static int runPackedPipeline(cl_context context, cl_device_id device, cl_program program, 
+							 float luminanceScale, const std::wstring& inputPath, const std::wstring& outputPath)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	CPBitmapImage I;
+
+	// Use WIC to load image without converting it
+	if (loadImage(inputPath, &I) != 0)
+	{
+		std::cout << "cannot load input image\n";
+		return 1;
+	}
+
+	// Get result - already in the layout saveImage expects
+	bgr8* imageOut = static_cast<bgr8*>(malloc(I.w * I.h * sizeof(bgr8)));
+
+	ImageParams params;
+	params.luminanceScale = luminanceScale;
+
+	// the same path a service embedding ImagePipeline takes, with a single request in flight
+	ImagePipelineConfig config;
+	config.lanes = 1;
+
+	ImagePipeline pipeline(context, device, program, config);
+
+	ImageResult processed = pipeline.submit(I, imageOut, params).get();
+
+	std::cout << "Time taken = " << processed.kernelSeconds << std::endl;
+
+	int result = (processed.status == CL_SUCCESS) ? saveImage(I.w, I.h, imageOut, outputPath) : 1;
+
+	std::cout << "Total time (decode to encode, copy) = " 
+			  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+
+	free(imageOut);
+	free(I.buffer);
+	return result;
+}
+
+// Packed pipeline without host side copies - the image is decoded straight into a mapped 
+// device visible input buffer and encoded straight from the mapped output buffer
+static int runMappedPackedPipeline(cl_context context, cl_command_queue commandQueue, cl_program program, 
+								   TransferMode transferMode, float luminanceScale, 
+								   const std::wstring& inputPath, const std::wstring& outputPath)
 {
-	// Initialise COM so we can export image data using WIC
+	auto start = std::chrono::steady_clock::now();
+
+	HostVisibleBuffer input  = { nullptr, nullptr, 0 };
+	HostVisibleBuffer output = { nullptr, nullptr, 0 };
+	void *inputMapped = nullptr;
+	int w = 0, h = 0;
+
+	// called by the decoder once the image size is known
+	auto allocateInput = [&](int width, int height) -> BGRA8*
+	{
+		input = createHostVisibleBuffer(context, CL_MEM_READ_ONLY, width * height * sizeof(BGRA8), transferMode);
+
+		if (!input.buffer) return nullptr;
+
+		traceCommand("map input", commandQueue, 0, [&](cl_event* event)
+		{
+			cl_int mapErr;
+			inputMapped = clEnqueueMapBuffer(commandQueue, input.buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, 
+											 input.size, 0, 0, event, &mapErr);
+			return mapErr;
+		});
+
+		return static_cast<BGRA8*>(inputMapped);
+	};
+
+	if (loadImage(inputPath, allocateInput, &w, &h) != 0)
+	{
+		std::cout << "cannot load input image\n";
+
+		if (inputMapped)
+			traceCommand("unmap input", commandQueue, 0, [&](cl_event* event)
+			{
+				return clEnqueueUnmapMemObject(commandQueue, input.buffer, inputMapped, 0, 0, event);
+			});
+
+		clFinish(commandQueue);
+		releaseHostVisibleBuffer(input);
+		return 1;
+	}
+
+	// hand the decoded pixels to the device - a no-op on devices that share host memory
+	traceCommand("unmap input", commandQueue, 0, [&](cl_event* event)
+	{
+		return clEnqueueUnmapMemObject(commandQueue, input.buffer, inputMapped, 0, 0, event);
+	});
+
+	output = createHostVisibleBuffer(context, CL_MEM_WRITE_ONLY, w * h * sizeof(bgr8), transferMode);
+
+	if (!output.buffer)
+	{
+		std::cout << "cannot create output buffer\n";
+		clFinish(commandQueue);
+		releaseHostVisibleBuffer(input);
+		return 1;
+	}
+
+	cl_kernel packedImageKernel = clCreateKernel(program, "BGRA8_XYY_BGR8", 0);
+
+	clSetKernelArg(packedImageKernel, 0, sizeof(cl_mem), &input.buffer);
+	clSetKernelArg(packedImageKernel, 1, sizeof(cl_mem), &output.buffer);
+	clSetKernelArg(packedImageKernel, 2, sizeof(cl_int), &w);
+	clSetKernelArg(packedImageKernel, 3, sizeof(cl_int), &h);
+	clSetKernelArg(packedImageKernel, 4, sizeof(cl_float), &luminanceScale);
+
+	WorkGroupSize packedLocal = WorkGroupTuner::shared().select(commandQueue, packedImageKernel, w, h);
+
+	cl_event packedEvent;
+
+	enqueueImageKernel(commandQueue, packedImageKernel, w, h, packedLocal, 0, 0, &packedEvent);
+
+	// map the result for reading once the kernel has finished
+	void *outputMapped = nullptr;
+
+	cl_int err = traceCommand("map output", commandQueue, 0, [&](cl_event* event)
+	{
+		cl_int mapErr;
+		outputMapped = clEnqueueMapBuffer(commandQueue, output.buffer, CL_TRUE, CL_MAP_READ, 0, output.size, 
+										  1, &packedEvent, event, &mapErr);
+		return mapErr;
+	});
+
+	std::cout << "Time taken = " << eventSeconds(packedEvent) << std::endl;
+
+	int result = 1;
+
+	if (outputMapped && err == CL_SUCCESS)
+	{
+		result = saveImage(w, h, static_cast<bgr8*>(outputMapped), outputPath);
+
+		traceCommand("unmap output", commandQueue, 0, [&](cl_event* event)
+		{
+			return clEnqueueUnmapMemObject(commandQueue, output.buffer, outputMapped, 0, 0, event);
+		});
+	}
+
+	clFinish(commandQueue);
+
+	std::cout << "Total time (decode to encode, " << transferModeName(transferMode) << ") = " 
+			  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+
+	clReleaseEvent(packedEvent);
+	clReleaseKernel(packedImageKernel);
+	releaseHostVisibleBuffer(input);
+	releaseHostVisibleBuffer(output);
+	return result;
+}
+
+// Packed pipeline on image objects - the decoded BGRA8 pixels go into an image2d of format 
+// and IMAGE_XYY_IMAGE reads and writes them through the texture path.  Falls back to the 
+// buffer version when the device has no image support for format
+static int runImageObjectPipeline(cl_context context, cl_device_id device, cl_command_queue commandQueue, cl_program program, 
+								  ImageObjectFormat format, float luminanceScale, 
+								  const std::wstring& inputPath, const std::wstring& outputPath)
+{
+	ImageObjectPipeline pipeline(context, device, program, format);
+
+	if (!pipeline.valid())
+	{
+		std::cout << "device has no " << imageObjectFormatName(format) << " image support - using buffers\n";
+		return runPackedPipeline(context, device, program, luminanceScale, inputPath, outputPath);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	CPBitmapImage I;
+
+	if (loadImage(inputPath, &I) != 0)
+	{
+		std::cout << "cannot load input image\n";
+		return 1;
+	}
+
+	bgr8* imageOut = static_cast<bgr8*>(malloc(I.w * I.h * sizeof(bgr8)));
+
+	double kernelSeconds = 0.0;
+	cl_int err = pipeline.process(commandQueue, I.buffer, I.w, I.h, luminanceScale, imageOut, &kernelSeconds);
+
+	std::cout << "Time taken = " << kernelSeconds << std::endl;
+
+	int result = (err == CL_SUCCESS) ? saveImage(I.w, I.h, imageOut, outputPath) : 1;
+
+	if (err != CL_SUCCESS)
+		std::cout << "image object pipeline failed with error " << err << std::endl;
+
+	std::cout << "Total time (decode to encode, " << imageObjectFormatName(format) << " images) = " 
+			  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+
+	free(imageOut);
+	free(I.buffer);
+	return result;
+}
+
+// Edit preview - process the whole image once with the resident RegionPipeline, then 
+// reprocess only rects as if the luminance scale had been changed to regionScale there, and 
+// compare the two latencies
+static int runRegionPipeline(cl_context context, cl_command_queue commandQueue, cl_program program, 
+							 const std::vector<ImageRect>& rects, float luminanceScale, float regionScale, 
+							 const std::wstring& inputPath, const std::wstring& outputPath)
+{
+	RegionPipeline pipeline(context, program);
+
+	if (!pipeline.valid())
+	{
+		std::cout << "region pipeline kernels not found\n";
+		return 1;
+	}
+
+	CPFloatImage F;
+
+	if (loadImage(inputPath, &F) != 0)
+	{
+		std::cout << "cannot load input image\n";
+		return 1;
+	}
+
+	size_t planeSize = static_cast<size_t>(F.w) * F.h * sizeof(float);
+
+	float* redOut   = static_cast<float*>(malloc(planeSize));
+	float* greenOut = static_cast<float*>(malloc(planeSize));
+	float* blueOut  = static_cast<float*>(malloc(planeSize));
+
+	RegionStats full, edit;
+
+	cl_int err = pipeline.load(commandQueue, F, luminanceScale, redOut, greenOut, blueOut, &full);
+
+	if (err == CL_SUCCESS)
+		err = pipeline.update(commandQueue, F, rects, regionScale, redOut, greenOut, blueOut, &edit);
+
+	int result = 1;
+
+	if (err == CL_SUCCESS)
+	{
+		std::cout << "Full image: " << full.pixels << " pixels, " << (full.bytesUploaded + full.bytesDownloaded) 
+				  << " bytes moved, " << full.seconds << " s\n";
+		std::cout << "Update (" << edit.rects << " rect(s)): " << edit.pixels << " pixels, " 
+				  << (edit.bytesUploaded + edit.bytesDownloaded) << " bytes moved, " << edit.seconds << " s\n";
+
+		result = saveImage(F.w, F.h, redOut, greenOut, blueOut, outputPath);
+	}
+	else
+		std::cout << "region pipeline failed with error " << err << std::endl;
+
+	free(redOut);
+	free(greenOut);
+	free(blueOut);
+
+	free(F.redChannel);
+	free(F.greenChannel);
+	free(F.blueChannel);
+	free(F.alphaChannel);
+	return result;
+}
+
+// Measure every build profile against the double precision reference on the synthetic 
+// corpus plus the input image, and recommend the fastest one within tolerance for each pipeline
+static int runProfileVerification(cl_context context, cl_device_id device, const std::string& kernelFile, 
+								  float luminanceScale, double tolerance, const std::wstring& inputPath)
+{
+	std::vector<ProfileTestImage> corpus = syntheticProfileCorpus();
+
+	CPFloatImage F;
+
+	if (loadImage(inputPath, &F) == 0)
+	{
+		ProfileTestImage input;
+		size_t count = static_cast<size_t>(F.w) * F.h;
+
+		input.name  = std::filesystem::path(inputPath).filename().string();
+		input.w     = F.w;
+		input.h     = F.h;
+		input.red   = std::vector<float>(F.redChannel, F.redChannel + count);
+		input.green = std::vector<float>(F.greenChannel, F.greenChannel + count);
+		input.blue  = std::vector<float>(F.blueChannel, F.blueChannel + count);
+
+		corpus.push_back(input);
+
+		free(F.redChannel);
+		free(F.greenChannel);
+		free(F.blueChannel);
+		free(F.alphaChannel);
+	}
+	else
+		std::cout << "cannot load input image - verifying on the synthetic images only\n";
+
+	std::cout << "Corpus:";
+
+	for (const ProfileTestImage& image : corpus)
+		std::cout << " " << image.name << " (" << image.w << "x" << image.h << ")";
+
+	std::cout << std::endl;
+
+	std::vector<ProfileAccuracy> results = verifyBuildProfiles(context, device, kernelFile.c_str(), corpus, luminanceScale);
+
+	for (const ProfileAccuracy& result : results)
+	{
+		std::cout << buildProfileName(result.profile) << (result.staged ? " staged: " : " fused: ");
+
+		if (!result.built)
+			std::cout << "failed to build or run\n";
+		else
+			std::cout << "max error = " << result.maxError << ", mean error = " << result.meanError 
+					  << ", PSNR = " << result.psnr << " dB, kernel time = " << result.kernelSeconds << std::endl;
+	}
+
+	int result = 0;
+
+	for (int staged = 0; staged < 2; ++staged)
+	{
+		int best = selectBuildProfile(results, staged != 0, tolerance);
+
+		std::cout << (staged ? "Staged" : "Fused") << " pipeline: ";
+
+		if (best < 0)
+		{
+			std::cout << "no profile within max error " << tolerance << std::endl;
+			result = 1;
+		}
+		else
+			std::cout << "fastest within max error " << tolerance << " is -profile " 
+					  << buildProfileName(results[best].profile) << std::endl;
+	}
+
+	return result;
+}
+
+// Host version of the convolution step of the staged pipeline.  luminance is the Y plane of 
+// the input before scaling - it is blurred or sharpened with the reference passes and each 
+// pixel of the scaled R, G, B planes is multiplied by filtered / original luminance, which is 
+// what XYY_L gives for the filtered luminance since the chromaticity is left unchanged
+static void cpuConvolveLuminance(int w, int h, const float* luminance, float* R, float* G, float* B, 
+								 ConvolutionMode mode, int radius, float amount)
+{
+	radius = std::min(std::max(radius, 1), maxConvolutionRadius);
+
+	std::vector<float> weights = gaussianWeights(radius);
+	std::vector<float> filtered(static_cast<size_t>(w) * h);
+
+	cpuSeparableConvolution(w, h, luminance, filtered.data(), weights.data(), radius);
+
+	if (mode == CONVOLVE_SHARPEN)
+		cpuUnsharpMask(w, h, luminance, filtered.data(), filtered.data(), amount);
+
+	for (size_t i = 0; i < filtered.size(); ++i)
+	{
+		float gain = (luminance[i] > 0.0f) ? filtered[i] / luminance[i] : 0.0f;
+
+		R[i] *= gain;
+		G[i] *= gain;
+		B[i] *= gain;
+	}
+}
+
+// Run the fused pipeline on the host with the native CPU backend - used when no OpenCL 
+// context is available or when -cpu is given.  A convolution mode runs on the luminance as 
+// the staged device pipeline does (planar only)
+static int runCPUPipeline(bool usePackedTransfer, float luminanceScale, ConvolutionMode convolution, 
+						  int convolutionRadius, float sharpenAmount, 
+						  const std::wstring& inputPath, const std::wstring& outputPath)
+{
+	std::cout << "Using CPU backend (" << cpuSimdLevelName(cpuDetectSimdLevel()) << ")\n";
+
+	int result;
+
+	if (usePackedTransfer)
+	{
+		CPBitmapImage I;
+
+		if (loadImage(inputPath, &I) != 0)
+		{
+			std::cout << "cannot load input image\n";
+			return 1;
+		}
+
+		bgr8* imageOut = static_cast<bgr8*>(malloc(I.w * I.h * sizeof(bgr8)));
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		cpuScaleLuminancePacked(I.w, I.h, reinterpret_cast<const unsigned char*>(I.buffer), 
+								reinterpret_cast<unsigned char*>(imageOut), luminanceScale);
+
+		auto t1 = std::chrono::steady_clock::now();
+
+		std::cout << "Time taken = " << std::chrono::duration<double>(t1 - t0).count() << std::endl;
+
+		result = saveImage(I.w, I.h, imageOut, outputPath);
+
+		free(imageOut);
+		free(I.buffer);
+	}
+	else
+	{
+		CPFloatImage F;
+		MappedRawImage mappedInput, mappedOutput;
+
+		// .cpfi files are mapped - the input copy-on-write, the output shared with the file
+		bool inputMapped  = isRawImagePath(inputPath);
+		bool outputMapped = isRawImagePath(outputPath);
+
+		if ((inputMapped ? mapRawImage(inputPath, &mappedInput) : loadImage(inputPath, &F)) != 0)
+		{
+			std::cout << "cannot load input image\n";
+			return 1;
+		}
+
+		if (inputMapped)
+			F = mappedInput.image;
+
+		// process in place unless the result goes straight into a mapped file
+		CPFloatImage out = F;
+
+		if (outputMapped && createRawImage(outputPath, F.w, F.h, 3, &mappedOutput) == 0)
+			out = mappedOutput.image;
+		else
+			outputMapped = false;
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		// the luminance is taken before the planes are scaled, possibly in place
+		std::vector<float> luminance;
+
+		if (convolution != CONVOLVE_NONE)
+		{
+			luminance.resize(static_cast<size_t>(F.w) * F.h);
+
+			for (size_t i = 0; i < luminance.size(); ++i)
+				luminance[i] = 0.2126f * F.redChannel[i] + 0.7152f * F.greenChannel[i] + 0.0722f * F.blueChannel[i];
+		}
+
+		cpuScaleLuminance(F.w, F.h, F.redChannel, F.greenChannel, F.blueChannel, 
+						  out.redChannel, out.greenChannel, out.blueChannel, luminanceScale);
+
+		if (convolution != CONVOLVE_NONE)
+			cpuConvolveLuminance(F.w, F.h, luminance.data(), out.redChannel, out.greenChannel, out.blueChannel, 
+								 convolution, convolutionRadius, sharpenAmount);
+
+		auto t1 = std::chrono::steady_clock::now();
+
+		std::cout << "Time taken = " << std::chrono::duration<double>(t1 - t0).count() << std::endl;
+
+		if (outputMapped)
+		{
+			unmapRawImage(&mappedOutput);
+			result = 0;
+		}
+		else
+			result = saveImage(F.w, F.h, out.redChannel, out.greenChannel, out.blueChannel, outputPath);
+
+		if (inputMapped)
+			unmapRawImage(&mappedInput);
+		else
+		{
+			free(F.redChannel);
+			free(F.greenChannel);
+			free(F.blueChannel);
+			free(F.alphaChannel);
+		}
+	}
+	return result;
+}
+
+// Process each input with the bands split across every selected device
+static int runSplitPipeline(const std::vector<cl_device_id>& devices, const std::string& kernelFile, BuildProfile profile, 
+							float luminanceScale, const std::vector<std::wstring>& inputs, const std::vector<std::wstring>& outputs)
+{
+	MultiDeviceSplitter splitter(devices, kernelFile.c_str(), profile);
+
+	if (splitter.numDevices() == 0)
+	{
+		std::cout << "no usable devices for -split\n";
+		return 1;
+	}
+
+	int failures = 0;
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		CPBitmapImage I;
+
+		if (loadImage(inputs[i], &I) != 0)
+		{
+			std::wcout << L"cannot load " << inputs[i] << std::endl;
+			failures++;
+			continue;
+		}
+
+		bgr8* imageOut = static_cast<bgr8*>(malloc(I.w * I.h * sizeof(bgr8)));
+
+		auto t0 = std::chrono::steady_clock::now();
+
+		if (splitter.process(I, imageOut, luminanceScale) != 0 || saveImage(I.w, I.h, imageOut, outputs[i]) != 0)
+			failures++;
+
+		auto t1 = std::chrono::steady_clock::now();
+
+		std::cout << "Time taken = " << std::chrono::duration<double>(t1 - t0).count() << std::endl;
+		splitter.report();
+
+		free(imageOut);
+		free(I.buffer);
+	}
+	return failures;
+}
+
+// One line summary of the options below, for option errors
+static void printUsage(const char* program)
+{
+	std::cout << "Usage: " << program << " [-in path] [-out path] [-kernels file] [-staged | -packed [-transfer mode] | -image format] [-cpu] [-L factor] [-batch source [-outdir dir] [-poolcap MB]] [-platform name] [-vendor name] [-devtype type] [-device index] [-split] [-storage mode] [-tonemap mode [-key value]] [-blur radius | -sharpen radius [-amount a]] [-checkconv] [-tiled rows] [-compress mode] [-stream source [-size WxH] [-rawformat fmt] [-first n] [-frames n] [-ring n] [-streamout dest]] [-roi x,y,w,h[:...] [-roiL factor]] [-profile name] [-verifyprofiles [-tolerance e]] [-specialise repeats] [-daemon socket [-workers n] [-queue n] [-connections n]] [-retune] [-nocache] [-trace file.json]\n";
+}
+
+// Command line options:
+//   -in <path>, -out <path>
+//                input image (default Resources/Images/Llandaf_highres.jpg) and result 
+//                (default result.bmp, written as TIFF, or PNG when the path ends .png).  Paths 
+//                ending .cpfi are raw planar float images that are memory mapped instead of 
+//                decoded or encoded, for intermediates between jobs (planar pipelines only - 
+//                the packed, image, tiled and split paths switch to it)
+//   -kernels <file>
+//                kernel source (default Resources/Kernels/HelloWorld.cl)
+//   -staged      run the original three kernel pipeline (RGB_XYY, XYY_XYZ, XYY_L) instead of
+//                the fused RGB_XYY_RGB kernel - useful to diff the outputs of the two paths
+//   -packed      upload the raw BGRA8 pixels and download packed BGR8 so format conversion 
+//                happens on the device (fused pipeline only)
+//   -transfer copy|map|hostptr
+//                how -packed moves data between host and device - copy host buffers (default), 
+//                or decode into / encode from mapped CL_MEM_ALLOC_HOST_PTR or 
+//                CL_MEM_USE_HOST_PTR buffers with no host side copies
+//   -image unorm8|half
+//                run the fused pipeline on image2d objects (CL_BGRA / CL_UNORM_INT8 or 
+//                CL_RGBA / CL_HALF_FLOAT) with read_imagef / write_imagef instead of linear 
+//                buffers.  Falls back to -packed on devices without image support.  Rejected 
+//                with -batch, -stream, -roi, -tiled, -split and -daemon
+//   -cpu         use the native CPU backend even if an OpenCL device is available.  The CPU 
+//                backend is also used automatically when no OpenCL context can be created, 
+//                and applies -blur and -sharpen with the reference passes
+//   -L <factor>  luminance scale factor (default 0.5)
+//   -batch <dir | list file>
+//                process every image in a directory, or listed one per line in a text file, 
+//                with decode, upload, compute, download and encode overlapped
+//   -outdir <dir>
+//                output directory for -batch (default "output")
+//   -platform <name>, -vendor <name>, -devtype gpu|cpu|accelerator|all, -device <index>
+//                device selection - platform and vendor are case insensitive substrings and 
+//                index counts the matching devices.  Defaults to GPUs on an NVIDIA platform
+//   -split       split each image into row bands across every selected device (defaults to 
+//                all devices on all platforms unless a selection is given).  Fails if no 
+//                device matches
+//   -poolcap <MB>
+//                memory cap for each of the -batch buffer pools (default no limit).  A request 
+//                over the cap waits for buffers to be released and is rejected after 10s
+//   -retune      ignore stored work-group sizes and time the candidates again
+//   -storage float|half|unorm16
+//                storage for the planar intermediate and output buffers - 32-bit float 
+//                (default), 16-bit half or 16-bit normalised integers.  The 16-bit modes also 
+//                run the float build and report the maximum error against it.  Single image 
+//                planar runs only - rejected with -packed, -image, -batch, -split, -tiled, 
+//                -stream, -roi and -daemon
+//   -tonemap reinhard|mean
+//                automatic exposure instead of the fixed -L scale - luminance statistics are 
+//                reduced on the device and drive a Reinhard or target mean tone mapping 
+//                kernel (staged pipeline, implied).  Rejected with -packed, -image, -batch, 
+//                -split, -tiled, -stream, -roi and -daemon
+//   -key <value> target luminance for -tonemap (default 0.18)
+//   -blur <radius>, -sharpen <radius>
+//                Gaussian blur or unsharp mask of the luminance plane with local memory tiled 
+//                separable passes (staged pipeline, implied).  -amount sets the unsharp 
+//                strength (default 1) and -checkconv compares the device result against the 
+//                CPU reference.  Also runs with -tiled and -cpu - rejected with -packed, -image, 
+//                -batch, -split, -stream, -roi and -daemon
+//   -tiled <rows>
+//                stream the image through the device in bands of rows so memory use is set 
+//                by the band size rather than the image size (packed pipeline, plus -blur or 
+//                -sharpen with a halo of radius rows)
+//   -compress none|fast|default
+//                output compression - strips are deflated in parallel at level 6 (default) 
+//                or level 1 (fast), or written uncompressed (none)
+//   -stream <pattern | - | file>
+//                process a frame sequence - numbered images (a %d pattern such as 
+//                frames/f%05d.png, starting at -first n) or raw frames on stdin (-) or in a 
+//                file, which need -size WxH and -rawformat bgra|rgb24|bgr24|i420 (default 
+//                bgra).  Frames flow through a ring of -ring n (default 3) preallocated device 
+//                and pinned buffers; -frames n stops early and -streamout writes numbered 
+//                images (a %d pattern) or one raw bgr24 file.  Prints fps and latency 
+//                percentiles
+//   -roi x,y,w,h[:x,y,w,h...]
+//                edit preview - process the whole image with the staged pipeline kept resident 
+//                on the device, then reprocess only the given rectangles with the luminance 
+//                scale -roiL (default 1), moving just their rows, and report both latencies
+//   -profile strict|mad|fast|native
+//                kernel build profile - no contraction and correctly rounded divides where 
+//                supported (default), -cl-mad-enable, -cl-fast-relaxed-math, or native_divide 
+//                for the colour math divides.  -split and -daemon build with it too
+//   -verifyprofiles
+//                build every profile and report its max and mean absolute error and PSNR 
+//                against a double precision host reference, with its kernel time, on 
+//                synthetic images plus the -in image.  Recommends the fastest profile whose 
+//                max error is within -tolerance (default half an 8-bit step, 0.00196)
+//   -specialise <repeats>
+//                -batch, -stream and -daemon run kernels compiled for an image size and 
+//                luminance scale once that combination has been seen repeats times (streams 
+//                at once).  Variants are cached in memory and with the program binaries; 
+//                other sizes use the generic kernels
+//   -daemon <socket>
+//                serve jobs from local clients over a Unix domain socket with the context, 
+//                program and buffer pools kept warm (see daemon.h for the protocol).  -workers 
+//                sets the job threads (default 4) and -queue the bounded job queue (default 
+//                16) - requests beyond it are refused with busy.  -connections caps the open 
+//                client connections (default 64).  -poolcap applies to the daemon's buffer pool
+//   -nocache     always build the kernels from source instead of using cached program binaries
+//   -trace <file.json>
+//                record a timeline of host work (decode, conversion, encode, program builds) 
+//                and every enqueued command with its queued, submit, start and end times, 
+//                written as Chrome trace JSON for chrome://tracing or ui.perfetto.dev on exit
+int main(int argc, char** argv)
+{
+	bool  useStagedPipeline = false;
+	bool  checkConvolution  = false;
+	bool  usePackedTransfer = false;
+	bool  useCPUBackend     = false;
+	bool  useImageObjects   = false;
+	float regionScale       = 1.0f;
+	bool  verifyProfiles    = false;
+	double profileTolerance = 0.5 / 255.0;
+	BuildProfile buildProfile = BUILD_PROFILE_STRICT;
+	int   specialiseAfter   = 0;
+	ImageObjectFormat imageFormat = IMAGE_OBJECT_UNORM8;
+	TransferMode transferMode = TRANSFER_COPY;
+	float luminanceScale    = 0.5f;
+	StorageMode storageMode = STORAGE_FLOAT;
+	ToneMapMode toneMapMode = TONEMAP_NONE;
+	ImageCompression compression = IMAGE_COMPRESSION_DEFAULT;
+	float toneMapKey        = 0.18f;
+	ConvolutionMode convolutionMode = CONVOLVE_NONE;
+	int   convolutionRadius = 2;
+	int   tiledBandRows     = 0;
+	float sharpenAmount     = 1.0f;
+
+	std::string    platformName, vendorName;
+	cl_device_type deviceType           = CL_DEVICE_TYPE_ALL;
+	int            deviceIndex          = -1;
+	bool           deviceSelectionGiven = false;
+	bool           useDeviceSplit       = false;
+
+	size_t poolMemoryCap = 0;
+
+	StreamOptions streamOptions;
+
+	std::vector<ImageRect> regions;
+
+	std::string daemonSocket;
+	int daemonWorkers = 4, daemonQueue = 16, daemonConnections = 64;
+
+	std::string tracePath;
+
+	std::wstring inputPath = (std::filesystem::path("Resources") / "Images" / "Llandaf_highres.jpg").wstring();
+	std::string  kernelFile = defaultKernelFile();
+	std::wstring outputPath(L"result.bmp");
+
+	std::wstring batchSource;
+	std::wstring outputDirectory(L"output");
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-staged") == 0)
+			useStagedPipeline = true;
+		else if (strcmp(argv[i], "-packed") == 0)
+			usePackedTransfer = true;
+		else if (strcmp(argv[i], "-transfer") == 0 && i + 1 < argc && parseTransferMode(argv[i + 1], &transferMode))
+			usePackedTransfer = true, ++i;
+		else if (strcmp(argv[i], "-image") == 0 && i + 1 < argc && parseImageObjectFormat(argv[i + 1], &imageFormat))
+			useImageObjects = true, ++i;
+		else if (strcmp(argv[i], "-cpu") == 0)
+			useCPUBackend = true;
+		else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+			luminanceScale = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "-in") == 0 && i + 1 < argc)
+			inputPath = std::filesystem::path(argv[++i]).wstring();
+		else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+			outputPath = std::filesystem::path(argv[++i]).wstring();
+		else if (strcmp(argv[i], "-kernels") == 0 && i + 1 < argc)
+			kernelFile = argv[++i];
+		else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+			batchSource = std::filesystem::path(argv[++i]).wstring();
+		else if (strcmp(argv[i], "-outdir") == 0 && i + 1 < argc)
+			outputDirectory = std::filesystem::path(argv[++i]).wstring();
+		else if (strcmp(argv[i], "-platform") == 0 && i + 1 < argc)
+			platformName = argv[++i], deviceSelectionGiven = true;
+		else if (strcmp(argv[i], "-vendor") == 0 && i + 1 < argc)
+			vendorName = argv[++i], deviceSelectionGiven = true;
+		else if (strcmp(argv[i], "-devtype") == 0 && i + 1 < argc && parseDeviceType(argv[i + 1], &deviceType))
+			++i, deviceSelectionGiven = true;
+		else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc)
+			deviceIndex = atoi(argv[++i]), deviceSelectionGiven = true;
+		else if (strcmp(argv[i], "-split") == 0)
+			useDeviceSplit = true;
+		else if (strcmp(argv[i], "-poolcap") == 0 && i + 1 < argc)
+			poolMemoryCap = static_cast<size_t>(atof(argv[++i]) * 1024.0 * 1024.0);
+		else if (strcmp(argv[i], "-retune") == 0)
+			WorkGroupTuner::shared().clear();
+		else if (strcmp(argv[i], "-storage") == 0 && i + 1 < argc && parseStorageMode(argv[i + 1], &storageMode))
+			++i;
+		else if (strcmp(argv[i], "-tonemap") == 0 && i + 1 < argc && parseToneMapMode(argv[i + 1], &toneMapMode))
+			useStagedPipeline = (toneMapMode != TONEMAP_NONE), ++i;
+		else if (strcmp(argv[i], "-key") == 0 && i + 1 < argc)
+			toneMapKey = static_cast<float>(atof(argv[++i]));
+		else if ((strcmp(argv[i], "-blur") == 0 || strcmp(argv[i], "-sharpen") == 0) && i + 1 < argc)
+		{
+			convolutionMode   = (argv[i][1] == 'b') ? CONVOLVE_BLUR : CONVOLVE_SHARPEN;
+			convolutionRadius = atoi(argv[++i]);
+			useStagedPipeline = true;
+		}
+		else if (strcmp(argv[i], "-amount") == 0 && i + 1 < argc)
+			sharpenAmount = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "-tiled") == 0 && i + 1 < argc)
+			tiledBandRows = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-checkconv") == 0)
+			checkConvolution = true;
+		else if (strcmp(argv[i], "-compress") == 0 && i + 1 < argc && parseImageCompression(argv[i + 1], &compression))
+			setImageCompression(compression), ++i;
+		else if (strcmp(argv[i], "-stream") == 0 && i + 1 < argc)
+			streamOptions.source = argv[++i];
+		else if (strcmp(argv[i], "-streamout") == 0 && i + 1 < argc)
+			streamOptions.destination = argv[++i];
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &streamOptions.w, &streamOptions.h) == 2)
+			++i;
+		else if (strcmp(argv[i], "-rawformat") == 0 && i + 1 < argc && parseRawFrameFormat(argv[i + 1], &streamOptions.rawFormat))
+			++i;
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+			streamOptions.maxFrames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-first") == 0 && i + 1 < argc)
+			streamOptions.firstFrame = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-ring") == 0 && i + 1 < argc)
+			streamOptions.ringSize = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-roi") == 0 && i + 1 < argc && parseImageRects(argv[i + 1], &regions))
+			++i;
+		else if (strcmp(argv[i], "-roiL") == 0 && i + 1 < argc)
+			regionScale = static_cast<float>(atof(argv[++i]));
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc && parseBuildProfile(argv[i + 1], &buildProfile))
+			++i;
+		else if (strcmp(argv[i], "-specialise") == 0 && i + 1 < argc)
+			specialiseAfter = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-verifyprofiles") == 0)
+			verifyProfiles = true;
+		else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc)
+			profileTolerance = atof(argv[++i]);
+		else if (strcmp(argv[i], "-daemon") == 0 && i + 1 < argc)
+			daemonSocket = argv[++i];
+		else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+			daemonWorkers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-queue") == 0 && i + 1 < argc)
+			daemonQueue = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-connections") == 0 && i + 1 < argc)
+			daemonConnections = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-nocache") == 0)
+			setProgramCacheDirectory(std::string());
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	// recording starts here and the trace is written whichever path main returns through
+	TraceSession traceSession(tracePath);
+
+	// packed paths decode with WIC and write 8-bit pixels - raw float inputs and outputs go 
+	// through the planar pipeline
+	if ((isRawImagePath(inputPath) || isRawImagePath(outputPath)) && 
+		(usePackedTransfer || useImageObjects || tiledBandRows > 0 || useDeviceSplit))
+	{
+		std::cout << "raw .cpfi input or output - using the planar pipeline\n";
+		usePackedTransfer = false;
+		useImageObjects = false;
+		useDeviceSplit = false;
+		tiledBandRows = 0;
+	}
+
+	// image objects are a single image path - the others would run without them
+	if (useImageObjects && (!batchSource.empty() || !streamOptions.source.empty() || !regions.empty() || 
+							tiledBandRows > 0 || useDeviceSplit || !daemonSocket.empty()))
+	{
+		std::cout << "-image runs single images only - it cannot be combined with -batch, -stream, -roi, "
+					 "-tiled, -split or -daemon\n";
+		return 1;
+	}
+
+	// tone mapping is part of the staged planar pipeline - the other paths would drop it
+	if (toneMapMode != TONEMAP_NONE && (usePackedTransfer || useImageObjects || !batchSource.empty() || useDeviceSplit || 
+										tiledBandRows > 0 || !streamOptions.source.empty() || !regions.empty() || 
+										!daemonSocket.empty()))
+	{
+		std::cout << "-tonemap applies to the planar pipeline only - it cannot be combined with -packed, -image, "
+					 "-batch, -split, -tiled, -stream, -roi or -daemon\n";
+		return 1;
+	}
+
+	// only the single image planar pipeline has a storage build - the other paths would drop it
+	if (storageMode != STORAGE_FLOAT && (usePackedTransfer || useImageObjects || !batchSource.empty() || useDeviceSplit || 
+										 tiledBandRows > 0 || !streamOptions.source.empty() || !regions.empty() || 
+										 !daemonSocket.empty()))
+	{
+		std::cout << "-storage applies to the planar pipeline only - it cannot be combined with -packed, -image, "
+					 "-batch, -split, -tiled, -stream, -roi or -daemon\n";
+		return 1;
+	}
+
+	// the convolution runs in the staged planar and tiled pipelines - the other paths would drop it
+	if (convolutionMode != CONVOLVE_NONE && (usePackedTransfer || useImageObjects || !batchSource.empty() || useDeviceSplit || 
+											 !streamOptions.source.empty() || !regions.empty() || !daemonSocket.empty()))
+	{
+		std::cout << (convolutionMode == CONVOLVE_BLUR ? "-blur" : "-sharpen") << " applies to the planar and tiled "
+					 "pipelines only - it cannot be combined with -packed, -image, -batch, -split, -stream, -roi or -daemon\n";
+		return 1;
+	}
+
+	// Any explicit selection replaces the default NVIDIA GPU selection, as does -split
+	DeviceSelector deviceSelector;
+
+	if (deviceSelectionGiven || useDeviceSplit)
+	{
+		deviceSelector.platform = platformName;
+		deviceSelector.vendor   = vendorName;
+		deviceSelector.type     = deviceType;
+		deviceSelector.index    = deviceIndex;
+	}
+
+	// the daemon sets up its own pipeline once and serves until a shutdown request
+	if (!daemonSocket.empty())
+	{
+		DaemonOptions options;
+
+		options.socketPath             = daemonSocket;
+		options.workers                = daemonWorkers;
+		options.queueCapacity          = daemonQueue;
+		options.maxConnections         = daemonConnections;
+		options.pipeline.selector      = deviceSelector;
+		options.pipeline.kernelFile    = kernelFile;
+		options.pipeline.profile       = buildProfile;
+		options.pipeline.poolMemoryCap = poolMemoryCap;
+		options.pipeline.specialiseAfter = specialiseAfter;
+
+		initCOM();
+		int result = runDaemon(options);
+		shutdownCOM();
+
+		return result;
+	}
+
+	std::vector<std::wstring> batchInputs;
+
+	if (!batchSource.empty())
+	{
+		batchInputs = collectBatchInputs(batchSource);
+
+		if (batchInputs.empty())
+		{
+			std::cout << "no images found for -batch\n";
+			return 1;
+		}
+	}
+
+	// Initialise COM so we can import image data using WIC
 	initCOM();
 
+	if (useDeviceSplit && !useCPUBackend)
+	{
+		std::vector<cl_device_id> devices = selectDevices(deviceSelector, true);
+
+		// falling back to a single device would quietly ignore -split
+		if (devices.empty())
+		{
+			std::cout << "-split found no devices matching the selection\n";
+			printUsage(argv[0]);
+			shutdownCOM();
+			return 1;
+		}
+
+		std::vector<std::wstring> inputs(1, inputPath), outputs(1, outputPath);
+
+		if (!batchInputs.empty())
+		{
+			std::filesystem::create_directories(outputDirectory);
+
+			inputs  = batchInputs;
+			outputs = batchOutputPaths(batchInputs, outputDirectory);
+		}
+
+		int result = runSplitPipeline(devices, kernelFile, buildProfile, luminanceScale, inputs, outputs);
+
+		shutdownCOM();
+		return result;
+	}
+
 	// Create and validate the OpenCL context
-	cl_context context = createContext();
+	cl_context context = useCPUBackend ? nullptr : createContext(deviceSelector);
 
 	if (!context)
 	{
-		std::cout << "cl context not created\n";
+		if (!useCPUBackend)
+			std::cout << "cl context not created - falling back to the CPU backend\n";
+
+		if (!streamOptions.source.empty() || verifyProfiles)
+		{
+			std::cout << (verifyProfiles ? "-verifyprofiles" : "-stream") << " needs an OpenCL device\n";
+			shutdownCOM();
+			return 1;
+		}
+
+		int result = 0;
+
+		if (batchInputs.empty())
+			result = runCPUPipeline(usePackedTransfer || useImageObjects, luminanceScale, convolutionMode, 
+									convolutionRadius, sharpenAmount, inputPath, outputPath);
+		else
+		{
+			// no device to overlap with - process the batch one image at a time
+			std::filesystem::create_directories(outputDirectory);
+
+			std::vector<std::wstring> outputs = batchOutputPaths(batchInputs, outputDirectory);
+
+			for (size_t n = 0; n < batchInputs.size(); ++n)
+				if (runCPUPipeline(usePackedTransfer || useImageObjects, luminanceScale, convolutionMode, convolutionRadius, 
+								   sharpenAmount, batchInputs[n], outputs[n]) != 0)
+					result++;
+		}
+
 		shutdownCOM();
-		return 1;
+		return result;
 	}
 
 	// Query the device from the context - should be the GPU since we requested this before
@@ -28,8 +1366,42 @@ int main(void)
 
 	cl_device_id device = contextDevices[0];
 
+	// the verification builds its own program for each profile
+	if (verifyProfiles)
+	{
+		int result = runProfileVerification(context, device, kernelFile, luminanceScale, profileTolerance, inputPath);
+
+		shutdownCOM();
+		return result;
+	}
+
 	// Create and validate the program object based on HelloWorld.cl
-	cl_program program = createProgram(context, device, "Resources\\Kernels\\HelloWorld.cl");
+	// The planar paths use the storage mode's build - the packed kernel is the same in every build
+	bool usePlanarStorage = batchInputs.empty() && streamOptions.source.empty() && regions.empty() && !usePackedTransfer && 
+							!useImageObjects && tiledBandRows <= 0 && storageMode != STORAGE_FLOAT;
+
+	std::string buildOptions = usePlanarStorage ? storageBuildOptions(storageMode) : "";
+
+	buildOptions += std::string(buildOptions.empty() ? "" : " ") + buildProfileOptions(buildProfile, device);
+
+	cl_program program = createProgram(context, device, kernelFile.c_str(), buildOptions.c_str());
+
+	if (!program)
+	{
+		std::cout << "program not created\n";
+		shutdownCOM();
+		return 1;
+	}
+
+	// float build to measure the 16-bit storage error against (and to check the convolution with), 
+	// with the same build profile so the comparison only sees the storage mode
+	cl_program referenceProgram = usePlanarStorage ? createProgram(context, device, kernelFile.c_str(), 
+																   buildProfileOptions(buildProfile, device).c_str()) : nullptr;
+
+	ProgramCacheStats cacheStats = getProgramCacheStats();
+
+	std::cout << "Program cache: " << cacheStats.hits << " hit(s), " << cacheStats.misses << " miss(es), " 
+			  << cacheStats.rejected << " rejected, " << cacheStats.stored << " stored\n";
 
 	// Create and validate the command queue (for first device in context)
 	// Note: add profiling flag so we can get timing data from event
@@ -42,103 +1414,70 @@ int main(void)
 		return 1;
 	}
 
-	CPFloatImage F;
-
-	// Use WIC to load image and extract RGBA channels as float buffers
-	loadImage(std::wstring(L"Resources\\Images\\Llandaf_highres.jpg"), &F);
-
-	// Setup input image as read only (appears as const parameter in the kernel)
-	cl_mem inputBufferRed  = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-										    F.w * F.h * sizeof(float), F.redChannel, 0);
-
-	cl_mem inputBufferGreen = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-											 F.w * F.h * sizeof(float), F.greenChannel, 0);
-
-	cl_mem inputBufferBlue  = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-											 F.w * F.h * sizeof(float), F.blueChannel, 0);
-	// ------------------------------------------------------------------------------
+	// specialised kernels for the paths that see the same size again and again
+	KernelVariantCache* variants = nullptr;
 
-	// Setup buffer to store the output image (again don't need to provide data 
-	// - we fill the buffer from the kernels)
-	cl_mem outputBufferRed   = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-	cl_mem outputBufferGreen = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-	cl_mem outputBufferBlue  = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-
-	cl_mem outputBufferRedOne   = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-	cl_mem outputBufferGreenOne = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-	cl_mem outputBufferBlueOne  = clCreateBuffer(context, CL_MEM_READ_WRITE, F.w * F.h * sizeof(float), 0, 0);
-
-	// Get the relevant kernel from the program object
-	cl_kernel xyyImageKernel   = clCreateKernel(program, "RGB_XYY", 0);
-	cl_kernel xyzImageKernel   = clCreateKernel(program, "XYY_XYZ", 0);
-	cl_kernel xyy_LImageKernel = clCreateKernel(program, "XYY_L", 0);
-
-	// Set kernel arguements - note the width is passed by reference to the image 
-	// structure variable
-	clSetKernelArg(xyyImageKernel, 0, sizeof(cl_mem), &inputBufferRed);
-	clSetKernelArg(xyyImageKernel, 1, sizeof(cl_mem), &inputBufferGreen);
-	clSetKernelArg(xyyImageKernel, 2, sizeof(cl_mem), &inputBufferBlue);
-	clSetKernelArg(xyyImageKernel, 3, sizeof(cl_mem), &outputBufferRed);
-	clSetKernelArg(xyyImageKernel, 4, sizeof(cl_mem), &outputBufferGreen);
-	clSetKernelArg(xyyImageKernel, 5, sizeof(cl_mem), &outputBufferBlue);
-	clSetKernelArg(xyyImageKernel, 6, sizeof(cl_int), &F.w);
-
-	clSetKernelArg(xyzImageKernel, 0, sizeof(cl_mem), &outputBufferRed);
-	clSetKernelArg(xyzImageKernel, 1, sizeof(cl_mem), &outputBufferGreen);
-	clSetKernelArg(xyzImageKernel, 2, sizeof(cl_mem), &outputBufferBlue);
-	clSetKernelArg(xyzImageKernel, 3, sizeof(cl_mem), &outputBufferRedOne);
-	clSetKernelArg(xyzImageKernel, 4, sizeof(cl_mem), &outputBufferGreenOne);
-	clSetKernelArg(xyzImageKernel, 5, sizeof(cl_mem), &outputBufferBlueOne);
-	clSetKernelArg(xyzImageKernel, 6, sizeof(cl_int), &F.w);
-
-	clSetKernelArg(xyy_LImageKernel, 0, sizeof(cl_mem), &outputBufferRedOne);
-	clSetKernelArg(xyy_LImageKernel, 1, sizeof(cl_mem), &outputBufferGreenOne);
-	clSetKernelArg(xyy_LImageKernel, 2, sizeof(cl_mem), &outputBufferBlueOne);
-	clSetKernelArg(xyy_LImageKernel, 3, sizeof(cl_mem), &outputBufferRed);
-	clSetKernelArg(xyy_LImageKernel, 4, sizeof(cl_mem), &outputBufferGreen);
-	clSetKernelArg(xyy_LImageKernel, 5, sizeof(cl_mem), &outputBufferBlue);
-	clSetKernelArg(xyy_LImageKernel, 6, sizeof(cl_int), &F.w);
-
-	// Setup the global work size based on the image dimensions
-	size_t imageWrkSize[2]      = { F.w, F.h };
-	size_t imageLocalWrkSize[2] = { 16, 16 };
-
-	cl_event xyyEvent, xyzEvent, xyy_lEvent;
-
-	cl_int err = clEnqueueNDRangeKernel(commandQueue, xyyImageKernel, 2, 0, imageWrkSize, 
-										imageLocalWrkSize, 0, 0, &xyyEvent);
-
-	err = clEnqueueNDRangeKernel(commandQueue, xyzImageKernel, 2, 0, imageWrkSize, 
-								 imageLocalWrkSize, 1, &xyyEvent, &xyzEvent); 
-	
-	err = clEnqueueNDRangeKernel(commandQueue, xyy_LImageKernel, 2, 0, imageWrkSize, 
-								 imageLocalWrkSize, 1, &xyzEvent, &xyy_lEvent);
+	if (specialiseAfter > 0 && (!streamOptions.source.empty() || !batchInputs.empty()))
+		variants = new KernelVariantCache(context, device, kernelFile, program, buildOptions, specialiseAfter);
 
-	// Synchronisation point
-	clWaitForEvents(1, &xyy_lEvent);
+	int result;
 
-	cl_ulong cl_t0 = static_cast<cl_ulong>(0);
-	cl_ulong cl_t1 = static_cast<cl_ulong>(0);
+	if (!streamOptions.source.empty())
+	{
+		streamOptions.luminanceScale = luminanceScale;
 
-	clGetEventProfilingInfo(xyyEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &cl_t0, 0);
-	clGetEventProfilingInfo(xyy_lEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &cl_t1, 0);
+		result = runStream(context, device, program, streamOptions, variants);
+	}
+	else if (!regions.empty())
+		result = runRegionPipeline(context, commandQueue, program, regions, luminanceScale, regionScale, 
+								   inputPath, outputPath);
+	else if (!batchInputs.empty())
+		result = runBatch(context, device, program, batchInputs, outputDirectory, luminanceScale, poolMemoryCap, variants);
+	else if (tiledBandRows > 0)
+	{
+		TiledOptions options;
+		options.bandRows          = tiledBandRows;
+		options.luminanceScale    = luminanceScale;
+		options.convolution       = convolutionMode;
+		options.convolutionRadius = convolutionRadius;
+		options.sharpenAmount     = sharpenAmount;
 
-	double cl_tdelta = static_cast<double>((cl_t1 - cl_t0));
+		result = runTiled(context, device, program, inputPath, outputPath, options);
+	}
+	else if (useImageObjects)
+		result = runImageObjectPipeline(context, device, commandQueue, program, imageFormat, luminanceScale, 
+										inputPath, outputPath);
+	else if (usePackedTransfer && transferMode != TRANSFER_COPY)
+		result = runMappedPackedPipeline(context, commandQueue, program, transferMode, luminanceScale, 
+										 inputPath, outputPath);
+	else if (usePackedTransfer)
+		result = runPackedPipeline(context, device, program, luminanceScale, inputPath, outputPath);
+	else
+	{
+		PlanarOptions options;
+		options.staged            = useStagedPipeline;
+		options.storage           = usePlanarStorage ? storageMode : STORAGE_FLOAT;
+		options.luminanceScale    = luminanceScale;
+		options.toneMap           = toneMapMode;
+		options.toneMapKey        = toneMapKey;
+		options.convolution       = convolutionMode;
+		options.convolutionRadius = convolutionRadius;
+		options.sharpenAmount     = sharpenAmount;
 
-	std::cout << "Time taken = " << (cl_tdelta * 1.0e-9) << std::endl;
+		result = runPlanarPipeline(context, commandQueue, program, referenceProgram, options, checkConvolution, 
+								   inputPath, outputPath);
+	}
 
-	// Setup buffers to store the result
-	float* redOut   = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
-	float* greenOut = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
-	float* blueOut  = static_cast<float*>(malloc(F.w * F.h * sizeof(float)));
+	if (variants)
+	{
+		KernelVariantStats variantStats = variants->stats();
 
-	// Get results
-	err = clEnqueueReadBuffer(commandQueue, outputBufferRed, CL_TRUE, 0, F.w * F.h * sizeof(float), redOut, 0, 0, 0);
-	err = clEnqueueReadBuffer(commandQueue, outputBufferGreen, CL_TRUE, 0, F.w * F.h * sizeof(float), greenOut, 0, 0, 0);
-	err = clEnqueueReadBuffer(commandQueue, outputBufferBlue, CL_TRUE, 0, F.w * F.h * sizeof(float), blueOut, 0, 0, 0);
+		std::cout << "Kernel variants: " << variantStats.specialised << " specialised, " << variantStats.generic 
+				  << " generic, " << variantStats.built << " built, " << variantStats.failed << " failed\n";
 
-	saveImage(F.w, F.h, redOut, greenOut, blueOut, std::wstring(L"result.bmp"));
+		delete variants;
+	}
 
 	shutdownCOM();
-	return 0;
+	return result;
 }
\ No newline at end of file
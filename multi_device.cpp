@@ -0,0 +1,227 @@
+//
+// Multi-device row band splitting - see multi_device.h
+//
+#include <iostream>
+#include <iomanip>
+#include "multi_device.h"
+#include "setup_cl.h"
+#include "trace_cl.h"
+
+// how quickly the band shares follow new measurements (1 = use only the latest timing)
+static const double rebalanceRate = 0.5;
+
+MultiDeviceSplitter::MultiDeviceSplitter(const std::vector<cl_device_id>& devices, const char* kernelFile,
+										 BuildProfile profile)
+{
+	double totalWeight = 0.0;
+
+	for (cl_device_id device : devices)
+	{
+		DeviceWorker worker = {};
+		worker.device = device;
+
+		char name[256] = { 0 };
+		clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, nullptr);
+		worker.name = name;
+
+		worker.context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, nullptr);
+
+		if (worker.context)
+			worker.program = createProgram(worker.context, device, kernelFile, buildProfileOptions(profile, device).c_str());
+
+		if (worker.program)
+		{
+			worker.queue = clCreateCommandQueue(worker.context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+			worker.kernel = clCreateKernel(worker.program, "BGRA8_XYY_BGR8", 0);
+		}
+
+		if (!worker.queue || !worker.kernel)
+		{
+			std::cout << "Skipping device " << worker.name << " - setup failed\n";
+
+			if (worker.kernel) clReleaseKernel(worker.kernel);
+			if (worker.queue) clReleaseCommandQueue(worker.queue);
+			if (worker.program) clReleaseProgram(worker.program);
+			if (worker.context) clReleaseContext(worker.context);
+			continue;
+		}
+
+		// initial share from the peak throughput estimate compute units x clock
+		cl_uint computeUnits = 1, clockMHz = 1;
+		clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, nullptr);
+		clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clockMHz, nullptr);
+
+		worker.weight = static_cast<double>(computeUnits) * (clockMHz > 0 ? clockMHz : 1);
+		totalWeight += worker.weight;
+
+		workers.push_back(worker);
+	}
+
+	for (DeviceWorker& worker : workers)
+		worker.weight /= totalWeight;
+}
+
+MultiDeviceSplitter::~MultiDeviceSplitter(void)
+{
+	for (DeviceWorker& worker : workers)
+	{
+		if (worker.inputBuffer) clReleaseMemObject(worker.inputBuffer);
+		if (worker.outputBuffer) clReleaseMemObject(worker.outputBuffer);
+		clReleaseKernel(worker.kernel);
+		clReleaseCommandQueue(worker.queue);
+		clReleaseProgram(worker.program);
+		clReleaseContext(worker.context);
+	}
+}
+
+int MultiDeviceSplitter::process(const CPBitmapImage& image, bgr8 *output, const float luminanceScale)
+{
+	if (workers.empty() || !image.buffer || !output) return 1;
+
+	size_t numWorkers = workers.size();
+
+	// Divide the rows by weight.  Rounding leftovers go to the last device.
+	std::vector<int> firstRow(numWorkers), numRows(numWorkers);
+	int row = 0;
+
+	for (size_t i = 0; i < numWorkers; ++i)
+	{
+		int rows = (i + 1 == numWorkers) ? image.h - row : static_cast<int>(workers[i].weight * image.h + 0.5);
+
+		if (rows > image.h - row) rows = image.h - row;
+
+		firstRow[i] = row;
+		numRows[i] = rows;
+		row += rows;
+	}
+
+	std::vector<cl_event> writeEvents(numWorkers, nullptr), readEvents(numWorkers, nullptr);
+	int failures = 0;
+
+	// Enqueue every band without blocking so all devices run concurrently
+	for (size_t i = 0; i < numWorkers; ++i)
+	{
+		DeviceWorker& worker = workers[i];
+
+		if (numRows[i] == 0) continue;
+
+		size_t bandPixels = static_cast<size_t>(image.w) * numRows[i];
+		size_t bandOffset = static_cast<size_t>(image.w) * firstRow[i];
+
+		if (!reserve(worker, bandPixels))
+		{
+			failures++;
+			continue;
+		}
+
+		cl_event kernelEvent = nullptr;
+
+		cl_int err = traceCommand("upload band", worker.queue, &writeEvents[i], [&](cl_event* event)
+		{
+			return clEnqueueWriteBuffer(worker.queue, worker.inputBuffer, CL_FALSE, 0, bandPixels * sizeof(BGRA8), 
+										image.buffer + bandOffset, 0, 0, event);
+		});
+
+		clSetKernelArg(worker.kernel, 0, sizeof(cl_mem), &worker.inputBuffer);
+		clSetKernelArg(worker.kernel, 1, sizeof(cl_mem), &worker.outputBuffer);
+		clSetKernelArg(worker.kernel, 2, sizeof(cl_int), &image.w);
+		clSetKernelArg(worker.kernel, 3, sizeof(cl_int), &numRows[i]);
+		clSetKernelArg(worker.kernel, 4, sizeof(cl_float), &luminanceScale);
+
+		size_t bandWrkSize[2] = { static_cast<size_t>(image.w), static_cast<size_t>(numRows[i]) };
+
+		if (err == CL_SUCCESS)
+			err = traceCommand("BGRA8_XYY_BGR8", worker.queue, &kernelEvent, [&](cl_event* event)
+			{
+				return clEnqueueNDRangeKernel(worker.queue, worker.kernel, 2, 0, bandWrkSize, 0, 0, 0, event);
+			});
+
+		if (err == CL_SUCCESS)
+			err = traceCommand("download band", worker.queue, &readEvents[i], [&](cl_event* event)
+			{
+				return clEnqueueReadBuffer(worker.queue, worker.outputBuffer, CL_FALSE, 0, bandPixels * sizeof(bgr8), 
+										   output + bandOffset, 0, 0, event);
+			});
+
+		if (kernelEvent) clReleaseEvent(kernelEvent);
+
+		clFlush(worker.queue);
+
+		if (err != CL_SUCCESS)
+		{
+			std::cout << "Cannot enqueue band on " << worker.name << " (error " << err << ")\n";
+			failures++;
+		}
+	}
+
+	// Wait for every band and measure each device from the start of its upload to the end of 
+	// its download, using that device's own clock
+	for (size_t i = 0; i < numWorkers; ++i)
+	{
+		if (readEvents[i])
+		{
+			clWaitForEvents(1, &readEvents[i]);
+
+			double seconds = eventSeconds(writeEvents[i], readEvents[i]);
+
+			if (seconds > 0.0)
+				workers[i].rowsPerSecond = numRows[i] / seconds;
+		}
+		else
+			clFinish(workers[i].queue);
+
+		if (writeEvents[i]) clReleaseEvent(writeEvents[i]);
+		if (readEvents[i]) clReleaseEvent(readEvents[i]);
+	}
+
+	// Re-balance the shares towards the measured throughput.  Devices that had no rows this 
+	// time keep their weight so they are not starved forever.
+	double totalRate = 0.0, measuredWeight = 0.0;
+
+	for (size_t i = 0; i < numWorkers; ++i)
+	{
+		if (numRows[i] > 0 && workers[i].rowsPerSecond > 0.0)
+		{
+			totalRate += workers[i].rowsPerSecond;
+			measuredWeight += workers[i].weight;
+		}
+	}
+
+	if (totalRate > 0.0)
+	{
+		for (size_t i = 0; i < numWorkers; ++i)
+		{
+			if (numRows[i] > 0 && workers[i].rowsPerSecond > 0.0)
+			{
+				double target = measuredWeight * workers[i].rowsPerSecond / totalRate;
+				workers[i].weight += rebalanceRate * (target - workers[i].weight);
+			}
+		}
+	}
+	return failures;
+}
+
+void MultiDeviceSplitter::report(void) const
+{
+	for (const DeviceWorker& worker : workers)
+		std::cout << std::setw(40) << std::left << worker.name << std::right
+				  << " share " << std::fixed << std::setprecision(1) << (worker.weight * 100.0) << "%"
+				  << "  " << std::setprecision(0) << worker.rowsPerSecond << " rows/s\n";
+
+	std::cout.unsetf(std::ios::fixed);
+	std::cout << std::setprecision(6);
+}
+
+bool MultiDeviceSplitter::reserve(DeviceWorker& worker, size_t numPixels)
+{
+	if (numPixels <= worker.capacity) return true;
+
+	if (worker.inputBuffer) clReleaseMemObject(worker.inputBuffer);
+	if (worker.outputBuffer) clReleaseMemObject(worker.outputBuffer);
+
+	worker.inputBuffer  = clCreateBuffer(worker.context, CL_MEM_READ_ONLY, numPixels * sizeof(BGRA8), 0, 0);
+	worker.outputBuffer = clCreateBuffer(worker.context, CL_MEM_WRITE_ONLY, numPixels * sizeof(bgr8), 0, 0);
+	worker.capacity     = (worker.inputBuffer && worker.outputBuffer) ? numPixels : 0;
+
+	return worker.capacity != 0;
+}
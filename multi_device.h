@@ -0,0 +1,60 @@
+//
+// Split one image into row bands and process the bands on several OpenCL devices at once
+//
+#ifndef _MULTI_DEVICE_
+#define _MULTI_DEVICE_
+
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+#include "imageio.h"
+#include "precision.h"
+
+class MultiDeviceSplitter
+{
+public:
+
+	// Create a context, queue and program (built with profile's options for that device) for 
+	// each device.  Devices may come from different platforms (e.g. a discrete GPU plus PoCL 
+	// on the host CPU).
+	MultiDeviceSplitter(const std::vector<cl_device_id>& devices, const char* kernelFile,
+						BuildProfile profile = BUILD_PROFILE_STRICT);
+	~MultiDeviceSplitter(void);
+
+	MultiDeviceSplitter(const MultiDeviceSplitter&) = delete;
+	MultiDeviceSplitter& operator=(const MultiDeviceSplitter&) = delete;
+
+	// number of devices that were set up successfully
+	int numDevices(void) const { return static_cast<int>(workers.size()); }
+
+	// Run BGRA8_XYY_BGR8 over image, writing w * h packed pixels to output.  Each device gets 
+	// a band of rows sized from its share of the measured throughput, and the shares are 
+	// updated from the timings of this call.  Returns 0 on success.
+	int process(const CPBitmapImage& image, bgr8 *output, const float luminanceScale);
+
+	// print each device's share and last measured throughput
+	void report(void) const;
+
+private:
+
+	struct DeviceWorker
+	{
+		cl_device_id		device;
+		std::string			name;
+		cl_context			context;
+		cl_command_queue	queue;
+		cl_program			program;
+		cl_kernel			kernel;
+		cl_mem				inputBuffer;
+		cl_mem				outputBuffer;
+		size_t				capacity;		// pixels
+		double				weight;			// share of the image, sums to 1 over all workers
+		double				rowsPerSecond;	// last measurement, 0 if not measured yet
+	};
+
+	bool reserve(DeviceWorker& worker, size_t numPixels);
+
+	std::vector<DeviceWorker>	workers;
+};
+
+#endif
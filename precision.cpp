@@ -0,0 +1,403 @@
+//
+// Build profiles and accuracy verification - see precision.h
+//
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include "precision.h"
+#include "setup_cl.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+// each image is timed this many times and the fastest run kept
+static const int profileTimingRuns = 3;
+
+//
+// Private API
+//
+static ProfileTestImage	createTestImage(const char* name, int w, int h);
+static cl_int			runProfileKernels(cl_context context, cl_command_queue queue, cl_program program, bool staged,
+										  const ProfileTestImage& image, float L, std::vector<float>* output,
+										  double* kernelSeconds);
+static bool				referencePixel(double r, double g, double b, double L, double* rgb);
+
+
+//
+// Public function implementation
+//
+bool parseBuildProfile(const char* name, BuildProfile* profile)
+{
+	if (strcmp(name, "strict") == 0)
+		*profile = BUILD_PROFILE_STRICT;
+	else if (strcmp(name, "mad") == 0)
+		*profile = BUILD_PROFILE_MAD;
+	else if (strcmp(name, "fast") == 0)
+		*profile = BUILD_PROFILE_RELAXED;
+	else if (strcmp(name, "native") == 0)
+		*profile = BUILD_PROFILE_NATIVE;
+	else
+		return false;
+
+	return true;
+}
+
+const char* buildProfileName(BuildProfile profile)
+{
+	switch (profile)
+	{
+	case BUILD_PROFILE_MAD:		return "mad";
+	case BUILD_PROFILE_RELAXED:	return "fast";
+	case BUILD_PROFILE_NATIVE:	return "native";
+	default:					return "strict";
+	}
+}
+
+std::string buildProfileOptions(BuildProfile profile, cl_device_id device)
+{
+	switch (profile)
+	{
+	case BUILD_PROFILE_MAD:		return "-cl-mad-enable";
+	case BUILD_PROFILE_RELAXED:	return "-cl-fast-relaxed-math";
+	case BUILD_PROFILE_NATIVE:	return "-D NATIVE_MATH";
+	default:					break;
+	}
+
+	// the option is only valid on devices reporting correctly rounded divide and sqrt
+	cl_device_fp_config config = 0;
+
+	if (clGetDeviceInfo(device, CL_DEVICE_SINGLE_FP_CONFIG, sizeof(config), &config, 0) == CL_SUCCESS &&
+		(config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT))
+		return "-D STRICT_MATH -cl-fp32-correctly-rounded-divide-sqrt";
+
+	return "-D STRICT_MATH";
+}
+
+std::vector<ProfileTestImage> syntheticProfileCorpus(void)
+{
+	std::vector<ProfileTestImage> corpus;
+
+	// fixed seed so every run measures the same pixels
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::uniform_real_distribution<float> dark(0.0f, 4.0f / 255.0f);
+
+	// 64 levels of each channel - 262144 colours in a 512 x 512 image
+	ProfileTestImage cube = createTestImage("rgb_cube", 512, 512);
+
+	for (size_t i = 0; i < cube.red.size(); ++i)
+	{
+		cube.red[i]   = (i & 63) / 63.0f;
+		cube.green[i] = ((i >> 6) & 63) / 63.0f;
+		cube.blue[i]  = ((i >> 12) & 63) / 63.0f;
+	}
+
+	corpus.push_back(cube);
+
+	// the last few 8-bit levels, where X + Y + Z and y are tiny
+	ProfileTestImage nearBlack = createTestImage("near_black", 256, 256);
+
+	for (size_t i = 0; i < nearBlack.red.size(); ++i)
+	{
+		nearBlack.red[i]   = dark(random);
+		nearBlack.green[i] = dark(random);
+		nearBlack.blue[i]  = dark(random);
+	}
+
+	corpus.push_back(nearBlack);
+
+	// 32 x 32 blocks of the corners of the RGB cube, ramping up in intensity along x
+	ProfileTestImage primaries = createTestImage("primaries", 256, 256);
+
+	for (int y = 0; y < primaries.h; ++y)
+	{
+		for (int x = 0; x < primaries.w; ++x)
+		{
+			int corner = ((y / 32) * (primaries.w / 32) + x / 32) % 8;
+			float ramp = ((x % 32) + 1) / 32.0f;
+			size_t i = static_cast<size_t>(y) * primaries.w + x;
+
+			primaries.red[i]   = (corner & 1) ? ramp : 0.0f;
+			primaries.green[i] = (corner & 2) ? ramp : 0.0f;
+			primaries.blue[i]  = (corner & 4) ? ramp : 0.0f;
+		}
+	}
+
+	corpus.push_back(primaries);
+
+	ProfileTestImage noise = createTestImage("noise", 512, 512);
+
+	for (size_t i = 0; i < noise.red.size(); ++i)
+	{
+		noise.red[i]   = unit(random);
+		noise.green[i] = unit(random);
+		noise.blue[i]  = unit(random);
+	}
+
+	corpus.push_back(noise);
+
+	return corpus;
+}
+
+std::vector<ProfileAccuracy> verifyBuildProfiles(cl_context context, cl_device_id device, const char* kernelFile,
+												 const std::vector<ProfileTestImage>& corpus, float L)
+{
+	std::vector<ProfileAccuracy> results;
+
+	cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+
+	for (int p = 0; p < BUILD_PROFILE_COUNT; ++p)
+	{
+		BuildProfile profile = static_cast<BuildProfile>(p);
+
+		// every profile has its own entry in the program cache since the options are part of the key
+		cl_program program = queue ? createProgram(context, device, kernelFile, buildProfileOptions(profile, device).c_str()) : nullptr;
+
+		for (int staged = 0; staged < 2; ++staged)
+		{
+			ProfileAccuracy result;
+
+			result.profile       = profile;
+			result.staged        = (staged != 0);
+			result.built         = (program != nullptr);
+			result.maxError      = 0.0;
+			result.meanError     = 0.0;
+			result.psnr          = 0.0;
+			result.kernelSeconds = 0.0;
+
+			double sumError = 0.0, sumSquared = 0.0;
+			size_t count = 0;
+
+			for (size_t n = 0; n < corpus.size() && result.built; ++n)
+			{
+				const ProfileTestImage& image = corpus[n];
+
+				std::vector<float> output[3];
+				double seconds = 0.0;
+
+				if (runProfileKernels(context, queue, program, result.staged, image, L, output, &seconds) != CL_SUCCESS)
+				{
+					result.built = false;
+					break;
+				}
+
+				result.kernelSeconds += seconds;
+
+				for (size_t i = 0; i < image.red.size(); ++i)
+				{
+					double expected[3];
+
+					if (!referencePixel(image.red[i], image.green[i], image.blue[i], L, expected))
+					{
+						// undefined chromaticity - the staged kernels divide 0 by 0
+						if (result.staged) continue;
+
+						expected[0] = expected[1] = expected[2] = 0.0;
+					}
+
+					for (int c = 0; c < 3; ++c)
+					{
+						double value = output[c][i];
+
+						// a NaN where the reference is defined counts as the largest possible error
+						double error = std::isnan(value) ? 1.0 :
+									   std::fabs(std::min(std::max(value, 0.0), 1.0) - std::min(std::max(expected[c], 0.0), 1.0));
+
+						result.maxError = std::max(result.maxError, error);
+						sumError   += error;
+						sumSquared += error * error;
+						++count;
+					}
+				}
+			}
+
+			if (result.built && count > 0)
+			{
+				double mse = sumSquared / count;
+
+				result.meanError = sumError / count;
+				result.psnr      = (mse > 0.0) ? 10.0 * std::log10(1.0 / mse) : INFINITY;
+			}
+
+			results.push_back(result);
+		}
+
+		if (program) clReleaseProgram(program);
+	}
+
+	if (queue) clReleaseCommandQueue(queue);
+
+	return results;
+}
+
+int selectBuildProfile(const std::vector<ProfileAccuracy>& results, bool staged, double tolerance)
+{
+	int best = -1;
+
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const ProfileAccuracy& result = results[i];
+
+		if (!result.built || result.staged != staged || result.maxError > tolerance) continue;
+
+		if (best < 0 || result.kernelSeconds < results[best].kernelSeconds)
+			best = static_cast<int>(i);
+	}
+
+	return best;
+}
+
+
+//
+// Private API implementation
+//
+static ProfileTestImage createTestImage(const char* name, int w, int h)
+{
+	ProfileTestImage image;
+
+	size_t count = static_cast<size_t>(w) * h;
+
+	image.name = name;
+	image.w    = w;
+	image.h    = h;
+	image.red.resize(count);
+	image.green.resize(count);
+	image.blue.resize(count);
+
+	return image;
+}
+
+// Run the fused or staged float pipeline over image, reading the result into output[0 .. 2].
+// kernelSeconds is the device time from the first kernel's start to the last one's end
+static cl_int runProfileKernels(cl_context context, cl_command_queue queue, cl_program program, bool staged,
+								const ProfileTestImage& image, float L, std::vector<float>* output,
+								double* kernelSeconds)
+{
+	size_t count     = static_cast<size_t>(image.w) * image.h;
+	size_t planeSize = count * sizeof(float);
+
+	const float *planes[3] = { image.red.data(), image.green.data(), image.blue.data() };
+
+	cl_mem input[3] = { 0, 0, 0 }, result[3] = { 0, 0, 0 }, scratch[3] = { 0, 0, 0 };
+	cl_int err = CL_SUCCESS;
+
+	for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+	{
+		input[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, planeSize,
+								  const_cast<float*>(planes[i]), &err);
+
+		if (err == CL_SUCCESS) result[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, planeSize, 0, &err);
+		if (err == CL_SUCCESS && staged) scratch[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, planeSize, 0, &err);
+	}
+
+	// each stage reads three planes and writes three - the staged chain goes input -> result
+	// -> scratch -> result
+	const char *names[3]    = { "RGB_XYY_RGB", 0, 0 };
+	cl_mem *sources[3]      = { input, 0, 0 };
+	cl_mem *destinations[3] = { result, 0, 0 };
+	int numStages = 1;
+
+	if (staged)
+	{
+		names[0] = "RGB_XYY";	sources[0] = input;		destinations[0] = result;
+		names[1] = "XYY_XYZ";	sources[1] = result;	destinations[1] = scratch;
+		names[2] = "XYY_L";		sources[2] = scratch;	destinations[2] = result;
+		numStages = 3;
+	}
+
+	cl_kernel kernels[3] = { 0, 0, 0 };
+
+	for (int s = 0; s < numStages && err == CL_SUCCESS; ++s)
+	{
+		kernels[s] = clCreateKernel(program, names[s], &err);
+
+		if (err != CL_SUCCESS) break;
+
+		for (int i = 0; i < 3; ++i)
+		{
+			clSetKernelArg(kernels[s], i, sizeof(cl_mem), &sources[s][i]);
+			clSetKernelArg(kernels[s], i + 3, sizeof(cl_mem), &destinations[s][i]);
+		}
+
+		clSetKernelArg(kernels[s], 6, sizeof(cl_int), &image.w);
+		clSetKernelArg(kernels[s], 7, sizeof(cl_int), &image.h);
+
+		// the fused kernel and XYY_XYZ take the luminance scale
+		if (!staged || s == 1)
+			clSetKernelArg(kernels[s], 8, sizeof(cl_float), &L);
+	}
+
+	WorkGroupSize local[3];
+
+	for (int s = 0; s < numStages && err == CL_SUCCESS; ++s)
+		local[s] = WorkGroupTuner::shared().select(queue, kernels[s], image.w, image.h);
+
+	*kernelSeconds = 0.0;
+
+	for (int run = 0; run < profileTimingRuns && err == CL_SUCCESS; ++run)
+	{
+		cl_event events[3] = { 0, 0, 0 };
+
+		// the queue is in order, so each stage sees the previous one's result
+		for (int s = 0; s < numStages && err == CL_SUCCESS; ++s)
+			err = enqueueImageKernel(queue, kernels[s], image.w, image.h, local[s], 0, 0, &events[s]);
+
+		if (err == CL_SUCCESS) err = clWaitForEvents(1, &events[numStages - 1]);
+
+		if (err == CL_SUCCESS)
+		{
+			double seconds = eventSeconds(events[0], events[numStages - 1]);
+
+			if (run == 0 || seconds < *kernelSeconds) *kernelSeconds = seconds;
+		}
+
+		for (cl_event event : events)
+			if (event) clReleaseEvent(event);
+	}
+
+	for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+	{
+		output[i].resize(count);
+		err = traceCommand("download plane", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueReadBuffer(queue, result[i], CL_TRUE, 0, planeSize, output[i].data(), 0, 0, event);
+		});
+	}
+
+	for (cl_kernel kernel : kernels)
+		if (kernel) clReleaseKernel(kernel);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (input[i]) clReleaseMemObject(input[i]);
+		if (result[i]) clReleaseMemObject(result[i]);
+		if (scratch[i]) clReleaseMemObject(scratch[i]);
+	}
+
+	return err;
+}
+
+// The RGB -> xyY -> scale luminance -> RGB math of the kernels in double precision.  Returns
+// false for pixels with no defined chromaticity (X + Y + Z or Y not positive)
+static bool referencePixel(double r, double g, double b, double L, double* rgb)
+{
+	double X = 0.4124 * r + 0.3576 * g + 0.1805 * b;
+	double Y = 0.2126 * r + 0.7152 * g + 0.0722 * b;
+	double Z = 0.0193 * r + 0.1192 * g + 0.9505 * b;
+
+	double sum = X + Y + Z;
+
+	if (sum <= 0.0 || Y <= 0.0) return false;
+
+	double x  = X / sum;
+	double y  = Y / sum;
+	double Yl = Y * L;
+
+	X = x * (Yl / y);
+	Z = (1 - x - y) * (Yl / y);
+
+	rgb[0] =  3.2405 * X + -1.5371 * Yl + -0.4985 * Z;
+	rgb[1] = -0.9693 * X +  1.8760 * Yl +  0.0416 * Z;
+	rgb[2] =  0.0556 * X + -0.2040 * Yl +  1.0572 * Z;
+	return true;
+}
@@ -0,0 +1,77 @@
+//
+// Build profiles trading accuracy for speed, and the measurement used to choose between them.
+// Every profile builds the same HelloWorld.cl with different options:
+//
+//   BUILD_PROFILE_STRICT	-D STRICT_MATH, which turns off contraction with FP_CONTRACT OFF, plus
+//							-cl-fp32-correctly-rounded-divide-sqrt where the device supports
+//							it - elsewhere divides keep the 2.5 ulp the OpenCL spec allows
+//   BUILD_PROFILE_MAD		-cl-mad-enable - a * b + c may be a mad with reduced accuracy
+//   BUILD_PROFILE_RELAXED	-cl-fast-relaxed-math - also assumes no NaN or infinity and allows
+//							reassociation and approximate divides
+//   BUILD_PROFILE_NATIVE	-D NATIVE_MATH - the colour math divides with native_divide
+//
+// verifyBuildProfiles runs the fused and staged float pipelines of each profile over a test
+// corpus and measures the error against a double precision host reference, along with the
+// kernel time, so the fastest profile within a tolerance can be picked from data.
+//
+#ifndef _PRECISION_
+#define _PRECISION_
+
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+enum BuildProfile
+{
+	BUILD_PROFILE_STRICT = 0,
+	BUILD_PROFILE_MAD,
+	BUILD_PROFILE_RELAXED,
+	BUILD_PROFILE_NATIVE,
+
+	BUILD_PROFILE_COUNT
+};
+
+// parse "strict", "mad", "fast" or "native" - returns false for anything else
+bool parseBuildProfile(const char* name, BuildProfile* profile);
+
+const char* buildProfileName(BuildProfile profile);
+
+// Build options selecting the profile for device - every profile, strict included, has some
+std::string buildProfileOptions(BuildProfile profile, cl_device_id device);
+
+// One image of the verification corpus as float planes in [0, 1]
+struct ProfileTestImage
+{
+	std::string			name;
+	int					w, h;
+	std::vector<float>	red, green, blue;
+};
+
+// Synthetic images covering the cases the divides are sensitive to - every colour of a 64
+// level RGB cube, near black pixels (tiny denominators), saturated primaries and uniform noise
+std::vector<ProfileTestImage> syntheticProfileCorpus(void);
+
+// Error of one profile and pipeline over the whole corpus.  Outputs and reference are clamped
+// to [0, 1] as the 8-bit output is, and pixels with no defined chromaticity (black) are skipped
+// for the staged pipeline, which produces NaN for them
+struct ProfileAccuracy
+{
+	BuildProfile	profile;
+	bool			staged;			// RGB_XYY, XYY_XYZ, XYY_L rather than RGB_XYY_RGB
+	bool			built;			// false if the program or a run failed - the rest is unset
+	double			maxError;		// largest absolute error of any channel
+	double			meanError;		// mean absolute error over every channel
+	double			psnr;			// dB with a peak of 1 - infinity for an exact match
+	double			kernelSeconds;	// device time over the corpus, best of several runs
+};
+
+// Build every profile for device and measure it on corpus with luminance scale L.  Results
+// are in profile order, fused before staged
+std::vector<ProfileAccuracy> verifyBuildProfiles(cl_context context, cl_device_id device, const char* kernelFile,
+												 const std::vector<ProfileTestImage>& corpus, float L);
+
+// Index of the fastest result for the staged or fused pipeline whose maxError is within
+// tolerance, or -1 if none is
+int selectBuildProfile(const std::vector<ProfileAccuracy>& results, bool staged, double tolerance);
+
+#endif
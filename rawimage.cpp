@@ -0,0 +1,267 @@
+//
+// Memory mapped raw planar images - see rawimage.h
+//
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <filesystem>
+#include "rawimage.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char		rawImageMagic[4] = { 'C', 'P', 'F', 'I' };
+static const uint32_t	rawImageVersion = 1;
+
+// planes start on page boundaries so they satisfy CL_MEM_USE_HOST_PTR alignment and can be
+// used straight from the mapping
+static const uint64_t	rawPlaneAlignment = 4096;
+
+//
+// Private API
+//
+static int			mapFile(const std::wstring& imagePath, size_t createSize, MappedRawImage* mapped);
+static void			setPlanes(const RawImageHeader& header, MappedRawImage* mapped);
+static uint64_t		alignPlane(uint64_t bytes);
+static bool			validSize(uint64_t w, uint64_t h);
+static bool			planesFit(uint64_t planeOffset, uint64_t planeStride, uint64_t channels, uint64_t size);
+
+
+//
+// Public function implementation
+//
+bool isRawImagePath(const std::wstring& imagePath)
+{
+	std::wstring ext = std::filesystem::path(imagePath).extension().wstring();
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::towlower);
+
+	return ext == L".cpfi";
+}
+
+int mapRawImage(const std::wstring& imagePath, MappedRawImage* mapped)
+{
+	if (!mapped || mapFile(imagePath, 0, mapped) != 0) return 1;
+
+	RawImageHeader header;
+
+	bool valid = mapped->size >= sizeof(header);
+
+	if (valid)
+	{
+		memcpy(&header, mapped->view, sizeof(header));
+
+		// validSize bounds the plane well below 2^64 bytes, so planeBytes cannot wrap
+		valid = memcmp(header.magic, rawImageMagic, sizeof(rawImageMagic)) == 0 &&
+				header.version == rawImageVersion &&
+				header.type == RAW_TYPE_FLOAT32 &&
+				header.layout == RAW_LAYOUT_PLANAR &&
+				(header.channels == 3 || header.channels == 4) &&
+				validSize(header.width, header.height) &&
+				header.planeOffset >= sizeof(header) &&
+				header.planeOffset % rawPlaneAlignment == 0 &&
+				header.planeStride % rawPlaneAlignment == 0 &&
+				header.planeStride >= static_cast<uint64_t>(header.width) * header.height * sizeof(float) &&
+				planesFit(header.planeOffset, header.planeStride, header.channels, mapped->size);
+	}
+
+	if (!valid)
+	{
+		unmapRawImage(mapped);
+		return 1;
+	}
+
+	setPlanes(header, mapped);
+	return 0;
+}
+
+int createRawImage(const std::wstring& imagePath, const int w, const int h, const int channels, MappedRawImage* mapped)
+{
+	if (!mapped || w <= 0 || h <= 0 || !validSize(w, h) || (channels != 3 && channels != 4)) return 1;
+
+	RawImageHeader header = {};
+
+	memcpy(header.magic, rawImageMagic, sizeof(rawImageMagic));
+	header.version     = rawImageVersion;
+	header.width       = static_cast<uint32_t>(w);
+	header.height      = static_cast<uint32_t>(h);
+	header.channels    = static_cast<uint32_t>(channels);
+	header.type        = RAW_TYPE_FLOAT32;
+	header.layout      = RAW_LAYOUT_PLANAR;
+	header.planeOffset = alignPlane(sizeof(header));
+	header.planeStride = alignPlane(static_cast<uint64_t>(w) * h * sizeof(float));
+
+	// the file has to be addressable as a whole to be mapped
+	if (!planesFit(header.planeOffset, header.planeStride, channels, SIZE_MAX)) return 1;
+
+	size_t size = static_cast<size_t>(header.planeOffset + channels * header.planeStride);
+
+	if (mapFile(imagePath, size, mapped) != 0) return 1;
+
+	memcpy(mapped->view, &header, sizeof(header));
+
+	setPlanes(header, mapped);
+	return 0;
+}
+
+void unmapRawImage(MappedRawImage* mapped)
+{
+	if (!mapped) return;
+
+#ifdef _WIN32
+	if (mapped->view)
+	{
+		if (mapped->writable)
+			FlushViewOfFile(mapped->view, 0);
+
+		UnmapViewOfFile(mapped->view);
+	}
+
+	if (mapped->mapping) CloseHandle(static_cast<HANDLE>(mapped->mapping));
+	if (mapped->file) CloseHandle(static_cast<HANDLE>(mapped->file));
+#else
+	if (mapped->view)
+	{
+		if (mapped->writable)
+			msync(mapped->view, mapped->size, MS_SYNC);
+
+		munmap(mapped->view, mapped->size);
+	}
+
+	// the descriptor is stored offset by one so 0 means none
+	if (mapped->file)
+		close(static_cast<int>(reinterpret_cast<intptr_t>(mapped->file)) - 1);
+#endif
+
+	*mapped = MappedRawImage();
+}
+
+int saveRawImage(const CPFloatImage& image, const std::wstring& imagePath)
+{
+	if (!image.redChannel || !image.greenChannel || !image.blueChannel) return 1;
+
+	MappedRawImage mapped;
+
+	if (createRawImage(imagePath, image.w, image.h, image.alphaChannel ? 4 : 3, &mapped) != 0) return 1;
+
+	size_t planeBytes = static_cast<size_t>(image.w) * image.h * sizeof(float);
+
+	memcpy(mapped.image.redChannel, image.redChannel, planeBytes);
+	memcpy(mapped.image.greenChannel, image.greenChannel, planeBytes);
+	memcpy(mapped.image.blueChannel, image.blueChannel, planeBytes);
+
+	if (image.alphaChannel)
+		memcpy(mapped.image.alphaChannel, image.alphaChannel, planeBytes);
+
+	unmapRawImage(&mapped);
+	return 0;
+}
+
+
+//
+// Private API implementation
+//
+
+// Map an existing file copy-on-write (createSize == 0) or create and map a file of createSize
+// bytes for writing
+static int mapFile(const std::wstring& imagePath, size_t createSize, MappedRawImage* mapped)
+{
+	*mapped = MappedRawImage();
+	mapped->writable = (createSize > 0);
+
+#ifdef _WIN32
+	HANDLE file = CreateFileW(imagePath.c_str(), mapped->writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+							  FILE_SHARE_READ, NULL, mapped->writable ? CREATE_ALWAYS : OPEN_EXISTING,
+							  FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) return 1;
+
+	mapped->file = file;
+
+	LARGE_INTEGER size;
+	size.QuadPart = static_cast<LONGLONG>(createSize);
+
+	if (!mapped->writable && !GetFileSizeEx(file, &size))
+	{
+		unmapRawImage(mapped);
+		return 1;
+	}
+
+	mapped->size = static_cast<size_t>(size.QuadPart);
+
+	// creating a read/write mapping larger than the file extends it
+	HANDLE mapping = CreateFileMappingW(file, NULL, mapped->writable ? PAGE_READWRITE : PAGE_WRITECOPY,
+										size.HighPart, size.LowPart, NULL);
+
+	if (mapping)
+	{
+		mapped->mapping = mapping;
+		mapped->view = MapViewOfFile(mapping, mapped->writable ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, mapped->size);
+	}
+#else
+	std::string path = std::filesystem::path(imagePath).string();
+
+	int fd = open(path.c_str(), mapped->writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+
+	if (fd < 0) return 1;
+
+	mapped->file = reinterpret_cast<void*>(static_cast<intptr_t>(fd) + 1);
+
+	struct stat info;
+
+	if (mapped->writable)
+		mapped->size = (ftruncate(fd, static_cast<off_t>(createSize)) == 0) ? createSize : 0;
+	else
+		mapped->size = (fstat(fd, &info) == 0) ? static_cast<size_t>(info.st_size) : 0;
+
+	if (mapped->size > 0)
+	{
+		// private mappings are copy-on-write, so a read-only descriptor is enough
+		void *view = mmap(nullptr, mapped->size, PROT_READ | PROT_WRITE, mapped->writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+
+		mapped->view = (view == MAP_FAILED) ? nullptr : view;
+	}
+#endif
+
+	if (!mapped->view)
+	{
+		unmapRawImage(mapped);
+		return 1;
+	}
+	return 0;
+}
+
+static void setPlanes(const RawImageHeader& header, MappedRawImage* mapped)
+{
+	char *planes = static_cast<char*>(mapped->view) + header.planeOffset;
+
+	mapped->image.w = static_cast<int>(header.width);
+	mapped->image.h = static_cast<int>(header.height);
+
+	mapped->image.redChannel   = reinterpret_cast<float*>(planes);
+	mapped->image.greenChannel = reinterpret_cast<float*>(planes + header.planeStride);
+	mapped->image.blueChannel  = reinterpret_cast<float*>(planes + 2 * header.planeStride);
+	mapped->image.alphaChannel = (header.channels == 4) ? reinterpret_cast<float*>(planes + 3 * header.planeStride) : nullptr;
+}
+
+static uint64_t alignPlane(uint64_t bytes)
+{
+	return (bytes + rawPlaneAlignment - 1) & ~(rawPlaneAlignment - 1);
+}
+
+// Width and height fit an int, as does the pixel count the pipelines index planes with
+static bool validSize(uint64_t w, uint64_t h)
+{
+	return w > 0 && h > 0 && w <= INT_MAX && h <= INT_MAX && w * h <= INT_MAX;
+}
+
+// planeOffset + channels * planeStride <= size, without wrapping
+static bool planesFit(uint64_t planeOffset, uint64_t planeStride, uint64_t channels, uint64_t size)
+{
+	return planeOffset <= size && channels > 0 && planeStride <= (size - planeOffset) / channels;
+}
@@ -0,0 +1,76 @@
+//
+// Raw planar float image format (.cpfi) for intermediates between jobs.  A fixed header is
+// followed by one page aligned plane of w * h floats per channel in CPFloatImage order (red,
+// green, blue and optionally alpha), so the file can be memory mapped and the planes used in
+// place - passed to clCreateBuffer with CL_MEM_USE_HOST_PTR or to the CPU backend - with no
+// decode and no copy.  Values are little endian.  Width, height and w * h are limited to
+// INT_MAX, and the first plane starts after the header.
+//
+#ifndef _RAW_IMAGE_
+#define _RAW_IMAGE_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "imageio.h"
+
+enum RawImageType
+{
+	RAW_TYPE_FLOAT32 = 0
+};
+
+enum RawImageLayout
+{
+	RAW_LAYOUT_PLANAR = 0
+};
+
+struct RawImageHeader
+{
+	char		magic[4];		// "CPFI"
+	uint32_t	version;
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	channels;		// 3 (R, G, B) or 4 (R, G, B, A)
+	uint32_t	type;			// RawImageType
+	uint32_t	layout;			// RawImageLayout
+	uint32_t	reserved;
+	uint64_t	planeOffset;	// file offset of the red plane, page aligned
+	uint64_t	planeStride;	// bytes from one plane to the next, page aligned
+};
+
+// A mapped .cpfi file.  image's channel pointers point into the mapping and must not be freed
+struct MappedRawImage
+{
+	CPFloatImage	image;
+	void			*view;
+	size_t			size;
+	void			*file;			// HANDLEs on Windows, the descriptor on POSIX
+	void			*mapping;
+	bool			writable;		// created by createRawImage - flushed on unmap
+
+	MappedRawImage(void)
+	{
+		view = file = mapping = nullptr;
+		size = 0;
+		writable = false;
+	}
+};
+
+// true if imagePath has the .cpfi extension
+bool isRawImagePath(const std::wstring& imagePath);
+
+// Map an existing file copy-on-write - the planes can be modified (by the CPU backend working
+// in place, say) without changing the file.  Returns non-zero on failure
+int mapRawImage(const std::wstring& imagePath, MappedRawImage* mapped);
+
+// Create a w x h file with channels planes (3 or 4) and map it for writing - whatever is
+// written to the planes is in the file once unmapRawImage returns
+int createRawImage(const std::wstring& imagePath, const int w, const int h, const int channels, MappedRawImage* mapped);
+
+// flush (for created files) and unmap
+void unmapRawImage(MappedRawImage* mapped);
+
+// write image (alpha included when present) to a new .cpfi file
+int saveRawImage(const CPFloatImage& image, const std::wstring& imagePath);
+
+#endif
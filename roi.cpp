@@ -0,0 +1,287 @@
+//
+// Region of interest reprocessing - see roi.h
+//
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include "roi.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+//
+// Private API
+//
+static bool		rectsOverlap(const ImageRect& a, const ImageRect& b);
+static void		subtractRect(const ImageRect& rect, const ImageRect& cut, std::vector<ImageRect>* pieces);
+
+
+//
+// Public function implementation
+//
+bool parseImageRects(const char* text, std::vector<ImageRect>* rects)
+{
+	std::vector<ImageRect> parsed;
+	std::stringstream stream(text);
+	std::string item;
+
+	while (std::getline(stream, item, ':'))
+	{
+		ImageRect rect;
+
+		if (sscanf(item.c_str(), "%d,%d,%d,%d", &rect.x, &rect.y, &rect.w, &rect.h) != 4 || rect.w <= 0 || rect.h <= 0)
+			return false;
+
+		parsed.push_back(rect);
+	}
+
+	if (parsed.empty()) return false;
+
+	*rects = parsed;
+	return true;
+}
+
+std::vector<ImageRect> normaliseImageRects(const std::vector<ImageRect>& rects, int w, int h)
+{
+	std::vector<ImageRect> result;
+
+	for (ImageRect rect : rects)
+	{
+		int x0 = std::max(rect.x, 0), y0 = std::max(rect.y, 0);
+		int x1 = std::min(rect.x + rect.w, w), y1 = std::min(rect.y + rect.h, h);
+
+		if (x1 <= x0 || y1 <= y0) continue;
+
+		rect.x = x0;
+		rect.y = y0;
+		rect.w = x1 - x0;
+		rect.h = y1 - y0;
+
+		// cut every rectangle already accepted out of this one, so what is left covers only
+		// pixels no earlier rectangle does - unlike a bounding box it adds no pixels
+		std::vector<ImageRect> pieces(1, rect);
+
+		for (const ImageRect& accepted : result)
+		{
+			std::vector<ImageRect> remaining;
+
+			for (const ImageRect& piece : pieces)
+				subtractRect(piece, accepted, &remaining);
+
+			pieces.swap(remaining);
+
+			if (pieces.empty()) break;
+		}
+
+		result.insert(result.end(), pieces.begin(), pieces.end());
+	}
+
+	return result;
+}
+
+RegionPipeline::RegionPipeline(cl_context context, cl_program program)
+	: clContext(context), w(0), h(0)
+{
+	xyyKernel = clCreateKernel(program, "RGB_XYY", 0);
+	xyzKernel = clCreateKernel(program, "XYY_XYZ", 0);
+	rgbKernel = clCreateKernel(program, "XYY_L", 0);
+
+	for (int i = 0; i < 3; ++i)
+		input[i] = output[i] = scratch[i] = nullptr;
+}
+
+RegionPipeline::~RegionPipeline(void)
+{
+	releasePlanes();
+
+	if (xyyKernel) clReleaseKernel(xyyKernel);
+	if (xyzKernel) clReleaseKernel(xyzKernel);
+	if (rgbKernel) clReleaseKernel(rgbKernel);
+}
+
+cl_int RegionPipeline::load(cl_command_queue queue, const CPFloatImage& image, float luminanceScale,
+							float* redOut, float* greenOut, float* blueOut, RegionStats* stats)
+{
+	if (!valid()) return CL_INVALID_KERNEL;
+
+	if (!input[0] || image.w != w || image.h != h)
+	{
+		releasePlanes();
+
+		w = image.w;
+		h = image.h;
+
+		size_t planeSize = static_cast<size_t>(w) * h * sizeof(float);
+		cl_int err = CL_SUCCESS;
+
+		for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+		{
+			input[i] = clCreateBuffer(clContext, CL_MEM_READ_ONLY, planeSize, 0, &err);
+
+			if (err == CL_SUCCESS) output[i] = clCreateBuffer(clContext, CL_MEM_READ_WRITE, planeSize, 0, &err);
+			if (err == CL_SUCCESS) scratch[i] = clCreateBuffer(clContext, CL_MEM_READ_WRITE, planeSize, 0, &err);
+		}
+
+		if (err != CL_SUCCESS)
+		{
+			releasePlanes();
+			return err;
+		}
+
+		// the planes never change while the size stays the same, so the arguments are set once
+		for (int i = 0; i < 3; ++i)
+		{
+			clSetKernelArg(xyyKernel, i, sizeof(cl_mem), &input[i]);
+			clSetKernelArg(xyyKernel, i + 3, sizeof(cl_mem), &output[i]);
+			clSetKernelArg(xyzKernel, i, sizeof(cl_mem), &output[i]);
+			clSetKernelArg(xyzKernel, i + 3, sizeof(cl_mem), &scratch[i]);
+			clSetKernelArg(rgbKernel, i, sizeof(cl_mem), &scratch[i]);
+			clSetKernelArg(rgbKernel, i + 3, sizeof(cl_mem), &output[i]);
+		}
+
+		cl_kernel kernels[3] = { xyyKernel, xyzKernel, rgbKernel };
+
+		for (cl_kernel kernel : kernels)
+		{
+			clSetKernelArg(kernel, 6, sizeof(cl_int), &w);
+			clSetKernelArg(kernel, 7, sizeof(cl_int), &h);
+		}
+	}
+
+	ImageRect whole = { 0, 0, w, h };
+
+	return update(queue, image, std::vector<ImageRect>(1, whole), luminanceScale, redOut, greenOut, blueOut, stats);
+}
+
+cl_int RegionPipeline::update(cl_command_queue queue, const CPFloatImage& image, const std::vector<ImageRect>& dirty,
+							  float luminanceScale, float* redOut, float* greenOut, float* blueOut, RegionStats* stats)
+{
+	if (!input[0] || image.w != w || image.h != h) return CL_INVALID_MEM_OBJECT;
+
+	std::vector<ImageRect> rects = normaliseImageRects(dirty, w, h);
+
+	auto start = std::chrono::steady_clock::now();
+
+	const float *hostInput[3] = { image.redChannel, image.greenChannel, image.blueChannel };
+	float *hostOutput[3] = { redOut, greenOut, blueOut };
+
+	// host and device planes share the same layout, so one pitch serves both sides
+	size_t rowPitch = static_cast<size_t>(w) * sizeof(float);
+	size_t pixels = 0;
+
+	clSetKernelArg(xyzKernel, 8, sizeof(cl_float), &luminanceScale);
+
+	// the kernels bounds check against the image, not the rectangle, so the global size must
+	// be exact - the runtime picks a local size that divides it
+	const WorkGroupSize exact = { 0, 0, true };
+
+	cl_int err = CL_SUCCESS;
+
+	// the queue is in order, so each rectangle's commands follow the previous ones
+	for (const ImageRect& rect : rects)
+	{
+		size_t origin[3] = { static_cast<size_t>(rect.x) * sizeof(float), static_cast<size_t>(rect.y), 0 };
+		size_t region[3] = { static_cast<size_t>(rect.w) * sizeof(float), static_cast<size_t>(rect.h), 1 };
+		size_t offset[2] = { static_cast<size_t>(rect.x), static_cast<size_t>(rect.y) };
+
+		for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+			err = traceCommand("upload rect", queue, 0, [&](cl_event* event)
+			{
+				return clEnqueueWriteBufferRect(queue, input[i], CL_FALSE, origin, origin, region, rowPitch, 0, rowPitch, 0,
+												hostInput[i], 0, 0, event);
+			});
+
+		if (err == CL_SUCCESS) err = enqueueImageKernel(queue, xyyKernel, rect.w, rect.h, exact, 0, 0, 0, offset);
+		if (err == CL_SUCCESS) err = enqueueImageKernel(queue, xyzKernel, rect.w, rect.h, exact, 0, 0, 0, offset);
+		if (err == CL_SUCCESS) err = enqueueImageKernel(queue, rgbKernel, rect.w, rect.h, exact, 0, 0, 0, offset);
+
+		for (int i = 0; i < 3 && err == CL_SUCCESS; ++i)
+			err = traceCommand("download rect", queue, 0, [&](cl_event* event)
+			{
+				return clEnqueueReadBufferRect(queue, output[i], CL_FALSE, origin, origin, region, rowPitch, 0, rowPitch, 0,
+											   hostOutput[i], 0, 0, event);
+			});
+
+		pixels += static_cast<size_t>(rect.w) * rect.h;
+	}
+
+	cl_int finishErr = clFinish(queue);
+
+	if (err == CL_SUCCESS) err = finishErr;
+
+	if (stats)
+	{
+		stats->rects           = static_cast<int>(rects.size());
+		stats->pixels          = pixels;
+		stats->bytesUploaded   = pixels * 3 * sizeof(float);
+		stats->bytesDownloaded = pixels * 3 * sizeof(float);
+		stats->seconds         = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	return err;
+}
+
+
+//
+// Private function implementation
+//
+void RegionPipeline::releasePlanes(void)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		if (input[i]) clReleaseMemObject(input[i]);
+		if (output[i]) clReleaseMemObject(output[i]);
+		if (scratch[i]) clReleaseMemObject(scratch[i]);
+
+		input[i] = output[i] = scratch[i] = nullptr;
+	}
+}
+
+
+//
+// Private API implementation
+//
+static bool rectsOverlap(const ImageRect& a, const ImageRect& b)
+{
+	return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+// append what is left of rect once cut is removed - up to four disjoint rectangles: full width
+// bands above and below cut, then the parts left and right of it
+static void subtractRect(const ImageRect& rect, const ImageRect& cut, std::vector<ImageRect>* pieces)
+{
+	if (!rectsOverlap(rect, cut))
+	{
+		pieces->push_back(rect);
+		return;
+	}
+
+	int x1 = rect.x + rect.w, y1 = rect.y + rect.h;
+	int cutY0 = std::max(cut.y, rect.y), cutY1 = std::min(cut.y + cut.h, y1);
+
+	if (cut.y > rect.y)
+	{
+		ImageRect above = { rect.x, rect.y, rect.w, cut.y - rect.y };
+		pieces->push_back(above);
+	}
+
+	if (cut.y + cut.h < y1)
+	{
+		ImageRect below = { rect.x, cut.y + cut.h, rect.w, y1 - (cut.y + cut.h) };
+		pieces->push_back(below);
+	}
+
+	if (cut.x > rect.x)
+	{
+		ImageRect left = { rect.x, cutY0, cut.x - rect.x, cutY1 - cutY0 };
+		pieces->push_back(left);
+	}
+
+	if (cut.x + cut.w < x1)
+	{
+		ImageRect right = { cut.x + cut.w, cutY0, x1 - (cut.x + cut.w), cutY1 - cutY0 };
+		pieces->push_back(right);
+	}
+}
@@ -0,0 +1,78 @@
+//
+// Region of interest reprocessing for interactive editing.  RegionPipeline keeps the float
+// input planes, the staged pipeline's intermediates and the output planes resident on the
+// device.  After the whole image has been processed once, update() takes a list of dirty
+// rectangles and only those are uploaded (clEnqueueWriteBufferRect), run through
+// RGB_XYY -> XYY_XYZ -> XYY_L (launched over each rectangle with a global work offset) and read
+// back (clEnqueueReadBufferRect) into the caller's output planes, whose other pixels keep the
+// previous result.  Every stage only reads the pixel it writes, so a rectangle's result does
+// not depend on anything outside it and edit latency scales with the edited area.
+//
+#ifndef _ROI_
+#define _ROI_
+
+#include <CL/opencl.h>
+#include <vector>
+#include "imageio.h"
+
+struct ImageRect
+{
+	int		x, y, w, h;
+};
+
+// parse "x,y,w,h" rectangles separated by ':' - returns false if any is malformed
+bool parseImageRects(const char* text, std::vector<ImageRect>* rects);
+
+// clip rects to a w x h image, drop empty ones and split those that overlap into disjoint
+// rectangles, so no pixel is processed twice and none outside the rects is processed
+std::vector<ImageRect> normaliseImageRects(const std::vector<ImageRect>& rects, int w, int h);
+
+// what an update moved and how long it took
+struct RegionStats
+{
+	int			rects;
+	size_t		pixels;
+	size_t		bytesUploaded;
+	size_t		bytesDownloaded;
+	double		seconds;		// host time from the first upload to the last download
+};
+
+class RegionPipeline
+{
+public:
+
+	// program must be the float storage build of HelloWorld.cl
+	RegionPipeline(cl_context context, cl_program program);
+	~RegionPipeline(void);
+
+	RegionPipeline(const RegionPipeline&) = delete;
+	RegionPipeline& operator=(const RegionPipeline&) = delete;
+
+	bool valid(void) const { return xyyKernel && xyzKernel && rgbKernel; }
+
+	// (Re)create the resident planes for input's size and process the whole image, writing
+	// the result to the output planes
+	cl_int load(cl_command_queue queue, const CPFloatImage& input, float luminanceScale,
+				float* redOut, float* greenOut, float* blueOut, RegionStats* stats = nullptr);
+
+	// input has changed inside dirty only (or those pixels get a new luminanceScale) - upload
+	// and reprocess just those rectangles and read them into the output planes, which must
+	// hold the result of the previous load or update
+	cl_int update(cl_command_queue queue, const CPFloatImage& input, const std::vector<ImageRect>& dirty,
+				  float luminanceScale, float* redOut, float* greenOut, float* blueOut, RegionStats* stats = nullptr);
+
+private:
+
+	void releasePlanes(void);
+
+	cl_context			clContext;
+	cl_kernel			xyyKernel;		// RGB_XYY
+	cl_kernel			xyzKernel;		// XYY_XYZ
+	cl_kernel			rgbKernel;		// XYY_L
+	cl_mem				input[3];
+	cl_mem				output[3];		// RGB_XYY result, then the final result
+	cl_mem				scratch[3];		// XYY_XYZ result
+	int					w, h;
+};
+
+#endif
@@ -7,18 +7,82 @@
 #include <string>
 #include <locale>
 #include <exception>
+#include <stdexcept>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <random>
 #include "setup_cl.h"
+#include "convolution.h"
+#include "trace.h"
 
-// Helper function to report available platforms and devices and create and return an OpenCL context
-cl_context createContext(void) 
+// On-disk program binary cache state
+static std::string			programCacheDirectory("kernel_cache");
+static ProgramCacheStats	programCacheStats = { 0, 0, 0, 0 };
+static std::mutex			programCacheStatsLock;		// createProgram runs on pipeline lanes, daemon workers and variant builds at once
+
+// Header written in front of every cached binary
+struct ProgramCacheHeader
+{
+	char		magic[4];		// "CLBC"
+	uint32_t	version;
+	uint64_t	key;			// hash of source, options and device identity
+	uint64_t	size;			// binary size in bytes
+	uint64_t	checksum;		// hash of the binary itself
+};
+
+static const uint32_t programCacheVersion = 1;
+
+//
+// Private API
+//
+static uint64_t		hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL);
+static std::string	getDeviceString(cl_device_id device, cl_device_info param);
+static std::string	getPlatformString(cl_platform_id platform, cl_platform_info param);
+static std::string	programOptions(const char* buildOptions);
+static uint64_t		programCacheKey(cl_device_id device, uint64_t sourceHash, const std::string& options);
+static std::string	programCachePath(uint64_t key);
+static cl_program	loadCachedProgram(cl_context context, cl_device_id device, uint64_t key, const std::string& options);
+static void			storeCachedProgram(cl_program program, cl_device_id device, uint64_t key);
+static cl_int		buildProgram(cl_program program, cl_device_id device, const std::string& options, bool reportErrors);
+static void			countCacheEvent(unsigned int ProgramCacheStats::*counter);
+
+bool parseDeviceType(const char* name, cl_device_type* type)
+{
+	if (strcmp(name, "gpu") == 0)
+		*type = CL_DEVICE_TYPE_GPU;
+	else if (strcmp(name, "cpu") == 0)
+		*type = CL_DEVICE_TYPE_CPU;
+	else if (strcmp(name, "accelerator") == 0)
+		*type = CL_DEVICE_TYPE_ACCELERATOR;
+	else if (strcmp(name, "all") == 0)
+		*type = CL_DEVICE_TYPE_ALL;
+	else
+		return false;
+
+	return true;
+}
+
+// Helper function to report available platforms and devices and return the devices matching 
+// selector, in platform order
+std::vector<cl_device_id> selectDevices(const DeviceSelector& selector, bool report) 
 {
 	cl_int				clerr;
 	cl_uint				numPlatforms;
-	cl_platform_id		*platformArray;
 	std::locale			loc;
-	cl_context			context = nullptr;
-	const				std::string platformToFind = std::string("NVIDIA");
-	int					platformIndex = -1;
+	std::vector<cl_device_id> selected;
+	int					matchIndex = 0;
+
+	// Case insensitive substring match used for the platform and vendor filters
+	auto contains = [&loc](std::string text, std::string pattern)
+	{
+		for (char& c : text) c = std::toupper(c, loc);
+		for (char& c : pattern) c = std::toupper(c, loc);
+
+		return text.find(pattern) != std::string::npos;
+	};
 
 	try 
 	{
@@ -26,95 +90,129 @@ cl_context createContext(void)
 		clerr = clGetPlatformIDs(0, nullptr, &numPlatforms);
 
 		if (clerr != CL_SUCCESS || numPlatforms == 0)
-			throw std::exception("No OpenCL platforms found");
+			throw std::runtime_error("No OpenCL platforms found");
 
 		// Create the array of available platforms
-		platformArray = (cl_platform_id*)malloc(numPlatforms * sizeof(cl_platform_id));
-
-		if (!platformArray)
-			throw std::exception("Unable to create platform array");
+		std::vector<cl_platform_id> platformArray(numPlatforms);
 
-		// Get platform list - for this application we'll use only the first platform found
-		clerr = clGetPlatformIDs(numPlatforms, platformArray, nullptr);
+		// Get platform list
+		clerr = clGetPlatformIDs(numPlatforms, platformArray.data(), nullptr);
 
 		// Validate returned platform
-		if (clerr != CL_SUCCESS || numPlatforms == 0)
-			throw std::exception("Unable to obtain platform information");
+		if (clerr != CL_SUCCESS)
+			throw std::runtime_error("Unable to obtain platform information");
 
 		// Cycle through each platform and display information
 		for (cl_uint i = 0; i < numPlatforms; ++i) 
 		{
-			// Used to store size of buffer for clGetPlatformInfo to put results of queries
-			size_t resultSize; 
-
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_PROFILE, 0, nullptr, &resultSize);
-			char *platformProfile = static_cast<char*>(malloc(resultSize));
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_PROFILE, resultSize, platformProfile, nullptr);
-
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_NAME, 0, nullptr, &resultSize);
-			char *platformName = static_cast<char*>(malloc(resultSize));
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_NAME, resultSize, platformName, nullptr);
-
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_VERSION, 0, nullptr, &resultSize);
-			char *platformVersion = static_cast<char*>(malloc(resultSize));
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_VERSION, resultSize, platformVersion, nullptr);
+			std::string platformName = getPlatformString(platformArray[i], CL_PLATFORM_NAME);
 
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_VENDOR, 0, nullptr, &resultSize);
-			char *platformVendor = static_cast<char*>(malloc(resultSize));
-			clerr = clGetPlatformInfo(platformArray[i], CL_PLATFORM_VENDOR, resultSize, platformVendor, nullptr);
-
-			std::cout << "Platform " << i << " profile : " << platformProfile
-					  << "\nPlatform " << i << " name    : " << platformName
-					  << "\nPlatform " << i << " version : " << platformVersion
-					  << "\nPlatform " << i << " vendor  : " << platformVendor << std::endl;
+			if (report)
+				std::cout << "Platform " << i << " profile : " << getPlatformString(platformArray[i], CL_PLATFORM_PROFILE)
+						  << "\nPlatform " << i << " name    : " << platformName
+						  << "\nPlatform " << i << " version : " << getPlatformString(platformArray[i], CL_PLATFORM_VERSION)
+						  << "\nPlatform " << i << " vendor  : " << getPlatformString(platformArray[i], CL_PLATFORM_VENDOR) 
+						  << std::endl;
 
 			// Query and report info on the devices available in the current platform
-			cl_uint numDevices;
+			cl_uint numDevices = 0;
 
 			// Query number of devices
 			clGetDeviceIDs(platformArray[i], CL_DEVICE_TYPE_ALL, 0, nullptr, &numDevices);
 
-			// Allocate buffer to store device info
-			cl_device_id *devices = static_cast<cl_device_id*>(malloc(numDevices * sizeof(cl_device_id)));
-
 			// Get device info
-			clGetDeviceIDs(platformArray[i], CL_DEVICE_TYPE_ALL, numDevices, devices, nullptr);
+			std::vector<cl_device_id> devices(numDevices);
+
+			if (numDevices > 0)
+				clGetDeviceIDs(platformArray[i], CL_DEVICE_TYPE_ALL, numDevices, devices.data(), nullptr);
+
+			bool platformMatches = selector.platform.empty() || contains(platformName, selector.platform);
 
 			for (cl_uint j = 0; j < numDevices; ++j) 
 			{
 				cl_uint maxComputeUnits, maxWorkItemDim;
+				cl_device_type deviceType;
 
-				clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &maxComputeUnits, &resultSize);
-				clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &maxWorkItemDim, &resultSize);
+				clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &maxComputeUnits, nullptr);
+				clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &maxWorkItemDim, nullptr);
+				clGetDeviceInfo(devices[j], CL_DEVICE_TYPE, sizeof(cl_device_type), &deviceType, nullptr);
 
-				std::cout << "\nMax compute units for device " << j << " = " << maxComputeUnits 
-						  << "\nMax work item dimensions for device " << j << " = " << maxWorkItemDim 
-						  << std::endl;
+				std::string deviceVendor = getDeviceString(devices[j], CL_DEVICE_VENDOR);
+
+				if (report)
+					std::cout << "\nDevice " << j << " name    : " << getDeviceString(devices[j], CL_DEVICE_NAME)
+							  << "\nDevice " << j << " vendor  : " << deviceVendor
+							  << "\nMax compute units for device " << j << " = " << maxComputeUnits 
+							  << "\nMax work item dimensions for device " << j << " = " << maxWorkItemDim 
+							  << std::endl;
+
+				if (!platformMatches || (deviceType & selector.type) == 0)
+					continue;
+
+				if (!selector.vendor.empty() && !contains(deviceVendor, selector.vendor))
+					continue;
+
+				// index counts matching devices across all platforms
+				if (selector.index < 0 || selector.index == matchIndex)
+					selected.push_back(devices[j]);
+
+				matchIndex++;
 			}
 
-			std::cout << "// --------------------------\n\n";
+			if (report)
+				std::cout << "// --------------------------\n\n";
+		}
+	}
+	catch (std::exception& err)
+	{
+		std::cout << err.what() << std::endl;
+	}
+	return selected;
+}
+
+// Helper function to report available platforms and devices and create and return an OpenCL 
+// context holding the devices matching selector.  A context cannot span platforms so only the 
+// matching devices of the first platform with a match are used.
+cl_context createContext(const DeviceSelector& selector) 
+{
+	cl_context			context = nullptr;
 
-			// Check if platform i is an nVidia-based platform
-			for (size_t k = 0; k < strlen(platformName); ++k)
-				platformName[k] = toupper(platformName[k], loc);
+	try 
+	{
+		std::vector<cl_device_id> devices = selectDevices(selector, true);
+
+		if (devices.empty())
+			throw std::runtime_error("No OpenCL device matches the device selection");
+
+		cl_platform_id platform = nullptr;
+		clGetDeviceInfo(devices[0], CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+
+		std::vector<cl_device_id> contextDevices;
+
+		for (cl_device_id device : devices)
+		{
+			cl_platform_id devicePlatform = nullptr;
+			clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &devicePlatform, nullptr);
 
-			size_t found = std::string(platformName).find(platformToFind);
-			if (found != std::string::npos && platformIndex == -1)
-				platformIndex = i;
+			if (devicePlatform == platform)
+				contextDevices.push_back(device);
 		}
 
-		// Create OpenCL context based on the first available nVidia platform
+		// Create OpenCL context based on the selected devices
 		cl_context_properties contextProperties[] = 
 		{
 			CL_CONTEXT_PLATFORM,
-			reinterpret_cast<cl_context_properties>(platformArray[platformIndex]),
+			reinterpret_cast<cl_context_properties>(platform),
 			0
 		};
 
-		context = clCreateContextFromType(contextProperties, CL_DEVICE_TYPE_GPU, nullptr, nullptr, nullptr);
+		cl_int clerr;
+
+		context = clCreateContext(contextProperties, static_cast<cl_uint>(contextDevices.size()), contextDevices.data(), 
+								  nullptr, nullptr, &clerr);
 
 		if (clerr != CL_SUCCESS || !context)
-			throw std::exception("Unable to create a valid GPU context");
+			throw std::runtime_error("Unable to create a valid context");
 
 		return context;
 	}
@@ -127,8 +225,11 @@ cl_context createContext(void)
 
 
 // Helper function to load the kernel source code from a suitable (text) file and setup an OpenCL program object
-cl_program createProgram(cl_context context, cl_device_id device, const char* fileName) 
+cl_program createProgram(cl_context context, cl_device_id device, const char* fileName, const char* buildOptions) 
 {
+	// covers loading a cached binary as well as a full compile
+	TraceSpan span("build program", "build");
+
 	// Open the kernel file - the extension can be anything, including .txt since it's just a text file
 	std::ifstream kernelFile(fileName, std::ios::in);
 
@@ -145,6 +246,26 @@ cl_program createProgram(cl_context context, cl_device_id device, const char* fi
 	// Extract a std::string from the stringstream object
 	std::string srcString = oss.str();
 
+	std::string options = programOptions(buildOptions);
+
+	// Try the binary cache first
+	uint64_t key = 0;
+
+	if (!programCacheDirectory.empty())
+	{
+		key = programCacheKey(device, hashBytes(srcString.data(), srcString.size()), options);
+
+		cl_program cached = loadCachedProgram(context, device, key, options);
+
+		if (cached)
+		{
+			countCacheEvent(&ProgramCacheStats::hits);
+			return cached;
+		}
+
+		countCacheEvent(&ProgramCacheStats::misses);
+	}
+
 	// Obtain the pointer to the contained C string
 	const char* src = srcString.c_str();
 
@@ -159,9 +280,279 @@ cl_program createProgram(cl_context context, cl_device_id device, const char* fi
 	}
 
 	// Attempt to build program object
-	err = clBuildProgram(program, 0, 0, 0, 0, 0);
+	err = buildProgram(program, device, options, true);
 
 	if (err != CL_SUCCESS) 
+	{
+		// Clean-up
+		clReleaseProgram(program);
+		return nullptr;
+	}
+
+	if (!programCacheDirectory.empty())
+		storeCachedProgram(program, device, key);
+
+	return program;
+}
+
+bool hashProgramSource(const char* fileName, uint64_t* sourceHash)
+{
+	std::ifstream kernelFile(fileName, std::ios::in);
+
+	if (!kernelFile.is_open())
+		return false;
+
+	std::ostringstream oss;
+	oss << kernelFile.rdbuf();
+
+	std::string source = oss.str();
+
+	*sourceHash = hashBytes(source.data(), source.size());
+	return true;
+}
+
+bool isProgramCached(cl_device_id device, uint64_t sourceHash, const char* buildOptions)
+{
+	if (programCacheDirectory.empty())
+		return false;
+
+	uint64_t key = programCacheKey(device, sourceHash, programOptions(buildOptions));
+
+	std::error_code ec;
+	return std::filesystem::is_regular_file(programCachePath(key), ec);
+}
+
+double eventSeconds(cl_event first, cl_event last)
+{
+	cl_ulong t0 = 0, t1 = 0;
+
+	clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t0, 0);
+	clGetEventProfilingInfo(last ? last : first, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t1, 0);
+
+	return static_cast<double>(t1 - t0) * 1.0e-9;
+}
+
+void setProgramCacheDirectory(const std::string& directory)
+{
+	programCacheDirectory = directory;
+}
+
+ProgramCacheStats getProgramCacheStats(void)
+{
+	std::lock_guard<std::mutex> guard(programCacheStatsLock);
+	return programCacheStats;
+}
+
+// random rather than a process id so it also differs between threads
+std::string uniqueTempPath(const std::string& path)
+{
+	static std::mutex lock;
+	static std::mt19937_64 generator{ (static_cast<uint64_t>(std::random_device()()) << 32) ^ std::random_device()() };
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%016llx.tmp", static_cast<unsigned long long>(generator()));
+
+	return path + suffix;
+}
+
+//
+// Private API implementation
+//
+
+// 64-bit FNV-1a
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+	const unsigned char *ptr = static_cast<const unsigned char*>(data);
+
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ ptr[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static std::string getDeviceString(cl_device_id device, cl_device_info param)
+{
+	size_t resultSize = 0;
+
+	if (clGetDeviceInfo(device, param, 0, nullptr, &resultSize) != CL_SUCCESS || resultSize == 0)
+		return std::string();
+
+	std::string result(resultSize, '\0');
+	clGetDeviceInfo(device, param, resultSize, &result[0], nullptr);
+	result.resize(strlen(result.c_str()));
+	return result;
+}
+
+static std::string getPlatformString(cl_platform_id platform, cl_platform_info param)
+{
+	size_t resultSize = 0;
+
+	if (clGetPlatformInfo(platform, param, 0, nullptr, &resultSize) != CL_SUCCESS || resultSize == 0)
+		return std::string();
+
+	std::string result(resultSize, '\0');
+	clGetPlatformInfo(platform, param, resultSize, &result[0], nullptr);
+	result.resize(strlen(result.c_str()));
+	return result;
+}
+
+// Everything that can change the compiled binary goes into the key - a driver update changes 
+// CL_DRIVER_VERSION so stale binaries are simply never looked up again
+// sourceHash is hashBytes of the kernel source, which the rest of the key continues from
+static uint64_t programCacheKey(cl_device_id device, uint64_t sourceHash, const std::string& options)
+{
+	cl_platform_id platform = nullptr;
+	clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, nullptr);
+
+	std::string identity = getDeviceString(device, CL_DEVICE_NAME) + '\n' +
+						   getDeviceString(device, CL_DEVICE_VENDOR) + '\n' +
+						   getDeviceString(device, CL_DEVICE_VERSION) + '\n' +
+						   getDeviceString(device, CL_DRIVER_VERSION) + '\n' +
+						   getPlatformString(platform, CL_PLATFORM_NAME) + '\n' +
+						   getPlatformString(platform, CL_PLATFORM_VERSION);
+
+	uint64_t hash = hashBytes("\0", 1, sourceHash);
+	hash = hashBytes(options.data(), options.size(), hash);
+	hash = hashBytes("\0", 1, hash);
+	return hashBytes(identity.data(), identity.size(), hash);
+}
+
+static std::string programCachePath(uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+
+	return (std::filesystem::path(programCacheDirectory) / name).string();
+}
+
+// Return a built program from the cache, or nullptr if there is no usable entry for key
+static cl_program loadCachedProgram(cl_context context, cl_device_id device, uint64_t key, const std::string& options)
+{
+	std::ifstream cacheFile(programCachePath(key), std::ios::in | std::ios::binary);
+
+	if (!cacheFile.is_open())
+		return nullptr;
+
+	ProgramCacheHeader header;
+	std::vector<unsigned char> binary;
+
+	bool valid = static_cast<bool>(cacheFile.read(reinterpret_cast<char*>(&header), sizeof(header))) &&
+				 memcmp(header.magic, "CLBC", 4) == 0 &&
+				 header.version == programCacheVersion &&
+				 header.key == key &&
+				 header.size > 0 && header.size < (1ULL << 31);
+
+	if (valid)
+	{
+		binary.resize(static_cast<size_t>(header.size));
+		valid = static_cast<bool>(cacheFile.read(reinterpret_cast<char*>(binary.data()), binary.size())) &&
+				hashBytes(binary.data(), binary.size()) == header.checksum;
+	}
+
+	if (!valid)
+	{
+		countCacheEvent(&ProgramCacheStats::rejected);
+		return nullptr;
+	}
+
+	const unsigned char *binaryPtr = binary.data();
+	size_t binarySize = binary.size();
+	cl_int binaryStatus, err;
+
+	cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &binaryPtr, &binaryStatus, &err);
+
+	if (program && err == CL_SUCCESS && binaryStatus == CL_SUCCESS)
+		err = buildProgram(program, device, options, false);
+
+	if (!program || err != CL_SUCCESS || binaryStatus != CL_SUCCESS)
+	{
+		if (program) clReleaseProgram(program);
+		countCacheEvent(&ProgramCacheStats::rejected);
+		return nullptr;
+	}
+	return program;
+}
+
+static void storeCachedProgram(cl_program program, cl_device_id device, uint64_t key)
+{
+	// the program was built for a single device so there is exactly one binary
+	size_t binarySize = 0;
+
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, nullptr) != CL_SUCCESS || 
+		binarySize == 0)
+		return;
+
+	std::vector<unsigned char> binary(binarySize);
+	unsigned char *binaryPtr = binary.data();
+
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryPtr, nullptr) != CL_SUCCESS)
+		return;
+
+	std::error_code ec;
+	std::filesystem::create_directories(programCacheDirectory, ec);
+
+	ProgramCacheHeader header;
+	memcpy(header.magic, "CLBC", 4);
+	header.version = programCacheVersion;
+	header.key = key;
+	header.size = binarySize;
+	header.checksum = hashBytes(binary.data(), binary.size());
+
+	// write to a temporary file and rename so a concurrent reader never sees a partial entry.  The
+	// temporary name is unique so threads or processes storing the same key do not share it
+	std::string path = programCachePath(key);
+	std::string tempPath = uniqueTempPath(path);
+
+	{
+		std::ofstream cacheFile(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+
+		if (!cacheFile.is_open())
+			return;
+
+		cacheFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		cacheFile.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+
+		if (!cacheFile)
+		{
+			cacheFile.close();
+			std::filesystem::remove(tempPath, ec);
+			return;
+		}
+	}
+
+	std::filesystem::rename(tempPath, path, ec);
+
+	if (ec)
+		std::filesystem::remove(tempPath, ec);
+	else
+		countCacheEvent(&ProgramCacheStats::stored);
+}
+
+// Options every build gets (the convolution tile size) followed by buildOptions
+static std::string programOptions(const char* buildOptions)
+{
+	std::string options = convolutionBuildOptions();
+
+	if (buildOptions && *buildOptions)
+		options += std::string(" ") + buildOptions;
+
+	return options;
+}
+
+static void countCacheEvent(unsigned int ProgramCacheStats::*counter)
+{
+	std::lock_guard<std::mutex> guard(programCacheStatsLock);
+	programCacheStats.*counter += 1;
+}
+
+// Build program for device, optionally printing the build log on failure
+static cl_int buildProgram(cl_program program, cl_device_id device, const std::string& options, bool reportErrors)
+{
+	cl_int err = clBuildProgram(program, 1, &device, options.c_str(), 0, 0);
+
+	if (err != CL_SUCCESS && reportErrors) 
 	{
 		size_t logSize;
 		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &logSize);
@@ -173,9 +564,7 @@ cl_program createProgram(cl_context context, cl_device_id device, const char* fi
 		std::cout << "Error in kernel:\n\n";
 		std::cout << buildLog;
 
-		// Clean-up
-		clReleaseProgram(program);
-		return nullptr;
+		free(buildLog);
 	}
-	return program;
-}
\ No newline at end of file
+	return err;
+}
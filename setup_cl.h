@@ -1,9 +1,70 @@
 #ifndef _SETUP_CL_
 #define _SETUP_CL_
 
-#include <CL\opencl.h>
+#include <CL/opencl.h>
+#include <cstdint>
+#include <string>
+#include <vector>
 
-cl_context createContext();
-cl_program createProgram(cl_context context, cl_device_id device, const char* fileName);
+// Counters for the on-disk program binary cache used by createProgram
+struct ProgramCacheStats
+{
+	unsigned int	hits;		// programs created from a cached binary
+	unsigned int	misses;		// no usable binary - built from source
+	unsigned int	rejected;	// cached binary found but corrupt or refused by the driver (also counted as a miss)
+	unsigned int	stored;		// binaries written to the cache after a source build
+};
+
+// Device selection criteria.  The default matches the original behaviour - GPUs on the first 
+// platform whose name contains "NVIDIA"
+struct DeviceSelector
+{
+	std::string		platform;	// case insensitive substring of the platform name ("" matches any)
+	std::string		vendor;		// case insensitive substring of the device vendor ("" matches any)
+	cl_device_type	type;		// CL_DEVICE_TYPE_GPU, _CPU, _ACCELERATOR or _ALL
+	int				index;		// index into the list of matching devices, -1 selects all of them
+
+	DeviceSelector(void)
+		: platform("NVIDIA"), vendor(), type(CL_DEVICE_TYPE_GPU), index(-1)
+	{
+	}
+};
+
+// parse "gpu", "cpu", "accelerator" or "all" - returns false for anything else
+bool parseDeviceType(const char* name, cl_device_type* type);
+
+// Return every device matching selector across all platforms, optionally printing the 
+// available platforms and devices
+std::vector<cl_device_id> selectDevices(const DeviceSelector& selector, bool report = false);
+
+// Create a context holding the devices matching selector on the first platform that has any
+cl_context createContext(const DeviceSelector& selector = DeviceSelector());
+
+// Build the program in fileName for device.  buildOptions follow the options every build gets 
+// (convolutionBuildOptions).  Binaries are cached on disk keyed by a hash of the kernel 
+// source, the options and the device/driver identity, so later runs skip the source build; 
+// any mismatch or corrupt cache file falls back to building from source.
+cl_program createProgram(cl_context context, cl_device_id device, const char* fileName, const char* buildOptions = nullptr);
+
+// Hash of the kernel source in fileName as the binary cache keys it, for isProgramCached.  
+// Returns false if the file cannot be read
+bool hashProgramSource(const char* fileName, uint64_t* sourceHash);
+
+// True if createProgram would find a cached binary for the source hashed to sourceHash built 
+// with buildOptions on device - the entry is only looked up, not validated
+bool isProgramCached(cl_device_id device, uint64_t sourceHash, const char* buildOptions = nullptr);
+
+// Device time in seconds from the start of first to the end of last (first itself when last is 
+// null).  The queue needs CL_QUEUE_PROFILING_ENABLE and the commands must have completed
+double eventSeconds(cl_event first, cl_event last = nullptr);
+
+// Directory for cached program binaries (default "kernel_cache").  An empty string disables the cache.
+void setProgramCacheDirectory(const std::string& directory);
+
+ProgramCacheStats getProgramCacheStats(void);
+
+// path plus a random ".<hex>.tmp" suffix, for writing a cache file that is then renamed over
+// path - no two threads or processes get the same temporary file
+std::string uniqueTempPath(const std::string& path);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,168 @@
+//
+// Storage mode helpers - see storage.h
+//
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include "storage.h"
+
+//
+// Private API
+//
+static std::string	floatLiteral(float value);
+
+
+//
+// Public function implementation
+//
+bool parseStorageMode(const char* name, StorageMode* mode)
+{
+	if (strcmp(name, "float") == 0)
+		*mode = STORAGE_FLOAT;
+	else if (strcmp(name, "half") == 0)
+		*mode = STORAGE_HALF;
+	else if (strcmp(name, "unorm16") == 0)
+		*mode = STORAGE_UNORM16;
+	else
+		return false;
+
+	return true;
+}
+
+const char* storageModeName(StorageMode mode)
+{
+	switch (mode)
+	{
+	case STORAGE_HALF:		return "half";
+	case STORAGE_UNORM16:	return "unorm16";
+	default:				return "float";
+	}
+}
+
+std::string storageBuildOptions(StorageMode mode)
+{
+	switch (mode)
+	{
+	case STORAGE_HALF:		return "-D STORAGE_HALF";
+	case STORAGE_UNORM16:	return "-D STORAGE_UNORM16 -D STORAGE_RANGE=" + floatLiteral(storageUnorm16Range);
+	default:				return "";
+	}
+}
+
+size_t storageElementSize(StorageMode mode)
+{
+	return (mode == STORAGE_FLOAT) ? sizeof(float) : sizeof(uint16_t);
+}
+
+void storageToFloat(StorageMode mode, const void* src, float* dst, size_t count)
+{
+	if (mode == STORAGE_HALF)
+	{
+		const uint16_t *s = static_cast<const uint16_t*>(src);
+
+		for (size_t i = 0; i < count; ++i)
+			dst[i] = halfToFloat(s[i]);
+	}
+	else if (mode == STORAGE_UNORM16)
+	{
+		const uint16_t *s = static_cast<const uint16_t*>(src);
+		const float scale = storageUnorm16Range / 65535.0f;
+
+		for (size_t i = 0; i < count; ++i)
+			dst[i] = s[i] * scale;
+	}
+	else
+		memcpy(dst, src, count * sizeof(float));
+}
+
+uint16_t floatToHalf(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+
+	uint16_t sign     = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	int      exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+	if (exponent >= 0x1f)
+		return sign | 0x7c00;
+
+	if (exponent <= 0)
+	{
+		if (exponent < -10) return sign;
+
+		// denormal - shift the mantissa, with its implicit bit, into place
+		mantissa |= 0x800000;
+
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+
+		if (rest > halfway || (rest == halfway && (half & 1))) ++half;
+
+		return sign | static_cast<uint16_t>(half);
+	}
+
+	uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+
+	// a carry out of the mantissa correctly bumps the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) ++half;
+
+	return sign | static_cast<uint16_t>(half);
+}
+
+float halfToFloat(uint16_t h)
+{
+	uint32_t sign     = static_cast<uint32_t>(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0x1f)
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent != 0)
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	else if (mantissa == 0)
+		bits = sign;
+	else
+	{
+		// denormal - normalise the mantissa
+		exponent = 113;
+
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			exponent--;
+		}
+
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+
+//
+// Private function implementation
+//
+
+
+// OpenCL C float literal that reads back as exactly value
+static std::string floatLiteral(float value)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.9gf", value);
+
+	// "2f" is not a valid literal - the kernel needs "2.0f"
+	if (!strpbrk(text, ".eEn"))
+		snprintf(text, sizeof(text), "%.1ff", value);
+
+	return text;
+}
@@ -0,0 +1,53 @@
+//
+// Storage formats for the planar pipeline's intermediate and output buffers.  The kernels are
+// compiled once per mode - storageBuildOptions gives the options to pass to createProgram -
+// and every buffer between (and after) the kernels holds values of storageElementSize bytes:
+//
+//   STORAGE_FLOAT		32-bit float, the original layout
+//   STORAGE_HALF		16-bit IEEE half through vload_half / vstore_half - no cl_khr_fp16 needed
+//   STORAGE_UNORM16	16-bit unsigned normalised over [0, storageUnorm16Range].  Negative
+//						values clamp to 0
+//
+// The inputs are always float planes.
+//
+#ifndef _STORAGE_
+#define _STORAGE_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum StorageMode
+{
+	STORAGE_FLOAT = 0,
+	STORAGE_HALF,
+	STORAGE_UNORM16
+};
+
+// Upper end of the STORAGE_UNORM16 range.  Z reaches 1.09 and the XYZ -> RGB step can
+// overshoot 1 for saturated colours, so [0, 1] is not enough
+const float storageUnorm16Range = 2.0f;
+
+// parse "float", "half" or "unorm16" - returns false for anything else
+bool parseStorageMode(const char* name, StorageMode* mode);
+
+const char* storageModeName(StorageMode mode);
+
+// Build options selecting the mode in HelloWorld.cl - empty for STORAGE_FLOAT.  The unorm16
+// build is given STORAGE_RANGE from storageUnorm16Range
+std::string storageBuildOptions(StorageMode mode);
+
+// Bytes per stored value
+size_t storageElementSize(StorageMode mode);
+
+// Convert count stored values back to float
+void storageToFloat(StorageMode mode, const void* src, float* dst, size_t count);
+
+// IEEE 754 binary32 -> binary16, rounding to nearest even.  Values too small for a half
+// denormal become zero and values too large become infinity
+uint16_t floatToHalf(float f);
+
+// IEEE 754 binary16 -> binary32, including denormals, infinities and NaN
+float halfToFloat(uint16_t h);
+
+#endif
@@ -0,0 +1,592 @@
+//
+// Frame sequence streaming with a ring of device and pinned host buffers - see stream.h
+//
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "stream.h"
+#include "imageio.h"
+#include "buffer_pool.h"
+#include "setup_cl.h"
+#include "autotune.h"
+#include "kernel_variants.h"
+#include "trace_cl.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// one frame in flight - the buffers are acquired once for the whole stream
+struct StreamSlot
+{
+	cl_mem				deviceInput;
+	cl_mem				deviceOutput;
+	StagingBuffer		hostInput;
+	StagingBuffer		hostOutput;
+	cl_kernel			kernel;
+	cl_event			writeEvent, kernelEvent, readEvent;
+	int					frame;
+	bool				busy;
+	std::chrono::steady_clock::time_point started;
+
+	StreamSlot(void)
+		: deviceInput(nullptr), deviceOutput(nullptr), kernel(nullptr),
+		  writeEvent(nullptr), kernelEvent(nullptr), readEvent(nullptr), frame(0), busy(false)
+	{
+		hostInput = hostOutput = StagingBuffer();
+	}
+};
+
+// Where frames come from.  Numbered images are decoded straight into the slot's pinned input;
+// raw frames are read into one reused frame buffer and converted to BGRA
+struct FrameSource
+{
+	bool					numbered;
+	std::string				pattern;
+	int						nextNumber;
+	FILE					*raw;
+	RawFrameFormat			format;
+	std::vector<unsigned char>	frame;
+	int						w, h;
+
+	FrameSource(void)
+		: numbered(false), nextNumber(0), raw(nullptr), format(RAW_FRAME_BGRA), w(0), h(0)
+	{
+	}
+};
+
+//
+// Private API
+//
+static bool		expandFramePattern(const std::string& pattern, int number, std::string* path);
+static bool		openFrameSource(const StreamOptions& options, FrameSource* source, CPBitmapImage* firstImage);
+static bool		readRawFrame(FrameSource* source, BGRA8* output);
+static void		convertRawFrame(RawFrameFormat format, int w, int h, const unsigned char* src, BGRA8* dst);
+static double	percentile(const std::vector<double>& sorted, double p);
+
+
+//
+// Public function implementation
+//
+bool parseRawFrameFormat(const char* name, RawFrameFormat* format)
+{
+	if (strcmp(name, "bgra") == 0)
+		*format = RAW_FRAME_BGRA;
+	else if (strcmp(name, "rgb24") == 0)
+		*format = RAW_FRAME_RGB24;
+	else if (strcmp(name, "bgr24") == 0)
+		*format = RAW_FRAME_BGR24;
+	else if (strcmp(name, "i420") == 0)
+		*format = RAW_FRAME_I420;
+	else
+		return false;
+
+	return true;
+}
+
+const char* rawFrameFormatName(RawFrameFormat format)
+{
+	switch (format)
+	{
+	case RAW_FRAME_RGB24:	return "rgb24";
+	case RAW_FRAME_BGR24:	return "bgr24";
+	case RAW_FRAME_I420:	return "i420";
+	default:				return "bgra";
+	}
+}
+
+size_t rawFrameSize(RawFrameFormat format, int w, int h)
+{
+	size_t pixels = static_cast<size_t>(w) * h;
+
+	switch (format)
+	{
+	case RAW_FRAME_RGB24:
+	case RAW_FRAME_BGR24:	return pixels * 3;
+	case RAW_FRAME_I420:	return pixels + 2 * (static_cast<size_t>(w / 2) * (h / 2));
+	default:				return pixels * 4;
+	}
+}
+
+int runStream(cl_context context, cl_device_id device, cl_program program, const StreamOptions& options,
+			  KernelVariantCache* variants)
+{
+	FrameSource source;
+	CPBitmapImage firstImage;
+
+	if (!openFrameSource(options, &source, &firstImage))
+		return 1;
+
+	int w = source.w, h = source.h;
+	size_t numPixels = static_cast<size_t>(w) * h;
+
+	// a destination with a %d conversion is numbered images, anything else one raw bgr24 file
+	std::string checkedPath;
+	bool numberedOutput = !options.destination.empty() && expandFramePattern(options.destination, 0, &checkedPath);
+	FILE *rawOutput = nullptr;
+
+	if (!options.destination.empty() && !numberedOutput)
+	{
+		rawOutput = fopen(options.destination.c_str(), "wb");
+
+		if (!rawOutput)
+		{
+			std::cout << "cannot create " << options.destination << std::endl;
+			free(firstImage.buffer);
+			if (source.raw && source.raw != stdin) fclose(source.raw);
+			return 1;
+		}
+	}
+
+	// upload, compute and download on their own in-order queues, chained with events
+	cl_command_queue uploadQueue   = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue computeQueue  = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue downloadQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+
+	int ringSize = std::max(options.ringSize, 2);
+
+	std::vector<StreamSlot> slots(ringSize);
+
+	// the whole ring is allocated here, once - the pools only serve as owners of the buffers
+	DeviceBufferPool devicePool(context);
+	HostStagingPool  stagingPool(context, downloadQueue);
+
+	bool ready = uploadQueue && computeQueue && downloadQueue;
+
+	for (StreamSlot& slot : slots)
+	{
+		if (!ready) break;
+
+		slot.deviceInput  = devicePool.acquire(numPixels * sizeof(BGRA8), CL_MEM_READ_ONLY);
+		slot.deviceOutput = devicePool.acquire(numPixels * sizeof(bgr8), CL_MEM_WRITE_ONLY);
+		slot.hostInput    = stagingPool.acquire(numPixels * sizeof(BGRA8));
+		slot.hostOutput   = stagingPool.acquire(numPixels * sizeof(bgr8));
+
+		// every frame has the same key, so the variant is worth building before the first one - 
+		// a stream of unknown length counts as endless
+		if (variants)
+			slot.kernel = variants->selectKernel(nullptr, "BGRA8_XYY_BGR8", w, h, options.luminanceScale, 
+												 (options.maxFrames > 0) ? options.maxFrames : INT_MAX);
+		else
+			slot.kernel = clCreateKernel(program, "BGRA8_XYY_BGR8", 0);
+
+		ready = slot.deviceInput && slot.deviceOutput && slot.hostInput.buffer && slot.hostOutput.buffer && slot.kernel;
+
+		if (ready)
+		{
+			clSetKernelArg(slot.kernel, 0, sizeof(cl_mem), &slot.deviceInput);
+			clSetKernelArg(slot.kernel, 1, sizeof(cl_mem), &slot.deviceOutput);
+			clSetKernelArg(slot.kernel, 2, sizeof(cl_int), &w);
+			clSetKernelArg(slot.kernel, 3, sizeof(cl_int), &h);
+			clSetKernelArg(slot.kernel, 4, sizeof(cl_float), &options.luminanceScale);
+		}
+	}
+
+	WorkGroupSize local = { 0, 0, true };
+
+	if (ready)
+		local = WorkGroupTuner::shared().select(computeQueue, slots[0].kernel, w, h);
+	else
+		std::cout << "cannot allocate the stream ring (" << ringSize << " x " << w << "x" << h << ")\n";
+
+	// Writer thread - completes frames in submission order and hands their slots back
+	std::deque<StreamSlot*> pending;
+	std::mutex lock;
+	std::condition_variable changed;
+	bool producerDone = false;
+
+	std::vector<double> latencies, kernelTimes;
+	latencies.reserve(4096);
+	kernelTimes.reserve(4096);
+
+	int failures = 0;
+
+	std::thread writer([&](void)
+	{
+		initCOM();
+
+		for (;;)
+		{
+			StreamSlot *slot;
+
+			{
+				std::unique_lock<std::mutex> guard(lock);
+
+				changed.wait(guard, [&](void) { return producerDone || !pending.empty(); });
+
+				if (pending.empty()) break;
+
+				slot = pending.front();
+				pending.pop_front();
+			}
+
+			bool ok = (clWaitForEvents(1, &slot->readEvent) == CL_SUCCESS);
+
+			bgr8 *result = static_cast<bgr8*>(slot->hostOutput.hostPtr);
+			std::string framePath;
+
+			if (ok && numberedOutput && expandFramePattern(options.destination, slot->frame, &framePath))
+				ok = (saveImage(w, h, result, std::filesystem::path(framePath).wstring()) == 0);
+			else if (ok && rawOutput)
+				ok = (fwrite(result, sizeof(bgr8), numPixels, rawOutput) == numPixels);
+
+			double kernelMs = eventSeconds(slot->kernelEvent) * 1000.0;
+
+			clReleaseEvent(slot->writeEvent);
+			clReleaseEvent(slot->kernelEvent);
+			clReleaseEvent(slot->readEvent);
+			slot->writeEvent = slot->kernelEvent = slot->readEvent = nullptr;
+
+			std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - slot->started;
+
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (ok)
+			{
+				latencies.push_back(latency.count());
+				kernelTimes.push_back(kernelMs);
+			}
+			else
+				++failures;
+
+			slot->busy = false;
+			changed.notify_all();
+		}
+
+		shutdownCOM();
+	});
+
+	auto streamStart = std::chrono::steady_clock::now();
+	int submitted = 0;
+
+	for (int n = 0; ready && (options.maxFrames <= 0 || n < options.maxFrames); ++n)
+	{
+		StreamSlot& slot = slots[n % ringSize];
+
+		// wait for the writer to finish with frame n - ringSize
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [&](void) { return !slot.busy; });
+		}
+
+		slot.started = std::chrono::steady_clock::now();
+		slot.frame   = source.numbered ? source.nextNumber : n;
+
+		// a failed enqueue below must only see events set for this frame
+		slot.writeEvent = slot.kernelEvent = slot.readEvent = nullptr;
+
+		BGRA8 *input = static_cast<BGRA8*>(slot.hostInput.hostPtr);
+		bool haveFrame;
+
+		if (firstImage.buffer)
+		{
+			// the first numbered image was decoded to find the stream size
+			memcpy(input, firstImage.buffer, numPixels * sizeof(BGRA8));
+			free(firstImage.buffer);
+			firstImage.buffer = nullptr;
+			source.nextNumber++;
+			haveFrame = true;
+		}
+		else if (source.numbered)
+		{
+			std::string path;
+			expandFramePattern(source.pattern, source.nextNumber, &path);
+
+			// the first missing number ends the sequence
+			if (!std::filesystem::exists(path)) break;
+
+			int frameW = 0, frameH = 0;
+
+			auto intoSlot = [&](int fw, int fh) -> BGRA8* { return (fw == w && fh == h) ? input : nullptr; };
+
+			haveFrame = (loadImage(std::filesystem::path(path).wstring(), intoSlot, &frameW, &frameH) == 0);
+
+			if (!haveFrame)
+			{
+				std::cout << "cannot load " << path << " (frames must all be " << w << "x" << h << ")\n";
+				++failures;
+				break;
+			}
+
+			source.nextNumber++;
+		}
+		else if (!(haveFrame = readRawFrame(&source, input)))
+			break;
+
+		cl_int err = traceCommand("upload", uploadQueue, &slot.writeEvent, [&](cl_event* event)
+		{
+			return clEnqueueWriteBuffer(uploadQueue, slot.deviceInput, CL_FALSE, 0, numPixels * sizeof(BGRA8),
+										input, 0, 0, event);
+		});
+
+		if (err == CL_SUCCESS)
+			err = enqueueImageKernel(computeQueue, slot.kernel, w, h, local, 1, &slot.writeEvent, &slot.kernelEvent);
+
+		if (err == CL_SUCCESS)
+			err = traceCommand("download", downloadQueue, &slot.readEvent, [&](cl_event* event)
+			{
+				return clEnqueueReadBuffer(downloadQueue, slot.deviceOutput, CL_FALSE, 0, numPixels * sizeof(bgr8),
+										   slot.hostOutput.hostPtr, 1, &slot.kernelEvent, event);
+			});
+
+		// cross-queue waits need every queue flushed
+		clFlush(uploadQueue);
+		clFlush(computeQueue);
+		clFlush(downloadQueue);
+
+		if (err != CL_SUCCESS)
+		{
+			std::cout << "cannot enqueue frame " << n << " (error " << err << ")\n";
+
+			clFinish(uploadQueue);
+			clFinish(computeQueue);
+			clFinish(downloadQueue);
+
+			if (slot.writeEvent) clReleaseEvent(slot.writeEvent);
+			if (slot.kernelEvent) clReleaseEvent(slot.kernelEvent);
+			if (slot.readEvent) clReleaseEvent(slot.readEvent);
+			slot.writeEvent = slot.kernelEvent = slot.readEvent = nullptr;
+
+			++failures;
+			break;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			slot.busy = true;
+			pending.push_back(&slot);
+		}
+
+		changed.notify_all();
+		++submitted;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		producerDone = true;
+	}
+
+	changed.notify_all();
+	writer.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - streamStart).count();
+
+	std::sort(latencies.begin(), latencies.end());
+
+	double kernelMean = 0.0;
+	for (double t : kernelTimes) kernelMean += t;
+	if (!kernelTimes.empty()) kernelMean /= kernelTimes.size();
+
+	std::cout << "Streamed " << latencies.size() << " of " << submitted << " frames (" << w << "x" << h << ", ring of "
+			  << ringSize << ") in " << seconds << "s - " << (seconds > 0.0 ? latencies.size() / seconds : 0.0) << " fps\n";
+
+	if (!latencies.empty())
+		std::cout << "Frame latency ms: p50 = " << percentile(latencies, 0.50) << ", p90 = " << percentile(latencies, 0.90)
+				  << ", p99 = " << percentile(latencies, 0.99) << ", max = " << latencies.back()
+				  << "; mean kernel = " << kernelMean << " ms\n";
+
+	devicePool.report("Stream device buffers");
+	stagingPool.report("Stream pinned buffers");
+
+	for (StreamSlot& slot : slots)
+	{
+		if (slot.kernel) clReleaseKernel(slot.kernel);
+		if (slot.deviceInput) devicePool.release(slot.deviceInput);
+		if (slot.deviceOutput) devicePool.release(slot.deviceOutput);
+		if (slot.hostInput.buffer) stagingPool.release(slot.hostInput);
+		if (slot.hostOutput.buffer) stagingPool.release(slot.hostOutput);
+	}
+
+	if (rawOutput) fclose(rawOutput);
+	if (source.raw && source.raw != stdin) fclose(source.raw);
+	free(firstImage.buffer);
+
+	if (uploadQueue) clReleaseCommandQueue(uploadQueue);
+	if (computeQueue) clReleaseCommandQueue(computeQueue);
+	if (downloadQueue) clReleaseCommandQueue(downloadQueue);
+
+	return (ready && failures == 0) ? 0 : 1;
+}
+
+
+//
+// Private API implementation
+//
+
+// Substitute number for the single %d (optionally %0<width>d) conversion in pattern.  %% is a
+// literal percent.  Returns false if pattern has no conversion or anything else after a %
+static bool expandFramePattern(const std::string& pattern, int number, std::string* path)
+{
+	std::string result;
+	int conversions = 0;
+
+	for (size_t i = 0; i < pattern.size(); ++i)
+	{
+		if (pattern[i] != '%')
+		{
+			result += pattern[i];
+			continue;
+		}
+
+		if (i + 1 < pattern.size() && pattern[i + 1] == '%')
+		{
+			result += '%';
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		bool zeroPad = (j < pattern.size() && pattern[j] == '0');
+		int width = 0;
+
+		while (j < pattern.size() && isdigit(static_cast<unsigned char>(pattern[j])))
+			width = width * 10 + (pattern[j++] - '0');
+
+		if (j >= pattern.size() || pattern[j] != 'd' || width > 16) return false;
+
+		std::string digits = std::to_string(number);
+
+		if (static_cast<int>(digits.size()) < width)
+			digits.insert(0, width - digits.size(), zeroPad ? '0' : ' ');
+
+		result += digits;
+		++conversions;
+		i = j;
+	}
+
+	if (conversions != 1) return false;
+
+	*path = result;
+	return true;
+}
+
+// Open the source and find the frame size - from the options for raw frames, or by decoding
+// the first numbered image (kept in firstImage so it is not decoded twice)
+static bool openFrameSource(const StreamOptions& options, FrameSource* source, CPBitmapImage* firstImage)
+{
+	std::string firstPath;
+
+	source->numbered = expandFramePattern(options.source, options.firstFrame, &firstPath);
+
+	if (source->numbered)
+	{
+		source->pattern    = options.source;
+		source->nextNumber = options.firstFrame;
+
+		if (loadImage(std::filesystem::path(firstPath).wstring(), firstImage) != 0)
+		{
+			std::cout << "cannot load the first frame " << firstPath << std::endl;
+			return false;
+		}
+
+		source->w = firstImage->w;
+		source->h = firstImage->h;
+		return true;
+	}
+
+	if (options.w <= 0 || options.h <= 0 || (options.rawFormat == RAW_FRAME_I420 && ((options.w | options.h) & 1)))
+	{
+		std::cout << "raw streams need a frame size (even for i420)\n";
+		return false;
+	}
+
+	if (options.source == "-")
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		source->raw = stdin;
+	}
+	else
+		source->raw = fopen(options.source.c_str(), "rb");
+
+	if (!source->raw)
+	{
+		std::cout << "cannot open " << options.source << std::endl;
+		return false;
+	}
+
+	source->format = options.rawFormat;
+	source->w      = options.w;
+	source->h      = options.h;
+
+	if (source->format != RAW_FRAME_BGRA)
+		source->frame.resize(rawFrameSize(source->format, source->w, source->h));
+
+	return true;
+}
+
+// read the next whole frame - BGRA goes straight into output.  A short read ends the stream
+static bool readRawFrame(FrameSource* source, BGRA8* output)
+{
+	if (source->format == RAW_FRAME_BGRA)
+	{
+		size_t bytes = rawFrameSize(RAW_FRAME_BGRA, source->w, source->h);
+		return fread(output, 1, bytes, source->raw) == bytes;
+	}
+
+	if (fread(source->frame.data(), 1, source->frame.size(), source->raw) != source->frame.size())
+		return false;
+
+	convertRawFrame(source->format, source->w, source->h, source->frame.data(), output);
+	return true;
+}
+
+static void convertRawFrame(RawFrameFormat format, int w, int h, const unsigned char* src, BGRA8* dst)
+{
+	size_t numPixels = static_cast<size_t>(w) * h;
+
+	if (format == RAW_FRAME_RGB24 || format == RAW_FRAME_BGR24)
+	{
+		int r = (format == RAW_FRAME_RGB24) ? 0 : 2;
+
+		for (size_t i = 0; i < numPixels; ++i, src += 3)
+			dst[i] = BGRA8(src[2 - r], src[1], src[r], 255);
+
+		return;
+	}
+
+	// I420 - full resolution Y plane then quarter resolution U and V planes.  BT.709 with
+	// limited range (Y in [16, 235], U and V in [16, 240]) as used for HD and UHD video
+	const unsigned char *Y = src;
+	const unsigned char *U = Y + numPixels;
+	const unsigned char *V = U + static_cast<size_t>(w / 2) * (h / 2);
+
+	auto clampByte = [](float v) -> BYTE { return static_cast<BYTE>(std::min(std::max(v + 0.5f, 0.0f), 255.0f)); };
+
+	for (int y = 0; y < h; ++y)
+	{
+		const unsigned char *uRow = U + static_cast<size_t>(y / 2) * (w / 2);
+		const unsigned char *vRow = V + static_cast<size_t>(y / 2) * (w / 2);
+
+		for (int x = 0; x < w; ++x)
+		{
+			float luma = (Y[static_cast<size_t>(y) * w + x] - 16) * (255.0f / 219.0f);
+			float cb   = (uRow[x / 2] - 128) * (255.0f / 224.0f);
+			float cr   = (vRow[x / 2] - 128) * (255.0f / 224.0f);
+
+			dst[static_cast<size_t>(y) * w + x] = BGRA8(clampByte(luma + 1.8556f * cb),
+														clampByte(luma - 0.1873f * cb - 0.4681f * cr),
+														clampByte(luma + 1.5748f * cr), 255);
+		}
+	}
+}
+
+// nearest rank percentile of an ascending list
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+
+	return sorted[std::min(std::max(rank, static_cast<size_t>(1)), sorted.size()) - 1];
+}
@@ -0,0 +1,62 @@
+//
+// Frame sequence streaming.  A stream is either numbered image files (a pattern such as
+// frames/f%05d.png) or raw frames of a fixed size read from stdin or a file (which may be a
+// pipe).  Every frame goes through the packed BGRA8_XYY_BGR8 kernel using a fixed ring of
+// slots - pinned host input and output buffers plus device buffers - sized once from the stream
+// resolution, so no frame allocates.  The upload, kernel and download of each frame are
+// enqueued without blocking on separate queues chained with events, and a writer thread waits
+// for each download in order and writes the result, so reading frame n + 1, processing frame
+// n and writing frame n - 1 overlap.  Sustained fps and per frame latency percentiles (frame
+// read to result written) are reported at the end.
+//
+#ifndef _STREAM_
+#define _STREAM_
+
+#include <CL/opencl.h>
+#include <string>
+
+class KernelVariantCache;
+
+// layout of raw input frames
+enum RawFrameFormat
+{
+	RAW_FRAME_BGRA = 0,		// 32bpp B, G, R, A - uploaded as is
+	RAW_FRAME_RGB24,		// 24bpp R, G, B
+	RAW_FRAME_BGR24,		// 24bpp B, G, R
+	RAW_FRAME_I420			// planar YUV 4:2:0 (yuv420p), BT.709 limited range - even sizes only
+};
+
+// parse "bgra", "rgb24", "bgr24" or "i420" - returns false for anything else
+bool parseRawFrameFormat(const char* name, RawFrameFormat* format);
+
+const char* rawFrameFormatName(RawFrameFormat format);
+
+// bytes of one w x h frame
+size_t rawFrameSize(RawFrameFormat format, int w, int h);
+
+struct StreamOptions
+{
+	std::string		source;				// pattern with a %d conversion (%05d etc) for numbered
+										// images, "-" for raw frames on stdin or a raw file
+	std::string		destination;		// pattern for numbered outputs, a raw bgr24 file, or
+										// empty to only measure
+	int				firstFrame;			// number of the first numbered image
+	int				maxFrames;			// 0 to run until the source ends
+	int				w, h;				// raw frame size
+	RawFrameFormat	rawFormat;
+	int				ringSize;			// frames in flight
+	float			luminanceScale;
+
+	StreamOptions(void)
+		: firstFrame(0), maxFrames(0), w(0), h(0), rawFormat(RAW_FRAME_BGRA), ringSize(3), luminanceScale(0.5f)
+	{
+	}
+};
+
+// Process the stream and print the throughput and latency report.  With variants every frame 
+// runs a kernel specialised for the stream's size and luminance scale.  Returns non-zero if the
+// stream could not be set up or a frame failed
+int runStream(cl_context context, cl_device_id device, cl_program program, const StreamOptions& options,
+			  KernelVariantCache* variants = nullptr);
+
+#endif
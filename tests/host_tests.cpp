@@ -0,0 +1,630 @@
+//
+// Host side checks for imagecore, run by ctest.  Every SIMD level the CPU supports is compared
+// with the scalar code and the scalar code with straightforward references written here:
+//
+//   cpuSeparableConvolution	against a direct 2D sum in double precision, clamping at the edges
+//   cpuScaleLuminance			each SIMD level against CPU_SIMD_SCALAR
+//   image_convert			BGRA8 to float, float to BGR8, range and grey conversion against
+//							per pixel loops - every level must give the same bytes
+//   encodePNG / TIFF		decoded again here (chunk CRCs, inflate, unfiltering / undoing the
+//							predictor) and compared with the input pixels, for every compression
+//   saveImage				the colour and grey float overloads through PNG and TIFF, decoded as
+//							above, and .cpfi files mapped back with mapRawImage
+//
+// Image sizes are chosen so rows do not fill whole vectors and span several strips.  Returns
+// the number of failed checks.
+//
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "cpu_pipeline.h"
+#include "image_convert.h"
+#include "image_encoder.h"
+#include "imageio.h"
+#include "rawimage.h"
+#include "thread_pool.h"
+
+static int failures = 0;
+
+//
+// Private API
+//
+static void					check(bool passed, const std::string& what);
+static std::vector<CPUSimdLevel> testedLevels(void);
+static std::vector<float>	randomPlane(std::mt19937& random, size_t count, float lo, float hi);
+static std::string			tempImagePath(const char* extension);
+static bool					readFile(const std::string& path, std::vector<unsigned char>* data);
+static uint32_t				get32BE(const unsigned char* p);
+static uint32_t				get32LE(const unsigned char* p);
+static uint16_t				get16LE(const unsigned char* p);
+static bool					decodePNG(const std::string& path, int* w, int* h, std::vector<unsigned char>* bgr);
+static bool					decodeTIFF(const std::string& path, int* w, int* h, std::vector<unsigned char>* bgr);
+static void					testConvolution(ThreadPool& pool);
+static void					testScaleLuminance(ThreadPool& pool);
+static void					testImageConvert(ThreadPool& pool);
+static void					testEncoders(void);
+static void					testSaveImage(void);
+
+
+int main(void)
+{
+	// more than one thread so the row splitting is exercised even on a single core runner
+	ThreadPool pool(4);
+
+	testConvolution(pool);
+	testScaleLuminance(pool);
+	testImageConvert(pool);
+	testEncoders();
+	testSaveImage();
+
+	if (failures)
+		std::cout << failures << " check(s) failed\n";
+	else
+		std::cout << "all checks passed\n";
+
+	return failures;
+}
+
+
+//
+// Private API implementation
+//
+static void check(bool passed, const std::string& what)
+{
+	if (!passed)
+	{
+		std::cout << "FAILED: " << what << std::endl;
+		failures++;
+	}
+}
+
+// scalar plus every SIMD level the build and CPU support
+static std::vector<CPUSimdLevel> testedLevels(void)
+{
+	std::vector<CPUSimdLevel> levels(1, CPU_SIMD_SCALAR);
+	CPUSimdLevel detected = cpuDetectSimdLevel();
+
+	if (detected == CPU_SIMD_NEON)
+		levels.push_back(CPU_SIMD_NEON);
+	else
+		for (int level = CPU_SIMD_SSE; level <= detected; ++level)
+			levels.push_back(static_cast<CPUSimdLevel>(level));
+
+	return levels;
+}
+
+static std::vector<float> randomPlane(std::mt19937& random, size_t count, float lo, float hi)
+{
+	std::uniform_real_distribution<float> value(lo, hi);
+	std::vector<float> plane(count);
+
+	for (float& v : plane)
+		v = value(random);
+
+	return plane;
+}
+
+static std::string tempImagePath(const char* extension)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "imagecore_host_tests";
+
+	path += extension;
+	return path.string();
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>* data)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+
+	if (!file) return false;
+
+	unsigned char buffer[65536];
+	size_t read;
+
+	data->clear();
+
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		data->insert(data->end(), buffer, buffer + read);
+
+	fclose(file);
+	return true;
+}
+
+static uint32_t get32BE(const unsigned char* p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static uint32_t get32LE(const unsigned char* p)
+{
+	return (static_cast<uint32_t>(p[3]) << 24) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[0];
+}
+
+static uint16_t get16LE(const unsigned char* p)
+{
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+// 8-bit RGB, non-interlaced PNGs only - which is all encodePNG writes
+static bool decodePNG(const std::string& path, int* w, int* h, std::vector<unsigned char>* bgr)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+	std::vector<unsigned char> file, idat;
+
+	if (!readFile(path, &file) || file.size() < 8 || memcmp(file.data(), signature, 8) != 0)
+		return false;
+
+	bool ended = false;
+
+	for (size_t pos = 8; pos + 12 <= file.size() && !ended; )
+	{
+		uint32_t length = get32BE(&file[pos]);
+
+		if (pos + 12 + length > file.size()) return false;
+
+		const unsigned char *type = &file[pos + 4];
+		const unsigned char *data = &file[pos + 8];
+
+		// the CRC covers the type and the data
+		if (crc32(crc32(0, nullptr, 0), type, length + 4) != get32BE(data + length))
+			return false;
+
+		if (memcmp(type, "IHDR", 4) == 0)
+		{
+			*w = static_cast<int>(get32BE(data));
+			*h = static_cast<int>(get32BE(data + 4));
+
+			// bit depth 8, colour type 2 (RGB), no interlace
+			if (length != 13 || data[8] != 8 || data[9] != 2 || data[12] != 0) return false;
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+			idat.insert(idat.end(), data, data + length);
+		else if (memcmp(type, "IEND", 4) == 0)
+			ended = true;
+
+		pos += 12 + length;
+	}
+
+	if (!ended || *w <= 0 || *h <= 0) return false;
+
+	size_t rowBytes = static_cast<size_t>(*w) * 3;
+	std::vector<unsigned char> lines((rowBytes + 1) * *h);
+	uLongf size = static_cast<uLongf>(lines.size());
+
+	// uncompress also checks the Adler-32 the encoder combined from its pieces
+	if (uncompress(lines.data(), &size, idat.data(), static_cast<uLong>(idat.size())) != Z_OK || size != lines.size())
+		return false;
+
+	std::vector<unsigned char> rgb(rowBytes * *h);
+
+	for (int y = 0; y < *h; ++y)
+	{
+		const unsigned char *line = &lines[y * (rowBytes + 1)];
+		unsigned char *row = &rgb[y * rowBytes];
+		const unsigned char *above = y > 0 ? row - rowBytes : nullptr;
+
+		for (size_t i = 0; i < rowBytes; ++i)
+		{
+			int a = i >= 3 ? row[i - 3] : 0;
+			int b = above ? above[i] : 0;
+			int c = (above && i >= 3) ? above[i - 3] : 0;
+			int predicted;
+
+			switch (line[0])
+			{
+			case 0:		predicted = 0; break;
+			case 1:		predicted = a; break;
+			case 2:		predicted = b; break;
+			case 3:		predicted = (a + b) / 2; break;
+			case 4:
+			{
+				int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+				predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+				break;
+			}
+			default:	return false;
+			}
+
+			row[i] = static_cast<unsigned char>(line[1 + i] + predicted);
+		}
+	}
+
+	bgr->resize(rgb.size());
+
+	for (size_t i = 0; i < rgb.size(); i += 3)
+	{
+		(*bgr)[i]     = rgb[i + 2];
+		(*bgr)[i + 1] = rgb[i + 1];
+		(*bgr)[i + 2] = rgb[i];
+	}
+
+	return true;
+}
+
+// little endian, chunky 8-bit RGB strips, uncompressed or Deflate with an optional horizontal
+// predictor - which covers what TiffStripEncoder writes
+static bool decodeTIFF(const std::string& path, int* w, int* h, std::vector<unsigned char>* bgr)
+{
+	std::vector<unsigned char> file;
+
+	if (!readFile(path, &file) || file.size() < 8 || memcmp(file.data(), "II*\0", 4) != 0)
+		return false;
+
+	uint32_t ifd = get32LE(&file[4]);
+
+	if (ifd + 2 > file.size()) return false;
+
+	uint32_t compression = 1, predictor = 1, rowsPerStrip = 0, numStrips = 0, offsetsAt = 0, countsAt = 0;
+	uint32_t samples = 0, photometric = 0;
+	int entries = get16LE(&file[ifd]);
+
+	if (ifd + 2 + 12 * entries > file.size()) return false;
+
+	*w = *h = 0;
+
+	for (int i = 0; i < entries; ++i)
+	{
+		const unsigned char *entry = &file[ifd + 2 + 12 * i];
+		uint16_t tag = get16LE(entry), type = get16LE(entry + 2);
+		uint32_t count = get32LE(entry + 4);
+
+		// a single SHORT or LONG is held in the entry itself, longer arrays are pointed to
+		uint32_t value = (type == 3) ? get16LE(entry + 8) : get32LE(entry + 8);
+		uint32_t at = static_cast<uint32_t>(entry + 8 - file.data());
+
+		switch (tag)
+		{
+		case 256:	*w = static_cast<int>(value); break;
+		case 257:	*h = static_cast<int>(value); break;
+		case 259:	compression = value; break;
+		case 262:	photometric = value; break;
+		case 273:	numStrips = count; offsetsAt = (count == 1) ? at : value; break;
+		case 277:	samples = value; break;
+		case 278:	rowsPerStrip = value; break;
+		case 279:	countsAt = (count == 1) ? at : value; break;
+		case 317:	predictor = value; break;
+		}
+	}
+
+	if (*w <= 0 || *h <= 0 || samples != 3 || photometric != 2 || rowsPerStrip == 0 ||
+		numStrips != (*h + rowsPerStrip - 1) / rowsPerStrip || offsetsAt + 4 * numStrips > file.size() ||
+		countsAt + 4 * numStrips > file.size())
+		return false;
+
+	size_t rowBytes = static_cast<size_t>(*w) * 3;
+	std::vector<unsigned char> rgb(rowBytes * *h);
+
+	for (uint32_t s = 0; s < numStrips; ++s)
+	{
+		uint32_t offset = get32LE(&file[offsetsAt + 4 * s]), bytes = get32LE(&file[countsAt + 4 * s]);
+		int rows = std::min(static_cast<int>(rowsPerStrip), *h - static_cast<int>(s * rowsPerStrip));
+		unsigned char *strip = &rgb[s * rowsPerStrip * rowBytes];
+		size_t stripBytes = rows * rowBytes;
+
+		if (static_cast<size_t>(offset) + bytes > file.size()) return false;
+
+		if (compression == 1)
+		{
+			if (bytes != stripBytes) return false;
+			memcpy(strip, &file[offset], stripBytes);
+		}
+		else if (compression == 8)
+		{
+			uLongf size = static_cast<uLongf>(stripBytes);
+
+			if (uncompress(strip, &size, &file[offset], bytes) != Z_OK || size != stripBytes)
+				return false;
+		}
+		else
+			return false;
+
+		if (predictor == 2)
+			for (int y = 0; y < rows; ++y)
+				for (size_t i = 3; i < rowBytes; ++i)
+					strip[y * rowBytes + i] = static_cast<unsigned char>(strip[y * rowBytes + i] + strip[y * rowBytes + i - 3]);
+	}
+
+	bgr->resize(rgb.size());
+
+	for (size_t i = 0; i < rgb.size(); i += 3)
+	{
+		(*bgr)[i]     = rgb[i + 2];
+		(*bgr)[i + 1] = rgb[i + 1];
+		(*bgr)[i + 2] = rgb[i];
+	}
+
+	return true;
+}
+
+static void testConvolution(ThreadPool& pool)
+{
+	std::mt19937 random(1);
+
+	struct { int w, h, radius; } cases[] = { { 37, 23, 3 }, { 1, 19, 2 }, { 29, 1, 4 }, { 5, 4, 6 }, { 16, 16, 0 } };
+
+	for (const auto& c : cases)
+	{
+		size_t count = static_cast<size_t>(c.w) * c.h;
+		std::vector<float> input = randomPlane(random, count, -1.0f, 1.0f);
+		std::vector<float> weights = randomPlane(random, 2 * c.radius + 1, 0.0f, 1.0f);
+		std::vector<float> output(count);
+
+		cpuSeparableConvolution(c.w, c.h, input.data(), output.data(), weights.data(), c.radius, &pool);
+
+		double maxError = 0.0;
+
+		for (int y = 0; y < c.h; ++y)
+		{
+			for (int x = 0; x < c.w; ++x)
+			{
+				double sum = 0.0;
+
+				for (int j = -c.radius; j <= c.radius; ++j)
+				{
+					int sy = std::min(std::max(y + j, 0), c.h - 1);
+
+					for (int i = -c.radius; i <= c.radius; ++i)
+					{
+						int sx = std::min(std::max(x + i, 0), c.w - 1);
+
+						sum += static_cast<double>(weights[j + c.radius]) * weights[i + c.radius] * input[sy * c.w + sx];
+					}
+				}
+
+				maxError = std::max(maxError, std::fabs(sum - output[y * c.w + x]));
+			}
+		}
+
+		check(maxError < 1.0e-4, "cpuSeparableConvolution " + std::to_string(c.w) + "x" + std::to_string(c.h) +
+			  " radius " + std::to_string(c.radius) + " max error " + std::to_string(maxError));
+	}
+}
+
+static void testScaleLuminance(ThreadPool& pool)
+{
+	std::mt19937 random(2);
+
+	const int w = 67, h = 13;
+	size_t count = static_cast<size_t>(w) * h;
+
+	std::vector<float> R = randomPlane(random, count, 0.0f, 1.0f);
+	std::vector<float> G = randomPlane(random, count, 0.0f, 1.0f);
+	std::vector<float> B = randomPlane(random, count, 0.0f, 1.0f);
+
+	// black and a grey, the pixels the scalar code special cases or that are exact
+	R[0] = G[0] = B[0] = 0.0f;
+	R[1] = G[1] = B[1] = 0.5f;
+
+	std::vector<float> reference[3] = { std::vector<float>(count), std::vector<float>(count), std::vector<float>(count) };
+
+	cpuScaleLuminance(w, h, R.data(), G.data(), B.data(), reference[0].data(), reference[1].data(), reference[2].data(),
+					  0.5f, CPU_SIMD_SCALAR, &pool);
+
+	for (CPUSimdLevel level : testedLevels())
+	{
+		std::vector<float> out[3] = { std::vector<float>(count), std::vector<float>(count), std::vector<float>(count) };
+
+		cpuScaleLuminance(w, h, R.data(), G.data(), B.data(), out[0].data(), out[1].data(), out[2].data(), 0.5f, level, &pool);
+
+		double maxError = 0.0;
+
+		for (int c = 0; c < 3; ++c)
+			for (size_t i = 0; i < count; ++i)
+				maxError = std::max(maxError, static_cast<double>(std::fabs(out[c][i] - reference[c][i])));
+
+		check(maxError < 1.0e-5, std::string("cpuScaleLuminance ") + cpuSimdLevelName(level) + " max error " +
+			  std::to_string(maxError));
+	}
+}
+
+static void testImageConvert(ThreadPool& pool)
+{
+	std::mt19937 random(3);
+	std::uniform_int_distribution<int> byte(0, 255);
+
+	// 67 is not a multiple of any vector width, so every row ends in the scalar remainder
+	const int w = 67, h = 9;
+	size_t count = static_cast<size_t>(w) * h;
+
+	std::vector<unsigned char> bgra(4 * count);
+
+	for (unsigned char& v : bgra)
+		v = static_cast<unsigned char>(byte(random));
+
+	// out of range values must saturate
+	std::vector<float> R = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> G = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> B = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> grey = randomPlane(random, count, -3.0f, 2.0f);
+	std::vector<float> positive = randomPlane(random, count, 0.0f, 2.0f);
+
+	auto saturate = [](float v) { return static_cast<unsigned char>(v >= 255.0f ? 255.0f : (v > 0.0f ? v : 0.0f)); };
+
+	std::vector<unsigned char> packed(3 * count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		packed[3 * i]     = saturate(B[i] * 255.0f);
+		packed[3 * i + 1] = saturate(G[i] * 255.0f);
+		packed[3 * i + 2] = saturate(R[i] * 255.0f);
+	}
+
+	for (CPUSimdLevel level : testedLevels())
+	{
+		std::string name = cpuSimdLevelName(level);
+
+		std::vector<float> planes[4] = { std::vector<float>(count), std::vector<float>(count), std::vector<float>(count),
+										 std::vector<float>(count) };
+
+		convertBGRA8ToFloat(w, h, bgra.data(), planes[0].data(), planes[1].data(), planes[2].data(), planes[3].data(), level, &pool);
+
+		bool same = true;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			same = same && planes[0][i] == bgra[4 * i + 2] / 255.0f && planes[1][i] == bgra[4 * i + 1] / 255.0f &&
+				   planes[2][i] == bgra[4 * i] / 255.0f && planes[3][i] == bgra[4 * i + 3] / 255.0f;
+		}
+
+		check(same, "convertBGRA8ToFloat " + name);
+
+		std::vector<unsigned char> bgr(3 * count);
+
+		convertFloatToBGR8(w, h, R.data(), G.data(), B.data(), bgr.data(), level, &pool);
+		check(bgr == packed, "convertFloatToBGR8 " + name);
+
+		for (const std::vector<float>* image : { &grey, &positive })
+		{
+			float mn, mx;
+
+			floatImageRange(w, h, image->data(), &mn, &mx, level, &pool);
+
+			check(mn == *std::min_element(image->begin(), image->end()) &&
+				  mx == *std::max_element(image->begin(), image->end()), "floatImageRange " + name);
+
+			// [0, max] to [0, 255] when semi-positive, [-max, max] otherwise
+			float maxValue = std::max(std::fabs(mn), std::fabs(mx));
+			float offset = (mn >= 0.0f) ? 0.0f : 1.0f;
+			float scale  = (mn >= 0.0f) ? 255.0f : 127.5f;
+
+			convertFloatToGreyBGR8(w, h, image->data(), bgr.data(), level, &pool);
+
+			same = true;
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				unsigned char expected = saturate(((*image)[i] / maxValue + offset) * scale);
+
+				same = same && bgr[3 * i] == expected && bgr[3 * i + 1] == expected && bgr[3 * i + 2] == expected;
+			}
+
+			check(same, "convertFloatToGreyBGR8 " + name + (offset == 0.0f ? " semi-positive" : " signed"));
+		}
+	}
+}
+
+static void testEncoders(void)
+{
+	std::mt19937 random(4);
+	std::uniform_int_distribution<int> byte(0, 255);
+
+	// more than two strips with a partial last one, and a single partial strip
+	struct { int w, h; } sizes[] = { { 53, 2 * encoderStripRows + 7 }, { 1, 5 } };
+
+	ImageCompression compressions[] = { IMAGE_COMPRESSION_NONE, IMAGE_COMPRESSION_FAST, IMAGE_COMPRESSION_DEFAULT };
+
+	std::string pngPath = tempImagePath(".png"), tiffPath = tempImagePath(".tif");
+
+	for (const auto& size : sizes)
+	{
+		std::vector<unsigned char> bgr(static_cast<size_t>(size.w) * size.h * 3);
+
+		// smooth gradients with noise, so the filters and predictor have something to do
+		for (int y = 0; y < size.h; ++y)
+			for (int x = 0; x < size.w; ++x)
+				for (int c = 0; c < 3; ++c)
+					bgr[(static_cast<size_t>(y) * size.w + x) * 3 + c] = static_cast<unsigned char>(x * 3 + y * (c + 1) + byte(random) % 8);
+
+		for (ImageCompression compression : compressions)
+		{
+			std::string name = std::string(imageCompressionName(compression)) + " " + std::to_string(size.w) + "x" +
+							   std::to_string(size.h);
+			std::vector<unsigned char> decoded;
+			int w = 0, h = 0;
+
+			bool encoded = encodePNG(std::filesystem::path(pngPath).wstring(), size.w, size.h, bgr.data(), compression) == 0;
+
+			check(encoded && decodePNG(pngPath, &w, &h, &decoded) && w == size.w && h == size.h && decoded == bgr,
+				  "encodePNG " + name);
+
+			// the TIFF is written in uneven batches of rows, as the row writer does
+			TiffStripEncoder tiff;
+
+			encoded = tiff.open(std::filesystem::path(tiffPath).wstring(), size.w, size.h, compression) == 0;
+
+			for (int y = 0; y < size.h && encoded; )
+			{
+				int rows = std::min(size.h - y, 1 + y % 11);
+
+				encoded = tiff.writeRows(rows, &bgr[static_cast<size_t>(y) * size.w * 3]) == 0;
+				y += rows;
+			}
+
+			encoded = (tiff.close() == 0) && encoded;
+
+			check(encoded && decodeTIFF(tiffPath, &w, &h, &decoded) && w == size.w && h == size.h && decoded == bgr,
+				  "TiffStripEncoder " + name);
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::remove(pngPath, ec);
+	std::filesystem::remove(tiffPath, ec);
+}
+
+static void testSaveImage(void)
+{
+	std::mt19937 random(5);
+
+	const int w = 45, h = 37;
+	size_t count = static_cast<size_t>(w) * h;
+
+	std::vector<float> R = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> G = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> B = randomPlane(random, count, -0.25f, 1.25f);
+	std::vector<float> grey = randomPlane(random, count, -1.0f, 3.0f);
+
+	// what the files must hold - the scalar conversions are checked against references above
+	std::vector<unsigned char> colour(3 * count), greyBGR(3 * count);
+
+	convertFloatToBGR8(w, h, R.data(), G.data(), B.data(), colour.data(), CPU_SIMD_SCALAR);
+	convertFloatToGreyBGR8(w, h, grey.data(), greyBGR.data(), CPU_SIMD_SCALAR);
+
+	for (const char* extension : { ".png", ".tif" })
+	{
+		std::string path = tempImagePath(extension);
+		std::wstring widePath = std::filesystem::path(path).wstring();
+		std::vector<unsigned char> decoded;
+		int dw = 0, dh = 0;
+
+		bool saved = saveImage(w, h, R.data(), G.data(), B.data(), widePath) == 0;
+
+		check(saved && (extension[1] == 'p' ? decodePNG(path, &dw, &dh, &decoded) : decodeTIFF(path, &dw, &dh, &decoded)) &&
+			  dw == w && dh == h && decoded == colour, std::string("saveImage colour planes ") + extension);
+
+		saved = saveImage(w, h, grey.data(), widePath) == 0;
+
+		check(saved && (extension[1] == 'p' ? decodePNG(path, &dw, &dh, &decoded) : decodeTIFF(path, &dw, &dh, &decoded)) &&
+			  dw == w && dh == h && decoded == greyBGR, std::string("saveImage grey ") + extension);
+
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+	}
+
+	// .cpfi keeps the float planes exactly, and 8-bit pixels are refused
+	std::string rawPath = tempImagePath(".cpfi");
+	std::wstring wideRawPath = std::filesystem::path(rawPath).wstring();
+	MappedRawImage mapped;
+
+	bool same = saveImage(w, h, R.data(), G.data(), B.data(), wideRawPath) == 0 && mapRawImage(wideRawPath, &mapped) == 0 &&
+				mapped.image.w == w && mapped.image.h == h &&
+				memcmp(mapped.image.redChannel, R.data(), count * sizeof(float)) == 0 &&
+				memcmp(mapped.image.greenChannel, G.data(), count * sizeof(float)) == 0 &&
+				memcmp(mapped.image.blueChannel, B.data(), count * sizeof(float)) == 0;
+
+	if (mapped.view) unmapRawImage(&mapped);
+
+	check(same, "saveImage .cpfi planes");
+	check(saveImage(w, h, reinterpret_cast<bgr8*>(colour.data()), wideRawPath) != 0, "saveImage refuses bgr8 to .cpfi");
+
+	std::error_code ec;
+	std::filesystem::remove(rawPath, ec);
+}
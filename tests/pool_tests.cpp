@@ -0,0 +1,178 @@
+//
+// Checks for the buffer pool accounting, run by ctest where OpenCL is found.  The pool under test
+// hands out dummy handles instead of OpenCL buffers, so no device is needed:
+//
+//   sets at the cap		two lanes each taking an input and an output buffer as one set under
+//							a cap of about 1.5 sets - no request may be rejected or time out
+//   oversized sets		a set larger than the cap is refused at once, holding nothing
+//   reuse				a released set is handed out again from the free list
+//
+// Returns the number of failed checks.
+//
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "buffer_pool.h"
+
+static int failures = 0;
+
+// BufferPoolBase with dummy handles in place of cl_mem objects
+class HandlePool : public BufferPoolBase
+{
+public:
+
+	explicit HandlePool(size_t memoryCap) : BufferPoolBase(nullptr, memoryCap) {}
+	~HandlePool(void) { trim(); }
+
+	bool acquire(int count, const size_t* bytes, const cl_mem_flags* flags, cl_mem* buffers)
+	{
+		std::vector<Entry> entries(count);
+		bool acquired = acquireEntries(count, bytes, flags, entries.data());
+
+		for (int i = 0; i < count; ++i)
+			buffers[i] = acquired ? entries[i].buffer : nullptr;
+
+		return acquired;
+	}
+
+	void release(cl_mem buffer) { releaseEntry(buffer); }
+
+protected:
+
+	bool createEntry(size_t size, cl_mem_flags flags, Entry& entry) override
+	{
+		entry.buffer = reinterpret_cast<cl_mem>(new char);
+		entry.mapped = nullptr;
+		entry.size   = size;
+		entry.flags  = flags;
+		return true;
+	}
+
+	void destroyEntry(Entry& entry) override
+	{
+		delete reinterpret_cast<char*>(entry.buffer);
+	}
+};
+
+// input and output of one image - both exact bucket sizes, 7 MB a set
+static const size_t		setSizes[2] = { 4 << 20, 3 << 20 };
+static const cl_mem_flags	setFlags[2] = { CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY };
+
+//
+// Private API
+//
+static void		check(bool passed, const std::string& what);
+static void		testSetsAtCap(void);
+static void		testOversizedSet(void);
+static void		testReuse(void);
+
+
+int main(void)
+{
+	testSetsAtCap();
+	testOversizedSet();
+	testReuse();
+
+	if (failures)
+		std::cout << failures << " check(s) failed\n";
+	else
+		std::cout << "all checks passed\n";
+
+	return failures;
+}
+
+
+//
+// Private API implementation
+//
+static void check(bool passed, const std::string& what)
+{
+	if (!passed)
+	{
+		std::cout << "FAILED: " << what << std::endl;
+		failures++;
+	}
+}
+
+// Room for one set and half of another.  Taking the input and output one at a time, each lane
+// could hold an input while waiting for an output that only the other lane's release would
+// make room for
+static void testSetsAtCap(void)
+{
+	const int lanes = 2, iterations = 200;
+
+	HandlePool pool((setSizes[0] + setSizes[1]) * 3 / 2);
+
+	// short enough that a stall fails the test rather than hanging it
+	pool.setAcquireTimeout(2000);
+
+	std::vector<int> acquired(lanes, 0);
+	std::vector<std::thread> threads;
+
+	for (int lane = 0; lane < lanes; ++lane)
+		threads.emplace_back([&, lane]()
+		{
+			for (int i = 0; i < iterations; ++i)
+			{
+				cl_mem buffers[2];
+
+				// a lane that was refused stops, so a stall costs one timeout
+				if (!pool.acquire(2, setSizes, setFlags, buffers))
+					break;
+
+				acquired[lane]++;
+
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+				pool.release(buffers[0]);
+				pool.release(buffers[1]);
+			}
+		});
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	BufferPoolStats stats = pool.stats();
+
+	for (int lane = 0; lane < lanes; ++lane)
+		check(acquired[lane] == iterations, "sets at cap: lane " + std::to_string(lane) + " acquired " +
+			  std::to_string(acquired[lane]) + " of " + std::to_string(iterations) + " sets");
+
+	check(stats.rejections == 0, "sets at cap: " + std::to_string(stats.rejections) + " rejection(s)");
+	check(stats.bytesInUse == 0, "sets at cap: bytes still in use after every release");
+	check(stats.peakBytes <= (setSizes[0] + setSizes[1]) * 3 / 2, "sets at cap: peak above the cap");
+}
+
+static void testOversizedSet(void)
+{
+	HandlePool pool(setSizes[0] + setSizes[1] - 1);
+	cl_mem buffers[2];
+
+	bool acquired = pool.acquire(2, setSizes, setFlags, buffers);
+	BufferPoolStats stats = pool.stats();
+
+	check(!acquired && !buffers[0] && !buffers[1], "oversized set: acquired over the cap");
+	check(stats.rejections == 1 && stats.waits == 0, "oversized set: not refused at once");
+	check(stats.bytesInUse == 0 && stats.allocations == 0, "oversized set: part of the set held or created");
+}
+
+static void testReuse(void)
+{
+	HandlePool pool(0);
+	cl_mem first[2], second[2];
+
+	pool.acquire(2, setSizes, setFlags, first);
+	pool.release(first[0]);
+	pool.release(first[1]);
+
+	bool acquired = pool.acquire(2, setSizes, setFlags, second);
+	BufferPoolStats stats = pool.stats();
+
+	check(acquired && second[0] == first[0] && second[1] == first[1], "reuse: released set not handed out again");
+	check(stats.allocations == 2 && stats.hits == 2, "reuse: new buffers created for a cached set");
+
+	pool.release(second[0]);
+	pool.release(second[1]);
+}
@@ -0,0 +1,125 @@
+#include <atomic>
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int numThreads)
+	: stopping(false)
+{
+	if (numThreads <= 0)
+		numThreads = static_cast<int>(std::thread::hardware_concurrency());
+
+	if (numThreads <= 0)
+		numThreads = 1;
+
+	for (int i = 0; i < numThreads; ++i)
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (std::thread& t : workers)
+		t.join();
+}
+
+void ThreadPool::run(std::function<void(void)> task)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		tasks.push_back(std::move(task));
+	}
+	wake.notify_one();
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)>& fn, int minChunk)
+{
+	int count = end - begin;
+
+	if (count <= 0) return;
+
+	if (minChunk < 1) minChunk = 1;
+
+	// a few chunks per thread so uneven rows balance out
+	int numChunks = size() * 4;
+	int chunk = (count + numChunks - 1) / numChunks;
+
+	if (chunk < minChunk) chunk = minChunk;
+
+	numChunks = (count + chunk - 1) / chunk;
+
+	if (numChunks == 1)
+	{
+		fn(begin, end);
+		return;
+	}
+
+	// chunks are claimed from a shared counter by the pool and the calling thread
+	std::atomic<int>		next(0);
+	std::mutex				doneLock;
+	std::condition_variable	doneSignal;
+	int						helpersRunning;
+
+	auto claimChunks = [&](void)
+	{
+		int i;
+
+		while ((i = next.fetch_add(1)) < numChunks)
+		{
+			int chunkBegin = begin + i * chunk;
+			int chunkEnd = (chunkBegin + chunk < end) ? chunkBegin + chunk : end;
+
+			fn(chunkBegin, chunkEnd);
+		}
+	};
+
+	helpersRunning = (numChunks - 1 < size()) ? numChunks - 1 : size();
+
+	for (int i = 0, n = helpersRunning; i < n; ++i)
+	{
+		run([&](void)
+		{
+			claimChunks();
+
+			std::lock_guard<std::mutex> guard(doneLock);
+			if (--helpersRunning == 0)
+				doneSignal.notify_all();
+		});
+	}
+
+	claimChunks();
+
+	// helpers reference the locals above so wait until every one of them has finished
+	std::unique_lock<std::mutex> guard(doneLock);
+	doneSignal.wait(guard, [&](void) { return helpersRunning == 0; });
+}
+
+ThreadPool& ThreadPool::shared(void)
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::workerLoop(void)
+{
+	for (;;)
+	{
+		std::function<void(void)> task;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this](void) { return stopping || !tasks.empty(); });
+
+			if (stopping && tasks.empty())
+				return;
+
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+
+		task();
+	}
+}
@@ -0,0 +1,49 @@
+//
+// Simple fixed size thread pool used to split image rows across host threads
+//
+#ifndef _THREAD_POOL_
+#define _THREAD_POOL_
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+class ThreadPool
+{
+public:
+
+	// numThreads <= 0 uses one thread per hardware thread
+	explicit ThreadPool(int numThreads = 0);
+	~ThreadPool(void);
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size(void) const { return static_cast<int>(workers.size()); }
+
+	// queue a task to run on one of the worker threads
+	void run(std::function<void(void)> task);
+
+	// split [begin, end) into contiguous chunks of at least minChunk items, call fn(chunkBegin, chunkEnd) 
+	// for each chunk on the pool and return when every chunk has completed.  The calling thread 
+	// processes chunks as well.  Must not be called from one of this pool's own workers.
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& fn, int minChunk = 1);
+
+	// process wide pool shared by the host side image code
+	static ThreadPool& shared(void);
+
+private:
+
+	void workerLoop(void);
+
+	std::vector<std::thread>				workers;
+	std::deque<std::function<void(void)>>	tasks;
+	std::mutex								lock;
+	std::condition_variable					wake;
+	bool									stopping;
+};
+
+#endif
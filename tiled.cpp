@@ -0,0 +1,331 @@
+//
+// Band streaming pipeline - see tiled.h
+//
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include "tiled.h"
+#include "imageio.h"
+#include "buffer_pool.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+// number of bands in flight on the device at once
+static const int numSlots = 2;
+
+// x, y and Y planes plus the convolution scratch and blurred planes
+static const int numPlanes = 5;
+
+// per slot state - everything is sized for the largest band and reused for every band
+struct TileSlot
+{
+	StagingBuffer	input;					// pinned band + halo rows of BGRA8
+	StagingBuffer	output;					// pinned band rows of bgr8
+	cl_mem			inputBuffer;
+	cl_mem			outputBuffer;
+	cl_mem			planes[numPlanes];		// convolution only
+	cl_event		readEvent;				// download of the band, nullptr when idle
+	int				rows;					// rows to append once readEvent completes
+};
+
+//
+// Private API
+//
+static bool			retireSlot(TileSlot& slot, ImageRowWriter* writer);
+
+
+//
+// Public function implementation
+//
+int runTiled(
+			 cl_context context,
+			 cl_device_id device,
+			 cl_program program,
+			 const std::wstring& inputPath,
+			 const std::wstring& outputPath,
+			 const TiledOptions& options
+			 )
+{
+	auto start = std::chrono::steady_clock::now();
+
+	ImageRowReader reader;
+
+	if (openImageReader(inputPath, &reader) != 0)
+	{
+		std::cout << "cannot load input image\n";
+		return 1;
+	}
+
+	const int w = reader.w;
+	const int h = reader.h;
+
+	bool useConvolution = (options.convolution != CONVOLVE_NONE);
+
+	int bandRows = std::min(std::max(options.bandRows, 1), h);
+	int halo     = useConvolution ? std::min(std::max(options.convolutionRadius, 1), maxConvolutionRadius) : 0;
+
+	// the largest band read from the file, halo included
+	int maxReadRows = std::min(bandRows + 2 * halo, h);
+
+	size_t maxReadPixels = static_cast<size_t>(w) * maxReadRows;
+	size_t maxBandPixels = static_cast<size_t>(w) * bandRows;
+
+	// separate in-order queues so one band's transfers overlap the other band's kernels
+	cl_command_queue uploadQueue   = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue computeQueue  = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+	cl_command_queue downloadQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, 0);
+
+	HostStagingPool stagingPool(context, uploadQueue);
+
+	TileSlot slots[numSlots] = {};
+	bool allocated = uploadQueue && computeQueue && downloadQueue;
+
+	for (int i = 0; i < numSlots && allocated; ++i)
+	{
+		TileSlot& slot = slots[i];
+
+		slot.input  = stagingPool.acquire(maxReadPixels * sizeof(BGRA8));
+		slot.output = stagingPool.acquire(maxBandPixels * sizeof(bgr8));
+
+		slot.inputBuffer  = clCreateBuffer(context, CL_MEM_READ_ONLY, maxReadPixels * sizeof(BGRA8), 0, 0);
+		slot.outputBuffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, maxReadPixels * sizeof(bgr8), 0, 0);
+
+		allocated = slot.input.buffer && slot.output.buffer && slot.inputBuffer && slot.outputBuffer;
+
+		for (int p = 0; p < numPlanes && useConvolution && allocated; ++p)
+		{
+			slot.planes[p] = clCreateBuffer(context, CL_MEM_READ_WRITE, maxReadPixels * sizeof(float), 0, 0);
+			allocated = (slot.planes[p] != nullptr);
+		}
+	}
+
+	cl_kernel fusedKernel = clCreateKernel(program, "BGRA8_XYY_BGR8", 0);
+	cl_kernel toXYYKernel = clCreateKernel(program, "BGRA8_XYY", 0);
+	cl_kernel toBGRKernel = clCreateKernel(program, "XYY_BGR8", 0);
+
+	SeparableConvolution convolution(context, program, halo);
+
+	ImageRowWriter writer;
+
+	int result = 0;
+
+	if (!allocated || !fusedKernel || !toXYYKernel || !toBGRKernel || (useConvolution && !convolution.valid()))
+	{
+		std::cout << "cannot allocate tiled buffers\n";
+		result = 1;
+	}
+	else if (openImageWriter(outputPath, w, h, &writer) != 0)
+	{
+		std::cout << "cannot create output image\n";
+		result = 1;
+	}
+
+	WorkGroupSize fusedLocal = { 0, 0, true }, toXYYLocal = { 0, 0, true }, toBGRLocal = { 0, 0, true };
+	bool tuned = false;
+
+	int numBands = (h + bandRows - 1) / bandRows;
+
+	for (int band = 0; band < numBands && result == 0; ++band)
+	{
+		TileSlot& slot = slots[band % numSlots];
+
+		// band - numSlots has to be written out before its slot (and the file order) moves on
+		if (!retireSlot(slot, &writer))
+		{
+			result = 1;
+			break;
+		}
+
+		int y0   = band * bandRows;
+		int rows = std::min(bandRows, h - y0);
+
+		// rows actually read - the halo is clamped at the top and bottom of the image, where the
+		// kernels clamp instead
+		int top      = std::max(y0 - halo, 0);
+		int bottom   = std::min(y0 + rows + halo, h);
+		int readRows = bottom - top;
+
+		if (readImageRows(&reader, top, readRows, static_cast<BGRA8*>(slot.input.hostPtr)) != 0)
+		{
+			std::cout << "cannot decode rows " << top << " to " << bottom << std::endl;
+			result = 1;
+			break;
+		}
+
+		size_t readPixels = static_cast<size_t>(w) * readRows;
+
+		// only set by the commands that were enqueued
+		cl_event writeEvent = nullptr, computeEvent = nullptr;
+
+		cl_int err = traceCommand("upload band", uploadQueue, &writeEvent, [&](cl_event* event)
+		{
+			return clEnqueueWriteBuffer(uploadQueue, slot.inputBuffer, CL_FALSE, 0, readPixels * sizeof(BGRA8),
+										slot.input.hostPtr, 0, 0, event);
+		});
+
+		if (useConvolution)
+		{
+			clSetKernelArg(toXYYKernel, 0, sizeof(cl_mem), &slot.inputBuffer);
+			clSetKernelArg(toXYYKernel, 1, sizeof(cl_mem), &slot.planes[0]);
+			clSetKernelArg(toXYYKernel, 2, sizeof(cl_mem), &slot.planes[1]);
+			clSetKernelArg(toXYYKernel, 3, sizeof(cl_mem), &slot.planes[2]);
+			clSetKernelArg(toXYYKernel, 4, sizeof(cl_int), &w);
+			clSetKernelArg(toXYYKernel, 5, sizeof(cl_int), &readRows);
+			clSetKernelArg(toXYYKernel, 6, sizeof(cl_float), &options.luminanceScale);
+
+			clSetKernelArg(toBGRKernel, 0, sizeof(cl_mem), &slot.planes[0]);
+			clSetKernelArg(toBGRKernel, 1, sizeof(cl_mem), &slot.planes[1]);
+			clSetKernelArg(toBGRKernel, 2, sizeof(cl_mem), &slot.planes[2]);
+			clSetKernelArg(toBGRKernel, 3, sizeof(cl_mem), &slot.outputBuffer);
+			clSetKernelArg(toBGRKernel, 4, sizeof(cl_int), &w);
+			clSetKernelArg(toBGRKernel, 5, sizeof(cl_int), &readRows);
+
+			if (!tuned && err == CL_SUCCESS)
+			{
+				toXYYLocal = WorkGroupTuner::shared().select(computeQueue, toXYYKernel, w, readRows);
+				toBGRLocal = WorkGroupTuner::shared().select(computeQueue, toBGRKernel, w, readRows);
+				tuned = true;
+			}
+
+			cl_event xyyEvent, convolutionEvent;
+
+			if (err == CL_SUCCESS)
+				err = enqueueImageKernel(computeQueue, toXYYKernel, w, readRows, toXYYLocal, 1, &writeEvent, &xyyEvent);
+
+			if (err == CL_SUCCESS)
+			{
+				err = convolution.enqueue(computeQueue, slot.planes[2], slot.planes[3], slot.planes[4], w, readRows,
+										  options.convolution, options.sharpenAmount, 1, &xyyEvent, &convolutionEvent);
+				clReleaseEvent(xyyEvent);
+			}
+
+			if (err == CL_SUCCESS)
+			{
+				err = enqueueImageKernel(computeQueue, toBGRKernel, w, readRows, toBGRLocal, 1, &convolutionEvent, &computeEvent);
+				clReleaseEvent(convolutionEvent);
+			}
+		}
+		else
+		{
+			clSetKernelArg(fusedKernel, 0, sizeof(cl_mem), &slot.inputBuffer);
+			clSetKernelArg(fusedKernel, 1, sizeof(cl_mem), &slot.outputBuffer);
+			clSetKernelArg(fusedKernel, 2, sizeof(cl_int), &w);
+			clSetKernelArg(fusedKernel, 3, sizeof(cl_int), &readRows);
+			clSetKernelArg(fusedKernel, 4, sizeof(cl_float), &options.luminanceScale);
+
+			if (!tuned && err == CL_SUCCESS)
+			{
+				fusedLocal = WorkGroupTuner::shared().select(computeQueue, fusedKernel, w, readRows);
+				tuned = true;
+			}
+
+			if (err == CL_SUCCESS)
+				err = enqueueImageKernel(computeQueue, fusedKernel, w, readRows, fusedLocal, 1, &writeEvent, &computeEvent);
+		}
+
+		// download only the band's own rows - the halo rows belong to the neighbouring bands
+		if (err == CL_SUCCESS)
+		{
+			err = traceCommand("download band", downloadQueue, &slot.readEvent, [&](cl_event* event)
+			{
+				return clEnqueueReadBuffer(downloadQueue, slot.outputBuffer, CL_FALSE,
+										   static_cast<size_t>(y0 - top) * w * sizeof(bgr8), static_cast<size_t>(rows) * w * sizeof(bgr8),
+										   slot.output.hostPtr, 1, &computeEvent, event);
+			});
+		}
+
+		if (computeEvent) clReleaseEvent(computeEvent);
+		if (writeEvent) clReleaseEvent(writeEvent);
+
+		// cross-queue waits need every queue flushed
+		clFlush(uploadQueue);
+		clFlush(computeQueue);
+		clFlush(downloadQueue);
+
+		if (err != CL_SUCCESS)
+		{
+			std::cout << "cannot enqueue band " << band << " (error " << err << ")\n";
+			slot.readEvent = nullptr;
+			result = 1;
+			break;
+		}
+
+		slot.rows = rows;
+	}
+
+	// write out the bands still in flight, oldest first
+	for (int band = numBands; band < numBands + numSlots; ++band)
+		if (!retireSlot(slots[band % numSlots], &writer))
+			result = 1;
+
+	if (uploadQueue) clFinish(uploadQueue);
+	if (computeQueue) clFinish(computeQueue);
+	if (downloadQueue) clFinish(downloadQueue);
+
+	if (writer.encoder && closeImageWriter(&writer) != 0)
+		result = 1;
+
+	closeImageReader(&reader);
+
+	if (result == 0)
+	{
+		size_t deviceBytes = numSlots * maxReadPixels * (sizeof(BGRA8) + sizeof(bgr8) + (useConvolution ? numPlanes * sizeof(float) : 0));
+		size_t hostBytes   = numSlots * (maxReadPixels * sizeof(BGRA8) + maxBandPixels * sizeof(bgr8));
+
+		std::cout << "Tiled: " << numBands << " band(s) of " << bandRows << " rows";
+
+		if (halo > 0)
+			std::cout << " + " << halo << " halo rows";
+
+		std::cout << ", device buffers " << (deviceBytes / (1024.0 * 1024.0)) << "MB, pinned host buffers "
+				  << (hostBytes / (1024.0 * 1024.0)) << "MB\n";
+
+		std::cout << "Total time (decode to encode, tiled) = "
+				  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << std::endl;
+	}
+
+	for (TileSlot& slot : slots)
+	{
+		if (slot.readEvent) clReleaseEvent(slot.readEvent);
+		if (slot.inputBuffer) clReleaseMemObject(slot.inputBuffer);
+		if (slot.outputBuffer) clReleaseMemObject(slot.outputBuffer);
+
+		for (cl_mem plane : slot.planes)
+			if (plane) clReleaseMemObject(plane);
+
+		if (slot.input.buffer) stagingPool.release(slot.input);
+		if (slot.output.buffer) stagingPool.release(slot.output);
+	}
+
+	if (fusedKernel) clReleaseKernel(fusedKernel);
+	if (toXYYKernel) clReleaseKernel(toXYYKernel);
+	if (toBGRKernel) clReleaseKernel(toBGRKernel);
+
+	if (uploadQueue) clReleaseCommandQueue(uploadQueue);
+	if (computeQueue) clReleaseCommandQueue(computeQueue);
+	if (downloadQueue) clReleaseCommandQueue(downloadQueue);
+	return result;
+}
+
+
+//
+// Private API implementation
+//
+
+// wait for the slot's band to download and append it to the output.  Idle slots succeed
+static bool retireSlot(TileSlot& slot, ImageRowWriter* writer)
+{
+	if (!slot.readEvent) return true;
+
+	cl_int err = clWaitForEvents(1, &slot.readEvent);
+
+	clReleaseEvent(slot.readEvent);
+	slot.readEvent = nullptr;
+
+	if (err != CL_SUCCESS || writeImageRows(writer, slot.rows, static_cast<const bgr8*>(slot.output.hostPtr)) != 0)
+	{
+		std::cout << "cannot write band\n";
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,40 @@
+//
+// Out-of-core processing for images larger than device (or host) memory.  The image is
+// streamed through the device in bands of rows: each band is decoded straight into a pinned
+// staging buffer, uploaded, processed, downloaded and appended to the output file while the
+// next band is already on its way.  Two bands are in flight and upload, compute and download
+// run on separate queues, so the transfers of one band overlap the kernels of the other.
+// Peak host and device memory depends only on the band size and the image width.
+//
+// Neighbourhood operations (the luminance blur / sharpen) need rows above and below the band -
+// each band is read with a halo of convolution radius rows on both sides, processed as a
+// whole and only its own rows are downloaded.
+//
+#ifndef _TILED_
+#define _TILED_
+
+#include <CL/opencl.h>
+#include <string>
+#include "convolution.h"
+
+struct TiledOptions
+{
+	int					bandRows;			// rows per band, not counting the halo
+	float				luminanceScale;
+	ConvolutionMode		convolution;		// CONVOLVE_NONE runs the fused packed kernel
+	int					convolutionRadius;
+	float				sharpenAmount;
+};
+
+// Process inputPath into outputPath (TIFF) band by band.  program must be the float storage
+// build.  Returns 0 on success
+int runTiled(
+			 cl_context context,
+			 cl_device_id device,
+			 cl_program program,
+			 const std::wstring& inputPath,
+			 const std::wstring& outputPath,
+			 const TiledOptions& options
+			 );
+
+#endif
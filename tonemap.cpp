@@ -0,0 +1,198 @@
+//
+// Device side luminance statistics and tone mapping - see tonemap.h
+//
+#include <cstring>
+#include <iostream>
+#include "tonemap.h"
+#include "autotune.h"
+#include "trace_cl.h"
+
+// upper limit for the reduction work-group size - enough to hide latency, small enough for
+// every device's local memory
+static const size_t maxReductionGroupSize = 256;
+
+// work-groups per compute unit for LUMA_STATS - each walks the image with a grid stride
+static const size_t groupsPerComputeUnit = 4;
+
+
+//
+// Public function implementation
+//
+bool parseToneMapMode(const char* name, ToneMapMode* mode)
+{
+	if (strcmp(name, "none") == 0)
+		*mode = TONEMAP_NONE;
+	else if (strcmp(name, "reinhard") == 0)
+		*mode = TONEMAP_REINHARD;
+	else if (strcmp(name, "mean") == 0)
+		*mode = TONEMAP_MEAN;
+	else
+		return false;
+
+	return true;
+}
+
+const char* toneMapModeName(ToneMapMode mode)
+{
+	switch (mode)
+	{
+	case TONEMAP_REINHARD:	return "reinhard";
+	case TONEMAP_MEAN:		return "mean";
+	default:				return "none";
+	}
+}
+
+LuminanceToneMapper::LuminanceToneMapper(cl_context context, cl_device_id device, cl_program program)
+	: statsKernel(nullptr), finalKernel(nullptr), toneMapKernel(nullptr),
+	  partialsBuffer(nullptr), histogramBuffer(nullptr), statsBuffer(nullptr), localSize(1), numGroups(1)
+{
+	statsKernel = clCreateKernel(program, "LUMA_STATS", 0);
+	finalKernel = clCreateKernel(program, "LUMA_STATS_FINAL", 0);
+
+	cl_kernel toneMap = clCreateKernel(program, "XYZ_XYY_TONEMAP", 0);
+
+	if (!statsKernel || !finalKernel || !toneMap)
+	{
+		std::cout << "tone mapping kernels not found\n";
+
+		if (toneMap) clReleaseKernel(toneMap);
+		return;
+	}
+
+	// the tree reductions need a power of two no larger than either kernel allows
+	size_t statsLimit = 1, finalLimit = 1;
+	clGetKernelWorkGroupInfo(statsKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &statsLimit, 0);
+	clGetKernelWorkGroupInfo(finalKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &finalLimit, 0);
+
+	while (localSize * 2 <= maxReductionGroupSize && localSize * 2 <= statsLimit && localSize * 2 <= finalLimit)
+		localSize *= 2;
+
+	cl_uint computeUnits = 1;
+	clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, 0);
+
+	numGroups = (computeUnits > 0 ? computeUnits : 1) * groupsPerComputeUnit;
+
+	partialsBuffer  = clCreateBuffer(context, CL_MEM_READ_WRITE, numGroups * sizeof(cl_float4), 0, 0);
+	histogramBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, lumaHistogramBins * sizeof(cl_uint), 0, 0);
+	statsBuffer     = clCreateBuffer(context, CL_MEM_READ_WRITE, 4 * sizeof(cl_float), 0, 0);
+
+	if (!partialsBuffer || !histogramBuffer || !statsBuffer)
+	{
+		std::cout << "tone mapping buffers not created\n";
+		clReleaseKernel(toneMap);
+		return;
+	}
+
+	// arguments that do not change between images
+	cl_int numPartials = static_cast<cl_int>(numGroups);
+
+	clSetKernelArg(statsKernel, 2, sizeof(cl_mem), &partialsBuffer);
+	clSetKernelArg(statsKernel, 3, sizeof(cl_mem), &histogramBuffer);
+	clSetKernelArg(statsKernel, 4, localSize * sizeof(cl_float4), 0);
+	clSetKernelArg(statsKernel, 5, lumaHistogramBins * sizeof(cl_uint), 0);
+
+	clSetKernelArg(finalKernel, 0, sizeof(cl_mem), &partialsBuffer);
+	clSetKernelArg(finalKernel, 1, sizeof(cl_int), &numPartials);
+	clSetKernelArg(finalKernel, 3, sizeof(cl_mem), &statsBuffer);
+	clSetKernelArg(finalKernel, 4, localSize * sizeof(cl_float4), 0);
+
+	clSetKernelArg(toneMap, 8, sizeof(cl_mem), &statsBuffer);
+
+	toneMapKernel = toneMap;
+}
+
+LuminanceToneMapper::~LuminanceToneMapper(void)
+{
+	if (statsKernel) clReleaseKernel(statsKernel);
+	if (finalKernel) clReleaseKernel(finalKernel);
+	if (toneMapKernel) clReleaseKernel(toneMapKernel);
+	if (partialsBuffer) clReleaseMemObject(partialsBuffer);
+	if (histogramBuffer) clReleaseMemObject(histogramBuffer);
+	if (statsBuffer) clReleaseMemObject(statsBuffer);
+}
+
+cl_int LuminanceToneMapper::enqueue(cl_command_queue queue, cl_mem X, cl_mem Y, cl_mem Z, cl_mem xOut, cl_mem yOut, cl_mem YOut,
+									int w, int h, ToneMapMode mode, float key,
+									cl_uint numEvents, const cl_event* waitList, cl_event* event)
+{
+	if (!valid()) return CL_INVALID_KERNEL;
+
+	cl_int count = w * h;
+	cl_int modeArg = static_cast<cl_int>(mode);
+	cl_uint zero = 0;
+
+	// LUMA_STATS accumulates into the histogram
+	cl_int err = traceCommand("clear histogram", queue, 0, [&](cl_event* event)
+	{
+		return clEnqueueFillBuffer(queue, histogramBuffer, &zero, sizeof(zero), 0, lumaHistogramBins * sizeof(cl_uint),
+								   numEvents, waitList, event);
+	});
+
+	clSetKernelArg(statsKernel, 0, sizeof(cl_mem), &Y);
+	clSetKernelArg(statsKernel, 1, sizeof(cl_int), &count);
+
+	size_t statsGlobal = numGroups * localSize;
+
+	if (err == CL_SUCCESS)
+		err = traceCommand("LUMA_STATS", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueNDRangeKernel(queue, statsKernel, 1, 0, &statsGlobal, &localSize, 0, 0, event);
+		});
+
+	clSetKernelArg(finalKernel, 2, sizeof(cl_int), &count);
+
+	if (err == CL_SUCCESS)
+		err = traceCommand("LUMA_STATS_FINAL", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueNDRangeKernel(queue, finalKernel, 1, 0, &localSize, &localSize, 0, 0, event);
+		});
+
+	clSetKernelArg(toneMapKernel, 0, sizeof(cl_mem), &X);
+	clSetKernelArg(toneMapKernel, 1, sizeof(cl_mem), &Y);
+	clSetKernelArg(toneMapKernel, 2, sizeof(cl_mem), &Z);
+	clSetKernelArg(toneMapKernel, 3, sizeof(cl_mem), &xOut);
+	clSetKernelArg(toneMapKernel, 4, sizeof(cl_mem), &yOut);
+	clSetKernelArg(toneMapKernel, 5, sizeof(cl_mem), &YOut);
+	clSetKernelArg(toneMapKernel, 6, sizeof(cl_int), &w);
+	clSetKernelArg(toneMapKernel, 7, sizeof(cl_int), &h);
+	clSetKernelArg(toneMapKernel, 9, sizeof(cl_float), &key);
+	clSetKernelArg(toneMapKernel, 10, sizeof(cl_int), &modeArg);
+
+	WorkGroupSize toneMapLocal = WorkGroupTuner::shared().select(queue, toneMapKernel, w, h);
+
+	if (err == CL_SUCCESS)
+		err = enqueueImageKernel(queue, toneMapKernel, w, h, toneMapLocal, 0, 0, event);
+
+	if (err != CL_SUCCESS)
+		std::cout << "tone mapping enqueue failed (" << err << ")\n";
+
+	return err;
+}
+
+bool LuminanceToneMapper::readStats(cl_command_queue queue, LuminanceStats* stats) const
+{
+	if (!valid()) return false;
+
+	cl_float values[4];
+
+	cl_int err = traceCommand("read stats", queue, 0, [&](cl_event* event)
+	{
+		return clEnqueueReadBuffer(queue, statsBuffer, CL_TRUE, 0, sizeof(values), values, 0, 0, event);
+	});
+
+	if (err == CL_SUCCESS)
+	{
+		err = traceCommand("read histogram", queue, 0, [&](cl_event* event)
+		{
+			return clEnqueueReadBuffer(queue, histogramBuffer, CL_TRUE, 0, sizeof(stats->histogram), stats->histogram, 0, 0, event);
+		});
+	}
+
+	if (err != CL_SUCCESS) return false;
+
+	stats->minimum    = values[0];
+	stats->maximum    = values[1];
+	stats->mean       = values[2];
+	stats->logAverage = values[3];
+	return true;
+}
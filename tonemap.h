@@ -0,0 +1,73 @@
+//
+// Automatic exposure for the staged pipeline.  The luminance statistics of the RGB_XYY output
+// are reduced on the device (LUMA_STATS + LUMA_STATS_FINAL) into a small buffer that
+// XYZ_XYY_TONEMAP reads directly, so adapting to the image costs one extra pass over the Y
+// plane and no host round trip.  XYZ_XYY_TONEMAP takes the place of XYY_XYZ.
+//
+#ifndef _TONEMAP_
+#define _TONEMAP_
+
+#include <CL/opencl.h>
+
+// values match TONEMAP_* in HelloWorld.cl
+enum ToneMapMode
+{
+	TONEMAP_NONE = -1,
+	TONEMAP_REINHARD = 0,
+	TONEMAP_MEAN = 1
+};
+
+// parse "none", "reinhard" or "mean" - returns false for anything else
+bool parseToneMapMode(const char* name, ToneMapMode* mode);
+
+const char* toneMapModeName(ToneMapMode mode);
+
+// LUMA_HISTOGRAM_BINS in HelloWorld.cl - bins cover log2 luminance -16 to 0
+const int lumaHistogramBins = 64;
+
+struct LuminanceStats
+{
+	float		minimum;
+	float		maximum;
+	float		mean;
+	float		logAverage;
+	cl_uint		histogram[lumaHistogramBins];
+};
+
+class LuminanceToneMapper
+{
+public:
+
+	// Create the kernels from program (any storage mode build) and the statistics buffers
+	LuminanceToneMapper(cl_context context, cl_device_id device, cl_program program);
+	~LuminanceToneMapper(void);
+
+	LuminanceToneMapper(const LuminanceToneMapper&) = delete;
+	LuminanceToneMapper& operator=(const LuminanceToneMapper&) = delete;
+
+	bool valid(void) const { return toneMapKernel != nullptr; }
+
+	// Enqueue the statistics reduction over Y and the tone mapping of the X, Y, Z planes into
+	// the x, y, Y planes.  The queue must be in order - event is set on the tone mapping
+	// kernel and the statistics kernels run between waitList and it.
+	cl_int enqueue(cl_command_queue queue, cl_mem X, cl_mem Y, cl_mem Z, cl_mem xOut, cl_mem yOut, cl_mem YOut,
+				   int w, int h, ToneMapMode mode, float key,
+				   cl_uint numEvents, const cl_event* waitList, cl_event* event);
+
+	// Blocking read of the statistics computed by the last enqueue - for reporting only, the
+	// pipeline itself never reads them back
+	bool readStats(cl_command_queue queue, LuminanceStats* stats) const;
+
+private:
+
+	cl_kernel	statsKernel;
+	cl_kernel	finalKernel;
+	cl_kernel	toneMapKernel;
+	cl_mem		partialsBuffer;		// one float4 per work-group
+	cl_mem		histogramBuffer;	// lumaHistogramBins counts
+	cl_mem		statsBuffer;		// min, max, mean, log-average
+	size_t		localSize;			// power of two work-group size for both reductions
+	size_t		numGroups;
+};
+
+#endif
@@ -0,0 +1,356 @@
+//
+// Host/device timeline tracing - see trace.h
+//
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+// a session left open in a long running process stops recording here rather than growing
+// without bound - no record holds an OpenCL object, so the cap only bounds host memory
+static const size_t maxTraceRecords = 1024 * 1024;
+
+struct HostSpanRecord
+{
+	const char		*name;
+	const char		*category;
+	int				thread;
+	int64_t			start, end;
+};
+
+struct CommandRecord
+{
+	std::string			name;
+	const void			*queue;
+	const void			*device;
+	std::string			deviceName;
+	int					thread;
+	int64_t				enqueueStart;	// host time around the enqueue call
+	int64_t				enqueueEnd;
+	bool				complete;		// the device times below are set
+	uint64_t			queued, submit, start, end;
+};
+
+// Recording state, shared by every thread
+static std::atomic<bool>				tracing(false);
+static std::mutex						traceLock;
+static std::vector<HostSpanRecord>		hostSpans;
+static std::vector<CommandRecord>		commands;
+static std::map<std::thread::id, int>	threadIndices;
+static size_t							droppedRecords = 0;
+static int64_t							sessionStart = 0;
+static uint64_t							sessionNumber = 0;	// so late completions skip a new session's records
+
+//
+// Private API
+//
+static int			threadIndex(void);
+static std::string	jsonEscape(const std::string& text);
+static std::string	microseconds(int64_t ns);
+static std::string	timestamp(int64_t ns);
+
+
+//
+// Public function implementation
+//
+bool traceEnabled(void)
+{
+	return tracing.load(std::memory_order_relaxed);
+}
+
+int64_t traceNow(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool traceBeginCommand(const char* name, const void* queue, const void* device, const std::string& deviceName,
+					   int64_t enqueueStart, int64_t enqueueEnd, TraceCommandTicket* ticket)
+{
+	CommandRecord record;
+
+	record.name         = name;
+	record.queue        = queue;
+	record.device       = device;
+	record.deviceName   = deviceName;
+	record.enqueueStart = enqueueStart;
+	record.enqueueEnd   = enqueueEnd;
+	record.complete     = false;
+
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	if (!traceEnabled()) return false;
+
+	if (commands.size() + hostSpans.size() >= maxTraceRecords)
+	{
+		droppedRecords++;
+		return false;
+	}
+
+	record.thread = threadIndex();
+	commands.push_back(record);
+
+	ticket->session = sessionNumber;
+	ticket->index   = commands.size() - 1;
+	return true;
+}
+
+void traceEndCommand(const TraceCommandTicket& ticket, uint64_t queued, uint64_t submit, uint64_t start, uint64_t end)
+{
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	// the session that recorded the command may have closed since
+	if (ticket.session != sessionNumber || ticket.index >= commands.size()) return;
+
+	CommandRecord& command = commands[ticket.index];
+
+	command.queued   = queued;
+	command.submit   = submit;
+	command.start    = start;
+	command.end      = end;
+	command.complete = true;
+}
+
+TraceSpan::TraceSpan(const char* name, const char* category)
+	: name(name), category(category), start(traceEnabled() ? traceNow() : -1)
+{
+}
+
+TraceSpan::~TraceSpan(void)
+{
+	if (start < 0 || !traceEnabled()) return;
+
+	HostSpanRecord record = { name, category, 0, start, traceNow() };
+
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	if (commands.size() + hostSpans.size() < maxTraceRecords)
+	{
+		record.thread = threadIndex();
+		hostSpans.push_back(record);
+	}
+	else
+		droppedRecords++;
+}
+
+TraceSession::TraceSession(const std::string& path)
+	: outputPath(path)
+{
+	if (outputPath.empty()) return;
+
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	sessionStart = traceNow();
+	sessionNumber++;
+
+	// the thread opening the session is shown first, as "main"
+	threadIndices.clear();
+	threadIndex();
+
+	tracing = true;
+}
+
+TraceSession::~TraceSession(void)
+{
+	if (outputPath.empty()) return;
+
+	write();
+
+	tracing = false;
+
+	// completions still to come see another session number and are dropped
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	sessionNumber++;
+
+	commands.clear();
+	hostSpans.clear();
+	droppedRecords = 0;
+}
+
+bool TraceSession::write(void)
+{
+	if (outputPath.empty()) return false;
+
+	FILE *file = fopen(outputPath.c_str(), "w");
+
+	if (!file)
+	{
+		printf("cannot write trace %s\n", outputPath.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> guard(traceLock);
+
+	// commands still running when the trace is written show only their enqueue
+	std::map<const void*, int64_t> deviceOffsets;
+
+	for (const CommandRecord& command : commands)
+	{
+		if (!command.complete) continue;
+
+		// QUEUED is taken inside the enqueue call, so the host time after it returns less
+		// QUEUED is never below the true offset between the clocks - the smallest is the best
+		int64_t offset = command.enqueueEnd - static_cast<int64_t>(command.queued);
+		auto found = deviceOffsets.find(command.device);
+
+		if (found == deviceOffsets.end())
+			deviceOffsets[command.device] = offset;
+		else
+			found->second = std::min(found->second, offset);
+	}
+
+	std::vector<std::string> entries;
+
+	entries.push_back("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"host\"}}");
+	entries.push_back("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"device\"}}");
+
+	for (const auto& thread : threadIndices)
+	{
+		char label[32];
+
+		if (thread.second == 0)
+			snprintf(label, sizeof(label), "main");
+		else
+			snprintf(label, sizeof(label), "thread %d", thread.second);
+
+		entries.push_back("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread.second) +
+						  ",\"args\":{\"name\":\"" + label + "\"}}");
+	}
+
+	for (const HostSpanRecord& span : hostSpans)
+	{
+		entries.push_back("{\"name\":\"" + jsonEscape(span.name) + "\",\"cat\":\"" + jsonEscape(span.category) +
+						  "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string(span.thread) +
+						  ",\"ts\":" + timestamp(span.start) + ",\"dur\":" + microseconds(span.end - span.start) + "}");
+	}
+
+	// each queue gets a track for its commands, in order of first use
+	std::map<const void*, int> queueTracks;
+
+	for (size_t i = 0; i < commands.size(); ++i)
+	{
+		const CommandRecord& command = commands[i];
+		std::string name = jsonEscape(command.name);
+		std::string id = std::to_string(i);
+
+		// the enqueue call itself, on the host thread that made it
+		entries.push_back("{\"name\":\"enqueue " + name + "\",\"cat\":\"enqueue\",\"ph\":\"X\",\"pid\":1,\"tid\":" +
+						  std::to_string(command.thread) + ",\"ts\":" + timestamp(command.enqueueStart) +
+						  ",\"dur\":" + microseconds(command.enqueueEnd - command.enqueueStart) + "}");
+
+		if (!command.complete) continue;
+
+		auto track = queueTracks.find(command.queue);
+
+		if (track == queueTracks.end())
+		{
+			int index = static_cast<int>(queueTracks.size());
+
+			track = queueTracks.insert(std::make_pair(command.queue, index)).first;
+
+			entries.push_back("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":" + std::to_string(index) +
+							  ",\"args\":{\"name\":\"queue " + std::to_string(index) + " (" +
+							  jsonEscape(command.deviceName) + ")\"}}");
+		}
+
+		int64_t offset = deviceOffsets[command.device];
+		std::string tid = std::to_string(track->second);
+
+		int64_t queued = static_cast<int64_t>(command.queued) + offset;
+		int64_t submit = static_cast<int64_t>(command.submit) + offset;
+		int64_t start  = static_cast<int64_t>(command.start) + offset;
+		int64_t end    = static_cast<int64_t>(command.end) + offset;
+
+		// waiting commands overlap each other, so the wait is an async span under the queue
+		entries.push_back("{\"name\":\"" + name + "\",\"cat\":\"queued\",\"ph\":\"b\",\"id\":" + id +
+						  ",\"pid\":2,\"tid\":" + tid + ",\"ts\":" + timestamp(queued) + "}");
+		entries.push_back("{\"name\":\"" + name + "\",\"cat\":\"queued\",\"ph\":\"e\",\"id\":" + id +
+						  ",\"pid\":2,\"tid\":" + tid + ",\"ts\":" + timestamp(start) + "}");
+
+		entries.push_back("{\"name\":\"" + name + "\",\"cat\":\"device\",\"ph\":\"X\",\"pid\":2,\"tid\":" + tid +
+						  ",\"ts\":" + timestamp(start) + ",\"dur\":" + microseconds(end - start) +
+						  ",\"args\":{\"queued_us\":" + timestamp(queued) + ",\"submit_us\":" + timestamp(submit) +
+						  ",\"wait_us\":" + microseconds(start - queued) + "}}");
+
+		// arrow from the enqueue on the host to the command starting on the device
+		entries.push_back("{\"name\":\"enqueue\",\"cat\":\"flow\",\"ph\":\"s\",\"id\":" + id + ",\"pid\":1,\"tid\":" +
+						  std::to_string(command.thread) + ",\"ts\":" + timestamp(command.enqueueStart) + "}");
+		entries.push_back("{\"name\":\"enqueue\",\"cat\":\"flow\",\"ph\":\"f\",\"bp\":\"e\",\"id\":" + id +
+						  ",\"pid\":2,\"tid\":" + tid + ",\"ts\":" + timestamp(start) + "}");
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%zu},\"traceEvents\":[\n", droppedRecords);
+
+	for (size_t i = 0; i < entries.size(); ++i)
+		fprintf(file, "%s%s\n", entries[i].c_str(), (i + 1 < entries.size()) ? "," : "");
+
+	fprintf(file, "]}\n");
+
+	bool written = (ferror(file) == 0);
+
+	fclose(file);
+	return written;
+}
+
+
+//
+// Private API implementation
+//
+
+// small stable number for the calling thread - called with traceLock held
+static int threadIndex(void)
+{
+	auto found = threadIndices.find(std::this_thread::get_id());
+
+	if (found != threadIndices.end())
+		return found->second;
+
+	int index = static_cast<int>(threadIndices.size());
+
+	threadIndices[std::this_thread::get_id()] = index;
+	return index;
+}
+
+static std::string jsonEscape(const std::string& text)
+{
+	std::string escaped;
+
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+			escaped += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			escaped += code;
+		}
+		else
+			escaped += c;
+	}
+
+	return escaped;
+}
+
+// trace viewers work in us
+static std::string microseconds(int64_t ns)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.3f", ns * 1.0e-3);
+
+	return text;
+}
+
+// a time on the trace clock, relative to the start of the session
+static std::string timestamp(int64_t ns)
+{
+	return microseconds(ns - sessionStart);
+}
@@ -0,0 +1,92 @@
+//
+// Host/device timeline tracing written as Chrome trace JSON, which chrome://tracing and
+// ui.perfetto.dev both load.  While a TraceSession is open:
+//
+//   TraceSpan		records a scoped span of host work (decode, conversion, encode, program
+//					build ...) on the calling thread
+//   traceCommand	(trace_cl.h) records an enqueued command - a CL_COMPLETE callback on
+//					its event reads the CL_PROFILING_COMMAND_QUEUED, _SUBMIT, _START and _END
+//					times and releases the event, so recording costs a lock and a callback and
+//					no event outlives its command.  Commands still running when the trace is
+//					written show only their enqueue
+//
+// Everything lands on the host's steady clock.  Device timestamps are moved onto it per device
+// using the smallest gap seen between an enqueue call returning and the command's QUEUED time,
+// which bounds the offset from above.  Host threads appear as tracks of a "host" process and
+// each command queue as a track of a "device" process, with the time each command spent queued
+// shown as an async span on its queue's track and a flow arrow from the enqueue call to the
+// command.  With no session open, spans and commands cost a flag test.  Commands need a queue
+// created with CL_QUEUE_PROFILING_ENABLE.
+//
+#ifndef _TRACE_
+#define _TRACE_
+
+#include <cstdint>
+#include <string>
+
+// true while a TraceSession is open
+bool traceEnabled(void);
+
+// The recording behind traceCommand.  It takes no OpenCL types, so this header and the host
+// code using TraceSpan build without the OpenCL headers
+
+// identifies a recorded command to traceEndCommand
+struct TraceCommandTicket
+{
+	uint64_t	session;
+	size_t		index;
+};
+
+// ns on the trace clock
+int64_t traceNow(void);
+
+// Record a command enqueued on queue between the host times enqueueStart and enqueueEnd.  queue
+// and device only identify its track and clock.  Returns false if nothing was recorded
+bool traceBeginCommand(const char* name, const void* queue, const void* device, const std::string& deviceName,
+					   int64_t enqueueStart, int64_t enqueueEnd, TraceCommandTicket* ticket);
+
+// the command's QUEUED, SUBMIT, START and END times on the device clock, once it has completed
+void traceEndCommand(const TraceCommandTicket& ticket, uint64_t queued, uint64_t submit, uint64_t start, uint64_t end);
+
+class TraceSpan
+{
+public:
+
+	explicit TraceSpan(const char* name, const char* category = "host");
+	~TraceSpan(void);
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+
+	const char		*name;
+	const char		*category;
+	int64_t			start;			// ns on the trace clock, -1 if tracing was off
+};
+
+class TraceSession
+{
+public:
+
+	// start recording - an empty path records nothing
+	explicit TraceSession(const std::string& path);
+
+	// write the trace to the path and stop recording
+	~TraceSession(void);
+
+	TraceSession(const TraceSession&) = delete;
+	TraceSession& operator=(const TraceSession&) = delete;
+
+	bool valid(void) const { return !outputPath.empty(); }
+
+	// write what has been recorded so far without stopping.  Returns false if the file could
+	// not be written
+	bool write(void);
+
+private:
+
+	std::string		outputPath;
+};
+
+#endif
@@ -0,0 +1,115 @@
+//
+// OpenCL command tracing - see trace_cl.h
+//
+#include <map>
+#include <mutex>
+#include "trace_cl.h"
+
+//
+// Private API
+//
+static std::string		deviceName(cl_device_id device);
+static void CL_CALLBACK	commandComplete(cl_event event, cl_int status, void* data);
+
+
+//
+// Public function implementation
+//
+cl_int traceCommand(const char* name, cl_command_queue queue, cl_event* event,
+					const std::function<cl_int(cl_event* event)>& enqueue)
+{
+	if (!traceEnabled())
+		return enqueue(event);
+
+	cl_event ownEvent = nullptr;
+	cl_event *used = event ? event : &ownEvent;
+
+	// a failed enqueue leaves nothing to record
+	*used = nullptr;
+
+	int64_t start = traceNow();
+	cl_int err = enqueue(used);
+	int64_t end = traceNow();
+
+	if (err == CL_SUCCESS && *used)
+	{
+		cl_device_id device = nullptr;
+		clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, 0);
+
+		TraceCommandTicket *pending = new TraceCommandTicket;
+
+		if (!traceBeginCommand(name, queue, device, deviceName(device), start, end, pending))
+		{
+			delete pending;
+			pending = nullptr;
+		}
+
+		// the times are read and the event released as soon as the command completes, so the
+		// trace holds no event for longer than the command runs.  The caller releases its own
+		// event as usual - the callback owns another reference
+		if (pending)
+		{
+			if (event) clRetainEvent(*used);
+
+			if (clSetEventCallback(*used, CL_COMPLETE, commandComplete, pending) == CL_SUCCESS)
+				ownEvent = nullptr;
+			else
+			{
+				if (event) clReleaseEvent(*used);
+				delete pending;
+			}
+		}
+	}
+
+	if (ownEvent) clReleaseEvent(ownEvent);
+
+	return err;
+}
+
+
+//
+// Private API implementation
+//
+
+// looked up once per device rather than on every enqueue
+static std::string deviceName(cl_device_id device)
+{
+	static std::mutex lock;
+	static std::map<cl_device_id, std::string> names;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto found = names.find(device);
+
+	if (found != names.end())
+		return found->second;
+
+	char name[256] = "";
+
+	if (device)
+		clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, 0);
+
+	names[device] = name;
+	return name;
+}
+
+// CL_COMPLETE callback of a recorded command - runs on a runtime thread and only hands the
+// profiling times to the trace, which drops them if the recording session has closed
+static void CL_CALLBACK commandComplete(cl_event event, cl_int status, void* data)
+{
+	TraceCommandTicket *pending = static_cast<TraceCommandTicket*>(data);
+	cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+
+	// a command that failed (negative status) has no profiling information
+	bool complete = status == CL_COMPLETE &&
+					clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, 0) == CL_SUCCESS &&
+					clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, 0) == CL_SUCCESS &&
+					clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, 0) == CL_SUCCESS &&
+					clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, 0) == CL_SUCCESS;
+
+	if (complete)
+		traceEndCommand(*pending, queued, submit, start, end);
+
+	clReleaseEvent(event);
+	delete pending;
+}
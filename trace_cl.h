@@ -0,0 +1,18 @@
+//
+// OpenCL command tracing for the timeline in trace.h
+//
+#ifndef _TRACE_CL_
+#define _TRACE_CL_
+
+#include <CL/opencl.h>
+#include <functional>
+#include "trace.h"
+
+// Run enqueue, which must pass the event pointer it is given to the clEnqueue* call, and record
+// the command under name.  event is the caller's own event pointer or null - when tracing an
+// internal event is used in its place, so callers that want no event still get traced.
+// Returns what enqueue returned
+cl_int traceCommand(const char* name, cl_command_queue queue, cl_event* event,
+					const std::function<cl_int(cl_event* event)>& enqueue);
+
+#endif
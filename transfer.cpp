@@ -0,0 +1,111 @@
+//
+// Transfer mode helpers - see transfer.h
+//
+#include <cstring>
+#include <cstdlib>
+#include "transfer.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// CL_MEM_USE_HOST_PTR only avoids a copy when the memory is suitably aligned - a page is 
+// enough for every implementation we use
+static const size_t hostPtrAlignment = 4096;
+
+//
+// Private API
+//
+static void*	allocateAligned(size_t size);
+static void		freeAligned(void* ptr);
+
+
+//
+// Public function implementation
+//
+bool parseTransferMode(const char* name, TransferMode* mode)
+{
+	if (strcmp(name, "copy") == 0)
+		*mode = TRANSFER_COPY;
+	else if (strcmp(name, "map") == 0)
+		*mode = TRANSFER_MAP;
+	else if (strcmp(name, "hostptr") == 0)
+		*mode = TRANSFER_HOST_PTR;
+	else
+		return false;
+
+	return true;
+}
+
+const char* transferModeName(TransferMode mode)
+{
+	switch (mode)
+	{
+	case TRANSFER_MAP:		return "map";
+	case TRANSFER_HOST_PTR:	return "hostptr";
+	default:				return "copy";
+	}
+}
+
+HostVisibleBuffer createHostVisibleBuffer(cl_context context, cl_mem_flags flags, size_t size, TransferMode mode)
+{
+	HostVisibleBuffer result = { nullptr, nullptr, size };
+	cl_int err = CL_SUCCESS;
+
+	if (mode == TRANSFER_HOST_PTR)
+	{
+		// round the size up to whole cache lines as well as aligning the start
+		size_t paddedSize = (size + 63) & ~static_cast<size_t>(63);
+
+		result.hostMemory = allocateAligned(paddedSize);
+
+		if (result.hostMemory)
+			result.buffer = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, paddedSize, result.hostMemory, &err);
+	}
+	else
+		result.buffer = clCreateBuffer(context, flags | CL_MEM_ALLOC_HOST_PTR, size, 0, &err);
+
+	if (err != CL_SUCCESS && result.buffer)
+	{
+		clReleaseMemObject(result.buffer);
+		result.buffer = nullptr;
+	}
+
+	if (!result.buffer && result.hostMemory)
+	{
+		freeAligned(result.hostMemory);
+		result.hostMemory = nullptr;
+	}
+	return result;
+}
+
+void releaseHostVisibleBuffer(HostVisibleBuffer& buffer)
+{
+	if (buffer.buffer) clReleaseMemObject(buffer.buffer);
+	if (buffer.hostMemory) freeAligned(buffer.hostMemory);
+
+	buffer.buffer = nullptr;
+	buffer.hostMemory = nullptr;
+}
+
+//
+// Private API implementation
+//
+static void* allocateAligned(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, hostPtrAlignment);
+#else
+	void *ptr = nullptr;
+	return (posix_memalign(&ptr, hostPtrAlignment, size) == 0) ? ptr : nullptr;
+#endif
+}
+
+static void freeAligned(void* ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
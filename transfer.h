@@ -0,0 +1,43 @@
+//
+// Host <-> device transfer modes.  TRANSFER_COPY is the original path - host buffers copied 
+// to and from device buffers.  The other two modes create buffers the host can map directly so 
+// decode writes into device visible memory and encode reads from it:
+//
+//   TRANSFER_MAP		CL_MEM_ALLOC_HOST_PTR - the runtime allocates pinned host memory.  No copy 
+//						at all on integrated and CPU devices, full speed DMA on discrete GPUs
+//   TRANSFER_HOST_PTR	CL_MEM_USE_HOST_PTR over page aligned memory we allocate - zero copy on 
+//						CPU devices such as PoCL
+//
+#ifndef _TRANSFER_
+#define _TRANSFER_
+
+#include <CL/opencl.h>
+#include <cstddef>
+
+enum TransferMode
+{
+	TRANSFER_COPY = 0,
+	TRANSFER_MAP,
+	TRANSFER_HOST_PTR
+};
+
+// parse "copy", "map" or "hostptr" - returns false for anything else
+bool parseTransferMode(const char* name, TransferMode* mode);
+
+const char* transferModeName(TransferMode mode);
+
+// A buffer created for a mapped transfer mode
+struct HostVisibleBuffer
+{
+	cl_mem		buffer;
+	void		*hostMemory;	// memory we own for TRANSFER_HOST_PTR, nullptr otherwise
+	size_t		size;
+};
+
+// Create a buffer for mode (TRANSFER_MAP or TRANSFER_HOST_PTR) with the given access flags.  
+// buffer is nullptr on failure
+HostVisibleBuffer createHostVisibleBuffer(cl_context context, cl_mem_flags flags, size_t size, TransferMode mode);
+
+void releaseHostVisibleBuffer(HostVisibleBuffer& buffer);
+
+#endif